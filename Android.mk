@@ -1,18 +1,23 @@
+# my-dir names the last makefile included, so save it before the
+# subdirectories below are pulled in.
+commands_recovery_local_path := $(call my-dir)
+
 ifneq ($(TARGET_SIMULATOR),true)
 ifeq ($(TARGET_ARCH),arm)
 
-LOCAL_PATH := $(call my-dir)
+LOCAL_PATH := $(commands_recovery_local_path)
 include $(CLEAR_VARS)
 
-commands_recovery_local_path := $(LOCAL_PATH)
-
 LOCAL_SRC_FILES := \
 	recovery.c \
 	bootloader.c \
     commands.c \
 	firmware.c \
 	install.c \
+	memstat.c \
 	roots.c \
+	sdcard.c \
+	startup.c \
 	ui.c \
 	verifier.c \
 	extra.c 
@@ -26,6 +31,9 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 RECOVERY_API_VERSION := 2
 LOCAL_CFLAGS += -DRECOVERY_API_VERSION=$(RECOVERY_API_VERSION)
 
+# extra.c decodes splash pictures
+LOCAL_C_INCLUDES += external/jpeg external/libpng external/zlib
+
 # This binary is in the recovery ramdisk, which is otherwise a copy of root.
 # It gets copied there in config/Makefile.  LOCAL_MODULE_TAGS suppresses
 # a (redundant) copy of the binary in /system/bin for user builds.
@@ -40,21 +48,102 @@ else
   LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UI_LIB)
 endif
 LOCAL_STATIC_LIBRARIES += libamend
-LOCAL_STATIC_LIBRARIES += libminzip libunz libmtdutils libmincrypt
-LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
+LOCAL_STATIC_LIBRARIES += libminzip libunz libmtdutils libmincrypt libthreadpool
+LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libjpeg libpng libcutils
 LOCAL_STATIC_LIBRARIES += libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
+recovery_binary := $(LOCAL_BUILT_MODULE)
 
 include $(commands_recovery_local_path)/amend/Android.mk
 include $(commands_recovery_local_path)/minui/Android.mk
 include $(commands_recovery_local_path)/minzip/Android.mk
 include $(commands_recovery_local_path)/mtdutils/Android.mk
+include $(commands_recovery_local_path)/threadpool/Android.mk
 include $(commands_recovery_local_path)/tools/Android.mk
 include $(commands_recovery_local_path)/edify/Android.mk
 include $(commands_recovery_local_path)/updater/Android.mk
-commands_recovery_local_path :=
+
+# install the image pack into the recovery root with the binary
+$(recovery_binary): $(MINUI_IMAGE_PACK)
+recovery_binary :=
 
 endif   # TARGET_ARCH == arm
 endif	# !TARGET_SIMULATOR
 
+
+# Host microbenchmarks for minzip, the verifier and edify; see
+# recovery_bench.c.  Built straight from the sources, as the libraries
+# above are device-only.
+ifeq ($(HOST_OS),linux)
+LOCAL_PATH := $(commands_recovery_local_path)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	recovery_bench.c \
+	verifier.c \
+	minzip/Hash.c \
+	minzip/SysUtil.c \
+	minzip/DirUtil.c \
+	minzip/Inlines.c \
+	minzip/Zip.c \
+	edify/lexer.l \
+	edify/parser.y \
+	edify/expr.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH) $(LOCAL_PATH)/edify \
+    external/zlib external/safe-iop/include
+
+# minzip logs with printf on the host, which would land in the results.
+LOCAL_CFLAGS := -x c -O2 -DNDEBUG '-DLOG_PRI(p,t,...)=((void)0)'
+
+# Count the allocations made by the code under test.
+LOCAL_LDFLAGS := -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=strdup
+LOCAL_LDLIBS := -lresolv -lrt
+
+LOCAL_STATIC_LIBRARIES := libmincrypt libz
+
+LOCAL_MODULE := recovery_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# The startup graph from startup.c, run over simulated slow mounts; see
+# startup_bench.c.
+LOCAL_PATH := $(commands_recovery_local_path)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	startup_bench.c \
+	startup.c \
+	threadpool/threadpool.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+LOCAL_CFLAGS := -O2
+LOCAL_LDLIBS := -lpthread -lrt
+
+LOCAL_MODULE := startup_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Partitions a sparse file with sdcard.c and checks the result; see
+# test_sdcard.c.
+LOCAL_PATH := $(commands_recovery_local_path)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	test_sdcard.c \
+	sdcard.c \
+	mtdutils/mounts.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+LOCAL_CFLAGS := -Wall -g -O0 -D_GNU_SOURCE
+
+LOCAL_MODULE := sdcard_test
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+endif   # HOST_OS == linux
+
+commands_recovery_local_path :=
@@ -88,35 +88,322 @@ freePermissionRequestListElements(PermissionRequestList *list)
 
 /*
  * Global permission table
+ *
+ * Entries are kept in registration order for getPermissionAt(), and
+ * indexed by a radix tree of path components.  Each node's label is one
+ * or more whole components ("system/app"); a node is split when a new
+ * path diverges partway through its label.  A node refers to its exact
+ * and recursive entries by index, so a higher index is a newer entry.
+ * "below" caches the AND of every entry strictly under the node, which
+ * is what a recursive request has to meet; replacing an entry can only
+ * be undone by recomputing it, so that is left until it is next needed.
  */
 
+typedef struct PermissionNode {
+    char *label;                // "" for the root
+    int labelLen;
+    struct PermissionNode **children;   // sorted by first component
+    int numChildren;
+    int allocatedChildren;
+    int exact;                  // entry index, or -1
+    int recursive;              // entry index, or -1
+    unsigned int below;
+    bool belowStale;
+} PermissionNode;
+
+#define ALL_BITS (~0U)
+
 static struct {
     Permission *permissions;
     int numPermissionEntries;
     int allocatedPermissionEntries;
+    PermissionNode *root;
     bool permissionStateInitialized;
 } gPermissionState = {
 #if 1
-    NULL, 0, 0, false
+    NULL, 0, 0, NULL, false
 #else
     .permissions = NULL,
     .numPermissionEntries = 0,
     .allocatedPermissionEntries = 0,
+    .root = NULL,
     .permissionStateInitialized = false
 #endif
 };
 
+/* Copies path without empty and "." components, with ".." taking the
+ * previous one off, and without leading or trailing slashes.
+ */
+static char *
+normalizePath(const char *path, int *outLen)
+{
+    char *out = (char *)malloc(strlen(path) + 1);
+    int len = 0;
+
+    if (out == NULL) {
+        return NULL;
+    }
+    while (*path != '\0') {
+        const char *end = strchr(path, '/');
+        int n = (end != NULL) ? end - path : (int)strlen(path);
+
+        if (n == 0 || (n == 1 && path[0] == '.')) {
+            /* skip */
+        } else if (n == 2 && path[0] == '.' && path[1] == '.') {
+            while (len > 0 && out[len - 1] != '/') {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+        } else {
+            if (len > 0) {
+                out[len++] = '/';
+            }
+            memcpy(out + len, path, n);
+            len += n;
+        }
+        path += n;
+        if (*path == '/') {
+            path++;
+        }
+    }
+    out[len] = '\0';
+    *outLen = len;
+    return out;
+}
+
+static int
+componentLen(const char *s, int len)
+{
+    const char *slash = (const char *)memchr(s, '/', len);
+    return (slash != NULL) ? slash - s : len;
+}
+
+/* How much of label (in whole components) path starts with.
+ */
+static int
+matchComponents(const char *label, int labelLen, const char *path, int len)
+{
+    int matched = 0;
+    while (matched < labelLen && matched < len) {
+        int n = componentLen(label + matched, labelLen - matched);
+        if (componentLen(path + matched, len - matched) != n ||
+                memcmp(label + matched, path + matched, n) != 0)
+        {
+            break;
+        }
+        matched += n;
+        if (matched == labelLen || matched == len) {
+            return matched;
+        }
+        matched++;      // the '/'
+    }
+    /* Back up over the '/' after the last component that matched.
+     */
+    return (matched > 0) ? matched - 1 : 0;
+}
+
+/* Binary search on the first component.  Returns the index of the
+ * matching child, or -(insertion point) - 1.
+ */
+static int
+findChild(const PermissionNode *node, const char *path, int len)
+{
+    int n = componentLen(path, len);
+    int lo = 0, hi = node->numChildren - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const PermissionNode *child = node->children[mid];
+        int cn = componentLen(child->label, child->labelLen);
+        int cmp = memcmp(child->label, path, cn < n ? cn : n);
+        if (cmp == 0) {
+            cmp = cn - n;
+        }
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -lo - 1;
+}
+
+static PermissionNode *
+newNode(const char *label, int labelLen)
+{
+    PermissionNode *node = (PermissionNode *)calloc(1, sizeof(*node));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->label = (char *)malloc(labelLen + 1);
+    if (node->label == NULL) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, labelLen);
+    node->label[labelLen] = '\0';
+    node->labelLen = labelLen;
+    node->exact = -1;
+    node->recursive = -1;
+    node->below = ALL_BITS;
+    return node;
+}
+
+static void
+freeNode(PermissionNode *node)
+{
+    int i;
+    for (i = 0; i < node->numChildren; i++) {
+        freeNode(node->children[i]);
+    }
+    free(node->children);
+    free(node->label);
+    free(node);
+}
+
+static int
+insertChild(PermissionNode *parent, int at, PermissionNode *child)
+{
+    if (parent->numChildren == parent->allocatedChildren) {
+        int newSize = parent->allocatedChildren * 2;
+        PermissionNode **newChildren;
+        if (newSize < 4) {
+            newSize = 4;
+        }
+        newChildren = (PermissionNode **)realloc(parent->children,
+                newSize * sizeof(PermissionNode *));
+        if (newChildren == NULL) {
+            return -1;
+        }
+        parent->children = newChildren;
+        parent->allocatedChildren = newSize;
+    }
+    memmove(&parent->children[at + 1], &parent->children[at],
+            (parent->numChildren - at) * sizeof(PermissionNode *));
+    parent->children[at] = child;
+    parent->numChildren++;
+    return 0;
+}
+
+/* What the node's own entries allow, ignoring anything above or below.
+ */
+static unsigned int
+nodeAllowed(const PermissionNode *node)
+{
+    unsigned int allowed = ALL_BITS;
+    if (node->recursive >= 0) {
+        allowed &= gPermissionState.permissions[node->recursive].allowed;
+    }
+    /* A newer recursive entry overrides the exact one here too.
+     */
+    if (node->exact > node->recursive) {
+        allowed &= gPermissionState.permissions[node->exact].allowed;
+    }
+    return allowed;
+}
+
+static void
+markAllStale(PermissionNode *node)
+{
+    int i;
+    node->belowStale = true;
+    for (i = 0; i < node->numChildren; i++) {
+        markAllStale(node->children[i]);
+    }
+}
+
+static unsigned int
+belowAllowed(PermissionNode *node)
+{
+    if (node->belowStale) {
+        int i;
+        node->below = ALL_BITS;
+        for (i = 0; i < node->numChildren; i++) {
+            PermissionNode *child = node->children[i];
+            node->below &= nodeAllowed(child) & belowAllowed(child);
+        }
+        node->belowStale = false;
+    }
+    return node->below;
+}
+
+/* Finds or makes the node for a normalized path, splitting a node whose
+ * label runs past the end of the path or away from it.  "path" lists
+ * the nodes on the way, the root first; there are at most len + 1.
+ */
+static PermissionNode *
+addNode(const char *path, int len, PermissionNode **trail, int *trailLen)
+{
+    PermissionNode *node = gPermissionState.root;
+    int depth = 0;
+
+    trail[depth++] = node;
+    while (len > 0) {
+        int at = findChild(node, path, len);
+        if (at < 0) {
+            PermissionNode *child = newNode(path, len);
+            if (child == NULL || insertChild(node, -at - 1, child) < 0) {
+                if (child != NULL) {
+                    freeNode(child);
+                }
+                return NULL;
+            }
+            node = child;
+            trail[depth++] = node;
+            break;
+        }
+
+        PermissionNode *child = node->children[at];
+        int matched = matchComponents(child->label, child->labelLen,
+                path, len);
+        if (matched < child->labelLen) {
+            PermissionNode *mid = newNode(child->label, matched);
+            if (mid == NULL || insertChild(mid, 0, child) < 0) {
+                if (mid != NULL) {
+                    freeNode(mid);
+                }
+                return NULL;
+            }
+            /* The child keeps the rest of its label.
+             */
+            memmove(child->label, child->label + matched + 1,
+                    child->labelLen - matched);
+            child->labelLen -= matched + 1;
+            mid->below = nodeAllowed(child) & child->below;
+            mid->belowStale = child->belowStale;
+            node->children[at] = mid;
+            child = mid;
+        }
+        node = child;
+        trail[depth++] = node;
+        if (matched == len) {
+            break;
+        }
+        path += matched + 1;
+        len -= matched + 1;
+    }
+    *trailLen = depth;
+    return node;
+}
+
 int
 permissionInit()
 {
     if (gPermissionState.permissionStateInitialized) {
         return -1;
     }
+    gPermissionState.root = newNode("", 0);
+    if (gPermissionState.root == NULL) {
+        return -3;
+    }
     gPermissionState.permissions = NULL;
     gPermissionState.numPermissionEntries = 0;
     gPermissionState.allocatedPermissionEntries = 0;
     gPermissionState.permissionStateInitialized = true;
-//xxx maybe add an "namespace root gets no permissions" fallback by default
     return 0;
 }
 
@@ -132,6 +419,8 @@ permissionCleanup()
             }
             free(gPermissionState.permissions);
         }
+        freeNode(gPermissionState.root);
+        gPermissionState.root = NULL;
     }
 }
 
@@ -156,6 +445,13 @@ getPermissionAt(int index)
     return &gPermissionState.permissions[index];
 }
 
+static unsigned int
+entryAllowed(int index)
+{
+    return (index >= 0) ? gPermissionState.permissions[index].allowed :
+            PERM_NONE;
+}
+
 int
 getAllowedPermissions(const char *path, bool recursive,
         unsigned int *outAllowed)
@@ -170,9 +466,70 @@ getAllowedPermissions(const char *path, bool recursive,
     if (path == NULL) {
         return -1;
     }
-    //TODO: implement this for real.
-    recursive = false;
-    *outAllowed = PERMSET_ALL;
+
+    int len;
+    char *normalized = normalizePath(path, &len);
+    if (normalized == NULL) {
+        return -3;
+    }
+
+    /* Walk down as far as the path goes.  "inherited" is the nearest
+     * recursive entry seen so far; "node" ends up as the path's own
+     * node, or NULL, with "under" the node whose label runs on past
+     * the end of the path, if any.
+     */
+    PermissionNode *node = gPermissionState.root;
+    PermissionNode *under = NULL;
+    int inherited = -1;
+    const char *p = normalized;
+    while (len > 0) {
+        if (node->recursive >= 0) {
+            inherited = node->recursive;
+        }
+        int at = findChild(node, p, len);
+        if (at < 0) {
+            node = NULL;
+            break;
+        }
+        PermissionNode *child = node->children[at];
+        int matched = matchComponents(child->label, child->labelLen, p, len);
+        if (matched < child->labelLen) {
+            under = (matched == len) ? child : NULL;
+            node = NULL;
+            break;
+        }
+        node = child;
+        if (matched == len) {
+            break;
+        }
+        p += matched + 1;
+        len -= matched + 1;
+    }
+    free(normalized);
+
+    /* The newer of the path's own entries, else the inherited one.
+     */
+    int own = -1;
+    if (node != NULL) {
+        own = (node->exact > node->recursive) ? node->exact : node->recursive;
+        if (node->recursive >= 0) {
+            inherited = node->recursive;
+        }
+    }
+    unsigned int allowed = entryAllowed(own >= 0 ? own : inherited);
+
+    if (recursive) {
+        /* Everything below gets the inherited entry unless something
+         * more specific says otherwise.
+         */
+        allowed &= entryAllowed(inherited);
+        if (node != NULL) {
+            allowed &= belowAllowed(node);
+        } else if (under != NULL) {
+            allowed &= nodeAllowed(under) & belowAllowed(under);
+        }
+    }
+    *outAllowed = allowed;
     return 0;
 }
 
@@ -210,6 +567,71 @@ countPermissionConflicts(PermissionRequestList *requests, bool updateAllowed)
     return conflicts;
 }
 
+/* Points the path's node at entry "index", and brings the cached ANDs
+ * above it up to date.  The slot and what it held before are returned
+ * so that it can be put back.
+ */
+static int
+indexPermission(int index, int **outSlot, int *outOld)
+{
+    Permission *perm = &gPermissionState.permissions[index];
+    int len = strlen(perm->path);
+    PermissionNode **trail;
+    PermissionNode *node;
+    int depth, i;
+
+    trail = (PermissionNode **)malloc((len + 2) * sizeof(PermissionNode *));
+    if (trail == NULL) {
+        return -1;
+    }
+    node = addNode(perm->path, len, trail, &depth);
+    if (node == NULL) {
+        free(trail);
+        return -1;
+    }
+
+    /* Replacing an entry, or a recursive one overriding the exact one,
+     * can give bits back.
+     */
+    int *slot = perm->recursive ? &node->recursive : &node->exact;
+    bool replacing = (*slot >= 0) || (perm->recursive && node->exact >= 0);
+    *outSlot = slot;
+    *outOld = *slot;
+    *slot = index;
+    for (i = 0; i < depth - 1; i++) {
+        if (replacing) {
+            trail[i]->belowStale = true;     // recount when next asked
+        } else {
+            trail[i]->below &= perm->allowed;
+        }
+    }
+    free(trail);
+    return 0;
+}
+
+/* Component order ('/' before anything else), then registration order.
+ */
+static int
+comparePermissionIndices(const void *a, const void *b)
+{
+    int ia = *(const int *)a, ib = *(const int *)b;
+    const unsigned char *pa =
+            (const unsigned char *)gPermissionState.permissions[ia].path;
+    const unsigned char *pb =
+            (const unsigned char *)gPermissionState.permissions[ib].path;
+
+    while (*pa != '\0' && *pa == *pb) {
+        pa++;
+        pb++;
+    }
+    if (*pa != *pb) {
+        int ca = (*pa == '/') ? 1 : (*pa == '\0') ? 0 : *pa + 1;
+        int cb = (*pb == '/') ? 1 : (*pb == '\0') ? 0 : *pb + 1;
+        return ca - cb;
+    }
+    return ia - ib;
+}
+
 int
 registerPermissionSet(int count, Permission *set)
 {
@@ -242,20 +664,17 @@ registerPermissionSet(int count, Permission *set)
         gPermissionState.allocatedPermissionEntries = newSize;
     }
 
-    Permission *p = &gPermissionState.permissions[
-                        gPermissionState.numPermissionEntries];
-    int i;
+    int first = gPermissionState.numPermissionEntries;
+    Permission *p = &gPermissionState.permissions[first];
+    int i, len;
     for (i = 0; i < count; i++) {
         *p = set[i];
-        //TODO: cache the strlen of the path
-        //TODO: normalize; strip off trailing /
-        p->path = strdup(p->path);
+        p->path = normalizePath(p->path, &len);
         if (p->path == NULL) {
             /* If we can't add all of the entries, we don't
              * add any of them.
              */
-            Permission *pp = &gPermissionState.permissions[
-                                gPermissionState.numPermissionEntries];
+            Permission *pp = &gPermissionState.permissions[first];
             while (pp != p) {
                 free((void *)pp->path);
                 pp++;
@@ -264,7 +683,41 @@ registerPermissionSet(int count, Permission *set)
         }
         p++;
     }
-    gPermissionState.numPermissionEntries += count;
 
-    return 0;
+    /* Index the copies in path order, so that new children mostly go
+     * on the end of their parent's list.  If that fails, the slots are
+     * put back as they were and the cached ANDs recounted; any nodes
+     * added are harmless without entries.
+     */
+    int *order = (int *)malloc(count * sizeof(int));
+    int **slots = (int **)malloc(count * sizeof(int *));
+    int *olds = (int *)malloc(count * sizeof(int));
+    i = 0;
+    if (order != NULL && slots != NULL && olds != NULL) {
+        for (i = 0; i < count; i++) {
+            order[i] = first + i;
+        }
+        qsort(order, count, sizeof(int), comparePermissionIndices);
+        for (i = 0; i < count; i++) {
+            if (indexPermission(order[i], &slots[i], &olds[i]) < 0) {
+                break;
+            }
+        }
+    }
+    if (i < count) {
+        int j;
+        for (j = i - 1; j >= 0; j--) {
+            *slots[j] = olds[j];
+        }
+        markAllStale(gPermissionState.root);
+        for (j = 0; j < count; j++) {
+            free((void *)gPermissionState.permissions[first + j].path);
+        }
+    } else {
+        gPermissionState.numPermissionEntries += count;
+    }
+    free(order);
+    free(slots);
+    free(olds);
+    return (i < count) ? -5 : 0;
 }
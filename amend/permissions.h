@@ -73,22 +73,33 @@ void freePermissionRequestListElements(PermissionRequestList *list);
  * Global permission table
  */
 
+/* A recursive entry covers the path and everything below it; an exact
+ * one covers only the path.  Paths are compared by component, so "a//b/"
+ * and "a/./b" are both "a/b", and a leading '/' doesn't matter.
+ */
 typedef struct {
     const char *path;
     unsigned int allowed;
+    bool recursive;
 } Permission;
 
 int permissionInit(void);
 void permissionCleanup(void);
 
 /* Returns the allowed permissions for the path in "outAllowed".
+ * A path gets the permissions of the entry for its longest registered
+ * prefix: an exact or recursive entry for the path itself, else the
+ * nearest recursive entry above it, else none at all.  For a recursive
+ * request, the result is what every path at or below it is allowed.
+ * Takes time in proportion to the path's depth, not the table's size.
  * Returns 0 if successful, negative if a parameter or global state
  * is bad.
  */
 int getAllowedPermissions(const char *path, bool recursive,
         unsigned int *outAllowed);
 
-/* More-recently-registered permissions override older permissions.
+/* More-recently-registered permissions override older permissions
+ * for the same path.
  */
 int registerPermissionSet(int count, Permission *set);
 
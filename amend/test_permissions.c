@@ -298,13 +298,34 @@ test_allowed_permissions()
     ret = addPermissionRequestToList(&list, "/write", false, PERM_WRITE);
     assert(ret == 0);
 
-    //TODO: cover more cases once the permission stuff has been implemented
-
     /* All of the requests in the list should be allowed.
      */
     ret = countPermissionConflicts(&list, false);
     assert(ret == 0);
 
+    /* Exact entries don't reach below their paths, and nothing reaches
+     * paths nobody registered.
+     */
+    unsigned int allowed;
+    ret = getAllowedPermissions("/stat/file", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERM_NONE);
+    ret = getAllowedPermissions("/nowhere", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERM_NONE);
+    ret = getAllowedPermissions("/.stat/.read", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERMSET_READ);
+
+    /* Paths are normalized on the way in and on lookup.
+     */
+    ret = getAllowedPermissions("//.stat/./.read/", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERMSET_READ);
+    ret = getAllowedPermissions(".stat/x/../.write", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERMSET_WRITE);
+
     /* Add a request that will be denied.
      */
     ret = addPermissionRequestToList(&list, "/stat", false, 1<<31 | PERM_STAT);
@@ -313,13 +334,259 @@ test_allowed_permissions()
     ret = countPermissionConflicts(&list, false);
     assert(ret == 1);
 
-    //TODO: more tests
+    /* Recursive entries cover everything below them, down to the next
+     * entry, and a recursive request gets what all of that allows.
+     */
+    Permission tree[] = {
+        { "/system", PERMSET_WRITE, true },
+        { "/system/bin", PERMSET_READ, true },
+        { "/system/bin/sh", PERM_STAT, false },
+        { "/system/etc/", PERMSET_ALL, false },
+    };
+    ret = registerPermissionSet(sizeof(tree) / sizeof(tree[0]), tree);
+    assert(ret == 0);
+
+    ret = getAllowedPermissions("/system/app/Foo.apk", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERMSET_WRITE);
+    ret = getAllowedPermissions("/system/bin/ls", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERMSET_READ);
+    ret = getAllowedPermissions("/system/bin/sh", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERM_STAT);
+    ret = getAllowedPermissions("/system/etc", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERMSET_ALL);
+    ret = getAllowedPermissions("/system/etc", true, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERMSET_WRITE);
+    ret = getAllowedPermissions("/system/bin", true, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERM_STAT);
+    ret = getAllowedPermissions("/system", true, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERM_STAT);
+    ret = getAllowedPermissions("/", true, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERM_NONE);
 
+    /* Newer entries for the same path win, and give back what the old
+     * ones took away from recursive requests above them.
+     */
+    Permission newer[] = {
+        { "/system/bin/sh", PERMSET_READ, false },
+    };
+    ret = registerPermissionSet(1, newer);
+    assert(ret == 0);
+    ret = getAllowedPermissions("/system/bin/sh", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERMSET_READ);
+    ret = getAllowedPermissions("/system", true, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERMSET_READ);
+
+    /* A path that ends partway through a node's label.
+     */
+    Permission deep[] = {
+        { "/data/app/com.example/lib", PERM_STAT, true },
+    };
+    ret = registerPermissionSet(1, deep);
+    assert(ret == 0);
+    ret = getAllowedPermissions("/data/app", true, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERM_NONE);
+    ret = getAllowedPermissions("/data/app/com.example/lib/x.so", false,
+            &allowed);
+    assert(ret == 0);
+    assert(allowed == PERM_STAT);
+    ret = getAllowedPermissions("/data/app/com.example", false, &allowed);
+    assert(ret == 0);
+    assert(allowed == PERM_NONE);
+
+    freePermissionRequestListElements(&list);
     permissionCleanup();
 
     return 0;
 }
 
+/* A large table, checked against a plain scan of every entry.
+ */
+#define BIG_TABLE_SIZE 100000
+#define BIG_TABLE_QUERIES 500
+
+static const char *gComponents[] = {
+    "system", "app", "bin", "lib", "data", "a", "b", "a-b", "etc",
+};
+#define NUM_COMPONENTS (sizeof(gComponents) / sizeof(gComponents[0]))
+
+static void
+randomPath(char *buf, int minDepth, int maxDepth)
+{
+    int depth = minDepth + rand() % (maxDepth - minDepth + 1);
+    buf[0] = '\0';
+    while (depth-- > 0) {
+        strcat(buf, "/");
+        strcat(buf, gComponents[rand() % NUM_COMPONENTS]);
+    }
+}
+
+/* Whether "path" is "prefix" or below it; both are normalized.
+ */
+static bool
+isUnder(const char *path, const char *prefix)
+{
+    size_t n = strlen(prefix);
+    if (n == 0) {
+        return true;
+    }
+    return strncmp(path, prefix, n) == 0 &&
+            (path[n] == '\0' || path[n] == '/');
+}
+
+/* Scans the entries in "indices", which are in registration order.
+ */
+static unsigned int
+scanAllowed(const char *path, const int *indices, int count)
+{
+    int best = -1;
+    size_t bestLen = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        const Permission *p = getPermissionAt(indices[i]);
+        size_t n = strlen(p->path);
+        if (p->recursive ? !isUnder(path, p->path) : strcmp(path, p->path))
+        {
+            continue;
+        }
+        if (best < 0 || n >= bestLen) {
+            best = indices[i];
+            bestLen = n;
+        }
+    }
+    return (best >= 0) ? getPermissionAt(best)->allowed : PERM_NONE;
+}
+
+static unsigned int
+scanAllowedRecursive(const char *path, int *indices, int count)
+{
+    char child[512];
+    unsigned int allowed;
+    int i, n;
+
+    /* Only entries above or below the path can matter to anything
+     * at or below it.
+     */
+    for (i = n = 0; i < count; i++) {
+        const char *q = getPermissionAt(i)->path;
+        if (isUnder(q, path) || isUnder(path, q)) {
+            indices[n++] = i;
+        }
+    }
+
+    /* The path, something new below it, and every registered path
+     * below it along with something new below each of those.
+     */
+    snprintf(child, sizeof(child), "%s%s~new", path, *path ? "/" : "");
+    allowed = scanAllowed(path, indices, n) & scanAllowed(child, indices, n);
+    for (i = 0; i < n; i++) {
+        const char *q = getPermissionAt(indices[i])->path;
+        if (strcmp(q, path) != 0 && isUnder(q, path)) {
+            snprintf(child, sizeof(child), "%s/~new", q);
+            allowed &= scanAllowed(q, indices, n) &
+                    scanAllowed(child, indices, n);
+        }
+    }
+    return allowed;
+}
+
+static int
+test_big_permission_table()
+{
+    static Permission set[BIG_TABLE_SIZE / 4];
+    static char paths[BIG_TABLE_SIZE / 4][64];
+    static int indices[BIG_TABLE_SIZE];
+    PermissionRequestList list;
+    char path[64];
+    int ret, i, j, s;
+
+    srand(1);
+    ret = permissionInit();
+    assert(ret == 0);
+
+    /* Deep paths over a few names, so that nodes get shared, split and
+     * replaced, and in sets that overlap.
+     */
+    for (s = 0; s < 3; s++) {
+        int n = BIG_TABLE_SIZE / 4;
+        for (i = 0; i < n; i++) {
+            randomPath(paths[i], 0, 8);
+            set[i].path = paths[i];
+            set[i].allowed = rand() & PERMSET_ALL;
+            set[i].recursive = rand() % 3 == 0;
+        }
+        ret = registerPermissionSet(n, set);
+        assert(ret == 0);
+    }
+
+    /* And one wide directory.
+     */
+    for (i = 0; i < BIG_TABLE_SIZE / 4; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/data/app/pkg%05d.apk",
+                (i * 7919) % (BIG_TABLE_SIZE / 4));
+        set[i].path = paths[i];
+        set[i].allowed = rand() & PERMSET_ALL;
+        set[i].recursive = false;
+    }
+    ret = registerPermissionSet(BIG_TABLE_SIZE / 4, set);
+    assert(ret == 0);
+    int count = getPermissionCount();
+    assert(count == BIG_TABLE_SIZE);
+
+    ret = initPermissionRequestList(&list);
+    assert(ret == 0);
+    int expectedConflicts = 0;
+    for (i = 0; i < BIG_TABLE_QUERIES; i++) {
+        unsigned int allowed, expected;
+        bool recursive = i % 2;
+
+        if (i % 5 == 0) {
+            snprintf(path, sizeof(path), "data/app/pkg%05d.apk",
+                    rand() % (BIG_TABLE_SIZE / 4));
+        } else {
+            /* Keep the brute-force check of recursive requests to
+             * subtrees it can get through.
+             */
+            randomPath(path, recursive ? 3 : 0, 9);
+        }
+        ret = getAllowedPermissions(path, recursive, &allowed);
+        assert(ret == 0);
+        if (recursive) {
+            expected = scanAllowedRecursive(path + (*path == '/'),
+                    indices, count);
+        } else {
+            for (j = 0; j < count; j++) {
+                indices[j] = j;
+            }
+            expected = scanAllowed(path + (*path == '/'), indices, count);
+        }
+        assert(allowed == expected);
+
+        unsigned int requested = rand() & PERMSET_ALL;
+        ret = addPermissionRequestToList(&list, path, recursive, requested);
+        assert(ret == 0);
+        if ((requested & ~expected) != 0) {
+            expectedConflicts++;
+        }
+    }
+    ret = countPermissionConflicts(&list, true);
+    assert(ret == expectedConflicts);
+
+    freePermissionRequestListElements(&list);
+    permissionCleanup();
+    return 0;
+}
+
 int
 test_permissions()
 {
@@ -343,5 +610,11 @@ test_permissions()
         return ret;
     }
 
+    ret = test_big_permission_table();
+    if (ret != 0) {
+        fprintf(stderr, "test_big_permission_table() failed: %d\n", ret);
+        return ret;
+    }
+
     return 0;
 }
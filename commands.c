@@ -35,6 +35,7 @@
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "firmware.h"
+#include "memstat.h"
 #include "minzip/DirUtil.h"
 #include "minzip/Zip.h"
 #include "roots.h"
@@ -598,9 +599,11 @@ cmd_write_firmware_image(const char *name, void *cookie,
     struct FirmwareContext context;
     context.total_bytes = mzGetZipEntryUncompLen(entry);
     context.done_bytes = 0;
+    mem_track_alloc(context.total_bytes);
     context.data = malloc(context.total_bytes);
     if (context.data == NULL) {
         LOGE("Can't allocate %d bytes for %s\n", context.total_bytes, argv[0]);
+        mem_track_alloc(-(long) context.total_bytes);
         return 1;
     }
 
@@ -608,12 +611,14 @@ cmd_write_firmware_image(const char *name, void *cookie,
         context.done_bytes != context.total_bytes) {
         LOGE("Can't read %s\n", argv[0]);
         free(context.data);
+        mem_track_alloc(-(long) context.total_bytes);
         return 1;
     }
 
     if (remember_firmware_update(type, context.data, context.total_bytes)) {
         LOGE("Can't store %s image\n", type);
         free(context.data);
+        mem_track_alloc(-(long) context.total_bytes);
         return 1;
     }
 
@@ -702,8 +707,10 @@ cmd_write_raw_image(const char *name, void *cookie,
 
     /* Extract and write the image.
      */
+    MemPhase phase = mem_set_phase(MEM_PHASE_FLASH);
     bool ok = mzProcessZipEntryContents(package, entry,
             write_raw_image_process_fn, context);
+    mem_set_phase(phase);
     if (!ok) {
         LOGE("Error writing %s\n", dst_root_path);
         mtd_write_close(context);
@@ -720,6 +727,7 @@ cmd_write_raw_image(const char *name, void *cookie,
         LOGE("Error closing %s\n", dst_root_path);
         return -1;
     }
+    save_flash_health_report(partition);
     return 0;
 }
 
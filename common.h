@@ -28,6 +28,12 @@ int ui_key_pressed(int key);  // returns >0 if the code is currently pressed
 int ui_text_visible();        // returns >0 if text log is currently visible
 void ui_clear_key_queue();
 
+// Call fn(fd, cookie) on the UI thread whenever fd is readable or hung up.
+// Returns -1 if the UI isn't running.  fn must call ui_unwatch_fd() once it
+// is done with fd; nothing else may.
+int ui_watch_fd(int fd, void (*fn)(int fd, void *cookie), void *cookie);
+void ui_unwatch_fd(int fd);
+
 // Write a message to the on-screen log shown with Alt-L (also to stderr).
 // The screen is small, and users may need to report these messages to support,
 // so keep the output short and not too cryptic.
@@ -62,6 +68,9 @@ void ui_set_background(int icon);
 // TODO: Use some sort of "struct Bitmap" here instead of all these variables?
 char *ui_copy_image(int icon, int *width, int *height, int *bpp);
 
+// Free the images that aren't on screen; they are loaded again when needed.
+void ui_drop_caches();
+
 // Show a progress bar and define the scope of the next operation:
 //   portion - fraction of the progress bar the next operation will use
 //   seconds - expected time interval (progress bar moves at this minimum rate)
@@ -10,6 +10,19 @@
 #include <linux/fs.h>
 #include <errno.h>
 #include <dirent.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "bootloader.h"
 #include "commands.h"
@@ -18,6 +31,7 @@
 #include "install.h"
 #include "recovery_ui.h"
 #include "roots.h"
+#include "sdcard.h"
 #include "verifier.h"
 #include "minui/minui.h"
 #include "mtdutils/mtdutils.h"
@@ -81,7 +95,7 @@ long long int get_sdcard_size()
 	int fd, ret;
 	long long int size;
 
-	fd = open("/dev/block/mmcblk0", O_RDONLY);
+	fd = open(SDCARD_DEVICE, O_RDONLY);
 	if(fd < 0)
 		return 0;
 	ret = ioctl(fd, BLKGETSIZE64, &size);
@@ -142,167 +156,305 @@ void execute(int show, const char* file, char **args)
 	}
 }
 
-void free_string_array(char** array)
+// file browser
+// --------------------------------------------------------------------------------
+
+/* One directory's entries, read in a single pass and sorted: the
+ * subdirectories (with a trailing '/') and then the files matching the
+ * extension.  names is NULL terminated so it can be handed to the menu
+ * as it is.  Listings are cached, and reused for as long as the
+ * directory doesn't change.
+ */
+typedef struct {
+    char* path;
+    char* extension;            // NULL for the directory chooser
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    time_t scanned;             // when the scan started
+    int num_dirs;
+    int num_files;
+    char** names;
+    char* pool;                 // holds every name
+    int refs;                   // choose_file_menu() frames using it
+    unsigned last_used;
+} DirListing;
+
+#define DIR_CACHE_SIZE 8
+
+/* mtime only has whole seconds (two on vfat), so a change in the same
+ * tick as a scan leaves it as it was.  A listing is only trusted if the
+ * directory last changed longer than this before the scan started. */
+#define DIR_MTIME_SLACK 2
+
+static DirListing* dir_cache[DIR_CACHE_SIZE];
+static unsigned dir_cache_clock;
+
+static void free_listing(DirListing* l)
+{
+    free(l->path);
+    free(l->extension);
+    free(l->names);
+    free(l->pool);
+    free(l);
+}
+
+static int compare_names(const void* a, const void* b)
 {
-    if (array == NULL)
-        return;
-    char* cursor = array[0];
-    int i = 0;
-    while (cursor != NULL)
-    {
-        free(cursor);
-        cursor = array[++i];
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static int is_directory(const char* directory, const struct dirent* de)
+{
+    char path[PATH_MAX];
+    struct stat info;
+
+    if (de->d_type == DT_DIR)
+        return 1;
+    if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
+        return 0;
+    // the file system doesn't say, or it is a link: ask
+    snprintf(path, sizeof(path), "%s%s", directory, de->d_name);
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+// extension may list several, as ".png|.jpg"; case doesn't matter
+static int match_extension(const char* name, size_t len, const char* extension)
+{
+    while (*extension) {
+        const char* end = strchr(extension, '|');
+        size_t extLen = end ? (size_t) (end - extension) : strlen(extension);
+        if (extLen > 0 && len >= extLen &&
+            strncasecmp(name + len - extLen, extension, extLen) == 0)
+            return 1;
+        if (end == NULL)
+            break;
+        extension = end + 1;
     }
-    free(array);
+    return 0;
 }
 
-char** enumerate_files_in_directory(const char* directory, const char* extension, int* numFiles)
+static DirListing* read_listing(const char* directory, const char* extension,
+                                const struct stat* st)
 {
-    DIR *dir;
-    struct dirent *de;
-    int total = 0;
-    int i;
-    char** files = NULL;
-    int pass;
-    *numFiles = 0;
-    int dirLen = strlen(directory);
+    DIR* dir;
+    struct dirent* de;
+    DirListing* l;
+    size_t pool_size = 4096, pool_len = 0;
+    size_t* offsets = NULL;
+    int count = 0, capacity = 0, i;
 
     dir = opendir(directory);
-    if (dir == NULL) {
-        ui_print("无法打开文件夹.\n");
+    if (dir == NULL)
         return NULL;
-    }
-  
-    int extLen = 0;
-    if (extension != NULL)
-        extLen = strlen(extension);
-  
-    int isCounting = 1;
-    i = 0;
-    for (pass = 0; pass < 2; pass++) {
-        while ((de=readdir(dir)) != NULL) {
-            // skip hidden files
-            if (de->d_name[0] == '.')
-                continue;
-            
-            // NULL means that we are gathering directories, so skip this
-            if (extension != NULL)
-            {
-                // make sure that we can have the desired extension (prevent seg fault)
-                if (strlen(de->d_name) < (unsigned)extLen)
-                    continue;
-                // compare the extension
-                if (strcmp(de->d_name + strlen(de->d_name) - extLen, extension) != 0)
-                    continue;
-            }
-            else
-            {
-                struct stat info;
-                char fullFileName[PATH_MAX];
-                strcpy(fullFileName, directory);
-                strcat(fullFileName, de->d_name);
-                stat(fullFileName, &info);
-                // make sure it is a directory
-                if (!(S_ISDIR(info.st_mode)))
-                    continue;
-            }
-            
-            if (pass == 0)
-            {
-                total++;
-                continue;
-            }
-            
-            files[i] = (char*) malloc(dirLen + strlen(de->d_name) + 2);
-            strcpy(files[i], directory);
-            strcat(files[i], de->d_name);
-            if (extension == NULL)
-                strcat(files[i], "/");
-            i++;
+
+    l = calloc(1, sizeof(*l));
+    if (l == NULL)
+        goto fail;
+    l->scanned = time(NULL);
+    l->pool = malloc(pool_size);
+    if (l->pool == NULL)
+        goto fail;
+
+    /* Directories are gathered from the front of offsets and files from
+     * the back, so one pass over the entries sorts them into the two
+     * groups.  The pool only holds offsets until it stops moving. */
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+        int isdir;
+
+        // skip hidden files
+        if (de->d_name[0] == '.')
+            continue;
+        isdir = is_directory(directory, de);
+        if (!isdir && (extension == NULL ||
+                       !match_extension(de->d_name, len, extension)))
+            continue;
+
+        if (count == capacity) {
+            int grown = capacity ? capacity * 2 : 256;
+            size_t* n = realloc(offsets, grown * sizeof(*offsets));
+            if (n == NULL)
+                goto fail;
+            // files live at the top end; move them up with it
+            memmove(n + grown - l->num_files, n + capacity - l->num_files,
+                    l->num_files * sizeof(*n));
+            offsets = n;
+            capacity = grown;
         }
-        if (pass == 1)
-            break;
-        if (total == 0)
-            break;
-        rewinddir(dir);
-        *numFiles = total;
-        files = (char**) malloc((total+1)*sizeof(char*));
-        files[total]=NULL;
+        while (pool_len + len + 2 > pool_size) {
+            char* p = realloc(l->pool, pool_size * 2);
+            if (p == NULL)
+                goto fail;
+            l->pool = p;
+            pool_size *= 2;
+        }
+
+        memcpy(l->pool + pool_len, de->d_name, len);
+        if (isdir)
+            l->pool[pool_len + len++] = '/';
+        l->pool[pool_len + len] = '\0';
+        if (isdir)
+            offsets[l->num_dirs++] = pool_len;
+        else
+            offsets[capacity - ++l->num_files] = pool_len;
+        pool_len += len + 1;
+        count++;
     }
 
-    if(closedir(dir) < 0) {
-        LOGE("无法关闭文件夹.");
+    l->names = malloc((count + 1) * sizeof(char*));
+    if (l->names == NULL)
+        goto fail;
+    for (i = 0; i < l->num_dirs; i++)
+        l->names[i] = l->pool + offsets[i];
+    for (i = 0; i < l->num_files; i++)
+        l->names[l->num_dirs + i] = l->pool + offsets[capacity - 1 - i];
+    l->names[count] = NULL;
+    qsort(l->names, l->num_dirs, sizeof(char*), compare_names);
+    qsort(l->names + l->num_dirs, l->num_files, sizeof(char*), compare_names);
+
+    l->path = strdup(directory);
+    l->extension = extension ? strdup(extension) : NULL;
+    if (l->path == NULL || (extension && l->extension == NULL))
+        goto fail;
+    l->dev = st->st_dev;
+    l->ino = st->st_ino;
+    l->mtime = st->st_mtime;
+
+    free(offsets);
+    closedir(dir);
+    return l;
+
+fail:
+    LOGE("无法读取文件夹 %s\n", directory);
+    free(offsets);
+    if (l != NULL)
+        free_listing(l);
+    closedir(dir);
+    return NULL;
+}
+
+static DirListing* get_listing(const char* directory, const char* extension)
+{
+    DirListing** slot = NULL;
+    DirListing* l;
+    struct stat st;
+    int i;
+
+    if (stat(directory, &st) < 0)
+        return NULL;
+
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        l = dir_cache[i];
+        if (l == NULL || strcmp(l->path, directory) != 0 ||
+            (l->extension == NULL) != (extension == NULL) ||
+            (extension != NULL && strcmp(l->extension, extension) != 0))
+            continue;
+        if (l->dev == st.st_dev && l->ino == st.st_ino &&
+            l->mtime == st.st_mtime &&
+            st.st_mtime + DIR_MTIME_SLACK < l->scanned) {
+            l->refs++;
+            l->last_used = ++dir_cache_clock;
+            return l;
+        }
+        // stale: drop it, unless a menu further up is still showing it
+        if (l->refs == 0) {
+            free_listing(l);
+            dir_cache[i] = NULL;
+        }
     }
 
-    if (total==0) {
+    l = read_listing(directory, extension, &st);
+    if (l == NULL)
         return NULL;
+    l->refs = 1;
+    l->last_used = ++dir_cache_clock;
+
+    // take a free slot, or the least recently used listing nobody is
+    // showing; if every one is in use, this listing just isn't cached
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i] == NULL) {
+            slot = &dir_cache[i];
+            break;
+        }
+        if (dir_cache[i]->refs == 0 &&
+            (slot == NULL || dir_cache[i]->last_used < (*slot)->last_used))
+            slot = &dir_cache[i];
     }
+    if (slot != NULL) {
+        if (*slot != NULL)
+            free_listing(*slot);
+        *slot = l;
+    }
+    return l;
+}
 
-    return files;
+void drop_dir_listings(void)
+{
+    int i;
+
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        // a menu still showing one frees it in put_listing()
+        if (dir_cache[i] != NULL && dir_cache[i]->refs == 0)
+            free_listing(dir_cache[i]);
+        dir_cache[i] = NULL;
+    }
 }
 
-// pass in NULL for extension and you will get a directory chooser
-char* choose_file_menu(const char* directory, const char* extension, const char* headers[])
+static void put_listing(DirListing* l)
 {
-    DIR *dir;
-    struct dirent *de;
-    int numFiles = 0;
-    int numDirs = 0;
     int i;
-    char* return_value = NULL;
-    int dir_len = strlen(directory);
-
-    char** files = enumerate_files_in_directory(directory, extension, &numFiles);
-    char** dirs = NULL;
-    if (extension != NULL)
-        dirs = enumerate_files_in_directory(directory, NULL, &numDirs);
-    int total = numDirs + numFiles;
-    if (total == 0)
-    {
-        ui_print("无匹配项目.\n");
+
+    l->refs--;
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i] == l)
+            return;
     }
-    else
-    {
-        char** list = (char**) malloc((total + 1) * sizeof(char*));
-        list[total] = NULL;
+    if (l->refs == 0)
+        free_listing(l);
+}
 
+// pass in NULL for extension and you will get a directory chooser
+char* choose_file_menu(const char* directory, const char* extension, const char* headers[])
+{
+    static char ret[PATH_MAX];
+    char* return_value = NULL;
+    DirListing* l;
 
-        for (i = 0 ; i < numDirs; i++)
-        {
-            list[i] = strdup(dirs[i] + dir_len);
-        }
+    l = get_listing(directory, extension);
+    if (l == NULL) {
+        ui_print("无法打开文件夹.\n");
+        return NULL;
+    }
 
-        for (i = 0 ; i < numFiles; i++)
-        {
-            list[numDirs + i] = strdup(files[i] + dir_len);
-        }
+    if (l->num_dirs + l->num_files == 0) {
+        ui_print("无匹配项目.\n");
+        put_listing(l);
+        return NULL;
+    }
 
-        for (;;)
-        {
-            int chosen_item = get_menu_selection((char**)headers, list, 0);
-            if (chosen_item == SELECT_BACK)
-                break;
-            static char ret[PATH_MAX];
-            if (chosen_item < numDirs)
-            {
-                char* subret = choose_file_menu(dirs[chosen_item], extension, headers);
-                if (subret != NULL)
-                {
-                    strcpy(ret, subret);
-                    return_value = ret;
-                    break;
-                }
-                continue;
-            } 
-            strcpy(ret, files[chosen_item - numDirs]);
-            return_value = ret;
+    for (;;) {
+        // the menu shows the listing's own names; ui.c only copies the
+        // rows on screen
+        int chosen_item = get_menu_selection((char**)headers, l->names, 0);
+        if (chosen_item == SELECT_BACK)
             break;
+        if (extension != NULL && chosen_item < l->num_dirs) {
+            char subdir[PATH_MAX];
+            snprintf(subdir, sizeof(subdir), "%s%s", directory, l->names[chosen_item]);
+            char* subret = choose_file_menu(subdir, extension, headers);
+            if (subret != NULL) {
+                return_value = subret;
+                break;
+            }
+            continue;
         }
-        free_string_array(list);
+        snprintf(ret, sizeof(ret), "%s%s", directory, l->names[chosen_item]);
+        return_value = ret;
+        break;
     }
 
-    free_string_array(files);
-    free_string_array(dirs);
+    put_listing(l);
     return return_value;
 }
 
@@ -314,64 +466,206 @@ char* choose_file_menu(const char* directory, const char* extension, const char*
 
 struct bmp_file_header
 {
-	unsigned short type;
-	unsigned long file_size;
-	unsigned short r0;
-	unsigned short r1;
-	unsigned long data_offset;
+	uint16_t type;
+	uint32_t file_size;
+	uint16_t r0;
+	uint16_t r1;
+	uint32_t data_offset;
 };
 
 struct bmp_data_header
 {
-	unsigned long header_size;
-	unsigned long x;
-	unsigned long y;
-	unsigned short r0;
-	unsigned short depth;
-	unsigned long compress;
-	unsigned long image_size;
-	unsigned long r1;
-	unsigned long r2;
-	unsigned long color;
-	unsigned long r3;
+	uint32_t header_size;
+	int32_t x;
+	int32_t y;		// negative for top-down images
+	uint16_t r0;
+	uint16_t depth;
+	uint32_t compress;
+	uint32_t image_size;
+	uint32_t r1;
+	uint32_t r2;
+	uint32_t color;
+	uint32_t r3;
 };
 
 struct rgbquad
 {
-	unsigned char red;
-	unsigned char green;
 	unsigned char blue;
+	unsigned char green;
+	unsigned char red;
 	unsigned char unused;
 };
 
 #pragma pack(pop)
 
+#define BMP_RGB 0
+#define BMP_BITFIELDS 3
+
+// rows are read this many bytes at a time
+#define BMP_READ_BLOCK 65536
+
+struct bmp_reader
+{
+	int fd;
+	int width, height;
+	int depth;
+	int top_down;
+	unsigned row_bytes;		// including the padding to 4 bytes
+	off_t data_offset;
+	unsigned short palette[256];	// already RGB565
+	unsigned char* block;		// rows [block_first, block_first + block_rows)
+	int block_rows, block_first, block_count;
+	int next_row;
+};
+
 // rgb888 to rgb565
-static unsigned short convert(unsigned char r, unsigned char g, unsigned char b)
+static inline unsigned short convert(unsigned char r, unsigned char g, unsigned char b)
+{
+	return ((r>>3)<<11) | ((g>>2)<<5) | (b>>3);
+}
+
+/* Pixel stored as B, G, R bytes (and one more for 32bpp), read as a
+ * little endian word: rgb565 is three shifts and masks of it. */
+#define BGR_TO_565(v) ((((v)>>8) & 0xf800) | (((v)>>5) & 0x07e0) | (((v)>>3) & 0x001f))
+
+static void row_bgr24(unsigned short* out, const unsigned char* in, int count)
+{
+	int i = 0;
+
+#if defined(__ARM_NEON__)
+	for(; i + 8 <= count; i += 8)
+	{
+		uint8x8x3_t p = vld3_u8(in + i*3);
+		uint16x8_t v = vshll_n_u8(p.val[2], 8);
+		v = vsriq_n_u16(v, vshll_n_u8(p.val[1], 8), 5);
+		v = vsriq_n_u16(v, vshll_n_u8(p.val[0], 8), 11);
+		vst1q_u16(out + i, v);
+	}
+#elif defined(__SSE2__)
+	// four pixels per 16 byte load, shifted down into the low word of
+	// each lane; the row buffer has slack for the last load
+	const __m128i m_r = _mm_set1_epi32(0xf800);
+	const __m128i m_g = _mm_set1_epi32(0x07e0);
+	const __m128i m_b = _mm_set1_epi32(0x001f);
+	for(; i + 8 <= count; i += 8)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(in + i*3));
+		__m128i y = _mm_loadu_si128((const __m128i*)(in + i*3 + 12));
+		__m128i lo = _mm_unpacklo_epi64(
+				_mm_unpacklo_epi32(x, _mm_srli_si128(x, 3)),
+				_mm_unpacklo_epi32(_mm_srli_si128(x, 6), _mm_srli_si128(x, 9)));
+		__m128i hi = _mm_unpacklo_epi64(
+				_mm_unpacklo_epi32(y, _mm_srli_si128(y, 3)),
+				_mm_unpacklo_epi32(_mm_srli_si128(y, 6), _mm_srli_si128(y, 9)));
+		lo = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(lo, 8), m_r),
+				_mm_and_si128(_mm_srli_epi32(lo, 5), m_g)),
+				_mm_and_si128(_mm_srli_epi32(lo, 3), m_b));
+		hi = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(hi, 8), m_r),
+				_mm_and_si128(_mm_srli_epi32(hi, 5), m_g)),
+				_mm_and_si128(_mm_srli_epi32(hi, 3), m_b));
+		// sign extend so the signed pack doesn't saturate
+		lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+		hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(lo, hi));
+	}
+#endif
+
+	for(; i < count; i++)
+	{
+		const unsigned char* p = in + i*3;
+		out[i] = convert(p[2], p[1], p[0]);
+	}
+}
+
+static void row_bgrx32(unsigned short* out, const unsigned char* in, int count)
 {
-	unsigned short rr, gg, bb;
+	int i = 0;
 
-	rr = r>>3;
-	gg = g>>2;
-	bb = b>>3;
-	return ((rr) | (gg<<5) | (bb<<11));
+#if defined(__ARM_NEON__)
+	for(; i + 8 <= count; i += 8)
+	{
+		uint8x8x4_t p = vld4_u8(in + i*4);
+		uint16x8_t v = vshll_n_u8(p.val[2], 8);
+		v = vsriq_n_u16(v, vshll_n_u8(p.val[1], 8), 5);
+		v = vsriq_n_u16(v, vshll_n_u8(p.val[0], 8), 11);
+		vst1q_u16(out + i, v);
+	}
+#elif defined(__SSE2__)
+	const __m128i m_r = _mm_set1_epi32(0xf800);
+	const __m128i m_g = _mm_set1_epi32(0x07e0);
+	const __m128i m_b = _mm_set1_epi32(0x001f);
+	for(; i + 8 <= count; i += 8)
+	{
+		__m128i lo = _mm_loadu_si128((const __m128i*)(in + i*4));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(in + i*4 + 16));
+		lo = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(lo, 8), m_r),
+				_mm_and_si128(_mm_srli_epi32(lo, 5), m_g)),
+				_mm_and_si128(_mm_srli_epi32(lo, 3), m_b));
+		hi = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(hi, 8), m_r),
+				_mm_and_si128(_mm_srli_epi32(hi, 5), m_g)),
+				_mm_and_si128(_mm_srli_epi32(hi, 3), m_b));
+		lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+		hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(lo, hi));
+	}
+#endif
+
+	for(; i < count; i++)
+	{
+		uint32_t v;
+		memcpy(&v, in + i*4, 4);
+		out[i] = BGR_TO_565(v);
+	}
 }
 
-// get c bits from addr+n as a little edian number
-static int bits(const char* addr, int n, int c)
+// x1r5g5b5, the only 16bpp layout plain BI_RGB allows
+static void row_555(unsigned short* out, const unsigned char* in, int count)
 {
-	char t;
-	int ret, v, i;
+	int i;
 
-	ret = 0;
-	v = 1;
-	for(i = 0; i < c; i++)
+	for(i = 0; i < count; i++)
 	{
-		t = *((addr)+(n+i)/8) & (1<<((n+i)%8));
-		ret |= t ? v : 0;
-		v <<= 1;
+		unsigned v = in[i*2] | (in[i*2+1] << 8);
+		out[i] = ((v & 0x7fe0) << 1) | ((v >> 4) & 0x20) | (v & 0x1f);
 	}
-	return ret;
+}
+
+static void row_565(unsigned short* out, const unsigned char* in, int count)
+{
+	memcpy(out, in, count*2);
+}
+
+// palette images; pixels are packed from the most significant bit
+static void row_pal8(unsigned short* out, const unsigned char* in, int count,
+		const unsigned short* palette)
+{
+	int i;
+
+	for(i = 0; i < count; i++)
+		out[i] = palette[in[i]];
+}
+
+static void row_pal4(unsigned short* out, const unsigned char* in, int count,
+		const unsigned short* palette)
+{
+	int i;
+
+	for(i = 0; i + 2 <= count; i += 2, in++)
+	{
+		out[i] = palette[*in >> 4];
+		out[i+1] = palette[*in & 0x0f];
+	}
+	if(i < count)
+		out[i] = palette[*in >> 4];
+}
+
+static void row_pal1(unsigned short* out, const unsigned char* in, int count,
+		const unsigned short* palette)
+{
+	int i;
+
+	for(i = 0; i < count; i++)
+		out[i] = palette[(in[i/8] >> (7 - i%8)) & 1];
 }
 
 int bmp_info(const char* fn, int* w, int* h)
@@ -391,135 +685,776 @@ int bmp_info(const char* fn, int* w, int* h)
 		return -1;
 	hdr = (struct bmp_data_header*)(buffer+sizeof(struct bmp_file_header));
 	*w = hdr->x;
-	*h = hdr->y;
+	*h = hdr->y < 0 ? -hdr->y : hdr->y;
 
 	return 0;
 }
 
-char* bmp_load(const char* fn)
+bmp_reader* bmp_open(const char* fn, int* w, int* h)
 {
-	int fd, ret;
-	char *content, *temp;
-	struct bmp_file_header* file;
-	struct bmp_data_header* data;
+	struct bmp_file_header file;
+	struct bmp_data_header data;
+	struct stat st;
+	bmp_reader* r;
+	int i, colors;
 
-	fd = open(fn, O_RDONLY);
-	if(fd < 0)
+	r = (bmp_reader*)calloc(1, sizeof(bmp_reader));
+	if(!r)
 		return NULL;
-	content = (char*)(malloc(sizeof(struct bmp_file_header)));
-	ret = ensure_read(fd, content, sizeof(struct bmp_file_header));
-	if(ret < 0)
+	r->fd = open(fn, O_RDONLY);
+	if(r->fd < 0)
 	{
-		close(fd);
-		free(content);
+		free(r);
 		return NULL;
 	}
-	file = (struct bmp_file_header*)(content);
-	if((file->type != 0x4d42) || file->r0 || file->r1 || (file->data_offset > file->file_size))
+	if(ensure_read(r->fd, &file, sizeof(file)) < 0 ||
+		ensure_read(r->fd, &data, sizeof(data)) < 0 ||
+		fstat(r->fd, &st) < 0)
+		goto fail;
+	if(file.type != 0x4d42 || data.header_size < sizeof(data) ||
+		data.x <= 0 || data.x > 65536 || data.y == 0 ||
+		data.y > 65536 || data.y < -65536)
+		goto fail;
+
+	r->width = data.x;
+	r->height = data.y < 0 ? -data.y : data.y;
+	r->top_down = data.y < 0;
+	r->depth = data.depth;
+	r->row_bytes = ((r->width * r->depth + 31) / 32) * 4;
+	r->data_offset = file.data_offset;
+
+	switch(r->depth)
 	{
-		close(fd);
-		free(content);
-		return NULL;
+	case 1:
+	case 4:
+	case 8:
+		if(data.compress != BMP_RGB)
+			goto fail;
+		colors = data.color ? (int)data.color : (1 << r->depth);
+		if(colors > 256)
+			goto fail;
+		for(i = 0; i < colors; i++)
+		{
+			struct rgbquad q;
+			if(pread(r->fd, &q, sizeof(q),
+					sizeof(file) + data.header_size + i*sizeof(q)) != sizeof(q))
+				goto fail;
+			r->palette[i] = convert(q.red, q.green, q.blue);
+		}
+		break;
+	case 16:
+	case 32:
+		if(data.compress == BMP_BITFIELDS)
+		{
+			// only the layouts we have loops for
+			uint32_t masks[3];
+			if(pread(r->fd, masks, sizeof(masks),
+					sizeof(file) + data.header_size) != sizeof(masks))
+				goto fail;
+			if(r->depth == 16 && masks[0] == 0xf800 && masks[1] == 0x07e0 &&
+				masks[2] == 0x001f)
+				r->depth = 565;
+			else if(r->depth != 32 || masks[0] != 0xff0000 ||
+				masks[1] != 0xff00 || masks[2] != 0xff)
+				goto fail;
+		}
+		else if(data.compress != BMP_RGB)
+			goto fail;
+		break;
+	case 24:
+		if(data.compress != BMP_RGB)
+			goto fail;
+		break;
+	default:
+		goto fail;
 	}
-	temp = (char*)(realloc(content, file->file_size));
-	if(!temp)
+	if(r->data_offset + (off_t)r->row_bytes * r->height > st.st_size)
+		goto fail;
+
+	r->block_rows = BMP_READ_BLOCK / r->row_bytes;
+	if(r->block_rows < 1)
+		r->block_rows = 1;
+	if(r->block_rows > r->height)
+		r->block_rows = r->height;
+	// slack for the 24bpp loop's word loads
+	r->block = (unsigned char*)malloc(r->block_rows * r->row_bytes + 4);
+	if(!r->block)
+		goto fail;
+
+	*w = r->width;
+	*h = r->height;
+	return r;
+
+fail:
+	bmp_close(r);
+	return NULL;
+}
+
+int bmp_read_row(bmp_reader* r, unsigned short* out)
+{
+	int y = r->next_row, k;
+	const unsigned char* row;
+
+	if(y >= r->height)
+		return -1;
+	if(y >= r->block_first + r->block_count)
 	{
-		close(fd);
-		free(content);
-		return NULL;
+		// the next block_rows rows down the screen; bottom-up files
+		// keep them in the opposite order
+		int n = r->height - y;
+		off_t first;
+		if(n > r->block_rows)
+			n = r->block_rows;
+		first = r->top_down ? y : r->height - y - n;
+		if(pread(r->fd, r->block, n * r->row_bytes,
+				r->data_offset + first * r->row_bytes) != (ssize_t)(n * r->row_bytes))
+			return -1;
+		r->block_first = y;
+		r->block_count = n;
 	}
-	content = temp;
-	file = (struct bmp_file_header*)(content);
-	ret = ensure_read(fd, content+sizeof(struct bmp_file_header), file->file_size-sizeof(struct bmp_file_header));
-	if(ret < 0)
+	k = y - r->block_first;
+	if(!r->top_down)
+		k = r->block_count - 1 - k;
+	row = r->block + k * r->row_bytes;
+
+	switch(r->depth)
 	{
-		close(fd);
-		free(content);
-		return NULL;
+	case 1:  row_pal1(out, row, r->width, r->palette); break;
+	case 4:  row_pal4(out, row, r->width, r->palette); break;
+	case 8:  row_pal8(out, row, r->width, r->palette); break;
+	case 16: row_555(out, row, r->width); break;
+	case 565: row_565(out, row, r->width); break;
+	case 24: row_bgr24(out, row, r->width); break;
+	case 32: row_bgrx32(out, row, r->width); break;
 	}
-	close(fd);
-	data = (struct bmp_data_header*)(content+sizeof(struct bmp_file_header));
-	if(data->compress)
+	r->next_row++;
+	return 0;
+}
+
+void bmp_close(bmp_reader* r)
+{
+	if(!r)
+		return;
+	if(r->fd >= 0)
+		close(r->fd);
+	free(r->block);
+	free(r);
+}
+
+int bmp_to_565(const char* in, const char* out)
+{
+	int x, y, i, fd, ret = -1;
+	unsigned short* row;
+	bmp_reader* r;
+
+	r = bmp_open(in, &x, &y);
+	if(!r)
+		return -1;
+	row = (unsigned short*)malloc(sizeof(unsigned short)*x);
+	fd = open(out, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+	if(row && fd >= 0)
 	{
-		free(content);
-		return NULL;
+		for(i = 0; i < y; i++)
+		{
+			if(bmp_read_row(r, row) < 0 ||
+				ensure_write(fd, row, sizeof(unsigned short)*x) < 0)
+				break;
+		}
+		ret = (i == y) ? 0 : -1;
 	}
+	if(fd >= 0)
+		close(fd);
+	free(row);
+	bmp_close(r);
 
-	return content;
+	return ret;
 }
 
-// convert bmp to rgb565
-char* bmp_convert(const char* content)
+// image fitting
+// --------------------------------------------------------------------------------
+
+/* Decoders push RGB888 rows, top to bottom, into a fit_state.  The image
+ * is fitted to the screen keeping its aspect ratio, by averaging the
+ * source pixels each screen pixel covers, and centred on black.  Sums are
+ * exact: in x a source pixel is fit_w units wide and a screen pixel src_w
+ * units, and likewise in y, so no weight is ever rounded.  Averages keep
+ * 8 fractional bits, which the ordered dither turns into RGB565.  The sums
+ * grow with src_w and src_h, past 32 bits for images over 65k pixels on a
+ * side, so they are 64 bit.
+ */
+typedef struct
 {
-	unsigned short *logo;
-	int i, c, x, y;
-	struct bmp_file_header* file;
-	struct bmp_data_header* data;
-	struct rgbquad* rgb;
+	int src_w, src_h;
+	int dst_w, dst_h;
+	int fit_w, fit_h, fit_x, fit_y;
+	int src_y;			// next source row to arrive
+	int fit_row;			// next fitted row to finish
+	unsigned vpos;			// how far down the fitted row it is, in units
+	unsigned* hrow;			// one source row averaged across, 8.8
+	unsigned long long* vacc;	// fitted row being summed down
+	unsigned short* out;		// one screen row
+	int out_y;
+	image_row_fn fn;
+	void* cookie;
+	int error;
+} fit_state;
 
-	data = (struct bmp_data_header*)(content+sizeof(struct bmp_file_header));
-	x = data->x;
-	y = data->y;
-	logo = (unsigned short*)(malloc(sizeof(unsigned short)*x*y));
-	if(!logo)
-		return 0;
-	file = (struct bmp_file_header*)(content);
-	// there is a platte
-	if(file->data_offset > (sizeof(struct bmp_file_header)+sizeof(struct bmp_data_header)))
-	{
-        for(i = 0; i < x*y; i++)
-        {
-            c = bits((content+file->data_offset), data->depth*i, data->depth);
-            rgb = (struct rgbquad*)(content+sizeof(struct bmp_file_header)+sizeof(struct bmp_data_header))+c;
-            logo[(y-1-i/x)*x+i%x] = convert(rgb->red, rgb->green, rgb->blue);
-        }
+static const unsigned char bayer4[4][4] =
+{
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 },
+};
+
+static int fit_emit(fit_state* f)
+{
+	if(f->error)
+		return -1;
+	if(f->fn(f->out, f->cookie) < 0)
+		f->error = 1;
+	f->out_y++;
+	return f->error ? -1 : 0;
+}
+
+// black screen rows down to row y
+static int fit_emit_black(fit_state* f, int y)
+{
+	memset(f->out, 0, f->dst_w * sizeof(unsigned short));
+	while(f->out_y < y)
+	{
+		if(fit_emit(f) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int fit_init(fit_state* f, int src_w, int src_h, int dst_w, int dst_h,
+		image_row_fn fn, void* cookie)
+{
+	memset(f, 0, sizeof(*f));
+	if(src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+		return -1;
+	f->src_w = src_w;
+	f->src_h = src_h;
+	f->dst_w = dst_w;
+	f->dst_h = dst_h;
+	if((long long)src_w * dst_h > (long long)src_h * dst_w)
+	{
+		f->fit_w = dst_w;
+		f->fit_h = (long long)src_h * dst_w / src_w;
 	}
 	else
 	{
-        for(i = 0; i < x*y; i++)
-        {
-            c = bits((content+file->data_offset), data->depth*i, data->depth);
-            logo[(y-1-i/x)*x+i%x] = convert((c & 0x000000ff), (c & 0x0000ff00)>>8, (c & 0x00ff0000)>>16);
-        }
+		f->fit_h = dst_h;
+		f->fit_w = (long long)src_w * dst_h / src_h;
 	}
-	return (char*)(logo);
+	if(f->fit_w < 1)
+		f->fit_w = 1;
+	if(f->fit_h < 1)
+		f->fit_h = 1;
+	f->fit_x = (dst_w - f->fit_w) / 2;
+	f->fit_y = (dst_h - f->fit_h) / 2;
+	f->fn = fn;
+	f->cookie = cookie;
+
+	f->hrow = (unsigned*)malloc(f->fit_w * 3 * sizeof(unsigned));
+	f->vacc = (unsigned long long*)calloc(f->fit_w * 3, sizeof(*f->vacc));
+	f->out = (unsigned short*)malloc(dst_w * sizeof(unsigned short));
+	if(!f->hrow || !f->vacc || !f->out)
+		return -1;
+	return fit_emit_black(f, f->fit_y);
 }
 
-int bmp_to_565(const char* in, const char* out)
+static void fit_free(fit_state* f)
 {
-	int x, y, fd, ret;
-	char* data;
-	char* logo;
+	free(f->hrow);
+	free(f->vacc);
+	free(f->out);
+}
 
-	if(bmp_info(in, &x, &y) < 0)
-		return -1;
-	data = bmp_load(in);
-	if(!data)
-		return -1;
-	logo = bmp_convert(data);
-	if(!logo)
+static int fit_row_done(fit_state* f)
+{
+	unsigned short* out = f->out + f->fit_x;
+	const unsigned char* d = bayer4[f->out_y & 3];
+	int x;
+
+	/* vacc holds 8.8 averages times src_h.  One 5 bit step is 255*256/31
+	 * of those, so scaled by 31 a step is 255*256, and the threshold
+	 * (t+1/2)/16 of it is (2t+1)*255*8. */
+	for(x = 0; x < f->fit_w; x++)
 	{
-		free(data);
+		unsigned t = (2 * d[(f->fit_x + x) & 3] + 1) * 255 * 8;
+		unsigned r = ((unsigned)(f->vacc[x*3] / f->src_h) * 31 + t) / (255 * 256);
+		unsigned g = ((unsigned)(f->vacc[x*3+1] / f->src_h) * 63 + t) / (255 * 256);
+		unsigned b = ((unsigned)(f->vacc[x*3+2] / f->src_h) * 31 + t) / (255 * 256);
+		out[x] = (r << 11) | (g << 5) | b;
+	}
+	memset(f->vacc, 0, f->fit_w * 3 * sizeof(*f->vacc));
+	f->fit_row++;
+	return fit_emit(f);
+}
+
+static int fit_push(fit_state* f, const unsigned char* rgb)
+{
+	unsigned sw = f->src_w, fw = f->fit_w;
+	unsigned pos, left, take, end;
+	unsigned long long s0 = 0, s1 = 0, s2 = 0;
+	int i, x, c;
+
+	if(f->error || f->src_y >= f->src_h)
 		return -1;
+
+	// across: source pixel i covers [i*fw, (i+1)*fw), fitted pixel x
+	// covers [x*sw, (x+1)*sw)
+	i = 0;
+	left = fw;
+	for(x = 0; x < f->fit_w; x++)
+	{
+		for(end = sw; end > 0; end -= take)
+		{
+			take = left < end ? left : end;
+			s0 += rgb[i*3] * take;
+			s1 += rgb[i*3+1] * take;
+			s2 += rgb[i*3+2] * take;
+			left -= take;
+			if(left == 0)
+			{
+				i++;
+				left = fw;
+			}
+		}
+		f->hrow[x*3] = (unsigned)((s0 << 8) / sw);
+		f->hrow[x*3+1] = (unsigned)((s1 << 8) / sw);
+		f->hrow[x*3+2] = (unsigned)((s2 << 8) / sw);
+		s0 = s1 = s2 = 0;
 	}
-	fd = open(out, O_CREAT|O_WRONLY);
-	if(fd < 0)
+
+	// down: this row covers [src_y*fit_h, (src_y+1)*fit_h), a fitted row
+	// src_h units
+	for(left = f->fit_h; left > 0; left -= take)
 	{
-		free(logo);
-		free(data);
-		return -1;
+		take = f->src_h - f->vpos;
+		if(take > left)
+			take = left;
+		for(c = 0; c < f->fit_w * 3; c++)
+			f->vacc[c] += (unsigned long long)f->hrow[c] * take;
+		f->vpos += take;
+		if(f->vpos == (unsigned)f->src_h)
+		{
+			f->vpos = 0;
+			if(fit_row_done(f) < 0)
+				return -1;
+		}
 	}
-	ret = ensure_write(fd, logo, sizeof(unsigned short)*x*y);
-	close(fd);
-	free(logo);
-	free(data);
+	f->src_y++;
+	return 0;
+}
 
-	return ret;
+static int fit_finish(fit_state* f)
+{
+	if(f->error || f->src_y != f->src_h)
+		return -1;
+	return fit_emit_black(f, f->dst_h);
 }
 
 // jpg
 // --------------------------------------------------------------------------------
 
+struct jpeg_error
+{
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct jpeg_error* err = (struct jpeg_error*)cinfo->err;
+	char msg[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, msg);
+	LOGE("jpeg: %s\n", msg);
+	longjmp(err->jmp, 1);
+}
+
+static int jpeg_to_565(FILE* fp, int w, int h, image_row_fn fn, void* cookie)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error err;
+	fit_state fit;
+	JSAMPARRAY row;
+	volatile int ret = -1;
+	int denom;
+
+	memset(&fit, 0, sizeof(fit));
+	cinfo.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = jpeg_error_exit;
+	if(setjmp(err.jmp))
+		goto exit;
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, fp);
+	jpeg_read_header(&cinfo, TRUE);
+
+	// progressive files need the whole image's coefficients in memory
+	if(jpeg_has_multiple_scans(&cinfo))
+	{
+		LOGE("不支持渐进式JPEG\n");
+		goto exit;
+	}
+
+	/* Let the IDCT do most of the shrinking: take the smallest of 1/1,
+	 * 1/2, 1/4 and 1/8 that is still at least as big as the screen's
+	 * fit, and average down the rest of the way. */
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.scale_num = 1;
+	for(denom = 8; denom > 1; denom /= 2)
+	{
+		int sw = (cinfo.image_width + denom - 1) / denom;
+		int sh = (cinfo.image_height + denom - 1) / denom;
+		if((long long)sw * h >= (long long)sh * w ? sw >= w : sh >= h)
+			break;
+	}
+	cinfo.scale_denom = denom;
+	jpeg_start_decompress(&cinfo);
+	if(cinfo.output_components != 3)
+		goto exit;
+
+	if(fit_init(&fit, cinfo.output_width, cinfo.output_height, w, h, fn, cookie) < 0)
+		goto exit;
+	row = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, cinfo.output_width * 3, 1);
+	while(cinfo.output_scanline < cinfo.output_height)
+	{
+		jpeg_read_scanlines(&cinfo, row, 1);
+		if(fit_push(&fit, row[0]) < 0)
+			goto exit;
+	}
+	jpeg_finish_decompress(&cinfo);
+	ret = fit_finish(&fit);
+
+exit:
+	jpeg_destroy_decompress(&cinfo);
+	fit_free(&fit);
+	return ret;
+}
+
 // png
 // --------------------------------------------------------------------------------
 
+/* Read with libpng's progressive reader: the file is fed in a block at a
+ * time and rows come back through png_got_row, so only one is ever held. */
+struct png_state
+{
+	int w, h;
+	fit_state fit;
+	unsigned char* rgb;
+	int channels;
+	int done;
+	int error;
+};
+
+static void png_got_info(png_structp png_ptr, png_infop info_ptr)
+{
+	struct png_state* s = (struct png_state*)png_get_progressive_ptr(png_ptr);
+	int color_type = png_get_color_type(png_ptr, info_ptr);
+	int width = png_get_image_width(png_ptr, info_ptr);
+	int height = png_get_image_height(png_ptr, info_ptr);
+
+	// an interlaced image isn't complete until its last pass
+	if(png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE)
+	{
+		LOGE("不支持隔行扫描的PNG\n");
+		s->error = 1;
+		return;
+	}
+
+	png_set_expand(png_ptr);
+	png_set_strip_16(png_ptr);
+	if(color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+		png_set_gray_to_rgb(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+	s->channels = png_get_channels(png_ptr, info_ptr);
+
+	if(fit_init(&s->fit, width, height, s->w, s->h, s->fit.fn, s->fit.cookie) < 0)
+		s->error = 1;
+	s->rgb = (unsigned char*)malloc(width * 3);
+	if(!s->rgb)
+		s->error = 1;
+}
+
+static void png_got_row(png_structp png_ptr, png_bytep row, png_uint_32 num, int pass)
+{
+	struct png_state* s = (struct png_state*)png_get_progressive_ptr(png_ptr);
+	int x;
+
+	if(s->error || row == NULL)
+		return;
+	if(s->channels == 4)
+	{
+		// composite over black
+		for(x = 0; x < s->fit.src_w; x++)
+		{
+			unsigned a = row[x*4+3];
+			s->rgb[x*3] = row[x*4] * a / 255;
+			s->rgb[x*3+1] = row[x*4+1] * a / 255;
+			s->rgb[x*3+2] = row[x*4+2] * a / 255;
+		}
+		row = s->rgb;
+	}
+	if(fit_push(&s->fit, row) < 0)
+		s->error = 1;
+}
+
+static void png_got_end(png_structp png_ptr, png_infop info_ptr)
+{
+	struct png_state* s = (struct png_state*)png_get_progressive_ptr(png_ptr);
+	s->done = 1;
+}
+
+static int png_to_565(FILE* fp, int w, int h, image_row_fn fn, void* cookie)
+{
+	png_structp png_ptr;
+	png_infop info_ptr = NULL;
+	struct png_state s;
+	unsigned char buf[16384];
+	size_t n;
+	int ret = -1;
+
+	memset(&s, 0, sizeof(s));
+	s.w = w;
+	s.h = h;
+	s.fit.fn = fn;
+	s.fit.cookie = cookie;
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if(!png_ptr)
+		return -1;
+	info_ptr = png_create_info_struct(png_ptr);
+	if(!info_ptr)
+		goto exit;
+	if(setjmp(png_jmpbuf(png_ptr)))
+		goto exit;
+	png_set_progressive_read_fn(png_ptr, &s, png_got_info, png_got_row, png_got_end);
+
+	while(!s.done && !s.error && (n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		png_process_data(png_ptr, info_ptr, buf, n);
+	if(s.done && !s.error)
+		ret = fit_finish(&s.fit);
+
+exit:
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	free(s.rgb);
+	fit_free(&s.fit);
+	return ret;
+}
+
+// splash
+// --------------------------------------------------------------------------------
+
+static int bmp_fit_to_565(const char* in, int w, int h, image_row_fn fn, void* cookie)
+{
+	fit_state fit;
+	bmp_reader* r;
+	unsigned short* row = NULL;
+	unsigned char* rgb = NULL;
+	int bw, bh, x, y, ret = -1;
+
+	r = bmp_open(in, &bw, &bh);
+	if(!r)
+		return -1;
+	memset(&fit, 0, sizeof(fit));
+	row = (unsigned short*)malloc(bw * sizeof(unsigned short));
+	if(!row)
+		goto exit;
+
+	// already the screen's size: the rows go out as they are
+	if(bw == w && bh == h)
+	{
+		for(y = 0; y < h; y++)
+		{
+			if(bmp_read_row(r, row) < 0 || fn(row, cookie) < 0)
+				goto exit;
+		}
+		ret = 0;
+		goto exit;
+	}
+
+	rgb = (unsigned char*)malloc(bw * 3);
+	if(!rgb || fit_init(&fit, bw, bh, w, h, fn, cookie) < 0)
+		goto exit;
+	for(y = 0; y < bh; y++)
+	{
+		if(bmp_read_row(r, row) < 0)
+			goto exit;
+		for(x = 0; x < bw; x++)
+		{
+			unsigned v = row[x];
+			rgb[x*3] = ((v >> 11) * 255 + 15) / 31;
+			rgb[x*3+1] = (((v >> 5) & 0x3f) * 255 + 31) / 63;
+			rgb[x*3+2] = ((v & 0x1f) * 255 + 15) / 31;
+		}
+		if(fit_push(&fit, rgb) < 0)
+			goto exit;
+	}
+	ret = fit_finish(&fit);
+
+exit:
+	fit_free(&fit);
+	free(rgb);
+	free(row);
+	bmp_close(r);
+	return ret;
+}
+
+int image_to_565(const char* in, int w, int h, image_row_fn fn, void* cookie)
+{
+	unsigned char magic[4];
+	FILE* fp;
+	int ret = -1;
+
+	fp = fopen(in, "rb");
+	if(!fp)
+		return -1;
+	if(fread(magic, 1, sizeof(magic), fp) != sizeof(magic))
+	{
+		fclose(fp);
+		return -1;
+	}
+	rewind(fp);
+
+	if(magic[0] == 'B' && magic[1] == 'M')
+	{
+		fclose(fp);
+		return bmp_fit_to_565(in, w, h, fn, cookie);
+	}
+	if(png_sig_cmp(magic, 0, sizeof(magic)) == 0)
+		ret = png_to_565(fp, w, h, fn, cookie);
+	else if(magic[0] == 0xff && magic[1] == 0xd8)
+		ret = jpeg_to_565(fp, w, h, fn, cookie);
+	fclose(fp);
+	return ret;
+}
+
+/* Flashing goes in two passes over the picture.  The first decodes it
+ * and compares it with what the partition holds, zero padding to the
+ * erase block included, and stops at the first difference; only then
+ * does the second decode it again, straight into the partition.
+ */
+#define SPLASH_CHECK_FRACTION 0.2
+
+typedef struct
+{
+	MtdReadContext* in;
+	MtdWriteContext* out;
+	char* check;
+	int row_bytes;
+	int rows, h;
+	int differs;
+} splash_state;
+
+static int splash_check_row(const unsigned short* row, void* cookie)
+{
+	splash_state* s = (splash_state*)cookie;
+
+	if(mtd_read_data(s->in, s->check, s->row_bytes) != s->row_bytes ||
+		memcmp(s->check, row, s->row_bytes) != 0)
+	{
+		s->differs = 1;
+		return -1;
+	}
+	ui_set_progress((float)++s->rows / s->h);
+	return 0;
+}
+
+static int splash_write_row(const unsigned short* row, void* cookie)
+{
+	splash_state* s = (splash_state*)cookie;
+
+	if(mtd_write_data(s->out, (const char*)row, s->row_bytes) != s->row_bytes)
+		return -1;
+	ui_set_progress((float)++s->rows / s->h);
+	return 0;
+}
+
+// whether the partition already holds the picture, padding and all
+static int splash_unchanged(const MtdPartition* part, const char* in,
+		splash_state* s, size_t pad)
+{
+	size_t n, i;
+
+	s->in = mtd_read_partition(part);
+	if(!s->in)
+		return 0;
+	s->rows = 0;
+	if(image_to_565(in, s->row_bytes / 2, s->h, splash_check_row, s) < 0)
+	{
+		mtd_read_close(s->in);
+		return s->differs ? 0 : -1;
+	}
+	while(pad > 0 && !s->differs)
+	{
+		n = pad < (size_t)s->row_bytes ? pad : (size_t)s->row_bytes;
+		if(mtd_read_data(s->in, s->check, n) != (ssize_t)n)
+			s->differs = 1;
+		for(i = 0; i < n && !s->differs; i++)
+			s->differs = s->check[i] != 0;
+		pad -= n;
+	}
+	mtd_read_close(s->in);
+	return !s->differs;
+}
+
+int image_to_splash(const char* in, int w, int h)
+{
+	const MtdPartition* part;
+	splash_state s;
+	size_t total, erase, size;
+	int ret = -1;
+
+	part = get_root_mtd_partition("SPLASH:");
+	if(!part || mtd_partition_info(part, &total, &erase, NULL) < 0)
+	{
+		LOGE("找不到splash分区\n");
+		return -1;
+	}
+	size = (size_t)w * h * 2;
+	if(size > total)
+	{
+		LOGE("splash分区太小(%d字节)\n", (int)total);
+		return -1;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.row_bytes = w * 2;
+	s.h = h;
+	s.check = (char*)malloc(s.row_bytes);
+	if(!s.check)
+		return -1;
+
+	ui_show_progress(SPLASH_CHECK_FRACTION, 0);
+	ret = splash_unchanged(part, in, &s, (erase - size % erase) % erase);
+	if(ret != 0)
+		goto exit;
+
+	ui_show_progress(1.0 - SPLASH_CHECK_FRACTION, 0);
+	s.out = mtd_write_partition(part);
+	if(!s.out)
+	{
+		LOGE("无法打开splash分区\n");
+		ret = -1;
+		goto exit;
+	}
+	s.rows = 0;
+	ret = image_to_565(in, w, h, splash_write_row, &s);
+	// mtd_write_close() zero pads the last erase block
+	if(mtd_write_close(s.out) < 0)
+	{
+		LOGE("无法写入splash分区\n");
+		ret = -1;
+	}
+	save_flash_health_report(part);
+
+exit:
+	free(s.check);
+	return ret;
+}
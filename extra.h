@@ -12,11 +12,30 @@ long long int get_sdcard_size();
 void execute(int show, const char* file, char **args);
 
 char* choose_file_menu(const char* directory, const char* extension, const char* headers[]);
+// Forgets every cached directory listing, for when the card may have been
+// changed behind recovery's back.
+void drop_dir_listings(void);
 
 int bmp_info(const char* fn, int *x, int* y);
-char* bmp_load(const char* fn);
-char* bmp_convert(const char* content);
 int bmp_to_565(const char* in, const char* out);
 
+// Reads a BMP a few rows at a time: bmp_read_row() returns the next row
+// down the screen as RGB565, whichever way up the file is stored.
+typedef struct bmp_reader bmp_reader;
+bmp_reader* bmp_open(const char* fn, int* w, int* h);
+int bmp_read_row(bmp_reader* r, unsigned short* out);
+void bmp_close(bmp_reader* r);
+
+// Decodes a BMP, PNG or JPEG and fits it to w x h, keeping its aspect
+// ratio and centring it on black, dithered to RGB565.  Each of the h rows
+// goes to fn in turn; fn returns < 0 to give up.  Only a few rows are
+// held at a time.
+typedef int (*image_row_fn)(const unsigned short* row, void* cookie);
+int image_to_565(const char* in, int w, int h, image_row_fn fn, void* cookie);
+
+// Writes the picture to the splash partition, fitted to w x h.  Returns 1
+// if the partition already held it, 0 once written, or -1.
+int image_to_splash(const char* in, int w, int h);
+
 #endif
 
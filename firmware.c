@@ -17,6 +17,7 @@
 #include "bootloader.h"
 #include "common.h"
 #include "firmware.h"
+#include "memstat.h"
 #include "roots.h"
 
 #include <errno.h>
@@ -101,6 +102,7 @@ int maybe_install_firmware_update(const char *send_intent) {
     char *fail_image = ui_copy_image(
         BACKGROUND_ICON_FIRMWARE_ERROR, &width, &height, &bpp);
 
+    mem_set_phase(MEM_PHASE_FLASH);
     ui_print("写入%s...\n", update_type);
     if (write_update_for_bootloader(
             update_data, update_length,
@@ -123,6 +125,7 @@ int maybe_install_firmware_update(const char *send_intent) {
         return -1;
     }
 
+    mem_report();
     reboot(RB_AUTOBOOT);
 
     // Can't reboot?  WTF?
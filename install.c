@@ -18,13 +18,18 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "amend/amend.h"
 #include "common.h"
 #include "install.h"
+#include "memstat.h"
 #include "mincrypt/rsa.h"
 #include "minui/minui.h"
 #include "minzip/SysUtil.h"
@@ -39,6 +44,13 @@
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
 #define PUBLIC_KEYS_FILE "/res/keys"
 
+#ifndef RAMFS_MAGIC
+#define RAMFS_MAGIC 0x858458f6
+#endif
+#ifndef TMPFS_MAGIC
+#define TMPFS_MAGIC 0x01021994
+#endif
+
 static const ZipEntry *
 find_update_script(ZipArchive *zip)
 {
@@ -53,15 +65,18 @@ static int read_data(ZipArchive *zip, const ZipEntry *entry,
         LOGE("无效数据长度:%d\n", len);
         return -1;
     }
+    mem_track_alloc(len + 1);
     char *data = malloc(len + 1);
     if (data == NULL) {
         LOGE("无法为数据分配空间:%d字节\n", len + 1);
+        mem_track_alloc(-(len + 1));
         return -2;
     }
     bool ok = mzReadZipEntry(zip, entry, data, len);
     if (!ok) {
         LOGE("读取数据时出错\n");
         free(data);
+        mem_track_alloc(-(len + 1));
         return -3;
     }
     data[len] = '\0';     // not necessary, but just to be safe
@@ -113,6 +128,24 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
     return INSTALL_SUCCESS;
 }
 
+// In low-memory mode, a firmware image the updater left in a RAM-backed
+// file is mapped rather than copied, so it is only resident once.  Files
+// on flash are still copied: the cache partition is unmounted before the
+// image is written out, and a mapping would keep it busy.
+static char*
+map_firmware_file(const char* filename, unsigned int size) {
+    struct statfs sf;
+    if (statfs(filename, &sf) < 0 ||
+        (sf.f_type != RAMFS_MAGIC && sf.f_type != TMPFS_MAGIC)) {
+        return NULL;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
 // The update binary ask us to install a firmware file on reboot.  Set
 // that up.  Takes ownership of type and filename.
 static int
@@ -139,9 +172,28 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
     LOGI("type is %s; size is %d; file is %s\n",
          type, data_size, filename);
 
-    char* data = malloc(data_size);
+    // Accounting for the copy first may free up room for it.
+    mem_track_alloc(data_size);
+    char* data = NULL;
+    if (entry == NULL && mem_low() &&
+        (data = map_firmware_file(filename, data_size)) != NULL) {
+        LOGI("Mapped %s rather than copying it\n", filename);
+        mem_track_alloc(-(long) data_size);
+        mem_track_map(data_size);
+        if (remember_firmware_update(type, data, data_size)) {
+            LOGE("无法保存%s\n", type);
+            munmap(data, data_size);
+            mem_track_map(-(long) data_size);
+            return INSTALL_ERROR;
+        }
+        free(filename);
+        return INSTALL_SUCCESS;
+    }
+
+    data = malloc(data_size);
     if (data == NULL) {
         LOGI("Can't allocate %d bytes for firmware data\n", data_size);
+        mem_track_alloc(-(long) data_size);
         return INSTALL_ERROR;
     }
 
@@ -166,6 +218,7 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
     if (remember_firmware_update(type, data, data_size)) {
         LOGE("无法保存%s\n", type);
         free(data);
+        mem_track_alloc(-(long) data_size);
         return INSTALL_ERROR;
     }
     free(filename);
@@ -173,6 +226,101 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
     return INSTALL_SUCCESS;
 }
 
+// What try_update_binary() has read from the updater so far.
+typedef struct {
+    char buffer[1024];
+    int len;
+    char* firmware_type;
+    char* firmware_filename;
+    int watched;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} UpdaterOutput;
+
+static void handle_updater_command(char* line, UpdaterOutput* out) {
+    char* command = strtok(line, " \n");
+    if (command == NULL) {
+        return;
+    } else if (strcmp(command, "progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        char* seconds_s = strtok(NULL, " \n");
+
+        float fraction = strtof(fraction_s, NULL);
+        int seconds = strtol(seconds_s, NULL, 10);
+
+        ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                         seconds);
+    } else if (strcmp(command, "set_progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        float fraction = strtof(fraction_s, NULL);
+        ui_set_progress(fraction);
+    } else if (strcmp(command, "firmware") == 0) {
+        char* type = strtok(NULL, " \n");
+        char* filename = strtok(NULL, " \n");
+
+        if (type != NULL && filename != NULL) {
+            if (out->firmware_type != NULL) {
+                LOGE("忽略重复固件更新\n");
+            } else {
+                out->firmware_type = strdup(type);
+                out->firmware_filename = strdup(filename);
+            }
+        }
+    } else if (strcmp(command, "ui_print") == 0) {
+        char* str = strtok(NULL, "\n");
+        if (str) {
+            ui_print(str);
+        } else {
+            ui_print("\n");
+        }
+    } else {
+        LOGE("未知命令: [%s]\n", command);
+    }
+}
+
+// Reads what the updater has written so far and handles each complete
+// line.  Called on the UI thread when the pipe is readable, or in a loop
+// by try_update_binary() itself.
+static void read_updater_output(int fd, void* cookie) {
+    UpdaterOutput* out = (UpdaterOutput*) cookie;
+    int n = read(fd, out->buffer + out->len,
+                 sizeof(out->buffer) - 1 - out->len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+
+    if (n > 0) {
+        char* start = out->buffer;
+        char* end = out->buffer + out->len + n;
+        char* nl;
+        while ((nl = memchr(start, '\n', end - start)) != NULL) {
+            *nl = '\0';
+            handle_updater_command(start, out);
+            start = nl + 1;
+        }
+        if (start == out->buffer && end == out->buffer + sizeof(out->buffer) - 1) {
+            // an overlong line; handle it in pieces, like fgets() would
+            *end = '\0';
+            handle_updater_command(start, out);
+            start = end;
+        }
+        out->len = end - start;
+        memmove(out->buffer, start, out->len);
+        return;
+    }
+
+    // the updater closed its end (or the pipe broke)
+    if (out->len > 0) {
+        out->buffer[out->len] = '\0';
+        handle_updater_command(out->buffer, out);
+        out->len = 0;
+    }
+    if (out->watched) ui_unwatch_fd(fd);
+    pthread_mutex_lock(&out->lock);
+    out->done = 1;
+    pthread_cond_signal(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
 try_update_binary(const char *path, ZipArchive *zip) {
@@ -248,55 +396,34 @@ try_update_binary(const char *path, ZipArchive *zip) {
     }
     close(pipefd[1]);
 
-    char* firmware_type = NULL;
-    char* firmware_filename = NULL;
-
-    char buffer[1024];
-    FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
-        char* command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
-        } else if (strcmp(command, "progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            char* seconds_s = strtok(NULL, " \n");
-
-            float fraction = strtof(fraction_s, NULL);
-            int seconds = strtol(seconds_s, NULL, 10);
-
-            ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
-                             seconds);
-        } else if (strcmp(command, "set_progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            float fraction = strtof(fraction_s, NULL);
-            ui_set_progress(fraction);
-        } else if (strcmp(command, "firmware") == 0) {
-            char* type = strtok(NULL, " \n");
-            char* filename = strtok(NULL, " \n");
-
-            if (type != NULL && filename != NULL) {
-                if (firmware_type != NULL) {
-                    LOGE("忽略重复固件更新\n");
-                } else {
-                    firmware_type = strdup(type);
-                    firmware_filename = strdup(filename);
-                }
-            }
-        } else if (strcmp(command, "ui_print") == 0) {
-            char* str = strtok(NULL, "\n");
-            if (str) {
-                ui_print(str);
-            } else {
-                ui_print("\n");
-            }
-        } else {
-            LOGE("未知命令: [%s]\n", command);
-        }
+    UpdaterOutput out;
+    memset(&out, 0, sizeof(out));
+    pthread_mutex_init(&out.lock, NULL);
+    pthread_cond_init(&out.cond, NULL);
+
+    // Let the UI thread read the pipe along with everything else it
+    // waits on; if it isn't running, read it here.
+    out.watched = 1;
+    if (ui_watch_fd(pipefd[0], read_updater_output, &out) == 0) {
+        pthread_mutex_lock(&out.lock);
+        while (!out.done) pthread_cond_wait(&out.cond, &out.lock);
+        pthread_mutex_unlock(&out.lock);
+    } else {
+        out.watched = 0;
+        while (!out.done) read_updater_output(pipefd[0], &out);
     }
-    fclose(from_child);
+    close(pipefd[0]);
+    pthread_mutex_destroy(&out.lock);
+    pthread_cond_destroy(&out.cond);
+
+    char* firmware_type = out.firmware_type;
+    char* firmware_filename = out.firmware_filename;
 
     int status;
-    waitpid(pid, &status, 0);
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    wait4(pid, &status, 0, &usage);
+    mem_track_child(usage.ru_maxrss);
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         LOGE("%s出错\n(状态 %d)\n", path, WEXITSTATUS(status));
         return INSTALL_ERROR;
@@ -414,8 +541,45 @@ exit:
     return NULL;
 }
 
-int
-install_package(const char *root_path)
+// What startup got done ahead of install_package().
+static struct {
+    int keys_loaded;
+    RSAPublicKey* keys;
+    int num_keys;
+    const char* root_path;          // non-NULL if "zip" is open
+    ZipArchive zip;
+} g_prepared;
+
+void
+prepare_package_keys(void)
+{
+    g_prepared.keys = load_keys(PUBLIC_KEYS_FILE, &g_prepared.num_keys);
+    g_prepared.keys_loaded = 1;
+}
+
+void
+prepare_package(const char *root_path)
+{
+    char path[PATH_MAX] = "";
+    if (ensure_root_path_mounted(root_path) != 0 ||
+        translate_root_path(root_path, path, sizeof(path)) == NULL ||
+        mzOpenZipArchive(path, &g_prepared.zip) != 0) {
+        return;  // install_package() will try again, and say what failed
+    }
+    g_prepared.root_path = root_path;
+}
+
+// Lets the kernel take back the package's central directory pages; they
+// are read in again when an entry is looked up.
+static void
+drop_package_pages(void *cookie)
+{
+    ZipArchive *zip = (ZipArchive *) cookie;
+    madvise(zip->map.baseAddr, zip->map.baseLength, MADV_DONTNEED);
+}
+
+static int
+really_install_package(const char *root_path)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_print("准备安装更新...\n");
@@ -437,7 +601,15 @@ install_package(const char *root_path)
     LOGI("Update file path: %s\n", path);
 
     int numKeys;
-    RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+    RSAPublicKey* loadedKeys;
+    if (g_prepared.keys_loaded) {
+        loadedKeys = g_prepared.keys;
+        numKeys = g_prepared.num_keys;
+        g_prepared.keys_loaded = 0;
+        g_prepared.keys = NULL;
+    } else {
+        loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+    }
     if (loadedKeys == NULL) {
         LOGE("无法加载公钥\n");
         return INSTALL_CORRUPT;
@@ -453,23 +625,48 @@ install_package(const char *root_path)
     /* Try to open the package.
      */
     ZipArchive zip;
-    int err = mzOpenZipArchive(path, &zip);
+    int err = 0;
+    if (g_prepared.root_path != NULL &&
+        strcmp(g_prepared.root_path, root_path) == 0) {
+        zip = g_prepared.zip;
+        g_prepared.root_path = NULL;
+    } else {
+        err = mzOpenZipArchive(path, &zip);
+    }
     if (err != 0) {
         LOGE("无法打开%s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
         return INSTALL_CORRUPT;
     }
+    size_t map_length = zip.map.baseLength;
+    mem_track_map(map_length);
+    mem_add_relief(drop_package_pages, &zip);
 
+    mem_set_phase(MEM_PHASE_VERIFY);
     err = verify_jar_signature(&zip, loadedKeys, numKeys);
     free(loadedKeys);
     LOGI("verify_jar_signature returned %d\n", err);
+    int status = INSTALL_CORRUPT;
     if (err != true) {
         LOGE("签名验证失败\n");
-        return INSTALL_CORRUPT;
+    } else {
+        /* Verify and install the contents of the package.
+         */
+        mem_set_phase(MEM_PHASE_EXTRACT);
+        status = handle_update_package(path, &zip);
     }
 
-    /* Verify and install the contents of the package.
-     */
-    int status = handle_update_package(path, &zip);
+    mem_remove_relief(drop_package_pages, &zip);
     mzCloseZipArchive(&zip);
+    mem_track_map(-(long) map_length);
+    return status;
+}
+
+int
+install_package(const char *root_path)
+{
+    MemPhase phase = mem_set_phase(MEM_PHASE_OPEN);
+    int status = really_install_package(root_path);
+    mem_set_phase(phase);
+    mem_report();
     return status;
 }
@@ -22,4 +22,11 @@
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT };
 int install_package(const char *root_path);
 
+/* Load the keys, and mount and open the package, ahead of
+ * install_package(), which does whatever these didn't manage.  The two
+ * may run at the same time as each other, but not with install_package().
+ */
+void prepare_package_keys(void);
+void prepare_package(const char *root_path);
+
 #endif  // RECOVERY_INSTALL_H_
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "memstat.h"
+
+#define MAX_RELIEFS 8
+
+typedef struct {
+    int used;
+    long peak_rss_kb;
+    long peak_child_kb;
+    long long allocated;    // bytes accounted during the phase
+    long long peak_live;    // most bytes accounted and not yet freed
+    double seconds;
+} PhaseStats;
+
+typedef struct {
+    void (*fn)(void *cookie);
+    void *cookie;
+} Relief;
+
+static const char *PHASE_NAMES[NUM_MEM_PHASES] = {
+    "idle", "open", "verify", "extract", "flash"
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static PhaseStats g_phases[NUM_MEM_PHASES];
+static MemPhase g_phase = MEM_PHASE_IDLE;
+static long g_phase_start_hwm = 0;
+static double g_phase_start = 0;
+static long long g_live_alloc = 0, g_live_map = 0;
+static long g_budget_kb = 0;        // 0 if there is none
+
+static int g_low = 0;
+static MemPhase g_low_phase;
+static long g_low_kb;
+
+static Relief g_reliefs[MAX_RELIEFS];
+static int g_relief_count = 0;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the "<key>: <n> kB" value from a /proc file, or 0.
+static long
+read_proc_kb(const char *path, const char *key)
+{
+    FILE *f = fopen(path, "r");
+    char line[128];
+    size_t len = strlen(key);
+    long kb = 0;
+
+    if (f == NULL) return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, key, len) == 0 && line[len] == ':') {
+            sscanf(line + len + 1, "%ld", &kb);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+static long
+read_rss_kb(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size, resident = 0;
+
+    if (f == NULL) return 0;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * (getpagesize() / 1024);
+}
+
+// Samples RSS into the current phase and returns it.
+static long
+sample_locked(void)
+{
+    PhaseStats *s = &g_phases[g_phase];
+    long rss = read_rss_kb();
+    if (rss > s->peak_rss_kb) s->peak_rss_kb = rss;
+    return rss;
+}
+
+/* Closes the books on the current phase.  Samples only see RSS at the
+ * moments they are taken; if the high-water mark moved during the
+ * phase, the peak in between was this phase's.
+ */
+static long
+end_phase_locked(void)
+{
+    PhaseStats *s = &g_phases[g_phase];
+    long hwm = read_proc_kb("/proc/self/status", "VmHWM");
+
+    sample_locked();
+    if (hwm > g_phase_start_hwm && hwm > s->peak_rss_kb) {
+        s->peak_rss_kb = hwm;
+    }
+    s->seconds += now() - g_phase_start;
+    return hwm;
+}
+
+static void
+start_phase_locked(MemPhase phase, long hwm)
+{
+    g_phase = phase;
+    g_phases[phase].used = 1;
+    g_phase_start_hwm = hwm;
+    g_phase_start = now();
+}
+
+// Returns non-zero if this switched on low-memory mode.
+static int
+check_budget_locked(long kb)
+{
+    if (g_low || g_budget_kb <= 0 || kb <= g_budget_kb) return 0;
+    g_low = 1;
+    g_low_phase = g_phase;
+    g_low_kb = kb;
+    return 1;
+}
+
+// Called without the lock, as reliefs account for what they free.
+static void
+run_reliefs(void)
+{
+    Relief reliefs[MAX_RELIEFS];
+    int i, count;
+
+    LOGW("Over the memory budget (%ld of %ld KB) while %s;"
+         " switching to low-memory mode\n",
+         g_low_kb, g_budget_kb, PHASE_NAMES[g_low_phase]);
+    pthread_mutex_lock(&g_lock);
+    count = g_relief_count;
+    memcpy(reliefs, g_reliefs, count * sizeof(Relief));
+    pthread_mutex_unlock(&g_lock);
+    for (i = 0; i < count; ++i) reliefs[i].fn(reliefs[i].cookie);
+}
+
+void
+mem_init(long budget_kb)
+{
+    if (budget_kb <= 0) {
+        budget_kb = read_proc_kb("/proc/meminfo", "MemTotal") / 2;
+    }
+    pthread_mutex_lock(&g_lock);
+    g_budget_kb = budget_kb;
+    start_phase_locked(g_phase, read_proc_kb("/proc/self/status", "VmHWM"));
+    sample_locked();
+    pthread_mutex_unlock(&g_lock);
+    LOGI("Memory budget is %ld KB\n", budget_kb);
+}
+
+MemPhase
+mem_set_phase(MemPhase phase)
+{
+    pthread_mutex_lock(&g_lock);
+    MemPhase old = g_phase;
+    long hwm = end_phase_locked();
+    start_phase_locked(phase, hwm);
+    int switched = check_budget_locked(sample_locked());
+    pthread_mutex_unlock(&g_lock);
+    if (switched) run_reliefs();
+    return old;
+}
+
+static void
+track(long long *live, long bytes, int resident)
+{
+    pthread_mutex_lock(&g_lock);
+    PhaseStats *s = &g_phases[g_phase];
+    *live += bytes;
+    if (bytes > 0) s->allocated += bytes;
+    if (g_live_alloc + g_live_map > s->peak_live) {
+        s->peak_live = g_live_alloc + g_live_map;
+    }
+    long kb = sample_locked();
+    if (bytes > 0 && resident) kb += bytes / 1024;
+    int switched = check_budget_locked(kb);
+    pthread_mutex_unlock(&g_lock);
+    if (switched) run_reliefs();
+}
+
+void
+mem_track_alloc(long bytes)
+{
+    track(&g_live_alloc, bytes, 1);
+}
+
+// Mapped pages only count against the budget once they are touched.
+void
+mem_track_map(long bytes)
+{
+    track(&g_live_map, bytes, 0);
+}
+
+void
+mem_track_child(long peak_kb)
+{
+    pthread_mutex_lock(&g_lock);
+    PhaseStats *s = &g_phases[g_phase];
+    if (peak_kb > s->peak_child_kb) s->peak_child_kb = peak_kb;
+    pthread_mutex_unlock(&g_lock);
+}
+
+int
+mem_low(void)
+{
+    return g_low;
+}
+
+int
+mem_add_relief(void (*fn)(void *cookie), void *cookie)
+{
+    pthread_mutex_lock(&g_lock);
+    if (g_relief_count >= MAX_RELIEFS) {
+        pthread_mutex_unlock(&g_lock);
+        LOGW("mem_add_relief: too many reliefs\n");
+        return -1;
+    }
+    g_reliefs[g_relief_count].fn = fn;
+    g_reliefs[g_relief_count].cookie = cookie;
+    g_relief_count++;
+    int low = g_low;
+    pthread_mutex_unlock(&g_lock);
+
+    if (low) fn(cookie);
+    return 0;
+}
+
+void
+mem_remove_relief(void (*fn)(void *cookie), void *cookie)
+{
+    int i;
+    pthread_mutex_lock(&g_lock);
+    for (i = 0; i < g_relief_count; ++i) {
+        if (g_reliefs[i].fn == fn && g_reliefs[i].cookie == cookie) {
+            g_relief_count--;
+            memmove(&g_reliefs[i], &g_reliefs[i + 1],
+                    (g_relief_count - i) * sizeof(Relief));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+void
+mem_report(void)
+{
+    int i;
+
+    pthread_mutex_lock(&g_lock);
+    start_phase_locked(g_phase, end_phase_locked());
+    LOGI("Memory by phase (KB):    peak RSS  allocated  peak live"
+         "  updater    time\n");
+    for (i = 0; i < NUM_MEM_PHASES; ++i) {
+        const PhaseStats *s = &g_phases[i];
+        if (!s->used) continue;
+        LOGI("  %-20s %10ld %10lld %10lld %8ld %6.1fs\n", PHASE_NAMES[i],
+             s->peak_rss_kb, s->allocated / 1024, s->peak_live / 1024,
+             s->peak_child_kb, s->seconds);
+    }
+    if (g_low) {
+        LOGI("  low-memory mode since %s (%ld of %ld KB)\n",
+             PHASE_NAMES[g_low_phase], g_low_kb, g_budget_kb);
+    }
+    pthread_mutex_unlock(&g_lock);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_MEMSTAT_H_
+#define RECOVERY_MEMSTAT_H_
+
+/* Memory use per install phase.  Large buffers and mappings are
+ * accounted for by the code that makes them; RSS is sampled at each
+ * phase change and each accounted allocation.  When the process goes
+ * over its budget it switches to low-memory mode for good: everything
+ * registered with mem_add_relief() is asked to free what it can, and
+ * the large operations take their streaming paths from then on.
+ */
+
+typedef enum {
+    MEM_PHASE_IDLE,
+    MEM_PHASE_OPEN,         // opening the package, loading keys
+    MEM_PHASE_VERIFY,       // checking the signature
+    MEM_PHASE_EXTRACT,      // running the update script or binary
+    MEM_PHASE_FLASH,        // writing images to flash
+    NUM_MEM_PHASES
+} MemPhase;
+
+/* Sets the budget in KB of RSS.  0 or less means half of MemTotal.
+ */
+void mem_init(long budget_kb);
+
+/* Ends the current phase and starts "phase".  Returns the phase that
+ * was current, so a caller can put it back.
+ */
+MemPhase mem_set_phase(MemPhase phase);
+
+/* Accounts for a large buffer or mapping of "bytes", before it is made;
+ * pass a negative size when it is freed or unmapped (or couldn't be
+ * made).  A buffer that would take the process over budget switches
+ * on low-memory mode first, so the caller can check mem_low() after.
+ */
+void mem_track_alloc(long bytes);
+void mem_track_map(long bytes);
+
+/* Records the peak RSS of a child (the update binary), as wait4()
+ * reports it.
+ */
+void mem_track_child(long peak_kb);
+
+/* Non-zero once the process has gone over budget.
+ */
+int mem_low(void);
+
+/* fn(cookie) is called when low-memory mode is switched on, or at once
+ * if it already is.  Returns 0, or -1 if there is no room for it.
+ */
+int mem_add_relief(void (*fn)(void *cookie), void *cookie);
+void mem_remove_relief(void (*fn)(void *cookie), void *cookie);
+
+/* Logs the peak RSS and accounted memory of each phase so far.
+ */
+void mem_report(void);
+
+#endif  // RECOVERY_MEMSTAT_H_
@@ -1,7 +1,7 @@
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := graphics.c events.c resources.c chinese.c
+LOCAL_SRC_FILES := graphics.c blit.c events.c resources.c chinese.c
 
 LOCAL_C_INCLUDES +=\
     external/libpng\
@@ -10,3 +10,55 @@ LOCAL_C_INCLUDES +=\
 LOCAL_MODULE := libminui
 
 include $(BUILD_STATIC_LIBRARY)
+
+# Host tool that bakes res/images/*.png into images.pack (see respack.h).
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := mkpack.c
+
+LOCAL_C_INCLUDES +=\
+    external/libpng\
+    external/zlib
+
+LOCAL_STATIC_LIBRARIES := libpng libz
+
+LOCAL_MODULE := minui_mkpack
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Frame time benchmark, run on the device against a headless screen.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := minui_bench.c
+
+LOCAL_MODULE := minui_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_STATIC_LIBRARIES := libminui libpixelflinger_static libpng libz \
+    libcutils libc
+
+include $(BUILD_EXECUTABLE)
+
+# The image pack is generated into the intermediates directory and
+# installed into the recovery root next to res/images; recovery falls back
+# to the PNGs when it isn't there.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := images.pack
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE_PATH := $(TARGET_RECOVERY_ROOT_OUT)/res
+
+include $(BUILD_SYSTEM)/base_rules.mk
+
+minui_images := $(sort $(wildcard $(LOCAL_PATH)/../res/images/*.png))
+
+$(LOCAL_BUILT_MODULE): PRIVATE_IMAGES := $(minui_images)
+$(LOCAL_BUILT_MODULE): $(minui_images) $(HOST_OUT_EXECUTABLES)/minui_mkpack
+	@echo "Image pack: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(HOST_OUT_EXECUTABLES)/minui_mkpack $@ $(PRIVATE_IMAGES)
+
+MINUI_IMAGE_PACK := $(LOCAL_INSTALLED_MODULE)
+minui_images :=
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <string.h>
+
+#include "blit.h"
+
+/* Coverage a in 0..255 is widened to 0..256 so that full coverage gives
+ * exactly the text color: out = (c * a + d * (256 - a)) >> 8.
+ */
+static inline unsigned short blend_pixel_565(unsigned short d, unsigned a,
+                                             unsigned r, unsigned g, unsigned b)
+{
+    unsigned ia, dr, dg, db;
+
+    a += a >> 7;
+    ia = 256 - a;
+    dr = (r * a + (d >> 11) * ia) >> 8;
+    dg = (g * a + ((d >> 5) & 0x3f) * ia) >> 8;
+    db = (b * a + (d & 0x1f) * ia) >> 8;
+    return (dr << 11) | (dg << 5) | db;
+}
+
+void blit_a8_to_565(unsigned short *dst, const unsigned char *src, int count,
+                    unsigned r, unsigned g, unsigned b)
+{
+    unsigned short color = (r << 11) | (g << 5) | b;
+    int i = 0;
+
+#if defined(__ARM_NEON__)
+    uint16x8_t vr = vdupq_n_u16(r), vg = vdupq_n_u16(g), vb = vdupq_n_u16(b);
+    uint16x8_t m6 = vdupq_n_u16(0x3f), m5 = vdupq_n_u16(0x1f);
+    uint16x8_t full = vdupq_n_u16(256);
+
+    for (; i + 8 <= count; i += 8) {
+        uint8x8_t a8 = vld1_u8(src + i);
+        uint16x8_t a, ia, d, cr, cg, cb;
+
+        if (vget_lane_u64(vreinterpret_u64_u8(a8), 0) == 0) continue;
+        a = vmovl_u8(a8);
+        a = vaddq_u16(a, vshrq_n_u16(a, 7));
+        ia = vsubq_u16(full, a);
+        d = vld1q_u16(dst + i);
+        cr = vshrq_n_u16(vmlaq_u16(vmulq_u16(vr, a),
+                                   vshrq_n_u16(d, 11), ia), 8);
+        cg = vshrq_n_u16(vmlaq_u16(vmulq_u16(vg, a),
+                                   vandq_u16(vshrq_n_u16(d, 5), m6), ia), 8);
+        cb = vshrq_n_u16(vmlaq_u16(vmulq_u16(vb, a),
+                                   vandq_u16(d, m5), ia), 8);
+        vst1q_u16(dst + i, vorrq_u16(vshlq_n_u16(cr, 11),
+                                     vorrq_u16(vshlq_n_u16(cg, 5), cb)));
+    }
+#elif defined(__SSE2__)
+    __m128i vr = _mm_set1_epi16(r), vg = _mm_set1_epi16(g);
+    __m128i vb = _mm_set1_epi16(b), zero = _mm_setzero_si128();
+    __m128i m6 = _mm_set1_epi16(0x3f), m5 = _mm_set1_epi16(0x1f);
+    __m128i full = _mm_set1_epi16(256);
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadl_epi64((const __m128i*) (src + i));
+        __m128i ia, d, cr, cg, cb;
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) == 0xffff) continue;
+        a = _mm_unpacklo_epi8(a, zero);
+        a = _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+        ia = _mm_sub_epi16(full, a);
+        d = _mm_loadu_si128((const __m128i*) (dst + i));
+        cr = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(vr, a),
+                 _mm_mullo_epi16(_mm_srli_epi16(d, 11), ia)), 8);
+        cg = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(vg, a),
+                 _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(d, 5), m6), ia)), 8);
+        cb = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(vb, a),
+                 _mm_mullo_epi16(_mm_and_si128(d, m5), ia)), 8);
+        _mm_storeu_si128((__m128i*) (dst + i),
+                         _mm_or_si128(_mm_slli_epi16(cr, 11),
+                             _mm_or_si128(_mm_slli_epi16(cg, 5), cb)));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        unsigned a = src[i];
+        if (a == 0) continue;
+        dst[i] = (a == 255) ? color : blend_pixel_565(dst[i], a, r, g, b);
+    }
+}
+
+void fill_565(unsigned short *dst, int count, unsigned short color)
+{
+    int i = 0;
+
+#if defined(__ARM_NEON__)
+    uint16x8_t v = vdupq_n_u16(color);
+    for (; i + 8 <= count; i += 8) vst1q_u16(dst + i, v);
+#elif defined(__SSE2__)
+    __m128i v = _mm_set1_epi16(color);
+    for (; i + 8 <= count; i += 8) _mm_storeu_si128((__m128i*) (dst + i), v);
+#endif
+
+    for (; i < count; ++i) dst[i] = color;
+}
+
+void blend_565(unsigned short *dst, int count,
+               unsigned r, unsigned g, unsigned b, unsigned a)
+{
+    unsigned ia;
+    int i = 0;
+
+    // the color's share is the same for every pixel
+    a += a >> 7;
+    ia = 256 - a;
+    r *= a;
+    g *= a;
+    b *= a;
+
+#if defined(__ARM_NEON__)
+    uint16x8_t vr = vdupq_n_u16(r), vg = vdupq_n_u16(g), vb = vdupq_n_u16(b);
+    uint16x8_t via = vdupq_n_u16(ia);
+    uint16x8_t m6 = vdupq_n_u16(0x3f), m5 = vdupq_n_u16(0x1f);
+
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t d = vld1q_u16(dst + i), cr, cg, cb;
+        cr = vshrq_n_u16(vmlaq_u16(vr, vshrq_n_u16(d, 11), via), 8);
+        cg = vshrq_n_u16(vmlaq_u16(vg, vandq_u16(vshrq_n_u16(d, 5), m6),
+                                   via), 8);
+        cb = vshrq_n_u16(vmlaq_u16(vb, vandq_u16(d, m5), via), 8);
+        vst1q_u16(dst + i, vorrq_u16(vshlq_n_u16(cr, 11),
+                                     vorrq_u16(vshlq_n_u16(cg, 5), cb)));
+    }
+#elif defined(__SSE2__)
+    __m128i vr = _mm_set1_epi16(r), vg = _mm_set1_epi16(g);
+    __m128i vb = _mm_set1_epi16(b), via = _mm_set1_epi16(ia);
+    __m128i m6 = _mm_set1_epi16(0x3f), m5 = _mm_set1_epi16(0x1f);
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i d = _mm_loadu_si128((const __m128i*) (dst + i)), cr, cg, cb;
+        cr = _mm_srli_epi16(_mm_add_epi16(vr,
+                 _mm_mullo_epi16(_mm_srli_epi16(d, 11), via)), 8);
+        cg = _mm_srli_epi16(_mm_add_epi16(vg,
+                 _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(d, 5), m6), via)), 8);
+        cb = _mm_srli_epi16(_mm_add_epi16(vb,
+                 _mm_mullo_epi16(_mm_and_si128(d, m5), via)), 8);
+        _mm_storeu_si128((__m128i*) (dst + i),
+                         _mm_or_si128(_mm_slli_epi16(cr, 11),
+                             _mm_or_si128(_mm_slli_epi16(cg, 5), cb)));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        unsigned d = dst[i];
+        dst[i] = (((r + (d >> 11) * ia) >> 8) << 11) |
+                 (((g + ((d >> 5) & 0x3f) * ia) >> 8) << 5) |
+                 ((b + (d & 0x1f) * ia) >> 8);
+    }
+}
+
+void fill_8888(unsigned *dst, int count, unsigned color)
+{
+    int i = 0;
+
+#if defined(__ARM_NEON__)
+    uint32x4_t v = vdupq_n_u32(color);
+    for (; i + 4 <= count; i += 4) vst1q_u32(dst + i, v);
+#elif defined(__SSE2__)
+    __m128i v = _mm_set1_epi32(color);
+    for (; i + 4 <= count; i += 4) _mm_storeu_si128((__m128i*) (dst + i), v);
+#endif
+
+    for (; i < count; ++i) dst[i] = color;
+}
+
+void blend_8888(unsigned *dst, int count, unsigned color, unsigned a)
+{
+    const unsigned char *c = (const unsigned char*) &color;
+    unsigned short ca[8];
+    unsigned ia;
+    int i = 0, k;
+
+    // every byte blends the same way, whichever channel it holds
+    a += a >> 7;
+    ia = 256 - a;
+    for (k = 0; k < 8; ++k) ca[k] = c[k & 3] * a;
+
+#if defined(__ARM_NEON__)
+    uint16x8_t vca = vld1q_u16(ca), via = vdupq_n_u16(ia);
+
+    for (; i + 4 <= count; i += 4) {
+        uint8x16_t d = vld1q_u8((const uint8_t*) (dst + i));
+        uint8x8_t lo = vshrn_n_u16(vmlaq_u16(vca, vmovl_u8(vget_low_u8(d)),
+                                             via), 8);
+        uint8x8_t hi = vshrn_n_u16(vmlaq_u16(vca, vmovl_u8(vget_high_u8(d)),
+                                             via), 8);
+        vst1q_u8((uint8_t*) (dst + i), vcombine_u8(lo, hi));
+    }
+#elif defined(__SSE2__)
+    __m128i vca = _mm_loadu_si128((const __m128i*) ca);
+    __m128i via = _mm_set1_epi16(ia), zero = _mm_setzero_si128();
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+        __m128i lo = _mm_srli_epi16(_mm_add_epi16(vca,
+                         _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), via)), 8);
+        __m128i hi = _mm_srli_epi16(_mm_add_epi16(vca,
+                         _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), via)), 8);
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        unsigned char *d = (unsigned char*) (dst + i);
+        for (k = 0; k < 4; ++k) d[k] = (ca[k] + d[k] * ia) >> 8;
+    }
+}
+
+void blit_a8_to_8888(unsigned *dst, const unsigned char *src, int count,
+                     unsigned color)
+{
+    const unsigned char *c = (const unsigned char*) &color;
+    int i = 0, k;
+
+#if defined(__ARM_NEON__)
+    uint16x8_t full = vdupq_n_u16(256);
+    uint16x8_t vc[4];
+
+    for (k = 0; k < 4; ++k) vc[k] = vdupq_n_u16(c[k]);
+    for (; i + 8 <= count; i += 8) {
+        uint8x8_t a8 = vld1_u8(src + i);
+        uint16x8_t a, ia;
+        uint8x8x4_t d;
+
+        if (vget_lane_u64(vreinterpret_u64_u8(a8), 0) == 0) continue;
+        a = vmovl_u8(a8);
+        a = vaddq_u16(a, vshrq_n_u16(a, 7));
+        ia = vsubq_u16(full, a);
+        // one register per byte of the pixel
+        d = vld4_u8((const uint8_t*) (dst + i));
+        for (k = 0; k < 4; ++k) {
+            d.val[k] = vshrn_n_u16(vmlaq_u16(vmulq_u16(vc[k], a),
+                                             vmovl_u8(d.val[k]), ia), 8);
+        }
+        vst4_u8((uint8_t*) (dst + i), d);
+    }
+#elif defined(__SSE2__)
+    unsigned short cw[8];
+    __m128i vc, zero = _mm_setzero_si128(), full = _mm_set1_epi16(256);
+
+    for (k = 0; k < 8; ++k) cw[k] = c[k & 3];
+    vc = _mm_loadu_si128((const __m128i*) cw);
+    for (; i + 4 <= count; i += 4) {
+        unsigned cov;
+        __m128i a, alo, ahi, d, lo, hi;
+
+        memcpy(&cov, src + i, sizeof(cov));
+        if (cov == 0) continue;
+        // spread each coverage byte over the four bytes of its pixel
+        a = _mm_cvtsi32_si128(cov);
+        a = _mm_unpacklo_epi8(a, a);
+        a = _mm_unpacklo_epi16(a, a);
+        alo = _mm_unpacklo_epi8(a, zero);
+        ahi = _mm_unpackhi_epi8(a, zero);
+        alo = _mm_add_epi16(alo, _mm_srli_epi16(alo, 7));
+        ahi = _mm_add_epi16(ahi, _mm_srli_epi16(ahi, 7));
+        d = _mm_loadu_si128((const __m128i*) (dst + i));
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(vc, alo),
+                 _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+                                 _mm_sub_epi16(full, alo))), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(vc, ahi),
+                 _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+                                 _mm_sub_epi16(full, ahi))), 8);
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        unsigned a = src[i];
+        unsigned char *d = (unsigned char*) (dst + i);
+
+        if (a == 0) continue;
+        if (a == 255) {
+            dst[i] = color;
+            continue;
+        }
+        a += a >> 7;
+        for (k = 0; k < 4; ++k) d[k] = (c[k] * a + d[k] * (256 - a)) >> 8;
+    }
+}
+
+/* Image blits.  Sources are RGB565, or R, G, B, A bytes with premultiplied
+ * alpha (RGBX images have alpha 255).  The 8888 destinations differ only
+ * in which end red goes; swap is a constant in each caller, so each gets
+ * its own copy of the loop.
+ */
+void blit_rgba_to_565(unsigned short *dst, const unsigned char *src, int count)
+{
+    int i;
+
+    for (i = 0; i < count; ++i, src += 4) {
+        unsigned a = src[3], ia, d;
+
+        if (a == 0) continue;
+        if (a == 255) {
+            dst[i] = ((src[0] >> 3) << 11) | ((src[1] >> 2) << 5) | (src[2] >> 3);
+            continue;
+        }
+        ia = 255 - a;
+        d = dst[i];
+        dst[i] = (((src[0] + ((d >> 11) << 3) * ia / 255) >> 3) << 11) |
+                 (((src[1] + (((d >> 5) & 0x3f) << 2) * ia / 255) >> 2) << 5) |
+                 ((src[2] + ((d & 0x1f) << 3) * ia / 255) >> 3);
+    }
+}
+
+static inline void rgba_to_8888(unsigned char *dst, const unsigned char *src,
+                                int count, const int swap)
+{
+    int i;
+
+    for (i = 0; i < count; ++i, src += 4, dst += 4) {
+        unsigned r = src[swap ? 2 : 0], g = src[1], b = src[swap ? 0 : 2];
+        unsigned a = src[3], ia;
+
+        if (a == 0) continue;
+        if (a == 255) {
+            dst[0] = r;
+            dst[1] = g;
+            dst[2] = b;
+            dst[3] = 0xff;
+            continue;
+        }
+        ia = 255 - a;
+        dst[0] = r + dst[0] * ia / 255;
+        dst[1] = g + dst[1] * ia / 255;
+        dst[2] = b + dst[2] * ia / 255;
+        dst[3] = 0xff;
+    }
+}
+
+void blit_rgba_to_rgbx(unsigned *dst, const unsigned char *src, int count)
+{
+    rgba_to_8888((unsigned char*) dst, src, count, 0);
+}
+
+void blit_rgba_to_bgra(unsigned *dst, const unsigned char *src, int count)
+{
+    rgba_to_8888((unsigned char*) dst, src, count, 1);
+}
+
+static inline void rgb565_to_8888(unsigned char *dst, const unsigned short *src,
+                                  int count, const int swap)
+{
+    int i;
+
+    for (i = 0; i < count; ++i, dst += 4) {
+        unsigned v = src[i];
+        unsigned r = v >> 11, g = (v >> 5) & 0x3f, b = v & 0x1f;
+
+        r = (r << 3) | (r >> 2);
+        g = (g << 2) | (g >> 4);
+        b = (b << 3) | (b >> 2);
+        dst[0] = swap ? b : r;
+        dst[1] = g;
+        dst[2] = swap ? r : b;
+        dst[3] = 0xff;
+    }
+}
+
+void blit_565_to_rgbx(unsigned *dst, const unsigned short *src, int count)
+{
+    rgb565_to_8888((unsigned char*) dst, src, count, 0);
+}
+
+void blit_565_to_bgra(unsigned *dst, const unsigned short *src, int count)
+{
+    rgb565_to_8888((unsigned char*) dst, src, count, 1);
+}
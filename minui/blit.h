@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_BLIT_H_
+#define _MINUI_BLIT_H_
+
+// Pixel loops used by graphics.c to draw without going through
+// pixelflinger.  565 colors are passed already reduced to 5/6/5 bits;
+// 8888 colors as the pixel is laid out in memory.
+
+// Blend count 8-bit coverage values from src over dst in color (r, g, b).
+void blit_a8_to_565(unsigned short *dst, const unsigned char *src, int count,
+                    unsigned r, unsigned g, unsigned b);
+
+// The same for 8888 formats.
+void blit_a8_to_8888(unsigned *dst, const unsigned char *src, int count,
+                     unsigned color);
+
+// Solid fills, and constant alpha blends of a color over count pixels.
+// Alpha is 0..255.  The 8888 versions serve RGBX and BGRA alike.
+void fill_565(unsigned short *dst, int count, unsigned short color);
+void blend_565(unsigned short *dst, int count,
+               unsigned r, unsigned g, unsigned b, unsigned a);
+void fill_8888(unsigned *dst, int count, unsigned color);
+void blend_8888(unsigned *dst, int count, unsigned color, unsigned a);
+
+// Images: src is count pixels of premultiplied R, G, B, A bytes, or of
+// RGB565, drawn over dst.
+void blit_rgba_to_565(unsigned short *dst, const unsigned char *src, int count);
+void blit_rgba_to_rgbx(unsigned *dst, const unsigned char *src, int count);
+void blit_rgba_to_bgra(unsigned *dst, const unsigned char *src, int count);
+void blit_565_to_rgbx(unsigned *dst, const unsigned short *src, int count);
+void blit_565_to_bgra(unsigned *dst, const unsigned short *src, int count);
+
+#endif
@@ -97,57 +97,94 @@ int ch_test_cjk(const char* s)
     return (ch > 0x80) ? 1 : 0;
 }
 
-int ch_utf8_length(const char* s)
+int ch_utf8_decode(const char* s, unsigned* cp)
 {
     int res;
     ucs4_t ch;
 
-    res = utf8_mbtowc(&ch, (const unsigned char*)s, strlen(s));
+    // s is NUL terminated, and a NUL fails the continuation byte test
+    // before anything past it is read, so no length is needed.
+    res = utf8_mbtowc(&ch, (const unsigned char*)s, 6);
     if(res <= 0)
         return 0;
+    *cp = ch;
     return res;
 }
 
+int ch_utf8_length(const char* s)
+{
+    ucs4_t ch;
+
+    return ch_utf8_decode(s, &ch);
+}
+
+/* Word at a time: a word is all ascii if no byte has its top bit set and
+ * none is zero.  Only aligned words are read, so we never cross into a
+ * page past the terminating NUL.
+ */
+typedef unsigned long __attribute__((__may_alias__)) ch_word;
+
+#define ONES  ((ch_word) -1 / 0xff)
+#define HIGHS (ONES * 0x80)
+
+int ch_ascii_span(const char* s)
+{
+    const unsigned char* p = (const unsigned char*)s;
+    const ch_word* w;
+
+    while(((unsigned long)p & (sizeof(ch_word) - 1)) != 0) {
+        if(*p == 0 || *p >= 0x80)
+            return p - (const unsigned char*)s;
+        p++;
+    }
+    for(w = (const ch_word*)p; !(((*w - ONES) | *w) & HIGHS); w++)
+        ;
+    for(p = (const unsigned char*)w; *p != 0 && *p < 0x80; p++)
+        ;
+    return p - (const unsigned char*)s;
+}
+
 #include "chinese_custom.h"
 
-int ch_utf8_to_custom(const char* s)
+int ch_codepoint_to_custom(unsigned cp)
 {
-    int i, n;
-    struct utf8_to_custom* res;
-    unsigned char name[8];
+    unsigned page;
 
-    n = ch_utf8_length(s);
-    if(n <= 0)
+    if(cp < 0x80)
+        return cp - 32;
+    page = cp >> 8;
+    if(page >= CH_GLYPH_PAGES || ch_glyph_page[page] == 0)
         return 0;
-    if(n == 1)
-        return (*s - 32);
-    for(i = 0; i < n; i++)
-        name[i] = ((unsigned char*)(s))[i];
-    name[n] = 0;
-    res = in_word_set(name, n);
-    if(res)
-        return res->value;
-    else
+    return ch_glyph_index[(ch_glyph_page[page] - 1) * 256 + (cp & 0xff)];
+}
+
+int ch_utf8_to_custom(const char* s)
+{
+    unsigned cp;
+
+    if(ch_utf8_decode(s, &cp) <= 0)
         return 0;
+    return ch_codepoint_to_custom(cp);
 }
 
 int str_utf8_length(const char* s)
 {
-    int n, l, off;
+    int n, l;
 
     n = 0;
-    off = 0;
-    while(*(s + off))
+    for(;;)
     {
-        l = ch_utf8_length(s + off);
-        off += l;
-        if(l == 1)
-            n += 1;
-        else
-        {
-            // fix me
-            n += 2;
-        }
+        l = ch_ascii_span(s);
+        n += l;
+        s += l;
+        if(*s == 0)
+            break;
+        l = ch_utf8_length(s);
+        if(l <= 0)
+            break;
+        s += l;
+        // fix me
+        n += 2;
     }
 
     return n;
@@ -6,8 +6,14 @@
 int ch_test_cjk(const char* s);
 // size of the next utf-8 charater
 int ch_utf8_length(const char* s);
+// decode the next utf-8 character into *cp, returns its size or 0
+int ch_utf8_decode(const char* s, unsigned* cp);
+// number of ascii bytes before the next non-ascii character or the end
+int ch_ascii_span(const char* s);
 // convert utf-8 to our custom encoding
 int ch_utf8_to_custom(const char* s);
+// custom encoding of a codepoint, 0 when the font has no glyph for it
+int ch_codepoint_to_custom(unsigned cp);
 // 2 * wide chars + ascii chars
 int str_utf8_length(const char* s);
 
@@ -5,90 +5,79 @@ require 'iconv'
 require 'RMagick'
 include Magick
 
+# usage: chinese_gen.rb [ascii_font [cjk_font [charset]]]
+#
+# charset is a UTF-8 text file; every distinct non-ascii character in it
+# gets a glyph, in order of first appearance.  Without one the GB2312
+# ranges below are used.
+ascii_font = ARGV[0] || '/windows/C/Windows/Fonts/simhei.ttf'
+cjk_font = ARGV[1] || '/windows/C/Windows/Fonts/simsun.ttc'
+
 s = ''
 # basic printable
 for i in 32...128
     s = "%s%c" % [ s, i ]
 end
 
-# generate all gb2312 character
-#for i in 0xa1..0xfe
-#    for j in 0xa1..0xfe
-#        c += "%c%c" % [ i, j ]
-#    end
-#end
-#c = Iconv.iconv('utf-8', 'gb2312', c)[0]
-#c = Iconv.iconv('utf-8', 'gb18030', c)[0]
-#s += c
-# gen needed character using gperf
-p "preparing data"
-c = ''
-count = s.length
-f = File.open('chinese_custom.gperf', 'w')
-f.write("struct utf8_to_custom { char* name; int value; };\n")
-f.write("%%\n")
-# chinese punct
-for j in 0xa1..0xfe
-    ch = "%c%c" % [ 0xa1, j ]
-    c += ch
-    ch = Iconv.iconv('utf-8', 'gb2312', ch)[0]
-    line = "\"%s\", %d\n" % [ ch, count ]
-    f.write(line)
-    count += 1
-end
-# full width ascii
-for j in 0xa1..0xfe
-    ch = "%c%c" % [ 0xa3, j ]
-    c += ch
-    ch = Iconv.iconv('utf-8', 'gb2312', ch)[0]
-    line = "\"%s\", %d\n" % [ ch, count ]
-    f.write(line)
-    count += 1
-end
-# hiragana
-for j in 0xa1..0xf3
-    ch = "%c%c" % [ 0xa4, j ]
-    c += ch
-    ch = Iconv.iconv('utf-8', 'gb2312', ch)[0]
-    line = "\"%s\", %d\n" % [ ch, count ]
-    f.write(line)
-    count += 1
-end
-# katakana
-for j in 0xa1..0xf6
-    ch = "%c%c" % [ 0xa5, j ]
-    c += ch
-    ch = Iconv.iconv('utf-8', 'gb2312', ch)[0]
-    line = "\"%s\", %d\n" % [ ch, count ]
-    f.write(line)
-    count += 1
+def gb2312(hi, range)
+    range.map { |j| Iconv.iconv('utf-8', 'gb2312', "%c%c" % [ hi, j ])[0] }
 end
-# common simplified chinese charaters
-for i in 0xb0..0xd6
-    for j in 0xa1..0xfe
-        ch = "%c%c" % [ i, j ]
-        c += ch
-        ch = Iconv.iconv('utf-8', 'gb2312', ch)[0]
-        line = "\"%s\", %d\n" % [ ch, count ]
-        f.write(line)
-        count += 1
+
+p "preparing data"
+chars = []
+if ARGV[2]
+    seen = {}
+    File.open(ARGV[2]) { |f| f.read }.unpack('U*').each { |cp|
+        next if cp < 0x80 || seen[cp]
+        seen[cp] = true
+        chars.push([ cp ].pack('U'))
+    }
+else
+    # chinese punct
+    chars += gb2312(0xa1, 0xa1..0xfe)
+    # full width ascii
+    chars += gb2312(0xa3, 0xa1..0xfe)
+    # hiragana
+    chars += gb2312(0xa4, 0xa1..0xf3)
+    # katakana
+    chars += gb2312(0xa5, 0xa1..0xf6)
+    # common simplified chinese charaters
+    for i in 0xb0..0xd6
+        chars += gb2312(i, 0xa1..0xfe)
     end
+    chars += gb2312(0xd7, 0xa1..0xf9)
 end
-for j in 0xa1..0xf9
-    ch = "%c%c" % [ 0xd7, j ]
-    c += ch
-    ch = Iconv.iconv('utf-8', 'gb2312', ch)[0]
-    line = "\"%s\", %d\n" % [ ch, count ]
-    f.write(line)
-    count += 1
+
+# codepoint -> glyph lookup: ch_glyph_page[cp >> 8] is 0 when no glyph
+# falls in that 256 codepoint page, otherwise 1 + the page's block in
+# ch_glyph_index, which holds the custom encoding (0 for none).
+blocks = {}
+chars.each_with_index { |ch, i|
+    cp = ch.unpack('U')[0]
+    (blocks[cp >> 8] ||= Array.new(256, 0))[cp & 0xff] = s.length + i
+}
+page_count = (blocks.keys.max || 0) + 1
+page_order = blocks.keys.sort
+f = File.open('chinese_custom.h', 'w')
+f.write("/* generated by chinese_gen.rb, do not edit */\n")
+f.write("#define CH_GLYPH_PAGES #{page_count}\n")
+f.write("static const unsigned short ch_glyph_page[CH_GLYPH_PAGES] = {\n")
+for i in 0...page_count
+    f.write("%d, " % [ blocks[i] ? page_order.index(i) + 1 : 0 ])
+    f.write("\n") if i % 16 == 15
 end
-f.write('%%')
+f.write("\n};\n")
+f.write("static const unsigned short ch_glyph_index[#{page_order.length * 256}] = {\n")
+page_order.each { |page|
+    blocks[page].each_with_index { |v, j|
+        f.write("%d, " % [ v ])
+        f.write("\n") if j % 16 == 15
+    }
+}
+f.write("};\n")
 f.close
-p = IO.popen('gperf -t chinese_custom.gperf > chinese_custom.h')
-p.read
-p.close
 # gen a **huge** bitmap
-count -= s.length
+count = chars.length
 char_width = 10
 char_height = 18
 asc_width = char_width * s.length
@@ -100,7 +89,7 @@ canvas = Image.new(img_width, img_height)
 text = Draw.new
 text.gravity = WestGravity
 text.pointsize = 18
-text.font = '/windows/C/Windows/Fonts/simhei.ttf'
+text.font = ascii_font
 p "painting basic ascii"
 for i in 0...96
     ch = s[i, 1]
@@ -109,11 +98,10 @@ for i in 0...96
     text.text(i * char_width, 0, ch)
 end
 text.draw(canvas)
-text.font = '/windows/C/Windows/Fonts/simsun.ttc'
+text.font = cjk_font
 p "painting extra characters"
 for i in 0...count
-    ch = Iconv.iconv('utf-8', 'gb2312', c[i * 2, 2])[0]
-    text.text(i * char_width * 2 + asc_width, 0, ch)
+    text.text(i * char_width * 2 + asc_width, 0, chars[i])
 end
 text.draw(canvas)
 p "writing preview file"
@@ -16,6 +16,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/poll.h>
@@ -40,7 +42,7 @@ int ev_init(void)
         while((de = readdir(dir))) {
 //            fprintf(stderr,"/dev/input/%s\n", de->d_name);
             if(strncmp(de->d_name,"event",5)) continue;
-            fd = openat(dirfd(dir), de->d_name, O_RDONLY);
+            fd = openat(dirfd(dir), de->d_name, O_RDONLY | O_NONBLOCK);
             if(fd < 0) continue;
 
             ev_fds[ev_count].fd = fd;
@@ -80,3 +82,20 @@ int ev_get(struct input_event *ev, unsigned dont_wait)
 
     return -1;
 }
+
+int ev_get_fds(int *fds, int max)
+{
+    unsigned n;
+
+    for(n = 0; n < ev_count && n < (unsigned) max; n++) {
+        fds[n] = ev_fds[n].fd;
+    }
+    return n;
+}
+
+int ev_read(int fd, struct input_event *ev, int max)
+{
+    int r = read(fd, ev, max * sizeof(*ev));
+    if(r < 0) return -1;
+    return r / sizeof(*ev);
+}
@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -29,13 +30,15 @@
 
 #include <pixelflinger/pixelflinger.h>
 
+#include <png.h>
+
 #include "minui.h"
 
 #include "font.h"
 #include "chinese.h"
+#include "blit.h"
 
 typedef struct {
-    GGLSurface texture;
     unsigned cwidth;
     unsigned cheight;
     unsigned ascent;
@@ -43,20 +46,71 @@ typedef struct {
 
 static GRFont *gr_font = 0;
 static GGLContext *gr_context = 0;
-static GGLSurface gr_font_texture;
 static GGLSurface gr_framebuffer[2];
 static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
+static unsigned gr_fb_pages = 2;
+
+/* Where drawing goes: the back framebuffer page when the driver gives us
+ * two pages to flip between, or gr_mem_surface when it doesn't.
+ */
+static GGLSurface *gr_draw = NULL;
+
+#define GR_MAX_DAMAGE 16
+
+typedef struct {
+    int x, y, w, h;
+} GRRect;
+
+// Damage since the last flip.
+static GRRect gr_damage_rects[GR_MAX_DAMAGE];
+static int gr_damage_count = 0;
+
+// What gr_text() and gr_fill() draw with; they don't go through
+// pixelflinger.
+static GRRect gr_clip_rect;
+static unsigned gr_text_r, gr_text_g, gr_text_b;
+static unsigned gr_color_8888;      // as an RGBX or BGRA pixel
+static unsigned char gr_rgba[4];
+
+// Pixels copied to the screen by the last gr_flip().
+static int gr_flipped_pixels = 0;
+
+// Set by gr_init_headless(): the "framebuffer" is just memory.
+static int gr_headless = 0;
 
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
 static struct fb_var_screeninfo vi;
 
+// Format of the screen, and of every surface we draw into.
+static int gr_format = GGL_PIXEL_FORMAT_RGB_565;
+
+static int pixel_size(int format)
+{
+    return (format == GGL_PIXEL_FORMAT_RGB_565) ? 2 : 4;
+}
+
+/* The format fb0 is in, if it is one we draw directly; 32 bpp panels put
+ * red at either end. */
+static int fb_format(const struct fb_var_screeninfo *v)
+{
+    if (v->bits_per_pixel == 16) return GGL_PIXEL_FORMAT_RGB_565;
+    if (v->bits_per_pixel == 32 && v->green.offset == 8) {
+        if (v->red.offset == 0 && v->blue.offset == 16)
+            return GGL_PIXEL_FORMAT_RGBX_8888;
+        if (v->red.offset == 16 && v->blue.offset == 0)
+            return GGL_PIXEL_FORMAT_BGRA_8888;
+    }
+    return GGL_PIXEL_FORMAT_NONE;
+}
+
 static int get_framebuffer(GGLSurface *fb)
 {
-    int fd;
+    int fd, bpp;
     struct fb_fix_screeninfo fi;
+    unsigned line, page;
     void *bits;
 
     fd = open("/dev/graphics/fb0", O_RDWR);
@@ -77,6 +131,26 @@ static int get_framebuffer(GGLSurface *fb)
         return -1;
     }
 
+    gr_format = fb_format(&vi);
+    if (gr_format == GGL_PIXEL_FORMAT_NONE) {
+        // anything else, try switching to 16 bpp as we always used to
+        vi.bits_per_pixel = 16;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &vi) < 0 ||
+            ioctl(fd, FBIOGET_FSCREENINFO, &fi) < 0 ||
+            ioctl(fd, FBIOGET_VSCREENINFO, &vi) < 0 ||
+            (gr_format = fb_format(&vi)) == GGL_PIXEL_FORMAT_NONE) {
+            fprintf(stderr, "unsupported framebuffer format (%d bpp)\n",
+                    vi.bits_per_pixel);
+            close(fd);
+            return -1;
+        }
+    }
+
+    // rows may be padded past xres
+    bpp = pixel_size(gr_format);
+    line = fi.line_length ? fi.line_length : vi.xres * bpp;
+    page = vi.yres * line;
+
     bits = mmap(0, fi.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (bits == MAP_FAILED) {
         perror("failed to mmap framebuffer");
@@ -87,18 +161,22 @@ static int get_framebuffer(GGLSurface *fb)
     fb->version = sizeof(*fb);
     fb->width = vi.xres;
     fb->height = vi.yres;
-    fb->stride = vi.xres;
+    fb->stride = line / bpp;
     fb->data = bits;
-    fb->format = GGL_PIXEL_FORMAT_RGB_565;
+    fb->format = gr_format;
 
     fb++;
 
+    /* Without room for a second page there is nothing to flip to; both
+     * entries then describe the one page. */
+    gr_fb_pages = (fi.smem_len >= page * 2) ? 2 : 1;
+
     fb->version = sizeof(*fb);
     fb->width = vi.xres;
     fb->height = vi.yres;
-    fb->stride = vi.xres;
-    fb->data = (void*) (((unsigned) bits) + vi.yres * vi.xres * 2);
-    fb->format = GGL_PIXEL_FORMAT_RGB_565;
+    fb->stride = line / bpp;
+    fb->data = (char*) bits + (gr_fb_pages - 1) * page;
+    fb->format = gr_format;
 
     return fd;
 }
@@ -108,35 +186,155 @@ static void get_memory_surface(GGLSurface* ms) {
   ms->width = vi.xres;
   ms->height = vi.yres;
   ms->stride = vi.xres;
-  ms->data = malloc(vi.xres * vi.yres * 2);
-  ms->format = GGL_PIXEL_FORMAT_RGB_565;
+  ms->data = malloc(vi.xres * vi.yres * pixel_size(gr_format));
+  ms->format = gr_format;
 }
 
-static void set_active_framebuffer(unsigned n)
+static int set_active_framebuffer(unsigned n)
 {
-    if (n > 1) return;
-    vi.yres_virtual = vi.yres * 2;
+    if (n > 1) return -1;
+    vi.yres_virtual = vi.yres * gr_fb_pages;
     vi.yoffset = n * vi.yres;
-    vi.bits_per_pixel = 16;
     if (ioctl(gr_fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
         perror("active fb swap failed");
+        return -1;
     }
+    return 0;
+}
+
+static void copy_rect(GGLSurface *dst, const GGLSurface *src, const GRRect *r)
+{
+    int bpp = pixel_size(gr_format);
+    const unsigned char *from = src->data;
+    unsigned char *to = dst->data;
+    int y;
+
+    from += (r->y * src->stride + r->x) * bpp;
+    to += (r->y * dst->stride + r->x) * bpp;
+    if (r->x == 0 && r->w == (int) vi.xres && src->stride == dst->stride) {
+        memcpy(to, from, r->h * src->stride * bpp);
+        return;
+    }
+    for (y = 0; y < r->h; ++y) {
+        memcpy(to, from, r->w * bpp);
+        from += src->stride * bpp;
+        to += dst->stride * bpp;
+    }
+}
+
+/* Stop flipping pages and draw into memory instead, copying each frame's
+ * damage to the page on screen.  The page we were drawing into already
+ * holds everything up to and including the pending damage.
+ */
+static int use_memory_surface(void)
+{
+    GRRect all = { 0, 0, vi.xres, vi.yres };
+
+    get_memory_surface(&gr_mem_surface);
+    if (gr_mem_surface.data == NULL) return -1;
+    copy_rect(&gr_mem_surface, gr_draw, &all);
+    gr_draw = &gr_mem_surface;
+    gr_context->colorBuffer(gr_context, gr_draw);
+    return 0;
 }
 
 void gr_flip(void)
 {
-    GGLContext *gl = gr_context;
+    int i;
 
-    /* swap front and back buffers */
-    gr_active_fb = (gr_active_fb + 1) & 1;
+    /* nothing changed since the last flip */
+    gr_flipped_pixels = 0;
+    if (gr_damage_count == 0) return;
+    for (i = 0; i < gr_damage_count; ++i) {
+        gr_flipped_pixels += gr_damage_rects[i].w * gr_damage_rects[i].h;
+    }
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           vi.xres * vi.yres * 2);
+    if (gr_draw != &gr_mem_surface) {
+        unsigned back = (gr_active_fb + 1) & 1;
+
+        /* make the page we drew into visible */
+        if (set_active_framebuffer(back) == 0) {
+            gr_active_fb = back;
+
+            /* the other page is now the back page; bring it up to date
+             * with this frame so the next one can be drawn straight into
+             * it.  Only the damage differs between the two pages. */
+            gr_draw = &gr_framebuffer[(gr_active_fb + 1) & 1];
+            for (i = 0; i < gr_damage_count; ++i) {
+                copy_rect(gr_draw, &gr_framebuffer[gr_active_fb],
+                          &gr_damage_rects[i]);
+            }
+            gr_context->colorBuffer(gr_context, gr_draw);
+            gr_damage_count = 0;
+            return;
+        }
+        if (use_memory_surface() < 0) return;
+    }
 
-    /* inform the display driver */
-    set_active_framebuffer(gr_active_fb);
+    /* copy what changed in the in-memory surface to the page on screen */
+    for (i = 0; i < gr_damage_count; ++i) {
+        copy_rect(&gr_framebuffer[gr_active_fb], &gr_mem_surface,
+                  &gr_damage_rects[i]);
+    }
+    gr_damage_count = 0;
+}
+
+void gr_damage(int x, int y, int w, int h)
+{
+    GRRect *rects = gr_damage_rects;
+    int *count = &gr_damage_count;
+    int i;
+
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > (int) vi.xres) w = vi.xres - x;
+    if (y + h > (int) vi.yres) h = vi.yres - y;
+    if (w <= 0 || h <= 0) return;
+
+    /* skip rectangles we already cover */
+    for (i = 0; i < *count; ++i) {
+        GRRect *r = &rects[i];
+        if (x >= r->x && y >= r->y &&
+            x + w <= r->x + r->w && y + h <= r->y + r->h) {
+            return;
+        }
+    }
+
+    if (*count == GR_MAX_DAMAGE) {
+        /* out of slots: fold everything into one bounding box */
+        int x1 = x + w, y1 = y + h;
+        for (i = 0; i < *count; ++i) {
+            GRRect *r = &rects[i];
+            if (r->x < x) x = r->x;
+            if (r->y < y) y = r->y;
+            if (r->x + r->w > x1) x1 = r->x + r->w;
+            if (r->y + r->h > y1) y1 = r->y + r->h;
+        }
+        w = x1 - x;
+        h = y1 - y;
+        *count = 0;
+    }
+
+    rects[*count].x = x;
+    rects[*count].y = y;
+    rects[*count].w = w;
+    rects[*count].h = h;
+    (*count)++;
+}
+
+void gr_clip(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
+    gr_clip_rect.x = x;
+    gr_clip_rect.y = y;
+    gr_clip_rect.w = w;
+    gr_clip_rect.h = h;
+    if (w <= 0 || h <= 0) {
+        gl->disable(gl, GGL_SCISSOR_TEST);
+        return;
+    }
+    gl->scissor(gl, x, y, w, h);
+    gl->enable(gl, GGL_SCISSOR_TEST);
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -148,6 +346,20 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+    gr_text_r = r >> 3;
+    gr_text_g = g >> 2;
+    gr_text_b = b >> 3;
+    gr_rgba[0] = r;
+    gr_rgba[1] = g;
+    gr_rgba[2] = b;
+    gr_rgba[3] = a;
+
+    unsigned char pixel[4] = { r, g, b, 0xff };
+    if (gr_format == GGL_PIXEL_FORMAT_BGRA_8888) {
+        pixel[0] = b;
+        pixel[2] = r;
+    }
+    memcpy(&gr_color_8888, pixel, sizeof(gr_color_8888));
 }
 
 int gr_measure(const char *s)
@@ -155,64 +367,261 @@ int gr_measure(const char *s)
     return gr_font->cwidth * str_utf8_length(s);
 }
 
-static GGLSurface font_ftex;
-static int font_bitmap_count;
 static int font_char_per_bitmap = 128;
-static void** font_data;
 
-#include <sys/time.h>
+/* The font stays run-length encoded in font.rundata; it is decoded a page
+ * (font_char_per_bitmap cells) at a time, on first use, into a small LRU
+ * cache.  The image is stored row by row across every page, so
+ * font_index remembers where each row of each page starts:
+ * font_index[row * font_page_count + page].
+ */
+typedef struct {
+    unsigned run;       // offset into font.rundata
+    unsigned skip;      // pixels of that run belonging to earlier pages
+} FontRowStart;
+
+#define FONT_CACHE_PAGES 8
+
+typedef struct {
+    int page;           // -1 when unused
+    unsigned last_used;
+    unsigned char *bits;
+} FontPage;
+
+static FontRowStart *font_index;
+static int font_page_count;
+static unsigned font_page_width;
+static FontPage font_cache[FONT_CACHE_PAGES];
+static unsigned font_cache_clock;
+
+static void decode_font_page(int page, unsigned char *bits)
+{
+    unsigned width = font.width - page * font_page_width;
+    unsigned row, left, n;
+
+    if (width > font_page_width) width = font_page_width;
+
+    for (row = 0; row < font.cheight; ++row) {
+        const FontRowStart *start = &font_index[row * font_page_count + page];
+        const unsigned char *in = font.rundata + start->run;
+        unsigned char *out = bits + row * font_page_width;
+        unsigned skip = start->skip;
+
+        for (left = width; left > 0 && (n = *in & 0x7f) != 0; ++in) {
+            n -= skip;
+            skip = 0;
+            if (n > left) n = left;
+            memset(out, (*in & 0x80) ? 0xff : 0, n);
+            out += n;
+            left -= n;
+        }
+        memset(out, 0, font_page_width - (width - left));
+    }
+}
+
+static const unsigned char *font_page(int page)
+{
+    FontPage *slot = &font_cache[0];
+    int i;
+
+    for (i = 0; i < FONT_CACHE_PAGES; ++i) {
+        if (font_cache[i].page == page) {
+            slot = &font_cache[i];
+            goto found;
+        }
+        if (font_cache[i].last_used < slot->last_used) slot = &font_cache[i];
+    }
+
+    // not cached: reuse the least recently used slot
+    if (slot->bits == NULL) {
+        slot->bits = malloc(font_page_width * font.cheight);
+        if (slot->bits == NULL) return NULL;
+    }
+    decode_font_page(page, slot->bits);
+    slot->page = page;
+
+found:
+    slot->last_used = ++font_cache_clock;
+    return slot->bits;
+}
+
+/* Where a glyph sits in the font.  ASCII glyphs are found by arithmetic;
+ * anything else goes through the codepoint table, so those slots are
+ * cached by codepoint.
+ */
+typedef struct {
+    unsigned codepoint;
+    unsigned page;
+    unsigned offset;    // of the glyph's top row in its page
+    unsigned width;
+} GRGlyph;
+
+#define GR_GLYPH_CACHE_SIZE 256
+
+static GRGlyph gr_glyph_cache[GR_GLYPH_CACHE_SIZE];
+
+static void glyph_slot(int index, GRGlyph *g)
+{
+    // wide glyphs take two cells, and never straddle two pages
+    unsigned cell = (index < 96) ? index : 96 + (index - 96) * 2;
+
+    g->width = (index < 96) ? gr_font->cwidth : gr_font->cwidth * 2;
+    g->page = cell / font_char_per_bitmap;
+    g->offset = (cell % font_char_per_bitmap) * gr_font->cwidth;
+}
+
+static const GRGlyph *lookup_glyph(unsigned codepoint)
+{
+    GRGlyph *g = &gr_glyph_cache[codepoint & (GR_GLYPH_CACHE_SIZE - 1)];
+
+    if (g->codepoint != codepoint) {
+        glyph_slot(ch_codepoint_to_custom(codepoint), g);
+        g->codepoint = codepoint;
+    }
+    return g;
+}
 
 int gr_text(int x, int y, const char *s)
 {
-    GGLContext *gl = gr_context;
     GRFont *gfont = gr_font;
-    unsigned off, width, height, font_bitmap_width, n;
+    unsigned char *pixels = gr_draw->data;
+    unsigned stride = gr_draw->stride;
+    int bpp = pixel_size(gr_format);
+    int left = 0, right = gr_draw->width;
+    int top, bottom, row, n;
+    unsigned codepoint;
+    const unsigned char *bits;
+    const GRGlyph *g;
+    GRGlyph ascii;
 
     y -= gfont->ascent;
 
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
+    top = y;
+    bottom = y + gfont->cheight;
+    if (gr_clip_rect.w > 0 && gr_clip_rect.h > 0) {
+        if (gr_clip_rect.x > left) left = gr_clip_rect.x;
+        if (gr_clip_rect.x + gr_clip_rect.w < right)
+            right = gr_clip_rect.x + gr_clip_rect.w;
+        if (gr_clip_rect.y > top) top = gr_clip_rect.y;
+        if (gr_clip_rect.y + gr_clip_rect.h < bottom)
+            bottom = gr_clip_rect.y + gr_clip_rect.h;
+    }
+    if (top < 0) top = 0;
+    if (bottom > (int) gr_draw->height) bottom = gr_draw->height;
+
+    while (*s) {
+        unsigned char c = *s;
+        int x0, x1;
 
-    while((off = *s)) {
-        if(*((unsigned char*)(s)) < 0x20) {
+        if (c < 0x20) {
             s++;
             continue;
         }
-        width = gfont->cwidth;
-        height = gfont->cheight;
-        off = ch_utf8_to_custom(s);
-        if(off >= 96)
-            width *= 2;
-        memcpy(&font_ftex, &gfont->texture, sizeof(font_ftex));
-        font_bitmap_width = (font.width % (font.cwidth * font_char_per_bitmap));
-        if(!font_bitmap_width)
-            font_bitmap_width = font.cwidth * font_char_per_bitmap;
-        font_ftex.width = font_bitmap_width;
-        font_ftex.stride = font_bitmap_width;
-        font_ftex.data = font_data[(off < 96) ? (off / font_char_per_bitmap) : ((96 + (off - 96) * 2) / font_char_per_bitmap)];
-        gl->bindTexture(gl, &font_ftex);
-        if(off >= 96)
-            gl->texCoord2i(gl, ((96 + (off - 96) * 2) * font.cwidth) % (font_char_per_bitmap * font.cwidth) - x, 0 - y);
-        else
-            gl->texCoord2i(gl, (off % font_char_per_bitmap) * width - x, 0 - y);
-        gl->recti(gl, x, y, x + width, y + height);
-        x += width;
-        n = ch_utf8_length(s);
-        if(n <= 0)
-            break;
+        if (c < 0x80) {
+            glyph_slot(c - 32, &ascii);
+            g = &ascii;
+            n = 1;
+        } else {
+            n = ch_utf8_decode(s, &codepoint);
+            if (n <= 0)
+                break;
+            g = lookup_glyph(codepoint);
+        }
+
+        x0 = (x > left) ? x : left;
+        x1 = (x + (int) g->width < right) ? x + (int) g->width : right;
+        if (x0 < x1 && top < bottom && (bits = font_page(g->page)) != NULL) {
+            bits += g->offset + (x0 - x);
+            for (row = top; row < bottom; ++row) {
+                void *to = pixels + (row * stride + x0) * bpp;
+                const unsigned char *from = bits + (row - y) * font_page_width;
+                if (bpp == 2) {
+                    blit_a8_to_565(to, from, x1 - x0,
+                                   gr_text_r, gr_text_g, gr_text_b);
+                } else {
+                    blit_a8_to_8888(to, from, x1 - x0, gr_color_8888);
+                }
+            }
+        }
+        x += g->width;
         s += n;
     }
 
     return x;
 }
 
-void gr_fill(int x, int y, int w, int h)
+void gr_fill(int x, int y, int x1, int y1)
 {
     GGLContext *gl = gr_context;
-    gl->disable(gl, GGL_TEXTURE_2D);
-    gl->recti(gl, x, y, w, h);
+    unsigned char *pixels = gr_draw->data;
+    unsigned a = gr_rgba[3];
+    int row, bpp;
+
+    if (gr_clip_rect.w > 0 && gr_clip_rect.h > 0) {
+        if (x < gr_clip_rect.x) x = gr_clip_rect.x;
+        if (y < gr_clip_rect.y) y = gr_clip_rect.y;
+        if (x1 > gr_clip_rect.x + gr_clip_rect.w)
+            x1 = gr_clip_rect.x + gr_clip_rect.w;
+        if (y1 > gr_clip_rect.y + gr_clip_rect.h)
+            y1 = gr_clip_rect.y + gr_clip_rect.h;
+    }
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x1 > (int) gr_draw->width) x1 = gr_draw->width;
+    if (y1 > (int) gr_draw->height) y1 = gr_draw->height;
+    if (x >= x1 || y >= y1 || a == 0) return;
+
+    switch (gr_draw->format) {
+    case GGL_PIXEL_FORMAT_RGB_565:
+        bpp = 2;
+        pixels += (y * gr_draw->stride + x) * bpp;
+        for (row = y; row < y1; ++row, pixels += gr_draw->stride * bpp) {
+            if (a == 255) {
+                fill_565((unsigned short*) pixels, x1 - x,
+                         (gr_text_r << 11) | (gr_text_g << 5) | gr_text_b);
+            } else {
+                blend_565((unsigned short*) pixels, x1 - x,
+                          gr_text_r, gr_text_g, gr_text_b, a);
+            }
+        }
+        break;
+
+    case GGL_PIXEL_FORMAT_RGBX_8888:
+    case GGL_PIXEL_FORMAT_BGRA_8888:
+        bpp = 4;
+        pixels += (y * gr_draw->stride + x) * bpp;
+        for (row = y; row < y1; ++row, pixels += gr_draw->stride * bpp) {
+            if (a == 255) {
+                fill_8888((unsigned*) pixels, x1 - x, gr_color_8888);
+            } else {
+                blend_8888((unsigned*) pixels, x1 - x, gr_color_8888, a);
+            }
+        }
+        break;
+
+    default:
+        gl->disable(gl, GGL_TEXTURE_2D);
+        gl->recti(gl, x, y, x1, y1);
+        break;
+    }
+}
+
+static void blit_row(void *to, const void *from, int src_format, int count)
+{
+    if (src_format == gr_format) {
+        memcpy(to, from, count * pixel_size(gr_format));
+    } else if (src_format == GGL_PIXEL_FORMAT_RGB_565) {
+        if (gr_format == GGL_PIXEL_FORMAT_RGBX_8888)
+            blit_565_to_rgbx(to, from, count);
+        else
+            blit_565_to_bgra(to, from, count);
+    } else if (gr_format == GGL_PIXEL_FORMAT_RGB_565) {
+        blit_rgba_to_565(to, from, count);
+    } else if (gr_format == GGL_PIXEL_FORMAT_RGBX_8888) {
+        blit_rgba_to_rgbx(to, from, count);
+    } else {
+        blit_rgba_to_bgra(to, from, count);
+    }
 }
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
@@ -220,6 +629,51 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
         return;
     }
     GGLContext *gl = gr_context;
+    GGLSurface *src = (GGLSurface*) source;
+
+    /* res_create_surface() gives opaque images in the screen's format,
+     * which are copied row by row, and premultiplied RGBA, which is blended
+     * onto any screen format directly.  Opaque RGB565 or RGBX surfaces made
+     * for another screen are converted as they are drawn. */
+    if (src->format == gr_format ||
+        src->format == GGL_PIXEL_FORMAT_RGB_565 ||
+        src->format == GGL_PIXEL_FORMAT_RGBX_8888 ||
+        src->format == GGL_PIXEL_FORMAT_RGBA_8888) {
+        int left = 0, top = 0;
+        int right = gr_draw->width, bottom = gr_draw->height;
+        int bpp = pixel_size(gr_format), sbpp = pixel_size(src->format);
+        const unsigned char *from;
+        unsigned char *to;
+        int row;
+
+        if (gr_clip_rect.w > 0 && gr_clip_rect.h > 0) {
+            if (gr_clip_rect.x > left) left = gr_clip_rect.x;
+            if (gr_clip_rect.y > top) top = gr_clip_rect.y;
+            if (gr_clip_rect.x + gr_clip_rect.w < right)
+                right = gr_clip_rect.x + gr_clip_rect.w;
+            if (gr_clip_rect.y + gr_clip_rect.h < bottom)
+                bottom = gr_clip_rect.y + gr_clip_rect.h;
+        }
+        if (sx < 0) { w += sx; dx -= sx; sx = 0; }
+        if (sy < 0) { h += sy; dy -= sy; sy = 0; }
+        if (dx < left) { w -= left - dx; sx += left - dx; dx = left; }
+        if (dy < top) { h -= top - dy; sy += top - dy; dy = top; }
+        if (sx + w > (int) src->width) w = src->width - sx;
+        if (sy + h > (int) src->height) h = src->height - sy;
+        if (dx + w > right) w = right - dx;
+        if (dy + h > bottom) h = bottom - dy;
+        if (w <= 0 || h <= 0) return;
+
+        from = (const unsigned char*) src->data +
+               (sy * src->stride + sx) * sbpp;
+        to = (unsigned char*) gr_draw->data + (dy * gr_draw->stride + dx) * bpp;
+        for (row = 0; row < h; ++row) {
+            blit_row(to, from, src->format, w);
+            from += src->stride * sbpp;
+            to += gr_draw->stride * bpp;
+        }
+        return;
+    }
 
     gl->bindTexture(gl, (GGLSurface*) source);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
@@ -227,7 +681,10 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->enable(gl, GGL_TEXTURE_2D);
     gl->texCoord2i(gl, sx - dx, sy - dy);
+    // surfaces are premultiplied; gr_color() colors are not
+    gl->blendFunc(gl, GGL_ONE, GGL_ONE_MINUS_SRC_ALPHA);
     gl->recti(gl, dx, dy, dx + w, dy + h);
+    gl->blendFunc(gl, GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA);
 }
 
 unsigned int gr_get_width(gr_surface surface) {
@@ -244,47 +701,55 @@ unsigned int gr_get_height(gr_surface surface) {
     return ((GGLSurface*) surface)->height;
 }
 
-static void gr_init_font(void)
+static int gr_init_font(void)
 {
-    GGLSurface *ftex;
-    unsigned char *bits, *rle;
-    unsigned char *in, data;
-    int i, d, n, bmp, pos;
+    const unsigned char *in;
+    unsigned d, n, target;
+    int i, row, page;
 
     gr_font = calloc(sizeof(*gr_font), 1);
-    ftex = &gr_font->texture;
+    if (gr_font == NULL) return -1;
 
-    font_bitmap_count = font.width / font.cwidth / font_char_per_bitmap + 1;
-    font_data = (void**)malloc(font_bitmap_count * sizeof(void*));
-    for(n = 0; n < font_bitmap_count; n++)
-    {
-        font_data[n] = malloc(font_char_per_bitmap * font.cwidth * font.cheight);
-        memset(font_data[n], 0, font_char_per_bitmap * font.cwidth * font.cheight);
-    }
+    font_page_width = font.cwidth * font_char_per_bitmap;
+    font_page_count = (font.width + font_page_width - 1) / font_page_width;
+    font_index = malloc(font_page_count * font.cheight * sizeof(*font_index));
+    if (font_index == NULL) return -1;
+
+    /* one pass over the runs, noting where each (row, page) starts; the
+     * starts come in increasing order */
+    row = page = 0;
+    target = 0;
     d = 0;
-    in = font.rundata;
-    while((data = *in++))
-    {
-        n = data & 0x7f;
-        for(i = 0; i < n; i++, d++)
-        {
-            bmp = d % font.width / (font.cwidth * font_char_per_bitmap);
-            pos = d / font.width * (font.cwidth * font_char_per_bitmap) + (d % (font.cwidth * font_char_per_bitmap));
-            ((unsigned char*)(font_data[bmp]))[pos] = (data & 0x80) ? 0xff : 0;
+    for (in = font.rundata; (n = *in & 0x7f) != 0 &&
+                            row < (int) font.cheight; ++in) {
+        while (row < (int) font.cheight && target < d + n) {
+            FontRowStart *start = &font_index[row * font_page_count + page];
+            start->run = in - font.rundata;
+            start->skip = target - d;
+            if (++page == font_page_count) {
+                page = 0;
+                ++row;
+            }
+            target = row * font.width + page * font_page_width;
+        }
+        d += n;
+    }
+    // a short stream leaves the remaining rows blank
+    for (; row < (int) font.cheight; ++row, page = 0) {
+        for (; page < font_page_count; ++page) {
+            font_index[row * font_page_count + page].run = in - font.rundata;
+            font_index[row * font_page_count + page].skip = 0;
         }
     }
-    bits = font_data[0];
 
-    ftex->version = sizeof(*ftex);
-    ftex->width = font.width;
-    ftex->height = font.height;
-    ftex->stride = font.width;
-    ftex->data = (void*) bits;
-    ftex->format = GGL_PIXEL_FORMAT_A_8;
+    for (i = 0; i < FONT_CACHE_PAGES; ++i) {
+        font_cache[i].page = -1;
+    }
 
     gr_font->cwidth = font.cwidth;
     gr_font->cheight = font.cheight;
     gr_font->ascent = font.cheight - 2;
+    return 0;
 }
 
 int gr_init(void)
@@ -292,7 +757,10 @@ int gr_init(void)
     gglInit(&gr_context);
     GGLContext *gl = gr_context;
 
-    gr_init_font();
+    if (gr_init_font() < 0) {
+        perror("can't allocate font");
+        return -1;
+    }
     gr_vt_fd = open("/dev/tty0", O_RDWR | O_SYNC);
     if (gr_vt_fd < 0) {
         // This is non-fatal; post-Cupcake kernels don't have tty0.
@@ -310,15 +778,24 @@ int gr_init(void)
         return -1;
     }
 
-    get_memory_surface(&gr_mem_surface);
-
-    fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
-            gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
+    fprintf(stderr, "framebuffer: fd %d (%d x %d), %d page(s)\n",
+            gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height,
+            gr_fb_pages);
 
         /* start with 0 as front (displayed) and 1 as back (drawing) */
     gr_active_fb = 0;
     set_active_framebuffer(0);
-    gl->colorBuffer(gl, &gr_mem_surface);
+    if (gr_fb_pages == 2) {
+        gr_draw = &gr_framebuffer[1];
+    } else {
+        get_memory_surface(&gr_mem_surface);
+        if (gr_mem_surface.data == NULL) {
+            gr_exit();
+            return -1;
+        }
+        gr_draw = &gr_mem_surface;
+    }
+    gl->colorBuffer(gl, gr_draw);
 
 
     gl->activeTexture(gl, 0);
@@ -328,12 +805,130 @@ int gr_init(void)
     return 0;
 }
 
+int gr_init_headless(int width, int height, int bpp)
+{
+    if (bpp != 16 && bpp != 32) return -1;
+
+    gglInit(&gr_context);
+    GGLContext *gl = gr_context;
+
+    if (gr_init_font() < 0) {
+        perror("can't allocate font");
+        return -1;
+    }
+
+    memset(&vi, 0, sizeof(vi));
+    vi.xres = vi.xres_virtual = width;
+    vi.yres = vi.yres_virtual = height;
+    vi.bits_per_pixel = bpp;
+    gr_format = (bpp == 16) ? GGL_PIXEL_FORMAT_RGB_565
+                            : GGL_PIXEL_FORMAT_BGRA_8888;
+
+    // one page in memory stands in for the screen; draw as we would on a
+    // single-page framebuffer
+    gr_headless = 1;
+    gr_fb_pages = 1;
+    gr_active_fb = 0;
+    get_memory_surface(&gr_framebuffer[0]);
+    get_memory_surface(&gr_mem_surface);
+    if (gr_framebuffer[0].data == NULL || gr_mem_surface.data == NULL) {
+        gr_exit();
+        return -1;
+    }
+    memset(gr_framebuffer[0].data, 0, width * height * bpp / 8);
+    memset(gr_mem_surface.data, 0, width * height * bpp / 8);
+    gr_framebuffer[1] = gr_framebuffer[0];
+    gr_draw = &gr_mem_surface;
+    gl->colorBuffer(gl, gr_draw);
+
+    gl->activeTexture(gl, 0);
+    gl->enable(gl, GGL_BLEND);
+    gl->blendFunc(gl, GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA);
+
+    return 0;
+}
+
+int gr_flip_pixels(void)
+{
+    return gr_flipped_pixels;
+}
+
+// One row of s as 8-bit R, G, B.
+static void read_row_rgb(const GGLSurface *s, int y, unsigned char *rgb)
+{
+    const unsigned char *p = (const unsigned char*) s->data +
+                             y * s->stride * pixel_size(s->format);
+    unsigned x;
+
+    for (x = 0; x < s->width; ++x, rgb += 3) {
+        if (s->format == GGL_PIXEL_FORMAT_RGB_565) {
+            unsigned v = ((const unsigned short*) p)[x];
+            rgb[0] = ((v >> 11) * 255 + 15) / 31;
+            rgb[1] = (((v >> 5) & 0x3f) * 255 + 31) / 63;
+            rgb[2] = ((v & 0x1f) * 255 + 15) / 31;
+        } else if (s->format == GGL_PIXEL_FORMAT_BGRA_8888) {
+            rgb[0] = p[x * 4 + 2];
+            rgb[1] = p[x * 4 + 1];
+            rgb[2] = p[x * 4];
+        } else {
+            memcpy(rgb, p + x * 4, 3);
+        }
+    }
+}
+
+int gr_dump_png(const char *path)
+{
+    GGLSurface *fb = &gr_framebuffer[gr_active_fb];
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    unsigned char *row = NULL;
+    int result = -1;
+    unsigned y;
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return -1;
+
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL) goto exit;
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) goto exit;
+    row = malloc(fb->width * 3);
+    if (row == NULL) goto exit;
+    if (setjmp(png_jmpbuf(png_ptr))) goto exit;
+
+    png_init_io(png_ptr, fp);
+    png_set_IHDR(png_ptr, info_ptr, fb->width, fb->height, 8,
+                 PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+    for (y = 0; y < fb->height; ++y) {
+        read_row_rgb(fb, y, row);
+        png_write_row(png_ptr, row);
+    }
+    png_write_end(png_ptr, info_ptr);
+    result = 0;
+
+exit:
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(row);
+    if (fclose(fp) != 0) result = -1;
+    return result;
+}
+
 void gr_exit(void)
 {
     close(gr_fb_fd);
     gr_fb_fd = -1;
 
     free(gr_mem_surface.data);
+    gr_mem_surface.data = NULL;
+
+    if (gr_headless) {
+        free(gr_framebuffer[0].data);
+        gr_framebuffer[0].data = gr_framebuffer[1].data = NULL;
+        gr_headless = 0;
+        return;
+    }
 
     ioctl(gr_vt_fd, KDSETMODE, (void*) KD_TEXT);
     close(gr_vt_fd);
@@ -350,7 +945,29 @@ int gr_fb_height(void)
     return gr_framebuffer[0].height;
 }
 
+int gr_fb_format(void)
+{
+    return gr_format;
+}
+
 gr_pixel *gr_fb_data(void)
 {
-    return (unsigned short *) gr_mem_surface.data;
+    return (unsigned short *) gr_draw->data;
+}
+
+int gr_fb_read_565(gr_pixel *out)
+{
+    unsigned char *row = malloc(gr_draw->width * 3);
+    unsigned x, y;
+
+    if (row == NULL) return -1;
+    for (y = 0; y < gr_draw->height; ++y) {
+        read_row_rgb(gr_draw, y, row);
+        for (x = 0; x < gr_draw->width; ++x) {
+            const unsigned char *p = row + x * 3;
+            *out++ = ((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3);
+        }
+    }
+    free(row);
+    return 0;
 }
@@ -23,13 +23,40 @@ typedef unsigned short gr_pixel;
 int gr_init(void);
 void gr_exit(void);
 
+// Instead of gr_init(): draw into a width x height page in memory, with
+// no framebuffer or tty, for benchmarks and host tools.  bpp picks the
+// format: 16 for RGB565, 32 for BGRA8888.  gr_dump_png() writes out what
+// is "on screen" (after the last gr_flip()).
+int gr_init_headless(int width, int height, int bpp);
+int gr_dump_png(const char *path);
+
+// Pixels copied to the screen by the last gr_flip().
+int gr_flip_pixels(void);
+
 int gr_fb_width(void);
 int gr_fb_height(void);
+// The screen's pixel format, as one of pixelflinger's GGL_PIXEL_FORMAT_*.
+int gr_fb_format(void);
 gr_pixel *gr_fb_data(void);
+// Copies the surface being drawn into as packed RGB565, width * height
+// pixels, whatever format the screen is in.
+int gr_fb_read_565(gr_pixel *out);
 void gr_flip(void);
 
+// Damage tracking.  Drawing goes straight into the back framebuffer page
+// (or into memory when there is only one page); gr_flip() makes it
+// visible and only copies the rectangles marked with gr_damage() since
+// the last flip to keep the other page in step.  With nothing marked it
+// does nothing.  gr_fb_data() is the surface currently drawn into, in
+// the screen's own format and stride.
+// gr_clip() restricts all drawing to a rectangle, or lifts the
+// restriction when w or h is <= 0.
+void gr_damage(int x, int y, int w, int h);
+void gr_clip(int x, int y, int w, int h);
+
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
-void gr_fill(int x, int y, int w, int h);
+// Fills the rectangle from (x, y) up to, not including, (x1, y1).
+void gr_fill(int x, int y, int x1, int y1);
 int gr_text(int x, int y, const char *s);
 int gr_measure(const char *s);
 
@@ -45,10 +72,23 @@ int ev_init(void);
 void ev_exit(void);
 int ev_get(struct input_event *ev, unsigned dont_wait);
 
+// For callers running their own poll loop: ev_get_fds() fills fds with
+// the (non-blocking) input devices and returns how many there are;
+// ev_read() returns as many of one device's pending events as fit, or
+// -1 when it has none.
+int ev_get_fds(int *fds, int max);
+int ev_read(int fd, struct input_event *ev, int max);
+
 // Resources
 
-// Returns 0 if no error, else negative.
+// Loads /res/images/<name>.png, or the copy baked into /res/images.pack
+// (see respack.h) when there is one.  Opaque surfaces are in the screen's
+// format (set up by gr_init() first); surfaces with alpha are premultiplied
+// RGBA.  Returns 0 if no error, else negative.
 int res_create_surface(const char* name, gr_surface* pSurface);
-void res_free_surface(gr_surface surface);
+
+// Frees a surface.  Returns how many bytes of heap that gave back; 0 for a
+// surface whose pixels are in the pack.
+long res_free_surface(gr_surface surface);
 
 #endif
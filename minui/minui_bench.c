@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays what the recovery UI draws, on a headless minui, and reports
+ * how long each frame took and how many pixels it put on screen:
+ *
+ *   minui_bench [-s WIDTHxHEIGHT] [-b 16|32] [-n FRAMES] [-d DIR]
+ *
+ * The workloads follow ui.c: a scrolling log of mixed Chinese and ASCII
+ * lines, moving through a menu, and a progress bar filling up.  With -d,
+ * the last frame of each is written to DIR/<workload>.png.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "minui.h"
+
+#define CHAR_HEIGHT 18
+#define MAX_ROWS 64
+#define ROW_SPILL 2
+
+static int screen_w, screen_h, rows;
+static char log_text[MAX_ROWS][128];
+static int log_top = 0;
+
+static const char *dump_dir = NULL;
+
+typedef struct {
+    const char *name;
+    int frames;
+    double *ms;
+    long long pixels;
+} Result;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void report(Result *r)
+{
+    double total = 0;
+    int i;
+
+    for (i = 0; i < r->frames; ++i) total += r->ms[i];
+    qsort(r->ms, r->frames, sizeof(double), compare_double);
+    printf("%-10s %6d frames  avg %7.3f ms  p50 %7.3f  p95 %7.3f  max %7.3f"
+           "  %9lld px/frame\n",
+           r->name, r->frames, total / r->frames, r->ms[r->frames / 2],
+           r->ms[r->frames * 95 / 100], r->ms[r->frames - 1],
+           r->pixels / r->frames);
+
+    if (dump_dir != NULL) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s.png", dump_dir, r->name);
+        if (gr_dump_png(path) < 0) fprintf(stderr, "can't write %s\n", path);
+    }
+}
+
+// What ui.c's draw_screen_locked() does for the area [top, bottom).
+static void draw_log(int top, int bottom, int menu_items, int menu_sel)
+{
+    int i;
+
+    gr_color(0, 0, 0, 255);
+    gr_fill(0, 0, screen_w, screen_h);
+    gr_color(0, 0, 0, 160);
+    gr_fill(0, 0, screen_w, screen_h);
+
+    if (menu_items > 0) {
+        gr_color(64, 96, 255, 255);
+        gr_fill(0, menu_sel * CHAR_HEIGHT, screen_w,
+                (menu_sel + 1) * CHAR_HEIGHT + 1);
+    }
+    for (i = 0; i < rows; ++i) {
+        if ((i + 1) * CHAR_HEIGHT + ROW_SPILL <= top) continue;
+        if (i * CHAR_HEIGHT >= bottom) break;
+        if (i < menu_items) {
+            gr_color(i == menu_sel ? 255 : 64, i == menu_sel ? 255 : 96, 255, 255);
+        } else {
+            gr_color(255, 255, 0, 255);
+        }
+        gr_text(0, (i + 1) * CHAR_HEIGHT - 1, log_text[(i + log_top) % rows]);
+    }
+}
+
+static void redraw_rows(int first, int last, int menu_items, int menu_sel)
+{
+    int y = first * CHAR_HEIGHT;
+    int h = (last - first) * CHAR_HEIGHT + ROW_SPILL;
+
+    gr_clip(0, y, screen_w, h);
+    draw_log(y, y + h, menu_items, menu_sel);
+    gr_damage(0, y, screen_w, h);
+}
+
+static void finish_frame(Result *r, double start)
+{
+    gr_clip(0, 0, 0, 0);
+    gr_flip();
+    r->ms[r->frames++] = now_ms() - start;
+    r->pixels += gr_flip_pixels();
+}
+
+static void bench_log(Result *r, int frames)
+{
+    static const char *lines[] = {
+        "正在安装更新...",
+        "正在校验当前系统...",
+        "extracting system/app/Browser.apk",
+        "正在写入 boot 分区 (boot.img)",
+        "symlink: /system/bin/toolbox -> ls, ps, top, 挂载",
+        "E:无法打开 /sdcard/update.zip (No such file or directory)",
+    };
+    int i;
+
+    for (i = 0; i < frames; ++i) {
+        double start = now_ms();
+        // a new line at the bottom scrolls every row, as in ui_print()
+        snprintf(log_text[log_top], sizeof(log_text[0]), "%s %d",
+                 lines[i % (sizeof(lines) / sizeof(lines[0]))], i);
+        log_top = (log_top + 1) % rows;
+        redraw_rows(0, rows, 0, 0);
+        finish_frame(r, start);
+    }
+}
+
+static void bench_menu(Result *r, int frames)
+{
+    int items = rows - 4, sel = 0, i;
+
+    for (i = 0; i < rows; ++i) {
+        snprintf(log_text[(i + log_top) % rows], sizeof(log_text[0]),
+                 i < items ? "- 菜单项 %d: 从 SD 卡安装 update.zip" : "", i);
+    }
+    gr_damage(0, 0, screen_w, screen_h);
+    draw_log(0, screen_h, items, sel);
+    gr_flip();
+
+    for (i = 0; i < frames; ++i) {
+        double start = now_ms();
+        int old = sel;
+        sel = (i / items) % 2 ? sel - 1 : sel + 1;
+        if (sel < 0) sel = 0;
+        if (sel >= items) sel = items - 1;
+        // only the old and new selection rows change
+        redraw_rows(old, old + 1, items, sel);
+        redraw_rows(sel, sel + 1, items, sel);
+        finish_frame(r, start);
+    }
+}
+
+static void bench_progress(Result *r, int frames)
+{
+    gr_surface empty = NULL, fill = NULL;
+    int w = 252, h = 20, x0, y0, i;
+
+    res_create_surface("progress_bar_empty", &empty);
+    res_create_surface("progress_bar_fill", &fill);
+    x0 = (screen_w - w) / 2;
+    y0 = screen_h * 3 / 4;
+
+    for (i = 0; i < frames; ++i) {
+        double start = now_ms();
+        int pos = (i + 1) * w / frames, x;
+
+        gr_clip(x0, y0, w, h);
+        gr_color(0, 0, 0, 255);
+        gr_fill(x0, y0, x0 + w, y0 + h);
+        for (x = 0; x < w; ++x) {
+            gr_surface s = x < pos ? fill : empty;
+            if (s != NULL) {
+                gr_blit(s, 0, 0, 1, h, x0 + x, y0);
+            } else if (x < pos) {
+                gr_color(0, 160, 0, 255);
+                gr_fill(x0 + x, y0, x0 + x + 1, y0 + h);
+            }
+        }
+        gr_damage(x0, y0, w, h);
+        finish_frame(r, start);
+    }
+    if (empty) res_free_surface(empty);
+    if (fill) res_free_surface(fill);
+}
+
+int main(int argc, char **argv)
+{
+    int width = 480, height = 800, bpp = 16, frames = 500, c;
+
+    while ((c = getopt(argc, argv, "s:b:n:d:")) != -1) {
+        switch (c) {
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2) goto usage;
+            break;
+        case 'b':
+            bpp = atoi(optarg);
+            break;
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 'd':
+            dump_dir = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (frames <= 0 || width <= 0 || height <= 0) goto usage;
+
+    if (gr_init_headless(width, height, bpp) < 0) {
+        fprintf(stderr, "can't set up a %dx%d, %d bpp screen\n",
+                width, height, bpp);
+        return 1;
+    }
+    screen_w = gr_fb_width();
+    screen_h = gr_fb_height();
+    rows = screen_h / CHAR_HEIGHT;
+    if (rows > MAX_ROWS) rows = MAX_ROWS;
+
+    Result results[3] = {
+        { "log", 0, NULL, 0 },
+        { "menu", 0, NULL, 0 },
+        { "progress", 0, NULL, 0 },
+    };
+    for (c = 0; c < 3; ++c) {
+        results[c].ms = malloc(frames * sizeof(double));
+        if (results[c].ms == NULL) return 1;
+    }
+
+    printf("%dx%d, %d bpp, %d frames per workload\n",
+           screen_w, screen_h, bpp, frames);
+    bench_log(&results[0], frames);
+    report(&results[0]);
+    bench_menu(&results[1], frames);
+    report(&results[1]);
+    bench_progress(&results[2], frames);
+    report(&results[2]);
+
+    gr_exit();
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-s WIDTHxHEIGHT] [-b 16|32] [-n FRAMES] [-d DIR]\n",
+            argv[0]);
+    return 2;
+}
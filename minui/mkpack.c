@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host tool: bake PNGs into the image pack recovery maps at startup.
+ *
+ *   mkpack out.pack image.png...
+ *
+ * Opaque images are converted to RGB565, the framebuffer's format, so
+ * they can be blitted as they are; images with alpha become premultiplied
+ * RGBA8888.  See respack.h for the layout.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <png.h>
+
+#include "respack.h"
+
+typedef struct {
+    ResPackEntry entry;
+    unsigned char *pixels;
+    size_t size;
+} Image;
+
+static unsigned char premultiply(unsigned c, unsigned a) {
+    return (c * a + 127) / 255;
+}
+
+static int load_png(const char *path, Image *image) {
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    unsigned char *row = NULL;
+    unsigned char header[8];
+    int result = -1;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        png_sig_cmp(header, 0, sizeof(header))) {
+        fprintf(stderr, "%s: not a PNG file\n", path);
+        goto exit;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL) goto exit;
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) goto exit;
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "%s: corrupt PNG file\n", path);
+        goto exit;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_sig_bytes(png_ptr, sizeof(header));
+    png_read_info(png_ptr, info_ptr);
+
+    unsigned width = png_get_image_width(png_ptr, info_ptr);
+    unsigned height = png_get_image_height(png_ptr, info_ptr);
+    int channels = png_get_channels(png_ptr, info_ptr);
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    if (png_get_bit_depth(png_ptr, info_ptr) != 8 ||
+        (channels != 3 && channels != 4) ||
+        (color_type != PNG_COLOR_TYPE_RGB &&
+         color_type != PNG_COLOR_TYPE_RGBA)) {
+        fprintf(stderr, "%s: only 8-bit RGB and RGBA are supported\n", path);
+        goto exit;
+    }
+
+    ResPackEntry *e = &image->entry;
+    e->format = (channels == 3) ? RES_PACK_RGB_565 : RES_PACK_RGBA_8888;
+    e->width = width;
+    e->height = height;
+    // keep rows 4-byte aligned
+    e->stride = (channels == 3) ? (width + 1) & ~1u : width;
+    image->size = e->stride * height * ((channels == 3) ? 2 : 4);
+    image->pixels = calloc(1, image->size);
+    row = malloc(width * channels);
+    if (image->pixels == NULL || row == NULL) goto exit;
+
+    unsigned x, y;
+    for (y = 0; y < height; ++y) {
+        png_read_row(png_ptr, row, NULL);
+        if (channels == 3) {
+            unsigned char *out = image->pixels + y * e->stride * 2;
+            for (x = 0; x < width; ++x) {
+                const unsigned char *p = row + x * 3;
+                unsigned v = (((p[0] * 31 + 127) / 255) << 11) |
+                             (((p[1] * 63 + 127) / 255) << 5) |
+                             ((p[2] * 31 + 127) / 255);
+                out[x * 2] = v & 0xff;
+                out[x * 2 + 1] = v >> 8;
+            }
+        } else {
+            unsigned char *out = image->pixels + y * e->stride * 4;
+            for (x = 0; x < width; ++x) {
+                const unsigned char *p = row + x * 4;
+                out[x * 4] = premultiply(p[0], p[3]);
+                out[x * 4 + 1] = premultiply(p[1], p[3]);
+                out[x * 4 + 2] = premultiply(p[2], p[3]);
+                out[x * 4 + 3] = p[3];
+            }
+        }
+    }
+    result = 0;
+
+exit:
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    free(row);
+    fclose(fp);
+    return result;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s out.pack image.png...\n", argv[0]);
+        return 2;
+    }
+
+    int count = argc - 2, i;
+    Image *images = calloc(count, sizeof(Image));
+    if (images == NULL) return 1;
+
+    uint32_t offset = sizeof(ResPackHeader) + count * sizeof(ResPackEntry);
+    for (i = 0; i < count; ++i) {
+        const char *path = argv[i + 2];
+        const char *base = strrchr(path, '/');
+        base = base ? base + 1 : path;
+        size_t len = strlen(base);
+        if (len > 4 && strcmp(base + len - 4, ".png") == 0) len -= 4;
+        if (len >= RES_PACK_NAME_LEN) {
+            fprintf(stderr, "%s: name too long\n", path);
+            return 1;
+        }
+        memcpy(images[i].entry.name, base, len);
+        if (load_png(path, &images[i]) < 0) return 1;
+        images[i].entry.offset = offset;
+        offset += (images[i].size + 3) & ~3u;
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", argv[1]);
+    FILE *out = fopen(tmp, "wb");
+    if (out == NULL) {
+        perror(tmp);
+        return 1;
+    }
+
+    unsigned char buf[sizeof(ResPackEntry)];
+    put32(buf, RES_PACK_MAGIC);
+    put32(buf + 4, RES_PACK_VERSION);
+    put32(buf + 8, count);
+    put32(buf + 12, 0);
+    fwrite(buf, 1, sizeof(ResPackHeader), out);
+    for (i = 0; i < count; ++i) {
+        const ResPackEntry *e = &images[i].entry;
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, e->name, RES_PACK_NAME_LEN);
+        put32(buf + RES_PACK_NAME_LEN, e->format);
+        put32(buf + RES_PACK_NAME_LEN + 4, e->width);
+        put32(buf + RES_PACK_NAME_LEN + 8, e->height);
+        put32(buf + RES_PACK_NAME_LEN + 12, e->stride);
+        put32(buf + RES_PACK_NAME_LEN + 16, e->offset);
+        fwrite(buf, 1, sizeof(ResPackEntry), out);
+    }
+    for (i = 0; i < count; ++i) {
+        static const unsigned char pad[4];
+        fwrite(images[i].pixels, 1, images[i].size, out);
+        fwrite(pad, 1, ((images[i].size + 3) & ~3u) - images[i].size, out);
+    }
+
+    if (fclose(out) != 0 || rename(tmp, argv[1]) != 0) {
+        perror(argv[1]);
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -22,6 +23,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -32,6 +34,8 @@
 #include <png.h>
 
 #include "minui.h"
+#include "blit.h"
+#include "respack.h"
 
 // libpng gives "undefined reference to 'pow'" errors, and I have no
 // idea how to convince the build system to link with -lm.  We don't
@@ -41,7 +45,137 @@ double pow(double x, double y) {
     return x;
 }
 
+// RES_PACK_PATH, mapped on first use; pack_count stays 0 if it is missing
+// or unusable.
+static int pack_tried = 0;
+static const unsigned char* pack_data = NULL;
+static size_t pack_size = 0;
+static const ResPackEntry* pack_index = NULL;
+static unsigned pack_count = 0;
+
+static void open_pack(void) {
+    struct stat st;
+    pack_tried = 1;
+
+    int fd = open(RES_PACK_PATH, O_RDONLY);
+    if (fd < 0) return;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(ResPackHeader)) {
+        close(fd);
+        return;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+
+    const ResPackHeader* header = (const ResPackHeader*) data;
+    size_t index_end = sizeof(*header) + header->count * sizeof(ResPackEntry);
+    if (header->magic != RES_PACK_MAGIC ||
+        header->version != RES_PACK_VERSION ||
+        header->count > st.st_size / sizeof(ResPackEntry) ||
+        index_end > (size_t) st.st_size) {
+        fprintf(stderr, "ignoring bad %s\n", RES_PACK_PATH);
+        munmap(data, st.st_size);
+        return;
+    }
+
+    // drop any entry whose pixels don't fit in the file
+    const ResPackEntry* e = (const ResPackEntry*) (header + 1);
+    unsigned i;
+    for (i = 0; i < header->count; ++i) {
+        unsigned bpp = (e[i].format == RES_PACK_RGB_565) ? 2 : 4;
+        if (e[i].width == 0 || e[i].stride < e[i].width ||
+            e[i].offset < index_end || e[i].offset > (uint64_t) st.st_size ||
+            (uint64_t) e[i].stride * e[i].height * bpp >
+                    (uint64_t) st.st_size - e[i].offset) {
+            fprintf(stderr, "ignoring bad %s\n", RES_PACK_PATH);
+            munmap(data, st.st_size);
+            return;
+        }
+    }
+
+    pack_data = data;
+    pack_size = st.st_size;
+    pack_index = e;
+    pack_count = header->count;
+}
+
+// Puts an opaque RGBX image in the screen's format, so that gr_blit() can
+// copy its rows as they are.  No format is bigger, so it is done in place.
+static void to_screen_format(GGLSurface* surface) {
+    int count = surface->stride * surface->height;
+    switch (gr_fb_format()) {
+    case GGL_PIXEL_FORMAT_RGB_565:
+        blit_rgba_to_565(surface->data, surface->data, count);
+        surface->format = GGL_PIXEL_FORMAT_RGB_565;
+        break;
+    case GGL_PIXEL_FORMAT_BGRA_8888:
+        blit_rgba_to_bgra(surface->data, surface->data, count);
+        surface->format = GGL_PIXEL_FORMAT_BGRA_8888;
+        break;
+    }
+}
+
+// Copies an opaque RGB565 pack image out into a 32 bpp screen's format.
+static GGLSurface* expand_565(const ResPackEntry* e, int format) {
+    GGLSurface* surface = malloc(sizeof(GGLSurface) + e->width * e->height * 4);
+    if (surface == NULL) return NULL;
+    unsigned* out = (unsigned*) (surface + 1);
+    const unsigned short* in = (const unsigned short*) (pack_data + e->offset);
+    unsigned y;
+    for (y = 0; y < e->height; ++y) {
+        if (format == GGL_PIXEL_FORMAT_RGBX_8888)
+            blit_565_to_rgbx(out + y * e->width, in + y * e->stride, e->width);
+        else
+            blit_565_to_bgra(out + y * e->width, in + y * e->stride, e->width);
+    }
+    surface->version = sizeof(GGLSurface);
+    surface->width = e->width;
+    surface->height = e->height;
+    surface->stride = e->width;
+    surface->data = out;
+    surface->format = format;
+    return surface;
+}
+
+// Returns 0 and a surface if the pack has the image.  It points into the
+// pack, unless the image is opaque and the screen isn't RGB565.
+static int create_surface_from_pack(const char* name, gr_surface* pSurface) {
+    unsigned i;
+
+    if (!pack_tried) open_pack();
+    for (i = 0; i < pack_count; ++i) {
+        const ResPackEntry* e = &pack_index[i];
+        if (strncmp(e->name, name, RES_PACK_NAME_LEN) != 0) continue;
+
+        int format = gr_fb_format();
+        if (e->format == RES_PACK_RGB_565 &&
+            format != GGL_PIXEL_FORMAT_RGB_565) {
+            GGLSurface* surface = expand_565(e, format);
+            if (surface == NULL) return -8;
+            *pSurface = (gr_surface) surface;
+            return 0;
+        }
+
+        GGLSurface* surface = malloc(sizeof(GGLSurface));
+        if (surface == NULL) return -8;
+        surface->version = sizeof(GGLSurface);
+        surface->width = e->width;
+        surface->height = e->height;
+        surface->stride = e->stride;
+        surface->data = (unsigned char*) (pack_data + e->offset);
+        surface->format = (e->format == RES_PACK_RGB_565) ?
+                GGL_PIXEL_FORMAT_RGB_565 : GGL_PIXEL_FORMAT_RGBA_8888;
+        *pSurface = (gr_surface) surface;
+        return 0;
+    }
+    return -1;
+}
+
 int res_create_surface(const char* name, gr_surface* pSurface) {
+    if (create_surface_from_pack(name, pSurface) == 0) {
+        return 0;
+    }
+
     char resPath[256];
     GGLSurface* surface = NULL;
     int result = 0;
@@ -139,10 +273,27 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
             }
         }
     } else {
+        // surfaces with alpha are premultiplied, as in the image pack
+        unsigned all_alpha = 0xff;
         for (y = 0; y < height; ++y) {
             unsigned char* pRow = pData + y * stride;
             png_read_row(png_ptr, pRow, NULL);
+
+            int x;
+            for (x = 0; x < width; ++x) {
+                unsigned char* p = pRow + x * 4;
+                unsigned a = p[3];
+                p[0] = (p[0] * a + 127) / 255;
+                p[1] = (p[1] * a + 127) / 255;
+                p[2] = (p[2] * a + 127) / 255;
+                all_alpha &= a;
+            }
         }
+        // an alpha channel that is all 0xff makes no difference
+        if (all_alpha == 0xff) surface->format = GGL_PIXEL_FORMAT_RGBX_8888;
+    }
+    if (surface->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+        to_screen_format(surface);
     }
 
     *pSurface = (gr_surface) surface;
@@ -161,9 +312,19 @@ exit:
     return result;
 }
 
-void res_free_surface(gr_surface surface) {
+// Surfaces pointing into the pack are only the GGLSurface; their pixels
+// are the pack's, which is on the ramdisk and stays mapped, so they free
+// nothing worth counting.  Every other surface holds 4 bytes a pixel after
+// its header, whatever format it was converted to.
+long res_free_surface(gr_surface surface) {
     GGLSurface* pSurface = (GGLSurface*) surface;
-    if (pSurface) {
-        free(pSurface);
+    if (pSurface == NULL) return 0;
+
+    long bytes = 0;
+    const unsigned char* data = pSurface->data;
+    if (data < pack_data || data >= pack_data + pack_size) {
+        bytes = sizeof(GGLSurface) + (long) pSurface->stride * pSurface->height * 4;
     }
+    free(pSurface);
+    return bytes;
 }
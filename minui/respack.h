@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_RESPACK_H_
+#define _MINUI_RESPACK_H_
+
+#include <stdint.h>
+
+// Layout of /res/images.pack, written at build time by mkpack.c from
+// res/images/*.png and mapped by res_create_surface().  All fields are
+// little endian.  The header is followed by count entries; each entry's
+// pixels start at its offset, which is a multiple of 4.
+
+#define RES_PACK_PATH    "/res/images.pack"
+#define RES_PACK_MAGIC   0x4b415052   // "RPAK"
+#define RES_PACK_VERSION 1
+#define RES_PACK_NAME_LEN 48
+
+// Pixel formats, numbered as pixelflinger's GGL_PIXEL_FORMAT_*.  Images
+// with alpha are stored premultiplied.
+#define RES_PACK_RGBA_8888 1
+#define RES_PACK_RGB_565   4
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+} ResPackHeader;
+
+typedef struct {
+    char name[RES_PACK_NAME_LEN];   // file name without ".png"
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;                // in pixels
+    uint32_t offset;
+    uint32_t reserved;
+} ResPackEntry;
+
+#endif
@@ -22,3 +22,20 @@ include $(BUILD_EXECUTABLE)
 
 endif	# TARGET_ARCH == arm
 endif	# !TARGET_SIMULATOR
+
+#
+# Build the host-side tests, which run against a fake partition under /tmp
+#
+ifeq ($(HOST_OS),linux)
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := mtdutils.c test_mtdutils.c
+
+LOCAL_CFLAGS := -Wall -g -O0 -D_GNU_SOURCE
+LOCAL_LDFLAGS := -Wl,--wrap=open,--wrap=ioctl,--wrap=read
+LOCAL_MODULE := mtdutils_test
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+endif   # HOST_OS == linux
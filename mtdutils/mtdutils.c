@@ -33,6 +33,13 @@ struct MtdPartition {
     unsigned int size;
     unsigned int erase_size;
     char *name;
+
+    /* Health events recorded since the last report; kept across rescans,
+     * since the device index of a partition doesn't change.
+     */
+    MtdBlockHealth *health;
+    int health_alloc;
+    int health_count;
 };
 
 struct MtdReadContext {
@@ -67,6 +74,49 @@ static MtdState g_mtd_state = {
 
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
+/* Find (or create) the health record for the erase block at pos.
+ * Returns NULL if we're out of memory; telemetry is best-effort.
+ */
+static MtdBlockHealth *
+get_block_health(const MtdPartition *partition, loff_t pos)
+{
+    MtdPartition *p = &g_mtd_state.partitions[partition->device_index];
+    int block = pos / p->erase_size;
+    int i;
+    for (i = 0; i < p->health_count; ++i) {
+        if (p->health[i].block == block) {
+            return &p->health[i];
+        }
+    }
+    if (p->health_count + 1 > p->health_alloc) {
+        int alloc = (p->health_alloc * 2) + 1;
+        MtdBlockHealth *health = realloc(p->health, alloc * sizeof(*health));
+        if (health == NULL) {
+            return NULL;
+        }
+        p->health = health;
+        p->health_alloc = alloc;
+    }
+    MtdBlockHealth *h = &p->health[p->health_count++];
+    memset(h, 0, sizeof(*h));
+    h->block = block;
+    return h;
+}
+
+static void record_ecc(const MtdPartition *partition, loff_t pos,
+        const struct mtd_ecc_stats *before, const struct mtd_ecc_stats *after)
+{
+    if (after->corrected == before->corrected &&
+        after->failed == before->failed) {
+        return;
+    }
+    MtdBlockHealth *h = get_block_health(partition, pos);
+    if (h != NULL) {
+        h->ecc_corrected += after->corrected - before->corrected;
+        h->ecc_failed += after->failed - before->failed;
+    }
+}
+
 int
 mtd_scan_partitions()
 {
@@ -294,16 +344,36 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
 
     while (pos + size <= (int) partition->size) {
         if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
+            int err = errno;
             fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
-                    pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
+                    pos, strerror(err));
+            // Charge this block, not the next good one, with its errors.
+            if (ioctl(fd, ECCGETSTATS, &after)) {
+                fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+                return -1;
+            }
+            record_ecc(partition, pos, &before, &after);
+            if (err == EBADMSG && after.failed == before.failed) {
+                MtdBlockHealth *h = get_block_health(partition, pos);
+                if (h != NULL) h->ecc_failed++;
+            }
+            before = after;
+            pos += partition->erase_size;
+            continue;
+        }
+        if (ioctl(fd, ECCGETSTATS, &after)) {
             fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
             return -1;
-        } else if (after.failed != before.failed) {
+        }
+        record_ecc(partition, pos, &before, &after);
+
+        if (after.failed != before.failed) {
             fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
                     after.corrected - before.corrected,
                     after.failed - before.failed, pos);
         } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
+            MtdBlockHealth *h = get_block_health(partition, pos);
+            if (h != NULL) h->bad = MTD_BLOCK_SKIPPED;
             fprintf(stderr,
                     "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
                     mgbb, pos, errno);
@@ -318,6 +388,7 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
                     pos);
         }
 
+        before = after;
         pos += partition->erase_size;
     }
 
@@ -414,8 +485,11 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
         loff_t bpos = pos;
+        MtdBlockHealth *h;
         if (ioctl(fd, MEMGETBADBLOCK, &bpos) > 0) {
             add_bad_block_offset(ctx, pos);
+            h = get_block_health(partition, pos);
+            if (h != NULL) h->bad = MTD_BLOCK_SKIPPED;
             fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
@@ -427,6 +501,8 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         int retry;
         for (retry = 0; retry < 2; ++retry) {
             if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+                h = get_block_health(partition, pos);
+                if (h != NULL) h->erase_retries++;
                 fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
@@ -437,14 +513,23 @@ static int write_block(MtdWriteContext *ctx, const char *data)
                         pos, strerror(errno));
             }
 
+            struct mtd_ecc_stats before, after;
+            int have_stats = ioctl(fd, ECCGETSTATS, &before) == 0;
             char verify[size];
             if (lseek(fd, pos, SEEK_SET) != pos ||
                 read(fd, verify, size) != size) {
+                h = get_block_health(partition, pos);
+                if (h != NULL) h->write_retries++;
                 fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
+            if (have_stats && ioctl(fd, ECCGETSTATS, &after) == 0) {
+                record_ecc(partition, pos, &before, &after);
+            }
             if (memcmp(data, verify, size) != 0) {
+                h = get_block_health(partition, pos);
+                if (h != NULL) h->write_retries++;
                 fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
@@ -458,6 +543,8 @@ static int write_block(MtdWriteContext *ctx, const char *data)
 
         // Try to erase it once more as we give up on this block
         add_bad_block_offset(ctx, pos);
+        h = get_block_health(partition, pos);
+        if (h != NULL) h->bad = MTD_BLOCK_NEWLY_BAD;
         fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
         ioctl(fd, MEMERASE, &erase_info);
         pos += partition->erase_size;
@@ -521,6 +608,8 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
     while (blocks-- > 0) {
         loff_t bpos = pos;
         if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+            MtdBlockHealth *h = get_block_health(ctx->partition, pos);
+            if (h != NULL) h->bad = MTD_BLOCK_SKIPPED;
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
             pos += ctx->partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
@@ -529,12 +618,19 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = ctx->partition->erase_size;
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        int retry;
+        for (retry = 0; retry < 2; ++retry) {
+            if (ioctl(ctx->fd, MEMERASE, &erase_info) == 0) break;
+            MtdBlockHealth *h = get_block_health(ctx->partition, pos);
+            if (h != NULL) h->erase_retries++;
+            fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
         }
         pos += ctx->partition->erase_size;
     }
 
+    // Leave the fd past the erased blocks, so the next call carries on there
+    if (lseek(ctx->fd, pos, SEEK_SET) != pos) return -1;
     return pos;
 }
 
@@ -564,3 +660,46 @@ off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
     }
     return pos;
 }
+
+static const char *bad_block_name(int bad)
+{
+    switch (bad) {
+        case MTD_BLOCK_SKIPPED:    return "skipped";
+        case MTD_BLOCK_NEWLY_BAD:  return "new";
+        default:                   return "none";
+    }
+}
+
+const MtdBlockHealth *
+mtd_partition_health(const MtdPartition *partition, int *count)
+{
+    const MtdPartition *p = &g_mtd_state.partitions[partition->device_index];
+    *count = p->health_count;
+    return p->health;
+}
+
+void mtd_clear_health(const MtdPartition *partition)
+{
+    g_mtd_state.partitions[partition->device_index].health_count = 0;
+}
+
+int mtd_write_health_report(const MtdPartition *partition, FILE *out)
+{
+    int count, i;
+    const MtdBlockHealth *health = mtd_partition_health(partition, &count);
+
+    fprintf(out, "partition=%s size=%u erase_size=%u blocks=%d\n",
+            partition->name, partition->size, partition->erase_size, count);
+    for (i = 0; i < count; ++i) {
+        const MtdBlockHealth *h = &health[i];
+        fprintf(out, "block=%d ecc_corrected=%d ecc_failed=%d "
+                "erase_retries=%d write_retries=%d bad=%s\n",
+                h->block, h->ecc_corrected, h->ecc_failed,
+                h->erase_retries, h->write_retries, bad_block_name(h->bad));
+    }
+    fflush(out);
+    if (ferror(out)) return -1;
+
+    mtd_clear_health(partition);
+    return count;
+}
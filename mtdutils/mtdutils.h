@@ -17,6 +17,7 @@
 #ifndef MTDUTILS_H_
 #define MTDUTILS_H_
 
+#include <stdio.h>      // for FILE
 #include <sys/types.h>  // for size_t, etc.
 
 typedef struct MtdPartition MtdPartition;
@@ -48,8 +49,40 @@ void mtd_read_close(MtdReadContext *);
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
-off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
+/* Erases "blocks" blocks from the current position (0 ok, -1 for all) and
+ * moves past them.  Returns the new position, or -1 on error.
+ */
+off_t mtd_erase_blocks(MtdWriteContext *, int blocks);
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
 int mtd_write_close(MtdWriteContext *);
 
+/* Flash health telemetry.  The read and write paths record ECC
+ * corrections and failures, erase and program retries, and bad blocks
+ * per erase block; only blocks that saw an event get a record.
+ * Records accumulate per partition until they are reported or cleared.
+ */
+enum {
+    MTD_BLOCK_GOOD = 0,
+    MTD_BLOCK_SKIPPED,      /* already marked bad, skipped */
+    MTD_BLOCK_NEWLY_BAD,    /* gave up on it after retries */
+};
+
+typedef struct {
+    int block;              /* erase block index within the partition */
+    int ecc_corrected;
+    int ecc_failed;
+    int erase_retries;
+    int write_retries;
+    int bad;                /* one of MTD_BLOCK_* */
+} MtdBlockHealth;
+
+const MtdBlockHealth *mtd_partition_health(const MtdPartition *, int *count);
+void mtd_clear_health(const MtdPartition *);
+
+/* Writes one "partition=..." line followed by one "block=..." line per
+ * record, then clears the records.  Returns the number of blocks
+ * reported, or -1 on a write error (records are kept in that case).
+ */
+int mtd_write_health_report(const MtdPartition *, FILE *out);
+
 #endif  // MTDUTILS_H_
@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host tests for mtdutils against a fake NAND partition.  The binary is
+ * linked with --wrap=open,--wrap=ioctl,--wrap=read: /proc/mtd and
+ * /dev/mtd/mtd0 open files under /tmp instead, the MTD ioctls act on
+ * those, and reading ECC_BLOCK fails as an uncorrectable block would.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <mtd/mtd-user.h>
+
+#include "mtdutils.h"
+
+#define ERASE_SIZE  4096
+#define NUM_BLOCKS  200         // more than roots.c erases at a time
+#define CHUNK       64          // FORMAT_JOB_CHUNK_BLOCKS in roots.c
+#define BAD_BLOCK   70
+#define ECC_BLOCK   1
+
+static char g_proc_path[64], g_dev_path[64];
+static int g_erases[NUM_BLOCKS];
+static int g_dev_fd = -1;
+static int g_fail_reads;            // only test_read_ecc_failure() sets it
+static struct mtd_ecc_stats g_ecc;
+
+int __real_open(const char *path, int flags, ...);
+int __real_ioctl(int fd, unsigned long request, ...);
+ssize_t __real_read(int fd, void *buf, size_t count);
+
+int
+__wrap_open(const char *path, int flags, ...)
+{
+    va_list ap;
+    int mode;
+
+    va_start(ap, flags);
+    mode = va_arg(ap, int);
+    va_end(ap);
+    if (strcmp(path, "/proc/mtd") == 0) {
+        return __real_open(g_proc_path, flags, mode);
+    }
+    if (strcmp(path, "/dev/mtd/mtd0") == 0) {
+        g_dev_fd = __real_open(g_dev_path, flags, mode);
+        return g_dev_fd;
+    }
+    return __real_open(path, flags, mode);
+}
+
+ssize_t
+__wrap_read(int fd, void *buf, size_t count)
+{
+    if (g_fail_reads && fd == g_dev_fd &&
+        lseek(fd, 0, SEEK_CUR) / ERASE_SIZE == ECC_BLOCK) {
+        g_ecc.failed++;
+        errno = EBADMSG;
+        return -1;
+    }
+    return __real_read(fd, buf, count);
+}
+
+int
+__wrap_ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (request == MEMGETBADBLOCK) {
+        return *(loff_t *) arg / ERASE_SIZE == BAD_BLOCK;
+    }
+    if (request == MEMERASE) {
+        const struct erase_info_user *e = arg;
+        char ones[ERASE_SIZE];
+        assert(e->start % ERASE_SIZE == 0 && e->length == ERASE_SIZE);
+        assert(e->start / ERASE_SIZE < NUM_BLOCKS);
+        memset(ones, 0xff, sizeof(ones));
+        if (pwrite(fd, ones, sizeof(ones), e->start) != sizeof(ones)) {
+            return -1;
+        }
+        g_erases[e->start / ERASE_SIZE]++;
+        return 0;
+    }
+    if (request == ECCGETSTATS) {
+        *(struct mtd_ecc_stats *) arg = g_ecc;
+        return 0;
+    }
+    return __real_ioctl(fd, request, arg);
+}
+
+static void
+create_fake_partition(char fill)
+{
+    char block[ERASE_SIZE];
+    FILE *f;
+    int i;
+
+    snprintf(g_proc_path, sizeof(g_proc_path), "/tmp/test_mtd_proc.%d",
+             getpid());
+    snprintf(g_dev_path, sizeof(g_dev_path), "/tmp/test_mtd_dev.%d",
+             getpid());
+
+    f = fopen(g_proc_path, "w");
+    assert(f != NULL);
+    fprintf(f, "dev:    size   erasesize  name\n");
+    fprintf(f, "mtd0: %08x %08x \"cache\"\n",
+            NUM_BLOCKS * ERASE_SIZE, ERASE_SIZE);
+    assert(fclose(f) == 0);
+
+    f = fopen(g_dev_path, "w");
+    assert(f != NULL);
+    memset(block, fill, sizeof(block));
+    for (i = 0; i < NUM_BLOCKS; ++i) {
+        assert(fwrite(block, 1, sizeof(block), f) == sizeof(block));
+    }
+    assert(fclose(f) == 0);
+    memset(g_erases, 0, sizeof(g_erases));
+    memset(&g_ecc, 0, sizeof(g_ecc));
+}
+
+/* Erases the partition CHUNK blocks at a time, as erase_mtd_root() does
+ * while reporting progress, and checks each block was erased once.
+ */
+static int
+test_chunked_erase(void)
+{
+    const MtdPartition *partition;
+    MtdWriteContext *write;
+    char block[ERASE_SIZE];
+    off_t pos = 0;
+    int done, i, j;
+
+    create_fake_partition(0);
+    assert(mtd_scan_partitions() == 1);
+    partition = mtd_find_partition_by_name("cache");
+    assert(partition != NULL);
+    write = mtd_write_partition(partition);
+    assert(write != NULL);
+
+    for (done = 0; done < NUM_BLOCKS; done += CHUNK) {
+        int n = NUM_BLOCKS - done < CHUNK ? NUM_BLOCKS - done : CHUNK;
+        pos = mtd_erase_blocks(write, n);
+        if (pos != (off_t) (done + n) * ERASE_SIZE) return -__LINE__;
+    }
+    if (mtd_erase_blocks(write, 1) != (off_t) -1) return -__LINE__;
+    if (mtd_write_close(write) != 0) return -__LINE__;
+
+    int fd = open(g_dev_path, O_RDONLY);
+    assert(fd >= 0);
+    for (i = 0; i < NUM_BLOCKS; ++i) {
+        if (g_erases[i] != (i == BAD_BLOCK ? 0 : 1)) return -__LINE__;
+        assert(read(fd, block, sizeof(block)) == sizeof(block));
+        for (j = 0; j < ERASE_SIZE; ++j) {
+            if (block[j] != (i == BAD_BLOCK ? 0 : (char) 0xff)) {
+                return -__LINE__;
+            }
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/* Writing after an erase carries on where the erase stopped.
+ */
+static int
+test_write_after_erase(void)
+{
+    const MtdPartition *partition;
+    MtdWriteContext *write;
+    char block[ERASE_SIZE];
+
+    create_fake_partition(0);
+    assert(mtd_scan_partitions() == 1);
+    partition = mtd_find_partition_by_name("cache");
+    assert(partition != NULL);
+    write = mtd_write_partition(partition);
+    assert(write != NULL);
+
+    if (mtd_erase_blocks(write, 3) != 3 * ERASE_SIZE) return -__LINE__;
+    memset(block, 'x', sizeof(block));
+    if (mtd_write_data(write, block, sizeof(block)) != sizeof(block)) {
+        return -__LINE__;
+    }
+    if (mtd_erase_blocks(write, 0) != 4 * ERASE_SIZE) return -__LINE__;
+    if (mtd_write_close(write) != 0) return -__LINE__;
+
+    int fd = open(g_dev_path, O_RDONLY);
+    assert(fd >= 0);
+    assert(pread(fd, block, sizeof(block), 3 * ERASE_SIZE) == sizeof(block));
+    close(fd);
+    if (block[0] != 'x' || block[ERASE_SIZE - 1] != 'x') return -__LINE__;
+    if (g_erases[0] != 1 || g_erases[3] != 1 || g_erases[4] != 0) {
+        return -__LINE__;
+    }
+    return 0;
+}
+
+/* A block that can't be read is skipped, and its ECC failure is charged
+ * to it rather than to the next block read.
+ */
+static int
+test_read_ecc_failure(void)
+{
+    const MtdPartition *partition;
+    const MtdBlockHealth *health;
+    MtdReadContext *read;
+    char block[ERASE_SIZE];
+    int count, i;
+
+    create_fake_partition('r');
+    assert(mtd_scan_partitions() == 1);
+    partition = mtd_find_partition_by_name("cache");
+    assert(partition != NULL);
+    mtd_clear_health(partition);
+    read = mtd_read_partition(partition);
+    assert(read != NULL);
+
+    g_fail_reads = 1;
+    for (i = 0; i < 3; ++i) {
+        if (mtd_read_data(read, block, sizeof(block)) != sizeof(block)) {
+            g_fail_reads = 0;
+            return -__LINE__;
+        }
+    }
+    g_fail_reads = 0;
+    mtd_read_close(read);
+    if (g_ecc.failed != 1) return -__LINE__;
+
+    health = mtd_partition_health(partition, &count);
+    if (count != 1 || health == NULL) return -__LINE__;
+    if (health[0].block != ECC_BLOCK || health[0].ecc_failed != 1 ||
+        health[0].ecc_corrected != 0) {
+        return -__LINE__;
+    }
+    mtd_clear_health(partition);
+    return 0;
+}
+
+int
+test_mtdutils(void)
+{
+    int ret = test_chunked_erase();
+    if (ret != 0) {
+        fprintf(stderr, "test_chunked_erase() failed: %d\n", ret);
+    } else if ((ret = test_write_after_erase()) != 0) {
+        fprintf(stderr, "test_write_after_erase() failed: %d\n", ret);
+    } else if ((ret = test_read_ecc_failure()) != 0) {
+        fprintf(stderr, "test_read_ecc_failure() failed: %d\n", ret);
+    }
+    unlink(g_proc_path);
+    unlink(g_dev_path);
+    return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (test_mtdutils() != 0) return 1;
+    printf("mtdutils: all tests passed\n");
+    return 0;
+}
@@ -38,13 +38,17 @@
 #include "minzip/DirUtil.h"
 #include "roots.h"
 #include "recovery_ui.h"
+#include "sdcard.h"
 #include "extra.h"
+#include "memstat.h"
+#include "startup.h"
 
 static const struct option OPTIONS[] = {
   { "send_intent", required_argument, NULL, 's' },
   { "update_package", required_argument, NULL, 'u' },
   { "wipe_data", no_argument, NULL, 'w' },
   { "wipe_cache", no_argument, NULL, 'c' },
+  { "mem_budget", required_argument, NULL, 'm' },
   { NULL, 0, NULL, 0 },
 };
 
@@ -65,6 +69,7 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
  *   --update_package=root:path - verify install an OTA package file
  *   --wipe_data - erase user data (and cache), then reboot
  *   --wipe_cache - wipe cache (but not user data), then reboot
+ *   --mem_budget=megabytes - RSS above which to save memory (default: half)
  *
  * After completing, we remove /cache/recovery/command and reboot.
  * Arguments may also be supplied in the bootloader control block (BCB).
@@ -76,8 +81,8 @@ static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
  * 3. main system reboots into recovery
  * 4. get_args() writes BCB with "boot-recovery" and "--wipe_data"
  *    -- after this, rebooting will restart the erase --
- * 5. erase_root() reformats /data
- * 6. erase_root() reformats /cache
+ * 5. erase_roots() reformats /data
+ * 6. erase_roots() reformats /cache
  * 7. finish_recovery() erases BCB
  *    -- after this, rebooting will restart the main system --
  * 8. main() calls reboot() to boot main system
@@ -282,6 +287,22 @@ erase_root(const char *root)
     return format_root_device(root);
 }
 
+// Format several roots (NULL-terminated) with one progress bar.  Roots on
+// independent devices are formatted at the same time.
+static int
+erase_roots(const char **roots)
+{
+    int failed = 0;
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_reset_progress();
+    ui_show_progress(1.0, 0);
+    for (; *roots != NULL; ++roots) {
+        ui_print("正在格式化%s...\n", *roots);
+        if (queue_format_root(*roots)) failed++;
+    }
+    return run_root_jobs() + failed;
+}
+
 static char**
 prepend_title(char** headers) {
     char* title[] = { "Android系统恢复<"
@@ -331,8 +352,8 @@ wipe_data(int confirm) {
 
     ui_print("\n-- 清空数据...\n");
     device_wipe_data();
-    erase_root("DATA:");
-    erase_root("CACHE:");
+    const char *roots[] = { "DATA:", "CACHE:", NULL };
+    erase_roots(roots);
     ui_print("清空数据完成.\n");
 }
 
@@ -364,13 +385,11 @@ static void install_zip_file(const char* file)
 }
 
 #define SDCARD_SPLASH_FILE "/sdcard/splash.bmp"
-#define RGB565_SPLASH_FILE "/tmp/splash.565"
 
-static void install_bmp_file(const char* file)
+static void install_splash_file(const char* file)
 {
 	int ret;
-	int sx, sy, bx, by;
-	char* argv[4];
+	int sx, sy;
 
 	ret = ensure_root_path_mounted("SDCARD:");
 	if(ret != 0)
@@ -381,30 +400,15 @@ static void install_bmp_file(const char* file)
 		ui_print("无法获得屏幕大小!\n");
 		return;
 	}
-	ret = bmp_info(file, &bx, &by);
+	// pictures of another size are scaled to fit the screen
+	ui_print("正在写入%s...\n", file);
+	ret = image_to_splash(file, sx, sy);
 	if(ret < 0)
-	{
-		ui_print("无法打开%s!\n", file);
-		return;
-	}
-	if(sx != bx || sy != by)
-	{
-		ui_print("警告!\n");
-		ui_print("屏幕大小是%dx%d.\n", sx, sy);
-		ui_print("但位图大小是%dx%d.\n", bx, by);
-	}
-	ret = bmp_to_565(file, RGB565_SPLASH_FILE);
-	if(ret < 0)
-	{
-		ui_print("无法转换%s!\n", file);
-		return;
-	}
-	argv[0] = "/sbin/flash.sh";
-	argv[1] = "splash";
-	argv[2] = RGB565_SPLASH_FILE;
-	argv[3] = NULL;
-
-	execute(1, "/bin/sh", argv);
+		ui_print("无法写入%s!\n", file);
+	else if(ret > 0)
+		ui_print("启动画面没有变化.\n");
+	else
+		ui_print("启动画面已更新.\n");
 }
 
 static void process_ums_toggle()
@@ -415,6 +419,8 @@ static void process_ums_toggle()
 	argv[1] = NULL;
 
 	execute(1, "/bin/sh", (char**)argv);
+	// the card may have been written to over USB
+	drop_dir_listings();
 }
 
 static void process_browse_update()
@@ -447,7 +453,7 @@ static void process_browse_splash()
 	int ret;
 	char* file;
 	const char* headers[] = {
-		"选择一个BMP文件",
+		"选择一个图片文件",
 		"",
 		NULL,
 	};
@@ -455,9 +461,9 @@ static void process_browse_splash()
 	ret = ensure_root_path_mounted("SDCARD:");
 	if(ret != 0)
 		return;
-	file = choose_file_menu("/sdcard/", ".bmp", headers);
+	file = choose_file_menu("/sdcard/", ".bmp|.png|.jpg|.jpeg", headers);
 	if(file)
-		install_bmp_file(file);
+		install_splash_file(file);
 }
 
 static void process_partition()
@@ -469,8 +475,6 @@ static void process_partition()
     int selected, key, visible, action;
 	long long int size;
 	int mbsd, mbvf, mbex, mbsw;
-	char args[6][16];
-	char* argv[8];
 
 	theHeaders[0] = (char*)headers[0];
 	theHeaders[1] = (char*)headers[1];
@@ -497,7 +501,7 @@ static void process_partition()
 	sprintf(headers[1], "(方向/音量键调节分区)");
 	sprintf(headers[2], "未分配%dMB", mbsd-mbvf-mbex-mbsw);
 	sprintf(items[0], "  vfat = %d MB", mbvf);
-	sprintf(items[1], "  ext3 = %d MB", mbex);
+	sprintf(items[1], "  ext2 = %d MB", mbex);
 	sprintf(items[2], "  swap = %d MB", mbsw);
 
 	selected = 0;
@@ -558,7 +562,7 @@ static void process_partition()
 				}
 				sprintf(headers[2], "未分配%dMB", mbsd-mbvf-mbex-mbsw);
 				sprintf(items[0], "  vfat = %d MB", mbvf);
-				sprintf(items[1], "  ext3 = %d MB", mbex);
+				sprintf(items[1], "  ext2 = %d MB", mbex);
 				sprintf(items[2], "  swap = %d MB", mbsw);
 				ui_modify_menu(theHeaders, theItems);
 			}
@@ -570,21 +574,12 @@ static void process_partition()
 		key = ui_wait_key();
 		if(key == KEY_CENTER || key == KEY_ENTER || key == BTN_MOUSE || key == KEY_F21)
 		{
-			strcpy(args[0], "-v");
-			sprintf(args[1], "%d", mbvf);
-			strcpy(args[2], "-e");
-			sprintf(args[3], "%d", mbex);
-			strcpy(args[4], "-s");
-			sprintf(args[5], "%d", mbsw);
-			argv[0] = "/sbin/partsdc.sh";
-			argv[1] = (char*)args[0];
-			argv[2] = (char*)args[1];
-			argv[3] = (char*)args[2];
-			argv[4] = (char*)args[3];
-			argv[5] = (char*)args[4];
-			argv[6] = (char*)args[5];
-			argv[7] = NULL;
-			execute(1, "/bin/sh", argv);
+			ui_print("正在分区并格式化SD卡...\n");
+			if(sdcard_partition(SDCARD_DEVICE, mbvf, mbex, mbsw) != 0)
+				ui_print("SD卡分区失败!\n");
+			else
+				ui_print("SD卡分区完成.\n");
+			drop_dir_listings();
 		}
 	}
     ui_end_menu();
@@ -631,7 +626,7 @@ prompt_and_wait()
 				break;
 
 			case ITEM_APPLY_SPLASH:
-				install_bmp_file(SDCARD_SPLASH_FILE);
+				install_splash_file(SDCARD_SPLASH_FILE);
 				break;
 
 			case ITEM_BROWSE_UPDATE:
@@ -655,32 +650,51 @@ print_property(const char *key, const char *name, void *cookie)
     fprintf(stderr, "%s=%s\n", key, name);
 }
 
-int
-main(int argc, char **argv)
+static void
+drop_ui_caches(void *cookie)
 {
-    time_t start = time(NULL);
+    ui_drop_caches();
+}
 
-    // If these fail, there's not really anywhere to complain...
-    freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
-    freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
-    fprintf(stderr, "Starting recovery on %s", ctime(&start));
+/* Startup runs as a set of steps, each starting as soon as what it
+ * needs is done: the UI comes up while the arguments are read, the
+ * script commands registered and the keys loaded, and the package is
+ * mounted and opened as soon as the arguments name it.
+ */
+typedef struct {
+    int argc;
+    char **argv;
+    int previous_runs;
+    const char *send_intent;
+    const char *update_package;
+    int wipe_data, wipe_cache;
+    RecoveryCommandContext ctx;
+} Startup;
 
+static void
+start_ui(void *cookie)
+{
     ui_init();
-    get_args(&argc, &argv);
+    mem_add_relief(drop_ui_caches, NULL);
+}
 
-    int previous_runs = 0;
-    const char *send_intent = NULL;
-    const char *update_package = NULL;
-    int wipe_data = 0, wipe_cache = 0;
+static void
+start_args(void *cookie)
+{
+    Startup *s = (Startup *) cookie;
+    long mem_budget_mb = 0;
+
+    get_args(&s->argc, &s->argv);
 
     int arg;
-    while ((arg = getopt_long(argc, argv, "", OPTIONS, NULL)) != -1) {
+    while ((arg = getopt_long(s->argc, s->argv, "", OPTIONS, NULL)) != -1) {
         switch (arg) {
-        case 'p': previous_runs = atoi(optarg); break;
-        case 's': send_intent = optarg; break;
-        case 'u': update_package = optarg; break;
-        case 'w': wipe_data = wipe_cache = 1; break;
-        case 'c': wipe_cache = 1; break;
+        case 'p': s->previous_runs = atoi(optarg); break;
+        case 's': s->send_intent = optarg; break;
+        case 'u': s->update_package = optarg; break;
+        case 'w': s->wipe_data = s->wipe_cache = 1; break;
+        case 'c': s->wipe_cache = 1; break;
+        case 'm': mem_budget_mb = atol(optarg); break;
         case '?':
             LOGE("无效命令参数\n");
             continue;
@@ -688,22 +702,74 @@ main(int argc, char **argv)
     }
 
     fprintf(stderr, "Command:");
-    for (arg = 0; arg < argc; arg++) {
-        fprintf(stderr, " \"%s\"", argv[arg]);
+    for (arg = 0; arg < s->argc; arg++) {
+        fprintf(stderr, " \"%s\"", s->argv[arg]);
     }
     fprintf(stderr, "\n\n");
 
     property_list(print_property, NULL);
     fprintf(stderr, "\n");
 
-#if TEST_AMEND
-    test_amend();
-#endif
+    mem_init(mem_budget_mb * 1024);
+}
 
-    RecoveryCommandContext ctx = { NULL };
-    if (register_update_commands(&ctx)) {
+static void
+start_commands(void *cookie)
+{
+    Startup *s = (Startup *) cookie;
+    if (register_update_commands(&s->ctx)) {
         LOGE("初始化脚本运行环境失败\n");
     }
+}
+
+static void
+start_keys(void *cookie)
+{
+    prepare_package_keys();
+}
+
+static void
+start_package(void *cookie)
+{
+    Startup *s = (Startup *) cookie;
+    if (s->update_package != NULL) prepare_package(s->update_package);
+}
+
+enum { STEP_UI, STEP_ARGS, STEP_COMMANDS, STEP_KEYS, STEP_PACKAGE };
+
+static const StartupStep STARTUP_STEPS[] = {
+    { "ui",         start_ui,       0 },
+    { "args",       start_args,     0 },
+    { "commands",   start_commands, 0 },
+    { "keys",       start_keys,     0 },
+    { "package",    start_package,  1 << STEP_ARGS },
+};
+#define NUM_STARTUP_STEPS \
+    (int) (sizeof(STARTUP_STEPS) / sizeof(STARTUP_STEPS[0]))
+
+int
+main(int argc, char **argv)
+{
+    time_t start = time(NULL);
+
+    // If these fail, there's not really anywhere to complain...
+    freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
+    freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
+    fprintf(stderr, "Starting recovery on %s", ctime(&start));
+
+    Startup startup;
+    memset(&startup, 0, sizeof(startup));
+    startup.argc = argc;
+    startup.argv = argv;
+    run_startup(STARTUP_STEPS, NUM_STARTUP_STEPS, &startup, NUM_STARTUP_STEPS);
+
+    const char *send_intent = startup.send_intent;
+    const char *update_package = startup.update_package;
+    int wipe_data = startup.wipe_data, wipe_cache = startup.wipe_cache;
+
+#if TEST_AMEND
+    test_amend();
+#endif
 
     int status = INSTALL_SUCCESS;
 
@@ -711,9 +777,9 @@ main(int argc, char **argv)
         status = install_package(update_package);
         if (status != INSTALL_SUCCESS) ui_print("放弃安装.\n");
     } else if (wipe_data) {
+        const char *roots[] = { "DATA:", wipe_cache ? "CACHE:" : NULL, NULL };
         if (device_wipe_data()) status = INSTALL_ERROR;
-        if (erase_root("DATA:")) status = INSTALL_ERROR;
-        if (wipe_cache && erase_root("CACHE:")) status = INSTALL_ERROR;
+        if (erase_roots(roots)) status = INSTALL_ERROR;
         if (status != INSTALL_SUCCESS) ui_print("清空数据失败.\n");
     } else if (wipe_cache) {
         if (wipe_cache && erase_root("CACHE:")) status = INSTALL_ERROR;
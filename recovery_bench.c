@@ -0,0 +1,1076 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host microbenchmarks for minzip, the verifier and edify, run against
+ * inputs generated on the fly:
+ *
+ *   recovery_bench [-i ITERS] [-w WARMUP] [-s SCALE%] [-f FILTER]
+ *                  [-d TMPDIR] [-c CPU] [-l]
+ *
+ * Each case runs in its own process, so its peak RSS is its own: inputs
+ * are written to TMPDIR by one child, and another loads them, runs
+ * WARMUP untimed and ITERS timed iterations, and prints one JSON object
+ * per line on stdout: timings in ns per iteration (min, median, max), ns
+ * per unit of work, MB/s where the case moves bytes, allocations per
+ * iteration, and peak RSS.  SCALE shrinks or grows every input; -c pins
+ * the run to one CPU.  Allocations are counted with the linker's --wrap,
+ * so only calls from the code under test are seen.
+ *
+ * minzip reads the 16-bit entry count from the end of central directory
+ * record, so 65535 entries is the most a package can hold.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "minzip/Zip.h"
+#include "mincrypt/rsa.h"
+#include "mincrypt/sha.h"
+#include "verifier.h"
+#include "edify/expr.h"
+
+#define MAX_ITERS 1000
+#define MAX_ZIP_ENTRIES 65535
+
+// compression methods
+#define STORED 0
+#define DEFLATED 8
+
+// -----------------------------------------------------------------
+//   allocation counting (-Wl,--wrap=...)
+// -----------------------------------------------------------------
+
+static unsigned long long alloc_count, alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = __wrap_malloc(len);
+    if (copy != NULL) memcpy(copy, s, len);
+    return copy;
+}
+
+// verifier.c reports through the recovery UI.
+void ui_print(const char *fmt, ...)
+{
+}
+
+void ui_set_progress(float fraction)
+{
+}
+
+// -----------------------------------------------------------------
+//   cases
+// -----------------------------------------------------------------
+
+typedef struct Case Case;
+struct Case {
+    const char *name;
+    const char *unit;
+    long long n;                    // units of work per iteration
+    int (*generate)(Case *c);       // writes c->path
+    int (*prepare)(Case *c);
+    int (*run)(Case *c, int iter);
+    void (*finish)(Case *c);
+
+    long long bytes;                // bytes moved per iteration, or 0
+    char path[256];
+    char dir[256];
+    ZipArchive zip;
+    RSAPublicKey key;
+    char *script;
+    Expr *root;
+    int fd;
+};
+
+static const char *tmp_dir = "/tmp";
+
+// Results go here; stdout itself is left to the code under test, whose
+// printf()s are sent to stderr.
+static FILE *results;
+
+static unsigned rand_state = 1;
+
+// Inputs are the same on every run.
+static unsigned next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// -----------------------------------------------------------------
+//   zip writer
+// -----------------------------------------------------------------
+
+typedef struct {
+    FILE *fp;
+    long long offset;
+    unsigned char *cd;
+    size_t cd_len, cd_size;
+    unsigned count;
+} ZipWriter;
+
+static void put16(unsigned char *p, unsigned v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, unsigned v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int zw_open(ZipWriter *zw, const char *path)
+{
+    memset(zw, 0, sizeof(*zw));
+    zw->fp = fopen(path, "wb");
+    if (zw->fp == NULL) {
+        fprintf(stderr, "can't write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int zw_header(ZipWriter *zw, const char *name, int method,
+                     unsigned crc, unsigned comp_len, unsigned len)
+{
+    size_t name_len = strlen(name);
+    unsigned char h[46];
+
+    if (zw->cd_len + sizeof(h) + name_len > zw->cd_size) {
+        size_t size = (zw->cd_size + sizeof(h) + name_len) * 2;
+        unsigned char *cd = realloc(zw->cd, size);
+        if (cd == NULL) return -1;
+        zw->cd = cd;
+        zw->cd_size = size;
+    }
+
+    // central directory record
+    memset(h, 0, sizeof(h));
+    put32(h, 0x02014b50);
+    put16(h + 4, 20);
+    put16(h + 6, 20);
+    put16(h + 10, method);
+    put16(h + 14, 0x3d21);          // 2010-09-01
+    put32(h + 16, crc);
+    put32(h + 20, comp_len);
+    put32(h + 24, len);
+    put16(h + 28, name_len);
+    put32(h + 38, 0100644 << 16);
+    put32(h + 42, zw->offset);
+    memcpy(zw->cd + zw->cd_len, h, sizeof(h));
+    memcpy(zw->cd + zw->cd_len + sizeof(h), name, name_len);
+    zw->cd_len += sizeof(h) + name_len;
+    zw->count++;
+
+    // local header
+    memset(h, 0, 30);
+    put32(h, 0x04034b50);
+    put16(h + 4, 20);
+    put16(h + 8, method);
+    put16(h + 12, 0x3d21);
+    put32(h + 14, crc);
+    put32(h + 18, comp_len);
+    put32(h + 22, len);
+    put16(h + 26, name_len);
+    if (fwrite(h, 1, 30, zw->fp) != 30 ||
+        fwrite(name, 1, name_len, zw->fp) != name_len) {
+        return -1;
+    }
+    zw->offset += 30 + name_len;
+    return 0;
+}
+
+// Adds an entry holding data, deflated if that is asked for.
+static int zw_add(ZipWriter *zw, const char *name, int method,
+                  const unsigned char *data, unsigned len)
+{
+    unsigned crc = crc32(crc32(0, NULL, 0), data, len);
+    unsigned char *out = (unsigned char *) data;
+    unsigned long out_len = len;
+
+    if (method == DEFLATED) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        out_len = deflateBound(&zs, len) + 16;
+        out = malloc(out_len);
+        if (out == NULL) return -1;
+        if (deflateInit2(&zs, 6, Z_DEFLATED, -MAX_WBITS, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(out);
+            return -1;
+        }
+        zs.next_in = (unsigned char *) data;
+        zs.avail_in = len;
+        zs.next_out = out;
+        zs.avail_out = out_len;
+        int ret = deflate(&zs, Z_FINISH);
+        out_len = zs.total_out;
+        deflateEnd(&zs);
+        if (ret != Z_STREAM_END) {
+            free(out);
+            return -1;
+        }
+    }
+
+    int ret = zw_header(zw, name, method, crc, out_len, len);
+    if (ret == 0 && fwrite(out, 1, out_len, zw->fp) != out_len) ret = -1;
+    zw->offset += out_len;
+    if (out != data) free(out);
+    return ret;
+}
+
+// Adds an entry of len zero bytes.  STORED, it is a hole in the file.
+static int zw_add_zeros(ZipWriter *zw, const char *name, int method,
+                        long long len)
+{
+    static unsigned char zeros[1 << 20];
+    unsigned crc = crc32(0, NULL, 0);
+    long long left;
+
+    for (left = len; left > 0; left -= sizeof(zeros)) {
+        crc = crc32(crc, zeros, left < (long long) sizeof(zeros) ?
+                                left : (long long) sizeof(zeros));
+    }
+
+    if (method == STORED) {
+        if (zw_header(zw, name, method, crc, len, len) < 0) return -1;
+        zw->offset += len;
+        return fseeko(zw->fp, zw->offset, SEEK_SET);
+    }
+
+    // The compressed size goes in the headers once it is known.
+    long long local = zw->offset;
+    size_t cd_at = zw->cd_len;
+    if (zw_header(zw, name, method, crc, 0, len) < 0) return -1;
+
+    static unsigned char out[1 << 16];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 1, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    unsigned long long comp_len = 0;
+    int ret = Z_OK;
+    left = len;
+    while (ret != Z_STREAM_END) {
+        if (zs.avail_in == 0 && left > 0) {
+            zs.next_in = zeros;
+            zs.avail_in = left < (long long) sizeof(zeros) ?
+                          left : (long long) sizeof(zeros);
+            left -= zs.avail_in;
+        }
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        ret = deflate(&zs, left > 0 ? Z_NO_FLUSH : Z_FINISH);
+        if (ret != Z_OK && ret != Z_STREAM_END) break;
+        size_t n = sizeof(out) - zs.avail_out;
+        if (fwrite(out, 1, n, zw->fp) != n) break;
+        comp_len += n;
+    }
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) return -1;
+
+    unsigned char size[4];
+    put32(size, comp_len);
+    put32(zw->cd + cd_at + 20, comp_len);
+    zw->offset += comp_len;
+    if (fseeko(zw->fp, local + 18, SEEK_SET) < 0 ||
+        fwrite(size, 1, 4, zw->fp) != 4) {
+        return -1;
+    }
+    return fseeko(zw->fp, zw->offset, SEEK_SET);
+}
+
+static int zw_close(ZipWriter *zw)
+{
+    unsigned char end[22];
+    int ret = 0;
+
+    memset(end, 0, sizeof(end));
+    put32(end, 0x06054b50);
+    put16(end + 8, zw->count);
+    put16(end + 10, zw->count);
+    put32(end + 12, zw->cd_len);
+    put32(end + 16, zw->offset);
+    if (fwrite(zw->cd, 1, zw->cd_len, zw->fp) != zw->cd_len ||
+        fwrite(end, 1, sizeof(end), zw->fp) != sizeof(end)) {
+        ret = -1;
+    }
+    if (fclose(zw->fp) != 0) ret = -1;
+    free(zw->cd);
+    return ret;
+}
+
+// Text that deflates about as well as an OTA's scripts and configs do.
+static void fill_text(unsigned char *buf, unsigned len, unsigned seed)
+{
+    static const char *words[] = {
+        "system", "app", "lib", "ro.build", "=", "true", "0644", "\n",
+        "/etc/", "android", ".so", "permission", "1000", " ",
+    };
+    unsigned i = 0;
+    while (i < len) {
+        const char *w = words[(seed = seed * 69069 + 1) >> 28 &
+                              (sizeof(words) / sizeof(words[0]) - 1)];
+        while (*w != '\0' && i < len) buf[i++] = *w++;
+    }
+}
+
+// -----------------------------------------------------------------
+//   minzip
+// -----------------------------------------------------------------
+
+// n small entries across a few hundred directories, as in system/.
+static int write_many_entries(Case *c, int method)
+{
+    ZipWriter zw;
+    unsigned char data[2048];
+    char name[64];
+    long long i;
+
+    if (zw_open(&zw, c->path) < 0) return -1;
+    for (i = 0; i < c->n; ++i) {
+        unsigned len = next_rand() % sizeof(data);
+        fill_text(data, len, i);
+        snprintf(name, sizeof(name), "system/d%03lld/file%05lld.txt",
+                 i % 300, i);
+        if (zw_add(&zw, name, method, data, len) < 0) {
+            zw_close(&zw);
+            return -1;
+        }
+    }
+    return zw_close(&zw);
+}
+
+static int gen_small_stored(Case *c)
+{
+    return write_many_entries(c, STORED);
+}
+
+static int gen_small_deflated(Case *c)
+{
+    return write_many_entries(c, DEFLATED);
+}
+
+static int open_zip(Case *c)
+{
+    if (mzOpenZipArchive(c->path, &c->zip) != 0) {
+        fprintf(stderr, "can't open %s\n", c->path);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_zip(Case *c)
+{
+    mzCloseZipArchive(&c->zip);
+}
+
+static int run_open(Case *c, int iter)
+{
+    ZipArchive zip;
+    if (mzOpenZipArchive(c->path, &zip) != 0) return -1;
+    mzCloseZipArchive(&zip);
+    return 0;
+}
+
+static int run_find(Case *c, int iter)
+{
+    unsigned i;
+    char name[64];
+    for (i = 0; i < c->zip.numEntries; ++i) {
+        snprintf(name, sizeof(name), "system/d%03u/file%05u.txt",
+                 i % 300, i);
+        if (mzFindZipEntry(&c->zip, name) == NULL) return -1;
+    }
+    return 0;
+}
+
+static int prepare_extract_dir(Case *c)
+{
+    unsigned i;
+    c->bytes = 0;
+    if (open_zip(c) < 0) return -1;
+    for (i = 0; i < c->zip.numEntries; ++i) {
+        c->bytes += mzGetZipEntryUncompLen(mzGetZipEntryAt(&c->zip, i));
+    }
+    snprintf(c->dir, sizeof(c->dir), "%s/recovery_bench.%d", tmp_dir,
+             getpid());
+    return mkdir(c->dir, 0755);
+}
+
+static int run_extract_dir(Case *c, int iter)
+{
+    char target[300];
+    snprintf(target, sizeof(target), "%s/%d", c->dir, iter);
+    if (mkdir(target, 0755) < 0) return -1;
+    return mzExtractRecursive(&c->zip, "system", target, 0, NULL,
+                              NULL, NULL) ? 0 : -1;
+}
+
+static int remove_file(const char *path, const struct stat *st, int flag,
+                       struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void finish_extract_dir(Case *c)
+{
+    nftw(c->dir, remove_file, 64, FTW_DEPTH | FTW_PHYS);
+    close_zip(c);
+}
+
+static int gen_big_stored(Case *c)
+{
+    ZipWriter zw;
+    if (zw_open(&zw, c->path) < 0) return -1;
+    if (zw_add_zeros(&zw, "system/big.img", STORED, c->n) < 0) {
+        zw_close(&zw);
+        return -1;
+    }
+    return zw_close(&zw);
+}
+
+static int gen_big_deflated(Case *c)
+{
+    ZipWriter zw;
+    if (zw_open(&zw, c->path) < 0) return -1;
+    if (zw_add_zeros(&zw, "system/big.img", DEFLATED, c->n) < 0) {
+        zw_close(&zw);
+        return -1;
+    }
+    return zw_close(&zw);
+}
+
+static int prepare_extract_big(Case *c)
+{
+    c->bytes = c->n;
+    c->fd = open("/dev/null", O_WRONLY);
+    if (c->fd < 0) return -1;
+    return open_zip(c);
+}
+
+static int run_extract_big(Case *c, int iter)
+{
+    const ZipEntry *entry = mzFindZipEntry(&c->zip, "system/big.img");
+    if (entry == NULL) return -1;
+    return mzExtractZipEntryToFile(&c->zip, entry, c->fd) ? 0 : -1;
+}
+
+static void finish_extract_big(Case *c)
+{
+    close(c->fd);
+    close_zip(c);
+}
+
+// -----------------------------------------------------------------
+//   verifier
+// -----------------------------------------------------------------
+
+// A throwaway 2048-bit key with exponent 3, the kind mincrypt verifies.
+// It signs nothing but the packages this benchmark makes.
+static const char kTestKeyN[] =
+    "938c4b219b25612c5b484547b79c375f618bdb93cf0c2bccae004c44b0e246bd"
+    "30dbf2bcdff1103e9ccbc6048632f94b502b4fbcafae03ae4f01158a98cca7b4"
+    "0bb7314c35ec57fe15c0280a812563566e1d092a196df6e67e8bd9a399009f7c"
+    "7bb84997bcc352e2a8da1ca78f8076cc6c2ba1a7d39ac007293ccdf73b54c2cf"
+    "ed44ad51d522971f30b98aba6a407a5e5117f2f2912298236e84842ebd4e77c7"
+    "a92fc12b5de9049f0075acc7e600c57a8e35a26b5cd534c6955aec693be8bc6b"
+    "f41abf91789bba182ff4c1a2b3733d9410a32661504a9469fe743e6a6ab2ab66"
+    "a1f440cbfb2035a278712357ca14a4b3b46a9dc4d132ed34b491f9e9610a9b5f";
+static const char kTestKeyD[] =
+    "625d876bbcc3961d92302e2fcfbd7a3f965d3d0d34b2c7ddc955882dcb41847e"
+    "2092a1d33ff60ad46887d958597750dce01cdfd31fc957c98a00b90710886fcd"
+    "5d24cb8823f2e5540e801ab1ab6e42399ebe061c10f3f9eeff07e66d10ab14fd"
+    "a7d0310fd32ce1ec7091686fb5004f32f2c7c11a8d11d55a1b7ddea4d23881de"
+    "f05f4754d0cef00568c8d5bbc2dd18a93aa07608ebc904f746cbed877878ea36"
+    "3becd02f2ff6ae6fcd5a249117cf7f4731ea6a7dd01d2ef205a79f7d2fa36fe2"
+    "9a5398ddc53d047633673eb14699b839629733e98545a351590eb45357190eb0"
+    "e04a8a639a36bcee7eab291094b1b67ae5d82c87743bb0c6a65615571b01bdeb";
+
+// Little-endian words, as in RSAPublicKey.
+static void parse_hex(const char *hex, uint32_t *words)
+{
+    int i;
+    for (i = 0; i < RSANUMWORDS; ++i) {
+        char word[9];
+        memcpy(word, hex + (RSANUMWORDS - 1 - i) * 8, 8);
+        word[8] = '\0';
+        words[i] = strtoul(word, NULL, 16);
+    }
+}
+
+// a = a * 2 mod n, for a < n.
+static void double_mod(uint32_t *a, const uint32_t *n)
+{
+    uint32_t carry = 0, t[RSANUMWORDS];
+    int i, ge = 0;
+    for (i = 0; i < RSANUMWORDS; ++i) {
+        t[i] = (a[i] << 1) | carry;
+        carry = a[i] >> 31;
+    }
+    if (!carry) {
+        ge = 1;
+        for (i = RSANUMWORDS - 1; i >= 0; --i) {
+            if (t[i] != n[i]) {
+                ge = t[i] > n[i];
+                break;
+            }
+        }
+    }
+    if (carry || ge) {
+        int64_t borrow = 0;
+        for (i = 0; i < RSANUMWORDS; ++i) {
+            borrow += (int64_t) t[i] - n[i];
+            t[i] = (uint32_t) borrow;
+            borrow >>= 32;
+        }
+    }
+    memcpy(a, t, sizeof(t));
+}
+
+static void make_public_key(RSAPublicKey *key)
+{
+    uint32_t inv = 1;
+    int i;
+
+    key->len = RSANUMWORDS;
+    parse_hex(kTestKeyN, key->n);
+    // -1 / n[0] mod 2^32, by Newton's iteration
+    for (i = 0; i < 5; ++i) inv *= 2 - key->n[0] * inv;
+    key->n0inv = -inv;
+    // R^2 mod n, R = 2^(32 * RSANUMWORDS)
+    memset(key->rr, 0, sizeof(key->rr));
+    key->rr[0] = 1;
+    for (i = 0; i < 64 * RSANUMWORDS; ++i) double_mod(key->rr, key->n);
+}
+
+// c = a * b / R mod n
+static void mont_mul(const RSAPublicKey *key, uint32_t *c,
+                     const uint32_t *a, const uint32_t *b)
+{
+    uint32_t t[RSANUMWORDS + 2];
+    int i, j;
+
+    memset(t, 0, sizeof(t));
+    for (i = 0; i < RSANUMWORDS; ++i) {
+        uint64_t sum, carry = 0;
+        for (j = 0; j < RSANUMWORDS; ++j) {
+            sum = t[j] + (uint64_t) a[j] * b[i] + carry;
+            t[j] = (uint32_t) sum;
+            carry = sum >> 32;
+        }
+        sum = t[RSANUMWORDS] + carry;
+        t[RSANUMWORDS] = (uint32_t) sum;
+        t[RSANUMWORDS + 1] = sum >> 32;
+
+        uint32_t m = t[0] * key->n0inv;
+        carry = (t[0] + (uint64_t) m * key->n[0]) >> 32;
+        for (j = 1; j < RSANUMWORDS; ++j) {
+            sum = t[j] + (uint64_t) m * key->n[j] + carry;
+            t[j - 1] = (uint32_t) sum;
+            carry = sum >> 32;
+        }
+        sum = t[RSANUMWORDS] + carry;
+        t[RSANUMWORDS - 1] = (uint32_t) sum;
+        t[RSANUMWORDS] = t[RSANUMWORDS + 1] + (uint32_t) (sum >> 32);
+    }
+
+    int ge = t[RSANUMWORDS] != 0;
+    if (!ge) {
+        ge = 1;
+        for (i = RSANUMWORDS - 1; i >= 0; --i) {
+            if (t[i] != key->n[i]) {
+                ge = t[i] > key->n[i];
+                break;
+            }
+        }
+    }
+    if (ge) {
+        int64_t borrow = 0;
+        for (i = 0; i < RSANUMWORDS; ++i) {
+            borrow += (int64_t) t[i] - key->n[i];
+            t[i] = (uint32_t) borrow;
+            borrow >>= 32;
+        }
+    }
+    memcpy(c, t, RSANUMWORDS * sizeof(uint32_t));
+}
+
+// The PKCS#1 v1.5 SHA-1 signature RSA_verify() expects, big-endian.
+static void sign_digest(const RSAPublicKey *key, const uint8_t *digest,
+                        uint8_t *sig)
+{
+    static const uint8_t kDigestInfo[] = {
+        0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b, 0x0e,
+        0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14,
+    };
+    uint8_t em[RSANUMBYTES];
+    uint32_t m[RSANUMWORDS], d[RSANUMWORDS], x[RSANUMWORDS];
+    uint32_t acc[RSANUMWORDS], one[RSANUMWORDS];
+    int i;
+
+    memset(em, 0xff, sizeof(em));
+    em[0] = 0;
+    em[1] = 1;
+    em[RSANUMBYTES - SHA_DIGEST_SIZE - sizeof(kDigestInfo) - 1] = 0;
+    memcpy(em + RSANUMBYTES - SHA_DIGEST_SIZE - sizeof(kDigestInfo),
+           kDigestInfo, sizeof(kDigestInfo));
+    memcpy(em + RSANUMBYTES - SHA_DIGEST_SIZE, digest, SHA_DIGEST_SIZE);
+    for (i = 0; i < RSANUMWORDS; ++i) {
+        const uint8_t *p = em + RSANUMBYTES - 4 * (i + 1);
+        m[i] = (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    }
+    parse_hex(kTestKeyD, d);
+
+    memset(one, 0, sizeof(one));
+    one[0] = 1;
+    mont_mul(key, x, m, key->rr);       // m * R
+    mont_mul(key, acc, one, key->rr);   // R
+    for (i = 32 * RSANUMWORDS - 1; i >= 0; --i) {
+        mont_mul(key, acc, acc, acc);
+        if (d[i / 32] >> (i % 32) & 1) mont_mul(key, acc, acc, x);
+    }
+    mont_mul(key, acc, acc, one);
+
+    for (i = 0; i < RSANUMWORDS; ++i) {
+        uint8_t *p = sig + RSANUMBYTES - 4 * (i + 1);
+        p[0] = acc[i] >> 24;
+        p[1] = acc[i] >> 16;
+        p[2] = acc[i] >> 8;
+        p[3] = acc[i];
+    }
+}
+
+static void base64(const uint8_t *in, int len, char *out)
+{
+    static const char kChars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+    for (i = 0; i < len; i += 3) {
+        unsigned v = in[i] << 16 | (i + 1 < len ? in[i + 1] << 8 : 0) |
+                     (i + 2 < len ? in[i + 2] : 0);
+        *out++ = kChars[v >> 18];
+        *out++ = kChars[v >> 12 & 63];
+        *out++ = i + 1 < len ? kChars[v >> 6 & 63] : '=';
+        *out++ = i + 2 < len ? kChars[v & 63] : '=';
+    }
+    *out = '\0';
+}
+
+// n deflated entries and a manifest, signature file and signature for
+// them, laid out as signapk does.
+static int gen_signed(Case *c)
+{
+    ZipWriter zw;
+    unsigned char data[8192];
+    char name[64], digest64[32];
+    size_t mf_len = 0, mf_size = 256;
+    char *mf = malloc(mf_size);
+    long long i;
+    int ret = -1;
+
+    if (mf == NULL || zw_open(&zw, c->path) < 0) {
+        free(mf);
+        return -1;
+    }
+    mf_len = snprintf(mf, mf_size, "Manifest-Version: 1.0\r\n"
+                      "Created-By: 1.0 (Android SignApk)\r\n\r\n");
+    for (i = 0; i < c->n; ++i) {
+        unsigned len = next_rand() % sizeof(data);
+        fill_text(data, len, i);
+        snprintf(name, sizeof(name), "system/app/file%05lld.dat", i);
+        if (zw_add(&zw, name, DEFLATED, data, len) < 0) goto done;
+
+        uint8_t digest[SHA_DIGEST_SIZE];
+        SHA(data, len, digest);
+        base64(digest, SHA_DIGEST_SIZE, digest64);
+        if (mf_len + 128 > mf_size) {
+            char *grown = realloc(mf, mf_size *= 2);
+            if (grown == NULL) goto done;
+            mf = grown;
+        }
+        mf_len += snprintf(mf + mf_len, mf_size - mf_len,
+                           "Name: %s\r\nSHA1-Digest: %s\r\n\r\n",
+                           name, digest64);
+    }
+
+    char sf[256];
+    uint8_t digest[SHA_DIGEST_SIZE], sig[RSANUMBYTES];
+    SHA(mf, mf_len, digest);
+    base64(digest, SHA_DIGEST_SIZE, digest64);
+    int sf_len = snprintf(sf, sizeof(sf), "Signature-Version: 1.0\r\n"
+                          "Created-By: 1.0 (Android SignApk)\r\n"
+                          "SHA1-Digest-Manifest: %s\r\n\r\n", digest64);
+    SHA(sf, sf_len, digest);
+    make_public_key(&c->key);
+    sign_digest(&c->key, digest, sig);
+
+    if (zw_add(&zw, "META-INF/MANIFEST.MF", DEFLATED,
+               (unsigned char *) mf, mf_len) < 0 ||
+        zw_add(&zw, "META-INF/CERT.SF", DEFLATED,
+               (unsigned char *) sf, sf_len) < 0 ||
+        zw_add(&zw, "META-INF/CERT.RSA", STORED, sig, sizeof(sig)) < 0) {
+        goto done;
+    }
+    ret = 0;
+
+done:
+    if (zw_close(&zw) < 0) ret = -1;
+    free(mf);
+    return ret;
+}
+
+static int prepare_verify(Case *c)
+{
+    unsigned i;
+    c->bytes = 0;
+    make_public_key(&c->key);
+    if (open_zip(c) < 0) return -1;
+    for (i = 0; i < c->zip.numEntries; ++i) {
+        c->bytes += mzGetZipEntryUncompLen(mzGetZipEntryAt(&c->zip, i));
+    }
+    return 0;
+}
+
+static int run_verify(Case *c, int iter)
+{
+    return verify_jar_signature(&c->zip, &c->key, 1) ? 0 : -1;
+}
+
+// -----------------------------------------------------------------
+//   edify
+// -----------------------------------------------------------------
+
+typedef struct yy_buffer_state *YY_BUFFER_STATE;
+YY_BUFFER_STATE yy_scan_string(const char *str);
+void yy_delete_buffer(YY_BUFFER_STATE buffer);
+int yyparse(Expr **root, int *error_count);
+extern int gLine, gColumn, gPos;
+
+// Statements like an updater-script's checks, each of which holds.
+static int gen_script(Case *c)
+{
+    static const char *kStatements[] = {
+        "concat(\"system/app/\", \"App%lld.apk\") == "
+            "\"system/app/App%lld.apk\" || abort(\"mismatch\");\n",
+        "if is_substring(\"pp\", \"App%lld\") then \"yes\" "
+            "else abort(\"missing\") endif;\n",
+        "!(\"%lld\" == \"x\") && (\"%lld\" != \"y\");\n",
+        "ifelse(less_than_int(\"%lld\", \"%lld1\"), \"lt\", abort(\"ge\"));\n",
+        "assert(is_substring(\"ro.build\", \"ro.build.id=%lld\"));  "
+            "# %lld\n",
+    };
+    FILE *fp = fopen(c->path, "w");
+    long long i;
+
+    if (fp == NULL) return -1;
+    for (i = 0; i < c->n; ++i) {
+        fprintf(fp, kStatements[i % 5], i, i);
+    }
+    fprintf(fp, "\"done\"\n");
+    return fclose(fp);
+}
+
+static int parse_script(Case *c, Expr **root)
+{
+    int error_count = 0;
+    gLine = gColumn = 1;
+    gPos = 0;
+    YY_BUFFER_STATE buffer = yy_scan_string(c->script);
+    int error = yyparse(root, &error_count);
+    yy_delete_buffer(buffer);
+    return error != 0 || error_count != 0 ? -1 : 0;
+}
+
+static int prepare_script(Case *c)
+{
+    struct stat st;
+    FILE *fp = fopen(c->path, "r");
+
+    if (fp == NULL || fstat(fileno(fp), &st) < 0) return -1;
+    c->bytes = st.st_size;
+    c->script = malloc(st.st_size + 1);
+    if (c->script == NULL ||
+        fread(c->script, 1, st.st_size, fp) != (size_t) st.st_size) {
+        fclose(fp);
+        return -1;
+    }
+    c->script[st.st_size] = '\0';
+    fclose(fp);
+
+    RegisterBuiltins();
+    FinishRegistration();
+    return 0;
+}
+
+// Parse trees are never freed in edify; the child process exits instead.
+static int run_parse(Case *c, int iter)
+{
+    Expr *root;
+    return parse_script(c, &root);
+}
+
+static int prepare_eval(Case *c)
+{
+    if (prepare_script(c) < 0) return -1;
+    return parse_script(c, &c->root);
+}
+
+static int run_eval(Case *c, int iter)
+{
+    State state;
+    state.cookie = NULL;
+    state.script = c->script;
+    state.errmsg = NULL;
+    char *result = Evaluate(&state, c->root);
+    free(state.errmsg);
+    if (result == NULL || strcmp(result, "done") != 0) return -1;
+    free(result);
+    return 0;
+}
+
+static void free_script(Case *c)
+{
+    free(c->script);
+}
+
+// -----------------------------------------------------------------
+//   runner
+// -----------------------------------------------------------------
+
+#define GB (1024LL * 1024 * 1024)
+
+static Case cases[] = {
+    { "zip_open", "entry", 10000, gen_small_stored, NULL, run_open, NULL },
+    { "zip_open", "entry", MAX_ZIP_ENTRIES, gen_small_stored, NULL,
+      run_open, NULL },
+    { "zip_find", "entry", MAX_ZIP_ENTRIES, gen_small_stored, open_zip,
+      run_find, close_zip },
+    { "zip_extract_dir", "entry", 10000, gen_small_deflated,
+      prepare_extract_dir, run_extract_dir, finish_extract_dir },
+    { "zip_extract_stored", "byte", 2 * GB, gen_big_stored,
+      prepare_extract_big, run_extract_big, finish_extract_big },
+    { "zip_extract_deflated", "byte", 2 * GB, gen_big_deflated,
+      prepare_extract_big, run_extract_big, finish_extract_big },
+    { "verify_jar_signature", "entry", 10000, gen_signed, prepare_verify,
+      run_verify, close_zip },
+    { "edify_parse", "statement", 50000, gen_script, prepare_script,
+      run_parse, free_script },
+    { "edify_eval", "statement", 50000, gen_script, prepare_eval,
+      run_eval, free_script },
+};
+#define NUM_CASES (int) (sizeof(cases) / sizeof(cases[0]))
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static int run_case(Case *c, int warmup, int iters)
+{
+    static double ns[MAX_ITERS];
+    int i;
+
+    if (c->prepare != NULL && c->prepare(c) < 0) {
+        fprintf(stderr, "%s: can't prepare %s\n", c->name, c->path);
+        return -1;
+    }
+    for (i = 0; i < warmup; ++i) {
+        if (c->run(c, iters + i) < 0) goto failed;
+    }
+    alloc_count = alloc_bytes = 0;
+    for (i = 0; i < iters; ++i) {
+        double start = now_ns();
+        if (c->run(c, i) < 0) goto failed;
+        ns[i] = now_ns() - start;
+    }
+    unsigned long long allocs = alloc_count, bytes = alloc_bytes;
+    if (c->finish != NULL) c->finish(c);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    qsort(ns, iters, sizeof(double), compare_double);
+    double median = ns[iters / 2];
+
+    fprintf(results, "{\"bench\":\"%s\",\"n\":%lld,\"unit\":\"%s\",\"warmup\":%d,"
+           "\"iters\":%d,\"min_ns\":%.0f,\"median_ns\":%.0f,\"max_ns\":%.0f,"
+           "\"ns_per_unit\":%.3f,",
+           c->name, c->n, c->unit, warmup, iters, ns[0], median,
+           ns[iters - 1], median / c->n);
+    if (c->bytes > 0) {
+        fprintf(results, "\"mb_per_s\":%.1f,",
+                c->bytes / (median / 1e9) / 1e6);
+    } else {
+        fprintf(results, "\"mb_per_s\":null,");
+    }
+    fprintf(results, "\"allocs_per_iter\":%llu,\"alloc_bytes_per_iter\":%llu,"
+           "\"peak_rss_kb\":%ld}\n",
+           allocs / iters, bytes / iters, usage.ru_maxrss);
+    fflush(results);
+    return 0;
+
+failed:
+    fprintf(stderr, "%s: iteration failed\n", c->name);
+    if (c->finish != NULL) c->finish(c);
+    return -1;
+}
+
+// Runs fn(c) in a child process and returns whether it succeeded.
+static int in_child(int (*fn)(Case *c, int warmup, int iters), Case *c,
+                    int warmup, int iters)
+{
+    fflush(results);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        _exit(fn(c, warmup, iters) == 0 ? 0 : 1);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int generate_case(Case *c, int warmup, int iters)
+{
+    return c->generate(c);
+}
+
+int main(int argc, char **argv)
+{
+    int iters = 5, warmup = 1, scale = 100, cpu = -1, list = 0;
+    const char *filter = NULL;
+    int failures = 0, i, opt;
+
+    if (getenv("TMPDIR") != NULL) tmp_dir = getenv("TMPDIR");
+    while ((opt = getopt(argc, argv, "i:w:s:f:d:c:l")) != -1) {
+        switch (opt) {
+        case 'i': iters = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 's': scale = atoi(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'd': tmp_dir = optarg; break;
+        case 'c': cpu = atoi(optarg); break;
+        case 'l': list = 1; break;
+        default: goto usage;
+        }
+    }
+    if (iters < 1 || iters > MAX_ITERS || warmup < 0 || scale < 1 ||
+        optind != argc) {
+        goto usage;
+    }
+
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL) return 1;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            fprintf(stderr, "can't pin to cpu %d: %s\n", cpu, strerror(errno));
+            return 1;
+        }
+    }
+
+    for (i = 0; i < NUM_CASES; ++i) {
+        Case *c = &cases[i];
+        c->n = c->n * scale / 100;
+        if (c->n < 1) c->n = 1;
+        if (!strcmp(c->unit, "entry") && c->n > MAX_ZIP_ENTRIES) {
+            c->n = MAX_ZIP_ENTRIES;
+        }
+        if (!strcmp(c->unit, "byte") && c->n > 0xffffffffLL) {
+            c->n = 0xffffffffLL;
+        }
+        if (filter != NULL && strstr(c->name, filter) == NULL) continue;
+        if (list) {
+            fprintf(results, "%s %lld %s\n", c->name, c->n, c->unit);
+            continue;
+        }
+
+        snprintf(c->path, sizeof(c->path), "%s/recovery_bench.%d.%d",
+                 tmp_dir, getpid(), i);
+        rand_state = 1;
+        if (in_child(generate_case, c, 0, 0) < 0 ||
+            in_child(run_case, c, warmup, iters) < 0) {
+            fprintf(results, "{\"bench\":\"%s\",\"n\":%lld,\"unit\":\"%s\","
+                    "\"error\":true}\n", c->name, c->n, c->unit);
+            ++failures;
+        }
+        unlink(c->path);
+    }
+    fclose(results);
+    return failures ? 1 : 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-i ITERS] [-w WARMUP] [-s SCALE%%] "
+            "[-f FILTER] [-d TMPDIR] [-c CPU] [-l]\n", argv[0]);
+    return 2;
+}
@@ -15,17 +15,27 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <linux/fs.h>
 
 #include "mtdutils/mtdutils.h"
 #include "mtdutils/mounts.h"
+#include "minzip/DirUtil.h"
 #include "minzip/Zip.h"
 #include "roots.h"
 #include "common.h"
+#include "sdcard.h"
 
 typedef struct {
     const char *name;
@@ -43,6 +53,11 @@ static const char g_mtd_device[] = "@\0g_mtd_device";
 static const char g_raw[] = "@\0g_raw";
 static const char g_package_file[] = "@\0g_package_file";
 
+static const char FLASH_HEALTH_FILE[] = "CACHE:recovery/flash_health";
+
+// Erase this many blocks between progress updates of a format job.
+#define FORMAT_JOB_CHUNK_BLOCKS 64
+
 static RootInfo g_roots[] = {
     { "BOOT:", g_mtd_device, NULL, "boot", NULL, g_raw },
     { "CACHE:", g_mtd_device, NULL, "cache", "/cache", "yaffs2" },
@@ -308,6 +323,136 @@ get_root_mtd_partition(const char *root_path)
     return mtd_find_partition_by_name(info->partition_name);
 }
 
+int
+save_flash_health_report(const MtdPartition *partition)
+{
+    char path[PATH_MAX];
+    if (ensure_root_path_mounted(FLASH_HEALTH_FILE) != 0 ||
+        translate_root_path(FLASH_HEALTH_FILE, path, sizeof(path)) == NULL) {
+        LOGW("Can't resolve %s\n", FLASH_HEALTH_FILE);
+        return -1;
+    }
+    // Use generous permissions, the system (init.rc) will reset them.
+    dirCreateHierarchy(path, 0777, NULL, 1);
+
+    FILE *fp = fopen(path, "a");
+    if (fp == NULL) {
+        LOGW("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    int ret = mtd_write_health_report(partition, fp);
+    if (fclose(fp) != 0) ret = -1;
+    if (ret < 0) {
+        LOGW("Can't write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Erase an MTD-backed root.  If job is non-NULL, erase in chunks and
+ * report progress through it; otherwise erase everything in one go.
+ * Returns 0 on success, 1 if the filesystem isn't one we can erase,
+ * and -1 on error.
+ */
+static int
+erase_mtd_root(const RootInfo *info, const MtdPartition *partition,
+        const char *root, RootJob *job)
+{
+    if (info->filesystem != g_raw && strcmp(info->filesystem, "yaffs2")) {
+        return 1;
+    }
+
+    MtdWriteContext *write = mtd_write_partition(partition);
+    if (write == NULL) {
+        LOGW("format_root_device: can't open \"%s\"\n", root);
+        return -1;
+    }
+
+    size_t total_size, erase_size;
+    int total = 0, done = 0;
+    off_t pos = 0;
+    if (job != NULL &&
+        mtd_partition_info(partition, &total_size, &erase_size, NULL) == 0 &&
+        erase_size > 0) {
+        total = total_size / erase_size;
+    }
+    if (total == 0) pos = mtd_erase_blocks(write, -1);
+    while (pos != (off_t) -1 && done < total) {
+        int n = total - done;
+        if (n > FORMAT_JOB_CHUNK_BLOCKS) n = FORMAT_JOB_CHUNK_BLOCKS;
+        pos = mtd_erase_blocks(write, n);
+        done += n;
+        set_root_job_progress(job, (float) done / total);
+    }
+
+    if (pos == (off_t) -1) {
+        LOGW("format_root_device: can't erase \"%s\"\n", root);
+        mtd_write_close(write);
+        return -1;
+    }
+    if (mtd_write_close(write)) {
+        LOGW("format_root_device: can't close \"%s\"\n", root);
+        return -1;
+    }
+    return 0;
+}
+
+/* Sets *start to the first sector of the partition that is block device
+ * "dev" on its disk; 0 if it is a whole disk.  Returns -1 if sysfs says
+ * it is a partition but not where.
+ */
+static int
+get_partition_start(dev_t dev, unsigned *start)
+{
+    char sys[64];
+    snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/start",
+            major(dev), minor(dev));
+    FILE *fp = fopen(sys, "r");
+    if (fp == NULL) {
+        *start = 0;
+        return errno == ENOENT ? 0 : -1;
+    }
+    int matches = fscanf(fp, "%u", start);
+    fclose(fp);
+    return matches == 1 ? 0 : -1;
+}
+
+/* Format a vfat root on a block device (the SD card's first partition)
+ * as FAT32, in place.  Only the primary device is formatted, never the
+ * whole card that some roots fall back to for mounting.  Returns 0 on
+ * success, 1 if the filesystem isn't one we can format, and -1 on error.
+ */
+static int
+format_block_root(const RootInfo *info, const char *root)
+{
+    if (info->filesystem == NULL || strcmp(info->filesystem, "vfat")) {
+        return 1;
+    }
+
+    int fd = open(info->device, O_RDWR);
+    if (fd < 0) {
+        LOGW("format_root_device: can't open \"%s\" (%s)\n",
+                root, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    unsigned long long size;
+    unsigned start;
+    int ret = -1;
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+        ioctl(fd, BLKGETSIZE64, &size) == 0 &&
+        get_partition_start(st.st_rdev, &start) == 0 &&
+        sdcard_format_fat32(fd, 0, size, start) == 0 &&
+        fsync(fd) == 0) {
+        ret = 0;
+    } else {
+        LOGW("format_root_device: can't format \"%s\"\n", root);
+    }
+    close(fd);
+    return ret;
+}
+
 int
 format_root_device(const char *root)
 {
@@ -349,24 +494,260 @@ format_root_device(const char *root)
                     info->partition_name);
             return -1;
         }
-        if (info->filesystem == g_raw || !strcmp(info->filesystem, "yaffs2")) {
-            MtdWriteContext *write = mtd_write_partition(partition);
-            if (write == NULL) {
-                LOGW("format_root_device: can't open \"%s\"\n", root);
-                return -1;
-            } else if (mtd_erase_blocks(write, -1) == (off_t) -1) {
-                LOGW("format_root_device: can't erase \"%s\"\n", root);
-                mtd_write_close(write);
-                return -1;
-            } else if (mtd_write_close(write)) {
-                LOGW("format_root_device: can't close \"%s\"\n", root);
-                return -1;
-            } else {
-                return 0;
-            }
+        int ret = erase_mtd_root(info, partition, root, NULL);
+        if (ret == 0) {
+            save_flash_health_report(partition);
+        }
+        if (ret <= 0) {
+            return ret;
+        }
+    } else if (info->device[0] == '/') {
+        int ret = format_block_root(info, root);
+        if (ret <= 0) {
+            return ret;
         }
     }
-//TODO: handle other device types (sdcard, etc.)
-    LOGW("format_root_device: can't handle non-mtd device \"%s\"\n", root);
+    LOGW("format_root_device: can't handle \"%s\"\n", root);
     return -1;
 }
+
+#define MAX_ROOT_JOBS 16
+
+struct RootJob {
+    const RootInfo *info;
+    const char *root;
+    RootJobFunction fn;
+    void *cookie;
+    const MtdPartition *partition;  // resolved before the job runs
+    float progress;
+    int result;
+    RootJob *next;                  // next job on the same device
+};
+
+static RootJob g_jobs[MAX_ROOT_JOBS];
+static int g_job_count = 0;
+static int g_jobs_running = 0;
+static pthread_mutex_t g_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_jobs_cond = PTHREAD_COND_INITIALIZER;
+
+/* Finds the whole disk that holds the block device at "path", using the
+ * device's parent in sysfs if it is a partition.  Returns -1 if "path"
+ * isn't a block device we can see.
+ */
+static int
+get_whole_disk(const char *path, dev_t *disk)
+{
+    struct stat st;
+    char sys[64];
+    unsigned int maj, min;
+
+    if (path == NULL || stat(path, &st) != 0 || !S_ISBLK(st.st_mode)) {
+        return -1;
+    }
+    *disk = st.st_rdev;
+    snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/partition",
+            major(st.st_rdev), minor(st.st_rdev));
+    if (access(sys, F_OK) != 0) {
+        return 0;  // already a whole disk
+    }
+    snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/../dev",
+            major(st.st_rdev), minor(st.st_rdev));
+    FILE *fp = fopen(sys, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    int matches = fscanf(fp, "%u:%u", &maj, &min);
+    fclose(fp);
+    if (matches != 2) {
+        return -1;
+    }
+    *disk = makedev(maj, min);
+    return 0;
+}
+
+/* Returns non-zero if the two roots live on the same physical device.
+ * All MTD partitions are on the one NAND chip; block devices are compared
+ * by the whole disk they are on, so "sda1" and "sda2" are the same device.
+ * When in doubt, the answer is yes, which only costs parallelism.
+ */
+static int
+same_device(const RootInfo *a, const RootInfo *b)
+{
+    if (a->device == g_mtd_device || b->device == g_mtd_device) {
+        return a->device == b->device;
+    }
+    dev_t da, db;
+    if (get_whole_disk(a->device, &da) != 0 &&
+        get_whole_disk(a->device2, &da) != 0) {
+        return 1;
+    }
+    if (get_whole_disk(b->device, &db) != 0 &&
+        get_whole_disk(b->device2, &db) != 0) {
+        return 1;
+    }
+    return da == db;
+}
+
+int
+queue_root_job(const char *root, RootJobFunction fn, void *cookie)
+{
+    const char *c = strchr(root, ':');
+    const RootInfo *info = get_root_info_for_path(root);
+    if (c == NULL || c[1] != '\0' || info == NULL || info->device == NULL) {
+        LOGW("queue_root_job: can't resolve \"%s\"\n", root);
+        return -1;
+    }
+    if (g_job_count >= MAX_ROOT_JOBS) {
+        LOGW("queue_root_job: too many jobs for \"%s\"\n", root);
+        return -1;
+    }
+    RootJob *job = &g_jobs[g_job_count++];
+    memset(job, 0, sizeof(*job));
+    job->info = info;
+    job->root = root;
+    job->fn = fn;
+    job->cookie = cookie;
+    return 0;
+}
+
+void
+set_root_job_progress(RootJob *job, float fraction)
+{
+    pthread_mutex_lock(&g_jobs_mutex);
+    job->progress = fraction;
+    pthread_cond_signal(&g_jobs_cond);
+    pthread_mutex_unlock(&g_jobs_mutex);
+}
+
+static int
+format_root_job(RootJob *job, const char *root, void *cookie)
+{
+    int ret = 1;
+    if (job->partition != NULL) {
+        ret = erase_mtd_root(job->info, job->partition, root, job);
+    } else if (job->info->device[0] == '/') {
+        ret = format_block_root(job->info, root);
+    }
+    if (ret > 0) {
+        LOGW("format_root_device: can't handle \"%s\"\n", root);
+        return -1;
+    }
+    return ret;
+}
+
+int
+queue_format_root(const char *root)
+{
+    return queue_root_job(root, format_root_job, NULL);
+}
+
+// Runs the chain of jobs for one device, in order.
+static void *
+root_job_thread(void *cookie)
+{
+    RootJob *job;
+    for (job = (RootJob *) cookie; job != NULL; job = job->next) {
+        job->result = job->fn(job, job->root, job->cookie);
+        set_root_job_progress(job, 1.0);
+    }
+
+    pthread_mutex_lock(&g_jobs_mutex);
+    g_jobs_running--;
+    pthread_cond_signal(&g_jobs_cond);
+    pthread_mutex_unlock(&g_jobs_mutex);
+    return NULL;
+}
+
+int
+run_root_jobs(void)
+{
+    RootJob *heads[MAX_ROOT_JOBS];
+    pthread_t threads[MAX_ROOT_JOBS];
+    int started[MAX_ROOT_JOBS];
+    int head_count = 0;
+    int failed = 0;
+    int i, j;
+
+    /* Do everything that touches global mount and partition state here,
+     * before any worker starts.
+     */
+    mtd_scan_partitions();
+    for (i = 0; i < g_job_count; ++i) {
+        RootJob *job = &g_jobs[i];
+        job->result = 0;
+        if (ensure_root_path_unmounted(job->root) < 0) {
+            LOGW("run_root_jobs: can't unmount \"%s\"\n", job->root);
+            job->result = -1;
+        } else if (job->info->device == g_mtd_device) {
+            job->partition = mtd_find_partition_by_name(
+                    job->info->partition_name);
+            if (job->partition == NULL) {
+                LOGW("run_root_jobs: can't find mtd partition \"%s\"\n",
+                        job->info->partition_name);
+                job->result = -1;
+            }
+        }
+        if (job->result != 0) {
+            job->progress = 1.0;
+            continue;
+        }
+
+        // Chain this job behind any earlier job on the same device.
+        for (j = i - 1; j >= 0; --j) {
+            if (g_jobs[j].result == 0 &&
+                same_device(g_jobs[j].info, job->info)) {
+                g_jobs[j].next = job;
+                break;
+            }
+        }
+        if (j < 0) {
+            heads[head_count++] = job;
+        }
+    }
+
+    pthread_mutex_lock(&g_jobs_mutex);
+    for (i = 0; i < head_count; ++i) {
+        started[i] = pthread_create(&threads[i], NULL,
+                root_job_thread, heads[i]) == 0;
+        if (started[i]) {
+            g_jobs_running++;
+        } else {
+            // Can't get a thread; run this device's jobs inline instead.
+            pthread_mutex_unlock(&g_jobs_mutex);
+            RootJob *job;
+            for (job = heads[i]; job != NULL; job = job->next) {
+                job->result = job->fn(job, job->root, job->cookie);
+                job->progress = 1.0;
+            }
+            pthread_mutex_lock(&g_jobs_mutex);
+        }
+    }
+
+    // Combine the progress of every job into the one progress bar.
+    while (g_jobs_running > 0) {
+        pthread_cond_wait(&g_jobs_cond, &g_jobs_mutex);
+        float progress = 0;
+        for (i = 0; i < g_job_count; ++i) {
+            progress += g_jobs[i].progress;
+        }
+        pthread_mutex_unlock(&g_jobs_mutex);
+        ui_set_progress(progress / g_job_count);
+        pthread_mutex_lock(&g_jobs_mutex);
+    }
+    pthread_mutex_unlock(&g_jobs_mutex);
+
+    for (i = 0; i < head_count; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < g_job_count; ++i) {
+        RootJob *job = &g_jobs[i];
+        if (job->result != 0) {
+            failed++;
+        } else if (job->fn == format_root_job && job->partition != NULL) {
+            save_flash_health_report(job->partition);
+        }
+    }
+    g_job_count = 0;
+    return failed;
+}
@@ -55,9 +55,52 @@ int ensure_root_path_unmounted(const char *root_path);
 
 const MtdPartition *get_root_mtd_partition(const char *root_path);
 
+/* Append the flash health record collected for the partition since the
+ * last report to CACHE:recovery/flash_health, so fleet tooling can spot
+ * failing NAND.  Call after each write or format of an MTD partition.
+ */
+int save_flash_health_report(const MtdPartition *partition);
+
 /* "root" must be the exact name of the root; no relative path is permitted.
  * If the named root is mounted, this will attempt to unmount it first.
+ * MTD roots are erased; vfat roots on a block device (SDCARD:) are
+ * formatted as FAT32.
  */
 int format_root_device(const char *root);
 
+/* Partition operation scheduler.
+ *
+ * Jobs queued here are grouped by the physical device behind their root.
+ * run_root_jobs() runs each device's jobs in queue order on a thread of
+ * its own, so jobs on independent devices (NAND vs. sdcard, say) overlap
+ * while jobs on the same device never do.  All MTD roots share the NAND,
+ * so only a batch that includes a block root (SDCARD:) runs in parallel.  The progress of all jobs is
+ * combined into the current ui_show_progress() scope.
+ *
+ * Every root with a queued job is unmounted before any job starts.  Job
+ * functions run on worker threads and must only do device I/O; anything
+ * that touches the mount table or rescans partitions has to happen before
+ * run_root_jobs() or after it returns.
+ */
+typedef struct RootJob RootJob;
+typedef int (*RootJobFunction)(RootJob *job, const char *root, void *cookie);
+
+/* Queue fn to run against "root" (exact root name, like format_root_device).
+ * Returns 0 if queued, negative if the root can't be resolved.
+ */
+int queue_root_job(const char *root, RootJobFunction fn, void *cookie);
+
+/* Queue a format_root_device() of "root".
+ */
+int queue_format_root(const char *root);
+
+/* Report progress (0.0 - 1.0) of the current job from its worker thread.
+ */
+void set_root_job_progress(RootJob *job, float fraction);
+
+/* Run and then forget all queued jobs.  Returns 0 if every job succeeded,
+ * otherwise the number of jobs that failed.
+ */
+int run_root_jobs(void);
+
 #endif  // RECOVERY_ROOTS_H_
@@ -0,0 +1,755 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "common.h"
+#include "sdcard.h"
+#include "mtdutils/mounts.h"
+
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+
+#define SECTOR_SIZE 512
+#define ALIGN_SECTORS 8192              // 4 MB, the card's allocation unit
+#define ZERO_CHUNK (256 * 1024)
+
+// Share of the progress bar for each step.
+#define MBR_PROGRESS 0.05
+#define VFAT_PROGRESS 0.55
+#define EXT_PROGRESS 0.35
+#define SWAP_PROGRESS 0.05
+
+static void put16(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int write_at(int fd, long long offset, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = pwrite64(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            LOGE("Can't write SD card at %lld (%s)\n", offset, strerror(errno));
+            return -1;
+        }
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Zeroes len bytes, moving the progress bar across its current scope.
+static int write_zeros(int fd, long long offset, long long len) {
+    static const char zeros[ZERO_CHUNK];
+    long long done = 0;
+    while (done < len) {
+        size_t n = len - done < ZERO_CHUNK ? len - done : ZERO_CHUNK;
+        if (write_at(fd, offset + done, zeros, n) < 0) return -1;
+        done += n;
+        ui_set_progress((float) done / len);
+    }
+    return 0;
+}
+
+// Tells the card it can forget a range; not every card (or file) can.
+static void discard_range(int fd, long long offset, long long len) {
+    unsigned long long range[2];
+    range[0] = offset;
+    range[1] = len;
+    if (len > 0 && ioctl(fd, BLKDISCARD, &range) < 0 && errno != ENOTTY &&
+            errno != EOPNOTSUPP) {
+        LOGW("Can't discard SD card range (%s)\n", strerror(errno));
+    }
+}
+
+static void random_bytes(unsigned char *p, int len) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, p, len) != len) {
+        int i;
+        srand(time(NULL) ^ getpid());
+        for (i = 0; i < len; ++i) p[i] = rand();
+    }
+    if (fd >= 0) close(fd);
+}
+
+/*
+ * MBR
+ */
+
+#define MBR_TYPE_FAT32_LBA 0x0c
+#define MBR_TYPE_LINUX 0x83
+#define MBR_TYPE_SWAP 0x82
+
+enum { SD_VFAT, SD_EXT, SD_SWAP, SD_NUM_PARTITIONS };
+
+typedef struct {
+    int fs;                             // one of SD_*
+    int type;
+    unsigned start;                     // in sectors
+    unsigned count;
+} SdPartition;
+
+// CHS as a 255 head, 63 sector disk would have it, saturating
+static void put_chs(unsigned char *p, unsigned lba) {
+    unsigned c = lba / (255 * 63), h = (lba / 63) % 255, s = lba % 63 + 1;
+    if (c > 1023) {
+        c = 1023;
+        h = 254;
+        s = 63;
+    }
+    p[0] = h;
+    p[1] = s | ((c >> 2) & 0xc0);
+    p[2] = c;
+}
+
+static int write_mbr(int fd, const SdPartition *parts, int count) {
+    unsigned char mbr[SECTOR_SIZE];
+    int i;
+
+    memset(mbr, 0, sizeof(mbr));
+    random_bytes(mbr + 440, 4);         // disk signature
+    for (i = 0; i < count; ++i) {
+        unsigned char *e = mbr + 446 + 16 * i;
+        put_chs(e + 1, parts[i].start);
+        e[4] = parts[i].type;
+        put_chs(e + 5, parts[i].start + parts[i].count - 1);
+        put32(e + 8, parts[i].start);
+        put32(e + 12, parts[i].count);
+    }
+    mbr[510] = 0x55;
+    mbr[511] = 0xaa;
+    return write_at(fd, 0, mbr, sizeof(mbr));
+}
+
+/*
+ * FAT32
+ *
+ * Written: the reserved sectors (boot sector, FSInfo and their backups),
+ * both FATs, and the root directory's one cluster.  The data area is
+ * left as it is, since nothing in it is reachable from an empty FAT.
+ */
+
+#define FAT32_RESERVED 32
+#define FAT32_MIN_CLUSTERS 65525
+
+static int fat32_sectors_per_cluster(long long size) {
+    long long mb = size >> 20;
+    if (mb <= 260) return 1;
+    if (mb <= 8192) return 8;
+    if (mb <= 16384) return 16;
+    if (mb <= 32768) return 32;
+    return 64;
+}
+
+typedef struct {
+    unsigned total;                     // sectors
+    unsigned spc;                       // sectors per cluster
+    unsigned fat_size;                  // sectors per FAT
+    unsigned reserved;                  // sectors before the first FAT
+    unsigned data;                      // first sector of the data area
+    unsigned clusters;
+} Fat32Layout;
+
+static int fat32_layout(Fat32Layout *l, long long size) {
+    if (size < FAT32_RESERVED * SECTOR_SIZE) {
+        LOGE("vfat partition is too small\n");
+        return -1;
+    }
+    l->total = size / SECTOR_SIZE;
+    l->spc = fat32_sectors_per_cluster(size);
+
+    // The FAT size formula from Microsoft's FAT specification.
+    unsigned per = (256 * l->spc + 2) / 2;
+    l->fat_size = (l->total - FAT32_RESERVED + per - 1) / per;
+
+    // Start the data area on an allocation unit, for the card's sake.
+    l->data = (FAT32_RESERVED + 2 * l->fat_size + ALIGN_SECTORS - 1) /
+            ALIGN_SECTORS * ALIGN_SECTORS;
+    l->reserved = l->data - 2 * l->fat_size;
+    if (l->data >= l->total) {
+        LOGE("vfat partition is too small\n");
+        return -1;
+    }
+    l->clusters = (l->total - l->data) / l->spc;
+    if (l->clusters < FAT32_MIN_CLUSTERS) {
+        LOGE("vfat partition is too small for FAT32\n");
+        return -1;
+    }
+    return 0;
+}
+
+int sdcard_format_fat32(int fd, long long offset, long long size,
+        unsigned start_sector) {
+    unsigned char boot[SECTOR_SIZE], info[SECTOR_SIZE], *fat;
+    unsigned total, spc, fat_size, reserved, data, clusters;
+    unsigned char serial[4];
+    Fat32Layout l;
+
+    if (fat32_layout(&l, size) < 0) return -1;
+    total = l.total;
+    spc = l.spc;
+    fat_size = l.fat_size;
+    reserved = l.reserved;
+    data = l.data;
+    clusters = l.clusters;
+
+    memset(boot, 0, sizeof(boot));
+    boot[0] = 0xeb;                     // jmp over the BPB
+    boot[1] = 0x58;
+    boot[2] = 0x90;
+    memcpy(boot + 3, "MSWIN4.1", 8);
+    put16(boot + 11, SECTOR_SIZE);
+    boot[13] = spc;
+    put16(boot + 14, reserved);
+    boot[16] = 2;                       // number of FATs
+    boot[21] = 0xf8;                    // media: fixed disk
+    put16(boot + 24, 63);               // sectors per track
+    put16(boot + 26, 255);              // heads
+    put32(boot + 28, start_sector);     // hidden sectors
+    put32(boot + 32, total);
+    put32(boot + 36, fat_size);
+    put32(boot + 44, 2);                // root directory cluster
+    put16(boot + 48, 1);                // FSInfo sector
+    put16(boot + 50, 6);                // backup boot sector
+    boot[64] = 0x80;                    // drive number
+    boot[66] = 0x29;                    // extended boot signature
+    random_bytes(serial, sizeof(serial));
+    memcpy(boot + 67, serial, 4);
+    memcpy(boot + 71, "NO NAME    ", 11);
+    memcpy(boot + 82, "FAT32   ", 8);
+    boot[510] = 0x55;
+    boot[511] = 0xaa;
+
+    memset(info, 0, sizeof(info));
+    put32(info, 0x41615252);
+    put32(info + 484, 0x61417272);
+    put32(info + 488, clusters - 1);    // free clusters; the root has one
+    put32(info + 492, 3);               // next free cluster
+    put32(info + 508, 0xaa550000);
+
+    // Reserved sectors and both FATs are zeroed in one go, then the few
+    // sectors that aren't zero go on top.
+    if (write_zeros(fd, offset, (long long) data * SECTOR_SIZE) < 0 ||
+        write_at(fd, offset, boot, sizeof(boot)) < 0 ||
+        write_at(fd, offset + SECTOR_SIZE, info, sizeof(info)) < 0 ||
+        write_at(fd, offset + 6 * SECTOR_SIZE, boot, sizeof(boot)) < 0 ||
+        write_at(fd, offset + 7 * SECTOR_SIZE, info, sizeof(info)) < 0) {
+        return -1;
+    }
+
+    fat = boot;                         // reuse: the first FAT sector
+    memset(fat, 0, SECTOR_SIZE);
+    put32(fat, 0x0ffffff8);
+    put32(fat + 4, 0x0fffffff);
+    put32(fat + 8, 0x0fffffff);         // the root directory's cluster
+    if (write_at(fd, offset + (long long) reserved * SECTOR_SIZE,
+                 fat, SECTOR_SIZE) < 0 ||
+        write_at(fd, offset + (long long) (reserved + fat_size) * SECTOR_SIZE,
+                 fat, SECTOR_SIZE) < 0) {
+        return -1;
+    }
+
+    // an empty root directory
+    return write_zeros(fd, offset + (long long) data * SECTOR_SIZE,
+            (long long) spc * SECTOR_SIZE);
+}
+
+/*
+ * ext2
+ *
+ * 4 KB blocks, 256 byte inodes, sparse superblocks.  With uninit_bg,
+ * the kernel zeroes inode tables itself the first time it mounts the
+ * filesystem, so only group 0's first inode table block (the reserved
+ * inodes, root and lost+found) is written here; the other groups are
+ * flagged INODE_UNINIT and the kernel sets their bitmaps up on first
+ * use.  That needs the ext4 driver, which mounts it as ext2 would be.
+ */
+
+#define EXT2_BLOCK_SIZE 4096
+#define EXT2_LOG_BLOCK_SIZE 2           // 1024 << 2
+#define EXT2_BLOCKS_PER_GROUP (EXT2_BLOCK_SIZE * 8)
+#define EXT2_INODE_SIZE 256
+#define EXT2_BYTES_PER_INODE 16384
+#define EXT2_DESC_SIZE 32
+#define EXT2_FIRST_INO 11
+#define EXT2_ROOT_INO 2
+#define EXT2_LPF_BLOCKS 4               // lost+found gets 16 KB, as mke2fs does
+
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM 0x0010
+#define EXT4_BG_INODE_UNINIT 0x0001
+
+typedef struct {
+    unsigned blocks;
+    unsigned groups;
+    unsigned inodes_per_group;
+    unsigned itable_blocks;
+    unsigned gdt_blocks;
+    unsigned char uuid[16];
+} Ext2Layout;
+
+static int is_power_of(unsigned n, unsigned base) {
+    while (n > 1 && n % base == 0) n /= base;
+    return n == 1;
+}
+
+static int ext2_has_super(unsigned group) {
+    return group <= 1 || is_power_of(group, 3) || is_power_of(group, 5) ||
+            is_power_of(group, 7);
+}
+
+static unsigned ext2_group_start(unsigned group) {
+    return group * EXT2_BLOCKS_PER_GROUP;
+}
+
+static unsigned ext2_group_blocks(const Ext2Layout *l, unsigned group) {
+    unsigned left = l->blocks - ext2_group_start(group);
+    return left < EXT2_BLOCKS_PER_GROUP ? left : EXT2_BLOCKS_PER_GROUP;
+}
+
+// the group's block bitmap; the inode bitmap and table follow it
+static unsigned ext2_group_meta(const Ext2Layout *l, unsigned group) {
+    return ext2_group_start(group) +
+            (ext2_has_super(group) ? 1 + l->gdt_blocks : 0);
+}
+
+static unsigned ext2_group_overhead(const Ext2Layout *l, unsigned group) {
+    return ext2_group_meta(l, group) - ext2_group_start(group) + 2 +
+            l->itable_blocks;
+}
+
+// CRC16 (polynomial 0x8005, reflected), as the group descriptors use.
+static unsigned crc16(unsigned crc, const unsigned char *p, int len) {
+    int i;
+    while (len-- > 0) {
+        crc ^= *p++;
+        for (i = 0; i < 8; ++i) crc = (crc >> 1) ^ (crc & 1 ? 0xa001 : 0);
+    }
+    return crc;
+}
+
+static int ext2_layout(Ext2Layout *l, long long size) {
+    unsigned ipg;
+
+    memset(l, 0, sizeof(*l));
+    if (size / EXT2_BLOCK_SIZE > 0xffffffffLL) {
+        LOGE("ext2 partition is too big\n");
+        return -1;
+    }
+    l->blocks = size / EXT2_BLOCK_SIZE;
+    for (;;) {
+        l->groups = (l->blocks + EXT2_BLOCKS_PER_GROUP - 1) /
+                EXT2_BLOCKS_PER_GROUP;
+        if (l->groups == 0) break;
+
+        // inodes fill whole inode table blocks, a multiple of 8 per group
+        ipg = (long long) l->blocks * EXT2_BLOCK_SIZE / EXT2_BYTES_PER_INODE /
+                l->groups;
+        ipg = (ipg + 15) / 16 * 16;
+        if (ipg < 16) ipg = 16;
+        if (ipg > EXT2_BLOCKS_PER_GROUP) ipg = EXT2_BLOCKS_PER_GROUP;
+        l->inodes_per_group = ipg;
+        l->itable_blocks = ipg * EXT2_INODE_SIZE / EXT2_BLOCK_SIZE;
+        l->gdt_blocks = (l->groups * EXT2_DESC_SIZE + EXT2_BLOCK_SIZE - 1) /
+                EXT2_BLOCK_SIZE;
+
+        // A last group too small to hold its own metadata and a little
+        // data is dropped, as mke2fs does.
+        unsigned last = l->groups - 1;
+        if (ext2_group_blocks(l, last) >= ext2_group_overhead(l, last) + 50)
+            break;
+        l->blocks = ext2_group_start(last);
+    }
+    if (l->groups == 0 || ext2_group_blocks(l, 0) <
+            ext2_group_overhead(l, 0) + 1 + EXT2_LPF_BLOCKS) {
+        LOGE("ext2 partition is too small\n");
+        return -1;
+    }
+    random_bytes(l->uuid, sizeof(l->uuid));
+    return 0;
+}
+
+static void set_bits(unsigned char *map, unsigned first, unsigned count) {
+    while (count-- > 0) {
+        map[first >> 3] |= 1 << (first & 7);
+        ++first;
+    }
+}
+
+static void ext2_inode(unsigned char *p, unsigned mode, unsigned links,
+        unsigned first_block, unsigned nblocks, unsigned now) {
+    unsigned i;
+    memset(p, 0, EXT2_INODE_SIZE);
+    put16(p, mode);
+    put32(p + 4, nblocks * EXT2_BLOCK_SIZE);
+    put32(p + 8, now);
+    put32(p + 12, now);
+    put32(p + 16, now);
+    put16(p + 26, links);
+    put32(p + 28, nblocks * (EXT2_BLOCK_SIZE / 512));
+    for (i = 0; i < nblocks; ++i) put32(p + 40 + 4 * i, first_block + i);
+}
+
+// Appends a directory entry; the last one in a block spans to its end.
+static unsigned char *ext2_dirent(unsigned char *p, unsigned ino,
+        const char *name, unsigned char *block_end) {
+    unsigned len = strlen(name);
+    unsigned rec = (8 + len + 3) & ~3;
+    if (block_end != NULL) rec = block_end - p;
+    put32(p, ino);
+    put16(p + 4, rec);
+    p[6] = len;
+    p[7] = 2;                           // a directory
+    memcpy(p + 8, name, len);
+    return p + rec;
+}
+
+int sdcard_format_ext2(int fd, long long offset, long long size) {
+    Ext2Layout l;
+    unsigned char sb[1024], *gdt = NULL, *block = NULL;
+    unsigned g, now = time(NULL);
+    unsigned free_blocks = 0, free_inodes = 0;
+    unsigned root_block, lpf_block;
+    int ret = -1;
+
+    if (ext2_layout(&l, size) < 0) return -1;
+    gdt = calloc(l.gdt_blocks, EXT2_BLOCK_SIZE);
+    block = malloc(EXT2_BLOCK_SIZE);
+    if (gdt == NULL || block == NULL) goto exit;
+
+    // group 0's first data blocks hold the two directories
+    root_block = ext2_group_meta(&l, 0) + 2 + l.itable_blocks;
+    lpf_block = root_block + 1;
+
+    for (g = 0; g < l.groups; ++g) {
+        unsigned char *d = gdt + g * EXT2_DESC_SIZE;
+        unsigned meta = ext2_group_meta(&l, g);
+        unsigned nblocks = ext2_group_blocks(&l, g);
+        unsigned used = ext2_group_overhead(&l, g);
+        unsigned used_inodes = g == 0 ? EXT2_FIRST_INO : 0;
+        unsigned char le_group[4];
+
+        if (g == 0) used += 1 + EXT2_LPF_BLOCKS;
+        free_blocks += nblocks - used;
+        free_inodes += l.inodes_per_group - used_inodes;
+
+        put32(d, meta);
+        put32(d + 4, meta + 1);
+        put32(d + 8, meta + 2);
+        put16(d + 12, nblocks - used);
+        put16(d + 14, l.inodes_per_group - used_inodes);
+        put16(d + 16, g == 0 ? 2 : 0);  // directories
+        put16(d + 18, g == 0 ? 0 : EXT4_BG_INODE_UNINIT);
+        put16(d + 28, l.inodes_per_group - used_inodes);  // itable_unused
+        put32(le_group, g);
+        put16(d + 30, crc16(crc16(crc16(0xffff, l.uuid, 16), le_group, 4),
+                d, 30));
+
+        // The block bitmap, with the blocks past a short last group
+        // marked in use.
+        memset(block, 0, EXT2_BLOCK_SIZE);
+        set_bits(block, 0, used);
+        set_bits(block, nblocks, EXT2_BLOCKS_PER_GROUP - nblocks);
+        if (write_at(fd, offset + (long long) meta * EXT2_BLOCK_SIZE,
+                     block, EXT2_BLOCK_SIZE) < 0) {
+            goto exit;
+        }
+
+        // The inode bitmap, with the bits past the group's inodes in use.
+        memset(block, 0, EXT2_BLOCK_SIZE);
+        set_bits(block, 0, used_inodes);
+        set_bits(block, l.inodes_per_group,
+                EXT2_BLOCKS_PER_GROUP - l.inodes_per_group);
+        if (write_at(fd, offset + (long long) (meta + 1) * EXT2_BLOCK_SIZE,
+                     block, EXT2_BLOCK_SIZE) < 0) {
+            goto exit;
+        }
+        ui_set_progress((float) (g + 1) / (l.groups + 1));
+    }
+
+    memset(sb, 0, sizeof(sb));
+    put32(sb + 0x00, l.groups * l.inodes_per_group);
+    put32(sb + 0x04, l.blocks);
+    put32(sb + 0x08, l.blocks / 20);    // 5% reserved for root
+    put32(sb + 0x0c, free_blocks);
+    put32(sb + 0x10, free_inodes);
+    put32(sb + 0x14, 0);                // first data block
+    put32(sb + 0x18, EXT2_LOG_BLOCK_SIZE);
+    put32(sb + 0x1c, EXT2_LOG_BLOCK_SIZE);
+    put32(sb + 0x20, EXT2_BLOCKS_PER_GROUP);
+    put32(sb + 0x24, EXT2_BLOCKS_PER_GROUP);
+    put32(sb + 0x28, l.inodes_per_group);
+    put32(sb + 0x30, now);              // last write
+    put16(sb + 0x36, 0xffff);           // no mount count checks
+    put16(sb + 0x38, 0xef53);
+    put16(sb + 0x3a, 1);                // clean
+    put16(sb + 0x3c, 1);                // continue on errors
+    put32(sb + 0x40, now);              // last check
+    put32(sb + 0x4c, 1);                // dynamic revision
+    put32(sb + 0x54, EXT2_FIRST_INO);
+    put16(sb + 0x58, EXT2_INODE_SIZE);
+    put32(sb + 0x60, EXT2_FEATURE_INCOMPAT_FILETYPE);
+    put32(sb + 0x64, EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER |
+            EXT2_FEATURE_RO_COMPAT_LARGE_FILE |
+            EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
+    memcpy(sb + 0x68, l.uuid, 16);
+    put32(sb + 0x108, now);             // created
+
+    // Superblock and descriptor copies, in group 0 and the sparse backups.
+    for (g = 0; g < l.groups; ++g) {
+        long long start;
+        if (!ext2_has_super(g)) continue;
+        start = offset + (long long) ext2_group_start(g) * EXT2_BLOCK_SIZE;
+        put16(sb + 0x5a, g);
+        memset(block, 0, EXT2_BLOCK_SIZE);
+        memcpy(block + (g == 0 ? 1024 : 0), sb, sizeof(sb));
+        if (write_at(fd, start, block, EXT2_BLOCK_SIZE) < 0 ||
+            write_at(fd, start + EXT2_BLOCK_SIZE, gdt,
+                     (size_t) l.gdt_blocks * EXT2_BLOCK_SIZE) < 0) {
+            goto exit;
+        }
+    }
+
+    // Group 0's first inode table block: the reserved inodes are zero but
+    // for the root directory and lost+found.
+    memset(block, 0, EXT2_BLOCK_SIZE);
+    ext2_inode(block + (EXT2_ROOT_INO - 1) * EXT2_INODE_SIZE, 040755, 3,
+            root_block, 1, now);
+    ext2_inode(block + (EXT2_FIRST_INO - 1) * EXT2_INODE_SIZE, 040700, 2,
+            lpf_block, EXT2_LPF_BLOCKS, now);
+    if (write_at(fd, offset + (long long) (ext2_group_meta(&l, 0) + 2) *
+                 EXT2_BLOCK_SIZE, block, EXT2_BLOCK_SIZE) < 0) {
+        goto exit;
+    }
+
+    memset(block, 0, EXT2_BLOCK_SIZE);
+    ext2_dirent(ext2_dirent(ext2_dirent(block, EXT2_ROOT_INO, ".", NULL),
+            EXT2_ROOT_INO, "..", NULL), EXT2_FIRST_INO, "lost+found",
+            block + EXT2_BLOCK_SIZE);
+    if (write_at(fd, offset + (long long) root_block * EXT2_BLOCK_SIZE,
+                 block, EXT2_BLOCK_SIZE) < 0) {
+        goto exit;
+    }
+
+    // lost+found is made big up front so fsck needn't grow it
+    memset(block, 0, EXT2_BLOCK_SIZE);
+    ext2_dirent(ext2_dirent(block, EXT2_FIRST_INO, ".", NULL),
+            EXT2_ROOT_INO, "..", block + EXT2_BLOCK_SIZE);
+    if (write_at(fd, offset + (long long) lpf_block * EXT2_BLOCK_SIZE,
+                 block, EXT2_BLOCK_SIZE) < 0) {
+        goto exit;
+    }
+    memset(block, 0, EXT2_BLOCK_SIZE);
+    put16(block + 4, EXT2_BLOCK_SIZE);  // one empty entry per block
+    for (g = 1; g < EXT2_LPF_BLOCKS; ++g) {
+        if (write_at(fd, offset + (long long) (lpf_block + g) *
+                     EXT2_BLOCK_SIZE, block, EXT2_BLOCK_SIZE) < 0) {
+            goto exit;
+        }
+    }
+    ui_set_progress(1.0);
+    ret = 0;
+
+exit:
+    free(gdt);
+    free(block);
+    return ret;
+}
+
+/*
+ * swap
+ */
+
+#define SWAP_PAGE_SIZE 4096
+#define SWAP_MIN_PAGES 10
+
+static int swap_layout(unsigned *pages, long long size) {
+    if (size / SWAP_PAGE_SIZE < SWAP_MIN_PAGES) {
+        LOGE("swap partition is too small\n");
+        return -1;
+    }
+    *pages = size / SWAP_PAGE_SIZE;
+    return 0;
+}
+
+int sdcard_format_swap(int fd, long long offset, long long size) {
+    unsigned char page[SWAP_PAGE_SIZE];
+    unsigned pages;
+
+    if (swap_layout(&pages, size) < 0) return -1;
+    memset(page, 0, sizeof(page));
+    put32(page + 1024, 1);              // version
+    put32(page + 1028, pages - 1);      // last page
+    random_bytes(page + 1036, 16);      // uuid
+    memcpy(page + SWAP_PAGE_SIZE - 10, "SWAPSPACE2", 10);
+    return write_at(fd, offset, page, sizeof(page));
+}
+
+/*
+ * The card
+ */
+
+// Unmounts anything on the card or its partitions before they move.
+// SDCARD: is mounted from the whole card when it has no partition 1.
+static int unmount_partitions(const char *device) {
+    char path[64];
+    int i;
+
+    if (scan_mounted_volumes() < 0) return -1;
+    for (i = 0; i <= 4; ++i) {
+        if (i == 0) snprintf(path, sizeof(path), "%s", device);
+        else snprintf(path, sizeof(path), "%sp%d", device, i);
+        const MountedVolume *vol = find_mounted_volume_by_device(path);
+        if (vol != NULL && unmount_mounted_volume(vol) < 0) {
+            LOGE("Can't unmount %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int sdcard_partition(const char *device, int vfat_mb, int ext_mb, int swap_mb) {
+    static const int types[SD_NUM_PARTITIONS] = {
+        MBR_TYPE_FAT32_LBA, MBR_TYPE_LINUX, MBR_TYPE_SWAP
+    };
+    int sizes[SD_NUM_PARTITIONS];
+    SdPartition parts[SD_NUM_PARTITIONS];
+    unsigned long long bytes;
+    unsigned sectors, next = ALIGN_SECTORS;
+    struct stat st;
+    int count = 0, fd, i, ret = -1;
+
+    sizes[SD_VFAT] = vfat_mb;
+    sizes[SD_EXT] = ext_mb;
+    sizes[SD_SWAP] = swap_mb;
+
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) goto exit;
+    if (S_ISBLK(st.st_mode)) {
+        if (unmount_partitions(device) < 0) goto exit;
+        if (ioctl(fd, BLKGETSIZE64, &bytes) < 0) goto exit;
+    } else {
+        bytes = st.st_size;
+    }
+    if (bytes / SECTOR_SIZE > 0xffffffffULL) {
+        LOGE("%s is too big for an MBR\n", device);
+        goto exit;
+    }
+    sectors = bytes / SECTOR_SIZE;
+
+    for (i = 0; i < SD_NUM_PARTITIONS; ++i) {
+        unsigned want;
+        if (sizes[i] <= 0) continue;
+        want = (unsigned) sizes[i] * (1024 * 1024 / SECTOR_SIZE);
+        if (next >= sectors) {
+            LOGE("No room for partition %d on %s\n", count + 1, device);
+            goto exit;
+        }
+        parts[count].fs = i;
+        parts[count].type = types[i];
+        parts[count].start = next;
+        parts[count].count = want < sectors - next ? want : sectors - next;
+        next = (next + parts[count].count + ALIGN_SECTORS - 1) /
+                ALIGN_SECTORS * ALIGN_SECTORS;
+        ++count;
+    }
+
+    // Nothing is touched until every partition is known to be formattable.
+    for (i = 0; i < count; ++i) {
+        long long size = (long long) parts[i].count * SECTOR_SIZE;
+        Fat32Layout fat;
+        Ext2Layout ext;
+        unsigned pages;
+        int r;
+
+        switch (parts[i].fs) {
+        case SD_VFAT: r = fat32_layout(&fat, size); break;
+        case SD_EXT: r = ext2_layout(&ext, size); break;
+        default: r = swap_layout(&pages, size); break;
+        }
+        if (r < 0) goto exit;
+    }
+
+    ui_show_progress(MBR_PROGRESS, 0);
+    for (i = 0; i < count; ++i) {
+        discard_range(fd, (long long) parts[i].start * SECTOR_SIZE,
+                (long long) parts[i].count * SECTOR_SIZE);
+    }
+    if (write_mbr(fd, parts, count) < 0) goto exit;
+    ui_set_progress(1.0);
+
+    for (i = 0; i < count; ++i) {
+        long long offset = (long long) parts[i].start * SECTOR_SIZE;
+        long long size = (long long) parts[i].count * SECTOR_SIZE;
+        int r;
+
+        switch (parts[i].fs) {
+        case SD_VFAT:
+            ui_show_progress(VFAT_PROGRESS, 0);
+            r = sdcard_format_fat32(fd, offset, size, parts[i].start);
+            break;
+        case SD_EXT:
+            ui_show_progress(EXT_PROGRESS, 0);
+            r = sdcard_format_ext2(fd, offset, size);
+            break;
+        default:
+            ui_show_progress(SWAP_PROGRESS, 0);
+            r = sdcard_format_swap(fd, offset, size);
+            break;
+        }
+        if (r < 0) goto exit;
+    }
+
+    if (fsync(fd) < 0) {
+        LOGE("Can't sync %s (%s)\n", device, strerror(errno));
+        goto exit;
+    }
+    // let the kernel see the new partitions
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKRRPART) < 0) {
+        LOGW("Can't reread %s partitions (%s)\n", device, strerror(errno));
+    }
+    ret = 0;
+
+exit:
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_SDCARD_H_
+#define RECOVERY_SDCARD_H_
+
+#define SDCARD_DEVICE "/dev/block/mmcblk0"
+
+/* Repartitions device (a whole card, or a plain file standing in for
+ * one) as vfat, ext2 and swap partitions of the given sizes in MB, in
+ * that order, and formats them.  A size of 0 leaves that partition out.
+ * Partitions start on 4 MB boundaries.  Only the metadata each
+ * filesystem needs is written; the rest of each range is discarded if
+ * the device supports it.  Progress goes to the UI progress bar.
+ * Returns 0 on success.
+ */
+int sdcard_partition(const char *device, int vfat_mb, int ext_mb, int swap_mb);
+
+/* Each formats size bytes of fd starting at offset.  start_sector is
+ * where the range sits on the card, for the FAT's hidden sector count.
+ */
+int sdcard_format_fat32(int fd, long long offset, long long size,
+        unsigned start_sector);
+int sdcard_format_ext2(int fd, long long offset, long long size);
+int sdcard_format_swap(int fd, long long offset, long long size);
+
+#endif  // RECOVERY_SDCARD_H_
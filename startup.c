@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "startup.h"
+#include "threadpool/threadpool.h"
+
+#define TIMELINE_WIDTH 40
+
+typedef struct Run Run;
+
+typedef struct {
+    Run *run;
+    int index;
+} StepTask;
+
+struct Run {
+    const StartupStep *steps;
+    int count;
+    void *cookie;
+    double start;
+    double began[MAX_STARTUP_STEPS], ended[MAX_STARTUP_STEPS];
+    unsigned done, submitted;       // bit i for steps[i]
+    pthread_mutex_t lock;
+    TaskGroup *group;
+    StepTask tasks[MAX_STARTUP_STEPS];
+};
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Puts the steps in an order that respects their dependencies.
+ * Returns -1 if there is none.
+ */
+static int
+order_steps(const StartupStep *steps, int count, int *order)
+{
+    unsigned all = (count == 32) ? ~0u : (1u << count) - 1;
+    unsigned placed = 0;
+    int n = 0, i;
+
+    for (i = 0; i < count; ++i) {
+        if (steps[i].deps & ~all) return -1;
+    }
+    while (n < count) {
+        int progress = 0;
+        for (i = 0; i < count; ++i) {
+            if (!(placed & (1u << i)) && (steps[i].deps & ~placed) == 0) {
+                order[n++] = i;
+                placed |= 1u << i;
+                progress = 1;
+            }
+        }
+        if (!progress) return -1;
+    }
+    return 0;
+}
+
+static void run_step(void *cookie);
+
+// Queues every step whose dependencies are done.
+static void
+submit_ready(Run *run)
+{
+    int ready[MAX_STARTUP_STEPS];
+    int n = 0, i;
+
+    pthread_mutex_lock(&run->lock);
+    for (i = 0; i < run->count; ++i) {
+        unsigned bit = 1u << i;
+        if (!(run->submitted & bit) && (run->steps[i].deps & ~run->done) == 0) {
+            run->submitted |= bit;
+            ready[n++] = i;
+        }
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    for (i = 0; i < n; ++i) {
+        task_group_submit(run->group, run_step, &run->tasks[ready[i]]);
+    }
+}
+
+static void
+run_step(void *cookie)
+{
+    StepTask *task = (StepTask *) cookie;
+    Run *run = task->run;
+    int i = task->index;
+
+    double began = now_ms();
+    run->steps[i].fn(run->cookie);
+    double ended = now_ms();
+
+    pthread_mutex_lock(&run->lock);
+    run->began[i] = began - run->start;
+    run->ended[i] = ended - run->start;
+    run->done |= 1u << i;
+    pthread_mutex_unlock(&run->lock);
+    submit_ready(run);
+}
+
+static void
+log_timeline(const Run *run)
+{
+    double total = 0, serial = 0;
+    int i, j;
+
+    for (i = 0; i < run->count; ++i) {
+        if (run->ended[i] > total) total = run->ended[i];
+        serial += run->ended[i] - run->began[i];
+    }
+    LOGI("Startup took %.1f ms (%.1f ms one step at a time)\n",
+         total, serial);
+    for (i = 0; i < run->count; ++i) {
+        char bar[TIMELINE_WIDTH + 1];
+        int from = 0, to = 0;
+        if (total > 0) {
+            from = (int) (run->began[i] * TIMELINE_WIDTH / total);
+            to = (int) (run->ended[i] * TIMELINE_WIDTH / total + 0.5);
+        }
+        if (to <= from) to = from + 1;
+        if (to > TIMELINE_WIDTH) to = TIMELINE_WIDTH;
+        for (j = 0; j < TIMELINE_WIDTH; ++j) {
+            bar[j] = (j >= from && j < to) ? '#' : ' ';
+        }
+        bar[TIMELINE_WIDTH] = '\0';
+        LOGI("  %-10s %7.1f - %7.1f ms |%s|\n", run->steps[i].name,
+             run->began[i], run->ended[i], bar);
+    }
+}
+
+int
+run_startup(const StartupStep *steps, int count, void *cookie, int threads)
+{
+    int order[MAX_STARTUP_STEPS];
+    ThreadPool *pool = NULL;
+    Run run;
+    int i;
+
+    if (count > MAX_STARTUP_STEPS || order_steps(steps, count, order) < 0) {
+        LOGW("run_startup: can't order the %d steps\n", count);
+        return -1;
+    }
+
+    memset(&run, 0, sizeof(run));
+    run.steps = steps;
+    run.count = count;
+    run.cookie = cookie;
+    pthread_mutex_init(&run.lock, NULL);
+    for (i = 0; i < count; ++i) {
+        run.tasks[i].run = &run;
+        run.tasks[i].index = i;
+    }
+
+    // The calling thread runs steps too while it waits.
+    if (threads > 1) pool = threadpool_create(threads - 1, MAX_STARTUP_STEPS);
+    if (pool != NULL) run.group = task_group_create(pool);
+
+    run.start = now_ms();
+    if (run.group != NULL) {
+        submit_ready(&run);
+        task_group_destroy(run.group);
+    } else {
+        for (i = 0; i < count; ++i) {
+            run.began[order[i]] = now_ms() - run.start;
+            steps[order[i]].fn(cookie);
+            run.ended[order[i]] = now_ms() - run.start;
+        }
+    }
+    if (pool != NULL) threadpool_destroy(pool);
+    pthread_mutex_destroy(&run.lock);
+
+    log_timeline(&run);
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_STARTUP_H_
+#define RECOVERY_STARTUP_H_
+
+#define MAX_STARTUP_STEPS 16
+
+/* One step of getting recovery going.  "deps" has bit i set if the step
+ * must wait for steps[i] to finish.
+ */
+typedef struct {
+    const char *name;
+    void (*fn)(void *cookie);
+    unsigned deps;
+} StartupStep;
+
+/* Runs each step as soon as the steps it depends on are done, on up to
+ * "threads" threads at once, then logs a timeline of when each ran.
+ * With "threads" of 1 or less the steps run one after another, in
+ * dependency order, on the calling thread.  Every step gets "cookie".
+ * Returns 0, or -1 if there are too many steps or their dependencies
+ * form a cycle, in which case none are run.
+ */
+int run_startup(const StartupStep *steps, int count, void *cookie,
+        int threads);
+
+#endif  // RECOVERY_STARTUP_H_
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs recovery's startup graph with simulated steps, one step at a time
+ * and then in parallel, and reports how long each took to get to the
+ * first frame and to being ready to install:
+ *
+ *   startup_bench [-m MOUNT_MS] [-u UI_MS] [-r ROUNDS]
+ *
+ * Mounts sleep for MOUNT_MS, as a slow card or a flash scan would; the
+ * UI burns UI_MS of CPU, as decoding the fonts and images does.  The
+ * steps and their dependencies are the ones main() in recovery.c uses.
+ * Timelines go to stderr.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "startup.h"
+
+static int mount_ms = 200, ui_ms = 150;
+static double run_start, first_frame;
+
+void ui_print(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Uses "ms" of this thread's CPU time, however long that takes.
+static void work(int ms)
+{
+    struct timespec ts;
+    double start, t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    start = ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+    do {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        t = ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+    } while (t - start < ms);
+}
+
+static void slow_mount(void)
+{
+    usleep(mount_ms * 1000);
+}
+
+static void sim_ui(void *cookie)
+{
+    work(ui_ms);
+    first_frame = now_ms() - run_start;
+}
+
+// MISC for the BCB, then CACHE for the command file.
+static void sim_args(void *cookie)
+{
+    slow_mount();
+    slow_mount();
+    work(2);
+}
+
+static void sim_commands(void *cookie)
+{
+    work(2);
+}
+
+static void sim_keys(void *cookie)
+{
+    work(5);
+}
+
+// Mount the card, then read the package's central directory.
+static void sim_package(void *cookie)
+{
+    slow_mount();
+    work(20);
+}
+
+enum { STEP_UI, STEP_ARGS, STEP_COMMANDS, STEP_KEYS, STEP_PACKAGE };
+
+static const StartupStep STEPS[] = {
+    { "ui",         sim_ui,         0 },
+    { "args",       sim_args,       0 },
+    { "commands",   sim_commands,   0 },
+    { "keys",       sim_keys,       0 },
+    { "package",    sim_package,    1 << STEP_ARGS },
+};
+#define NUM_STEPS (int) (sizeof(STEPS) / sizeof(STEPS[0]))
+
+static void bench(const char *name, int threads, int rounds)
+{
+    double frame = 0, ready = 0;
+    int i;
+
+    for (i = 0; i < rounds; ++i) {
+        run_start = now_ms();
+        run_startup(STEPS, NUM_STEPS, NULL, threads);
+        ready += now_ms() - run_start;
+        frame += first_frame;
+    }
+    printf("%-10s first frame %7.1f ms  ready to install %7.1f ms\n",
+           name, frame / rounds, ready / rounds);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-m MOUNT_MS] [-u UI_MS] [-r ROUNDS]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 3;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:u:r:")) != -1) {
+        switch (c) {
+            case 'm': mount_ms = atoi(optarg); break;
+            case 'u': ui_ms = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (mount_ms < 0 || ui_ms < 0 || rounds < 1) usage(argv[0]);
+
+    printf("%d ms per mount, %d ms of UI work, %d rounds\n",
+           mount_ms, ui_ms, rounds);
+    bench("serial", 1, rounds);
+    bench("parallel", NUM_STEPS, rounds);
+    return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host test for sdcard_partition().  A sparse file stands in for the card,
+ * as a loop device would; the UI is stubbed out below.
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "sdcard.h"
+#include "common.h"
+
+#define TEST_IMAGE "/tmp/test_sdcard.img"
+#define TEST_IMAGE_MB 1024
+
+static unsigned
+le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned) p[3] << 24);
+}
+
+static unsigned
+le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static int
+read_at(int fd, long long offset, void *data, size_t len)
+{
+    return pread64(fd, data, len, offset) == (ssize_t) len ? 0 : -1;
+}
+
+static int
+check_image(int fd)
+{
+    unsigned char buf[4096];
+    unsigned start[3], count[3];
+    int i;
+
+    /* The MBR: vfat, ext2 and swap, each on a 4 MB boundary.
+     */
+    if (read_at(fd, 0, buf, 512) < 0) return -__LINE__;
+    if (buf[510] != 0x55 || buf[511] != 0xaa) return -__LINE__;
+    for (i = 0; i < 3; ++i) {
+        start[i] = le32(buf + 446 + 16 * i + 8);
+        count[i] = le32(buf + 446 + 16 * i + 12);
+        if (start[i] % 8192 != 0) return -__LINE__;
+    }
+    if (buf[446 + 4] != 0x0c || buf[462 + 4] != 0x83 ||
+        buf[478 + 4] != 0x82 || buf[494 + 4] != 0) return -__LINE__;
+    if (count[0] != 512 * 2048 || count[1] != 256 * 2048) return -__LINE__;
+    if (start[1] < start[0] + count[0] || start[2] < start[1] + count[1])
+        return -__LINE__;
+
+    /* FAT32: boot sector, its backup, and the first FAT entries.
+     */
+    long long fat = (long long) start[0] * 512;
+    unsigned char backup[512];
+    if (read_at(fd, fat, buf, 512) < 0) return -__LINE__;
+    if (read_at(fd, fat + 6 * 512, backup, 512) < 0) return -__LINE__;
+    if (memcmp(buf, backup, 512) != 0) return -__LINE__;
+    if (memcmp(buf + 82, "FAT32   ", 8) != 0) return -__LINE__;
+    if (le32(buf + 28) != start[0] || le32(buf + 32) != count[0])
+        return -__LINE__;
+    unsigned reserved = le16(buf + 14), fat_size = le32(buf + 36);
+    if ((reserved + 2 * fat_size) % 8192 != 0) return -__LINE__;
+    if (read_at(fd, fat + (long long) reserved * 512, buf, 12) < 0)
+        return -__LINE__;
+    if (le32(buf) != 0x0ffffff8 || le32(buf + 8) != 0x0fffffff)
+        return -__LINE__;
+
+    /* ext2: the superblock, and its first backup in group 1.
+     */
+    long long ext = (long long) start[1] * 512;
+    if (read_at(fd, ext + 1024, buf, 1024) < 0) return -__LINE__;
+    if (le16(buf + 0x38) != 0xef53) return -__LINE__;
+    if (le32(buf + 0x04) * 4096LL > (long long) count[1] * 512)
+        return -__LINE__;
+    if (read_at(fd, ext + 32768 * 4096LL, buf + 1024, 1024) < 0)
+        return -__LINE__;
+    if (le16(buf + 1024 + 0x38) != 0xef53 || le16(buf + 1024 + 0x5a) != 1)
+        return -__LINE__;
+
+    /* swap
+     */
+    long long swap = (long long) start[2] * 512;
+    if (read_at(fd, swap, buf, 4096) < 0) return -__LINE__;
+    if (memcmp(buf + 4086, "SWAPSPACE2", 10) != 0) return -__LINE__;
+    if (le32(buf + 1028) != count[2] / 8 - 1) return -__LINE__;
+
+    return 0;
+}
+
+/* Calls sdcard_partition(), which should fail, and checks that the MBR
+ * and the vfat boot sector of the image are as they were.
+ */
+static int
+check_unchanged_on_failure(int vfat_mb, int ext_mb, int swap_mb)
+{
+    unsigned char before[1024], after[1024];
+    int fd;
+
+    fd = open(TEST_IMAGE, O_RDONLY);
+    if (fd < 0) return -__LINE__;
+    if (read_at(fd, 0, before, 512) < 0 ||
+        read_at(fd, (long long) le32(before + 446 + 8) * 512,
+                before + 512, 512) < 0) {
+        close(fd);
+        return -__LINE__;
+    }
+    close(fd);
+
+    if (sdcard_partition(TEST_IMAGE, vfat_mb, ext_mb, swap_mb) == 0)
+        return -__LINE__;
+
+    fd = open(TEST_IMAGE, O_RDONLY);
+    if (fd < 0) return -__LINE__;
+    if (read_at(fd, 0, after, 512) < 0 ||
+        read_at(fd, (long long) le32(before + 446 + 8) * 512,
+                after + 512, 512) < 0 ||
+        memcmp(before, after, sizeof(before)) != 0 ||
+        check_image(fd) != 0) {
+        close(fd);
+        return -__LINE__;
+    }
+    close(fd);
+    return 0;
+}
+
+int
+test_sdcard()
+{
+    int fd, ret;
+
+    unlink(TEST_IMAGE);
+    fd = open(TEST_IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -__LINE__;
+    if (ftruncate64(fd, TEST_IMAGE_MB * 1024LL * 1024) < 0) {
+        close(fd);
+        unlink(TEST_IMAGE);
+        return -__LINE__;
+    }
+    close(fd);
+
+    /* The swap partition asks for more than is left, and is cut short.
+     */
+    ret = sdcard_partition(TEST_IMAGE, 512, 256, 1024);
+    if (ret == 0) {
+        fd = open(TEST_IMAGE, O_RDONLY);
+        ret = fd < 0 ? -__LINE__ : check_image(fd);
+        if (fd >= 0) close(fd);
+    } else {
+        ret = -__LINE__;
+    }
+
+    /* Too little room for FAT32 fails before anything is written: the
+     * partition table and filesystems from above are still there.
+     */
+    if (ret == 0) ret = check_unchanged_on_failure(16, 0, 0);
+
+    unlink(TEST_IMAGE);
+    return ret;
+}
+
+void
+ui_print(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void
+ui_show_progress(float portion, int seconds)
+{
+}
+
+void
+ui_set_progress(float fraction)
+{
+}
+
+int
+main(int argc, char **argv)
+{
+    int ret = test_sdcard();
+    if (ret != 0) {
+        fprintf(stderr, "test_sdcard() failed: %d\n", ret);
+        return 1;
+    }
+    printf("sdcard: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,40 @@
+# Copyright 2009 The Android Open Source Project
+
+LOCAL_PATH := $(call my-dir)
+
+#
+# Build the device-side library, shared by recovery and the updater
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := threadpool.c
+
+LOCAL_CFLAGS := -Wall
+LOCAL_MODULE := libthreadpool
+
+include $(BUILD_STATIC_LIBRARY)
+
+#
+# Build the host-side stress tests and task overhead benchmark
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := threadpool.c test_threadpool.c
+
+LOCAL_CFLAGS := -Wall -g -O0
+LOCAL_LDLIBS := -lpthread
+LOCAL_MODULE := threadpool_test
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := threadpool.c threadpool_bench.c
+
+LOCAL_CFLAGS := -Wall -O2
+LOCAL_LDLIBS := -lpthread -lrt
+LOCAL_MODULE := threadpool_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+/* Pool sizes to run each test with: one worker, a few, and more workers
+ * than CPUs.
+ */
+static const int kSizes[] = { 1, 3, 16 };
+#define NUM_SIZES (int) (sizeof(kSizes) / sizeof(kSizes[0]))
+
+static void
+add_one(void *cookie)
+{
+    __sync_fetch_and_add((volatile int *) cookie, 1);
+}
+
+static int
+test_many_tasks(ThreadPool *pool)
+{
+    volatile int count = 0;
+    int i, round;
+
+    for (round = 0; round < 10; ++round) {
+        TaskGroup *group = task_group_create(pool);
+        assert(group != NULL);
+        for (i = 0; i < 10000; ++i) {
+            assert(task_group_submit(group, add_one, (void *) &count) == 0);
+        }
+        assert(task_group_wait(group) == 0);
+        assert(count == (round + 1) * 10000);
+        task_group_destroy(group);
+    }
+    return 0;
+}
+
+/* Sums 0..n-1 by splitting the range in two until it is small, with
+ * each half a task of its own, as parallel hashing of a big file would.
+ */
+typedef struct {
+    ThreadPool *pool;
+    long long lo, hi;
+    long long sum;
+} Range;
+
+static void
+sum_range(void *cookie)
+{
+    Range *r = (Range *) cookie;
+    if (r->hi - r->lo <= 64) {
+        long long i;
+        for (i = r->lo; i < r->hi; ++i) r->sum += i;
+        return;
+    }
+    long long mid = r->lo + (r->hi - r->lo) / 2;
+    Range halves[2] = {
+        { r->pool, r->lo, mid, 0 },
+        { r->pool, mid, r->hi, 0 },
+    };
+    TaskGroup *group = task_group_create(r->pool);
+    assert(group != NULL);
+    assert(task_group_submit(group, sum_range, &halves[0]) == 0);
+    sum_range(&halves[1]);
+    assert(task_group_wait(group) == 0);
+    task_group_destroy(group);
+    r->sum = halves[0].sum + halves[1].sum;
+}
+
+static int
+test_nested_groups(ThreadPool *pool)
+{
+    Range r = { pool, 0, 1 << 20, 0 };
+    TaskGroup *group = task_group_create(pool);
+    assert(group != NULL);
+    assert(task_group_submit(group, sum_range, &r) == 0);
+    assert(task_group_wait(group) == 0);
+    task_group_destroy(group);
+    assert(r.sum == (long long) (1 << 20) * ((1 << 20) - 1) / 2);
+    return 0;
+}
+
+/* Several threads submitting to groups of their own at once.
+ */
+typedef struct {
+    ThreadPool *pool;
+    volatile int count;
+} Submitter;
+
+static void *
+submitter_thread(void *cookie)
+{
+    Submitter *s = (Submitter *) cookie;
+    TaskGroup *group = task_group_create(s->pool);
+    int i;
+
+    assert(group != NULL);
+    for (i = 0; i < 20000; ++i) {
+        assert(task_group_submit(group, add_one, (void *) &s->count) == 0);
+    }
+    assert(task_group_wait(group) == 0);
+    task_group_destroy(group);
+    return NULL;
+}
+
+static int
+test_submitters(ThreadPool *pool)
+{
+    Submitter s[4];
+    pthread_t threads[4];
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+        s[i].pool = pool;
+        s[i].count = 0;
+        assert(pthread_create(&threads[i], NULL, submitter_thread, &s[i]) == 0);
+    }
+    for (i = 0; i < 4; ++i) {
+        pthread_join(threads[i], NULL);
+        assert(s[i].count == 20000);
+    }
+    return 0;
+}
+
+/* Tasks that hold every worker until a gate opens.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int open;
+    volatile int entered;
+    volatile int ran;
+} Gate;
+
+static void
+wait_at_gate(void *cookie)
+{
+    Gate *gate = (Gate *) cookie;
+    __sync_fetch_and_add(&gate->entered, 1);
+    pthread_mutex_lock(&gate->lock);
+    while (!gate->open) pthread_cond_wait(&gate->cond, &gate->lock);
+    pthread_mutex_unlock(&gate->lock);
+    __sync_fetch_and_add(&gate->ran, 1);
+}
+
+static void
+open_gate(Gate *gate)
+{
+    pthread_mutex_lock(&gate->lock);
+    gate->open = 1;
+    pthread_cond_broadcast(&gate->cond);
+    pthread_mutex_unlock(&gate->lock);
+}
+
+static int
+test_cancel(ThreadPool *pool)
+{
+    Gate gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+    int size = threadpool_size(pool);
+    volatile int count = 0;
+    int i;
+
+    TaskGroup *blockers = task_group_create(pool);
+    TaskGroup *group = task_group_create(pool);
+    assert(blockers != NULL && group != NULL);
+    for (i = 0; i < size; ++i) {
+        assert(task_group_submit(blockers, wait_at_gate, &gate) == 0);
+    }
+    while (gate.entered < size) usleep(1000);
+
+    // Nothing can run these until the gate opens, so all are dropped.
+    for (i = 0; i < 100; ++i) {
+        assert(task_group_submit(group, add_one, (void *) &count) == 0);
+    }
+    task_group_cancel(group);
+    assert(task_group_cancelled(group));
+    assert(task_group_submit(group, add_one, (void *) &count) == -1);
+    open_gate(&gate);
+
+    assert(task_group_wait(group) == -1);
+    assert(count == 0);
+    assert(task_group_wait(blockers) == 0);
+    assert(gate.ran == size);
+    task_group_destroy(group);
+    task_group_destroy(blockers);
+    return 0;
+}
+
+/* A queue of 4 tasks, filled from outside the pool and from inside it.
+ */
+static void
+submit_many(void *cookie)
+{
+    Submitter *s = (Submitter *) cookie;
+    TaskGroup *group = task_group_create(s->pool);
+    int i;
+
+    assert(group != NULL);
+    for (i = 0; i < 1000; ++i) {
+        assert(task_group_submit(group, add_one, (void *) &s->count) == 0);
+    }
+    task_group_destroy(group);
+}
+
+static int
+test_backpressure(int size)
+{
+    ThreadPool *pool = threadpool_create(size, 4);
+    Submitter s = { pool, 0 };
+    int i;
+
+    assert(pool != NULL);
+    TaskGroup *group = task_group_create(pool);
+    assert(group != NULL);
+    for (i = 0; i < 10000; ++i) {
+        assert(task_group_submit(group, add_one, (void *) &s.count) == 0);
+    }
+    for (i = 0; i < 20; ++i) {
+        assert(task_group_submit(group, submit_many, &s) == 0);
+    }
+    assert(task_group_wait(group) == 0);
+    assert(s.count == 10000 + 20 * 1000);
+    task_group_destroy(group);
+    threadpool_destroy(pool);
+    return 0;
+}
+
+static int
+test_default_size()
+{
+    ThreadPool *pool = threadpool_shared();
+    assert(pool != NULL);
+    assert(threadpool_shared() == pool);
+    assert(threadpool_default_size() >= 1);
+    assert(threadpool_size(pool) == threadpool_default_size());
+    return 0;
+}
+
+int
+test_threadpool()
+{
+    int i, ret;
+
+    for (i = 0; i < NUM_SIZES; ++i) {
+        ThreadPool *pool = threadpool_create(kSizes[i], 0);
+        assert(pool != NULL);
+        assert(threadpool_size(pool) == kSizes[i]);
+
+        ret = test_many_tasks(pool);
+        if (ret != 0) {
+            fprintf(stderr, "test_many_tasks(%d) failed: %d\n", kSizes[i], ret);
+            return ret;
+        }
+        ret = test_nested_groups(pool);
+        if (ret != 0) {
+            fprintf(stderr, "test_nested_groups(%d) failed: %d\n",
+                    kSizes[i], ret);
+            return ret;
+        }
+        ret = test_submitters(pool);
+        if (ret != 0) {
+            fprintf(stderr, "test_submitters(%d) failed: %d\n", kSizes[i], ret);
+            return ret;
+        }
+        ret = test_cancel(pool);
+        if (ret != 0) {
+            fprintf(stderr, "test_cancel(%d) failed: %d\n", kSizes[i], ret);
+            return ret;
+        }
+        threadpool_destroy(pool);
+
+        ret = test_backpressure(kSizes[i]);
+        if (ret != 0) {
+            fprintf(stderr, "test_backpressure(%d) failed: %d\n",
+                    kSizes[i], ret);
+            return ret;
+        }
+    }
+
+    ret = test_default_size();
+    if (ret != 0) {
+        fprintf(stderr, "test_default_size() failed: %d\n", ret);
+        return ret;
+    }
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int runs = argc > 1 ? atoi(argv[1]) : 1;
+    int i;
+
+    for (i = 0; i < runs; ++i) {
+        int ret = test_threadpool();
+        if (ret != 0) return 1;
+    }
+    printf("threadpool: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE     // for CPU_COUNT
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+#define DEFAULT_QUEUE_SIZE 256
+
+typedef struct {
+    TaskFunction fn;
+    void *cookie;
+    TaskGroup *group;
+} Task;
+
+/* A bounded ring of tasks.  A worker pushes and pops its own queue at
+ * the tail; thieves, and the workers taking from the shared queue, take
+ * from the head.  Each queue has its own lock, so a worker only contends
+ * with whoever is stealing from it.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    Task *tasks;
+    unsigned mask;                  // size - 1; the size is a power of 2
+    volatile unsigned head, tail;   // head == tail when empty
+} TaskQueue;
+
+typedef struct {
+    ThreadPool *pool;
+    TaskQueue queue;
+    pthread_t thread;
+    unsigned seed;                  // picks the first worker to steal from
+} Worker;
+
+struct ThreadPool {
+    Worker *workers;
+    int count;
+    int started;
+    TaskQueue shared;               // tasks from non-worker threads
+    pthread_cond_t room;            // with shared.lock
+    int room_waiters;
+    pthread_key_t self;             // the Worker, on worker threads
+
+    /* Idle workers, and threads waiting on a group, sleep on "wake".
+     * "queued" counts the tasks in every queue.  A sleeper bumps
+     * "sleepers" before it checks "queued", and a submitter bumps
+     * "queued" before it checks "sleepers", so one of them always sees
+     * the other.
+     */
+    volatile int queued;
+    volatile int sleepers;
+    int stopping;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+};
+
+struct TaskGroup {
+    ThreadPool *pool;
+    volatile int pending;           // submitted, not yet run or dropped
+    volatile int cancelled;
+};
+
+static int
+queue_init(TaskQueue *q, int size)
+{
+    unsigned n = 1;
+    while (n < (unsigned) size) n <<= 1;
+    q->tasks = malloc(n * sizeof(Task));
+    if (q->tasks == NULL) return -1;
+    q->mask = n - 1;
+    q->head = q->tail = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    return 0;
+}
+
+static void
+queue_free(TaskQueue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    free(q->tasks);
+}
+
+// The caller holds q->lock for these.
+static int
+queue_full(const TaskQueue *q)
+{
+    return q->tail - q->head > q->mask;
+}
+
+static void
+queue_push(TaskQueue *q, const Task *t)
+{
+    q->tasks[q->tail & q->mask] = *t;
+    q->tail++;
+}
+
+static int
+queue_take(TaskQueue *q, int newest, Task *t)
+{
+    if (q->head == q->tail) return 0;
+    if (newest) {
+        *t = q->tasks[--q->tail & q->mask];
+    } else {
+        *t = q->tasks[q->head++ & q->mask];
+    }
+    return 1;
+}
+
+static int
+take_from(ThreadPool *pool, TaskQueue *q, int newest, Task *t)
+{
+    if (q->head == q->tail) return 0;   // don't lock an empty queue
+    pthread_mutex_lock(&q->lock);
+    int found = queue_take(q, newest, t);
+    if (found) {
+        __sync_fetch_and_sub(&pool->queued, 1);
+        if (q == &pool->shared && pool->room_waiters > 0) {
+            pthread_cond_signal(&pool->room);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/* Finds a task for "self" (NULL on other threads): the newest on its own
+ * queue, else the oldest on the shared queue, else the oldest on some
+ * other worker's queue.
+ */
+static int
+find_task(ThreadPool *pool, Worker *self, Task *t)
+{
+    int i, start = 0;
+
+    if (self != NULL) {
+        if (take_from(pool, &self->queue, 1, t)) return 1;
+        self->seed = self->seed * 1103515245 + 12345;
+        start = (self->seed >> 16) % pool->count;
+    }
+    if (take_from(pool, &pool->shared, 0, t)) return 1;
+    for (i = 0; i < pool->count; ++i) {
+        Worker *victim = &pool->workers[(start + i) % pool->count];
+        if (victim != self && take_from(pool, &victim->queue, 0, t)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+wake_one(ThreadPool *pool)
+{
+    if (pool->sleepers > 0) {
+        pthread_mutex_lock(&pool->sleep_lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->sleep_lock);
+    }
+}
+
+static void
+run_task(ThreadPool *pool, const Task *t)
+{
+    if (!t->group->cancelled) t->fn(t->cookie);
+
+    // The group may be freed as soon as "pending" reaches 0.
+    if (__sync_sub_and_fetch(&t->group->pending, 1) == 0 &&
+        pool->sleepers > 0) {
+        pthread_mutex_lock(&pool->sleep_lock);
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->sleep_lock);
+    }
+}
+
+static void *
+worker_thread(void *cookie)
+{
+    Worker *self = (Worker *) cookie;
+    ThreadPool *pool = self->pool;
+    Task t;
+    int stop;
+
+    pthread_setspecific(pool->self, self);
+    do {
+        if (find_task(pool, self, &t)) {
+            run_task(pool, &t);
+            stop = 0;
+            continue;
+        }
+        pthread_mutex_lock(&pool->sleep_lock);
+        __sync_fetch_and_add(&pool->sleepers, 1);
+        if (pool->queued <= 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->sleep_lock);
+        }
+        __sync_fetch_and_sub(&pool->sleepers, 1);
+        stop = pool->stopping && pool->queued <= 0;
+        pthread_mutex_unlock(&pool->sleep_lock);
+    } while (!stop);
+    return NULL;
+}
+
+int
+threadpool_default_size(void)
+{
+#ifdef CPU_COUNT
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        return CPU_COUNT(&set);
+    }
+#endif
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+ThreadPool *
+threadpool_create(int threads, int queue_size)
+{
+    int i;
+
+    if (threads <= 0) threads = threadpool_default_size();
+    if (queue_size <= 0) queue_size = DEFAULT_QUEUE_SIZE;
+
+    ThreadPool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) return NULL;
+    pool->workers = calloc(threads, sizeof(Worker));
+    if (pool->workers == NULL || queue_init(&pool->shared, queue_size) < 0) {
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    for (i = 0; i < threads; ++i) {
+        if (queue_init(&pool->workers[i].queue, queue_size) < 0) break;
+        pool->workers[i].pool = pool;
+        pool->workers[i].seed = i;
+    }
+    pool->count = i;
+    pthread_cond_init(&pool->room, NULL);
+    pthread_mutex_init(&pool->sleep_lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_key_create(&pool->self, NULL);
+
+    // Every queue is in place before a worker can go looking in them.
+    for (i = 0; i < pool->count; ++i) {
+        Worker *w = &pool->workers[i];
+        if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) break;
+        pool->started++;
+    }
+    if (pool->started == 0) {
+        threadpool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void
+threadpool_destroy(ThreadPool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->sleep_lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->sleep_lock);
+    for (i = 0; i < pool->started; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (i = 0; i < pool->count; ++i) {
+        queue_free(&pool->workers[i].queue);
+    }
+    queue_free(&pool->shared);
+    pthread_cond_destroy(&pool->room);
+    pthread_mutex_destroy(&pool->sleep_lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_key_delete(pool->self);
+    free(pool->workers);
+    free(pool);
+}
+
+int
+threadpool_size(const ThreadPool *pool)
+{
+    return pool->started;
+}
+
+static ThreadPool *g_shared_pool = NULL;
+static pthread_once_t g_shared_once = PTHREAD_ONCE_INIT;
+
+static void
+create_shared_pool(void)
+{
+    g_shared_pool = threadpool_create(0, 0);
+}
+
+ThreadPool *
+threadpool_shared(void)
+{
+    pthread_once(&g_shared_once, create_shared_pool);
+    return g_shared_pool;
+}
+
+TaskGroup *
+task_group_create(ThreadPool *pool)
+{
+    TaskGroup *group = calloc(1, sizeof(*group));
+    if (group != NULL) group->pool = pool;
+    return group;
+}
+
+void
+task_group_destroy(TaskGroup *group)
+{
+    task_group_wait(group);
+    free(group);
+}
+
+int
+task_group_submit(TaskGroup *group, TaskFunction fn, void *cookie)
+{
+    ThreadPool *pool = group->pool;
+    Worker *self = (Worker *) pthread_getspecific(pool->self);
+    Task t;
+
+    if (group->cancelled) return -1;
+    t.fn = fn;
+    t.cookie = cookie;
+    t.group = group;
+    __sync_fetch_and_add(&group->pending, 1);
+
+    if (self != NULL) {
+        // Blocking here could leave every worker waiting on another.
+        pthread_mutex_lock(&self->queue.lock);
+        if (queue_full(&self->queue)) {
+            pthread_mutex_unlock(&self->queue.lock);
+            run_task(pool, &t);
+            return 0;
+        }
+        queue_push(&self->queue, &t);
+        __sync_fetch_and_add(&pool->queued, 1);
+        pthread_mutex_unlock(&self->queue.lock);
+    } else {
+        pthread_mutex_lock(&pool->shared.lock);
+        while (queue_full(&pool->shared)) {
+            pool->room_waiters++;
+            pthread_cond_wait(&pool->room, &pool->shared.lock);
+            pool->room_waiters--;
+        }
+        queue_push(&pool->shared, &t);
+        __sync_fetch_and_add(&pool->queued, 1);
+        pthread_mutex_unlock(&pool->shared.lock);
+    }
+    wake_one(pool);
+    return 0;
+}
+
+int
+task_group_wait(TaskGroup *group)
+{
+    ThreadPool *pool = group->pool;
+    Worker *self = (Worker *) pthread_getspecific(pool->self);
+    Task t;
+
+    /* Help rather than block, so a worker waiting on a group it
+     * submitted to can't starve the pool.  The tasks run here needn't
+     * be this group's.
+     */
+    while (group->pending > 0) {
+        if (find_task(pool, self, &t)) {
+            run_task(pool, &t);
+            continue;
+        }
+        pthread_mutex_lock(&pool->sleep_lock);
+        __sync_fetch_and_add(&pool->sleepers, 1);
+        if (group->pending > 0 && pool->queued <= 0) {
+            pthread_cond_wait(&pool->wake, &pool->sleep_lock);
+        }
+        __sync_fetch_and_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->sleep_lock);
+    }
+    return group->cancelled ? -1 : 0;
+}
+
+void
+task_group_cancel(TaskGroup *group)
+{
+    group->cancelled = 1;
+    __sync_synchronize();
+}
+
+int
+task_group_cancelled(const TaskGroup *group)
+{
+    return group->cancelled;
+}
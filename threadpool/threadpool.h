@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+/* A fixed set of worker threads for CPU-bound work: hashing, inflating,
+ * extracting.  Each worker has its own bounded deque; tasks submitted
+ * from a worker go on its deque and are run newest first, tasks from
+ * other threads go on a shared bounded queue, and an idle worker steals
+ * the oldest task from a busy one.
+ *
+ * Tasks are submitted through a task group, which can be waited on or
+ * cancelled as a whole.  A thread waiting on a group runs queued tasks
+ * while it waits, so tasks may submit and wait on groups of their own.
+ */
+
+typedef struct ThreadPool ThreadPool;
+typedef struct TaskGroup TaskGroup;
+
+typedef void (*TaskFunction)(void *cookie);
+
+/* The number of CPUs this thread may run on, at least 1.
+ */
+int threadpool_default_size(void);
+
+/* Starts "threads" workers, or threadpool_default_size() if it is 0 or
+ * less.  Each queue holds "queue_size" tasks, or 256 if it is 0 or less.
+ * Returns NULL if no worker could be started.
+ */
+ThreadPool *threadpool_create(int threads, int queue_size);
+
+/* Runs every task still queued, then stops the workers.  Every group
+ * must have been destroyed.
+ */
+void threadpool_destroy(ThreadPool *pool);
+
+int threadpool_size(const ThreadPool *pool);
+
+/* The process-wide pool, started with the default size on first use.
+ * It is never destroyed.  Returns NULL if it can't be started.
+ */
+ThreadPool *threadpool_shared(void);
+
+TaskGroup *task_group_create(ThreadPool *pool);
+
+/* Waits for the group, then frees it.
+ */
+void task_group_destroy(TaskGroup *group);
+
+/* Queues fn(cookie) to run on the pool.  If the queue is full, a worker
+ * runs the task itself and any other thread waits for room.
+ * Returns 0, or -1 if the group has been cancelled.
+ */
+int task_group_submit(TaskGroup *group, TaskFunction fn, void *cookie);
+
+/* Returns once every task submitted to the group has run or been
+ * dropped.  Returns 0, or -1 if the group was cancelled.
+ */
+int task_group_wait(TaskGroup *group);
+
+/* Drops the group's tasks that haven't started and refuses new ones.
+ * Tasks already running finish; long ones can poll
+ * task_group_cancelled() to stop early.
+ */
+void task_group_cancel(TaskGroup *group);
+
+int task_group_cancelled(const TaskGroup *group);
+
+#endif  // THREADPOOL_H_
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures what a task costs the pool, with tasks that do nothing:
+ *
+ *   threadpool_bench [-t THREADS] [-n TASKS] [-r ROUNDS]
+ *
+ * "submit" queues TASKS tasks from outside the pool and waits for them;
+ * "spawn" has the workers create them, as a recursive split does, so
+ * they go on the workers' own queues and are stolen from there; "thread"
+ * starts a thread per task, which is what the pool replaces.  Each line
+ * gives the best and median ns per task over ROUNDS rounds.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "threadpool.h"
+
+static ThreadPool *pool;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void nothing(void *cookie)
+{
+}
+
+static void run_submit(int tasks)
+{
+    TaskGroup *group = task_group_create(pool);
+    int i;
+    for (i = 0; i < tasks; ++i) task_group_submit(group, nothing, NULL);
+    task_group_destroy(group);
+}
+
+// A task that splits into two until it is down to a single task.
+static void spawn(void *cookie)
+{
+    long n = (long) cookie;
+    if (n <= 1) return;
+    TaskGroup *group = task_group_create(pool);
+    task_group_submit(group, spawn, (void *) (n / 2));
+    task_group_submit(group, spawn, (void *) (n - n / 2));
+    task_group_destroy(group);
+}
+
+static void run_spawn(int tasks)
+{
+    // A tree with "tasks" leaves has 2 * tasks - 1 tasks in all.
+    TaskGroup *group = task_group_create(pool);
+    task_group_submit(group, spawn, (void *) (long) ((tasks + 1) / 2));
+    task_group_destroy(group);
+}
+
+static void *thread_nothing(void *cookie)
+{
+    return NULL;
+}
+
+static void run_thread(int tasks)
+{
+    int i;
+    for (i = 0; i < tasks; ++i) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, thread_nothing, NULL) == 0) {
+            pthread_join(t, NULL);
+        }
+    }
+}
+
+static void bench(const char *name, void (*run)(int), int tasks, int rounds)
+{
+    double *ns = malloc(rounds * sizeof(double));
+    int i;
+
+    run(tasks);     // warm up
+    for (i = 0; i < rounds; ++i) {
+        double start = now_ns();
+        run(tasks);
+        ns[i] = (now_ns() - start) / tasks;
+    }
+    qsort(ns, rounds, sizeof(double), compare_double);
+    printf("%-8s %8d tasks  best %8.1f ns/task  p50 %8.1f\n",
+           name, tasks, ns[0], ns[rounds / 2]);
+    free(ns);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-t THREADS] [-n TASKS] [-r ROUNDS]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int threads = 0, tasks = 100000, rounds = 10;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:r:")) != -1) {
+        switch (c) {
+            case 't': threads = atoi(optarg); break;
+            case 'n': tasks = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (tasks < 2 || rounds < 1) usage(argv[0]);
+
+    pool = threadpool_create(threads, 0);
+    if (pool == NULL) {
+        fprintf(stderr, "can't start the pool\n");
+        return 1;
+    }
+    printf("%d workers, %d CPUs\n", threadpool_size(pool),
+           threadpool_default_size());
+
+    bench("submit", run_submit, tasks, rounds);
+    bench("spawn", run_spawn, tasks, rounds);
+    bench("thread", run_thread, tasks / 10, rounds);
+
+    threadpool_destroy(pool);
+    return 0;
+}
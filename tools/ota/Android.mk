@@ -14,6 +14,14 @@
 
 LOCAL_PATH := $(call my-dir)
 
+# Host tool that lays an OTA package out in the order recovery reads it.
+include $(CLEAR_VARS)
+LOCAL_MODULE := ota-layout
+LOCAL_SRC_FILES := ota-layout.c
+LOCAL_C_INCLUDES += external/zlib
+LOCAL_STATIC_LIBRARIES := libz
+include $(BUILD_HOST_EXECUTABLE)
+
 ifneq ($(TARGET_SIMULATOR),true)
 
 include $(CLEAR_VARS)
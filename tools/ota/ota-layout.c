@@ -0,0 +1,773 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host tool: rewrite an OTA package so recovery reads it front to back.
+ *
+ *   ota-layout [-a alignment] [-m min-saving-%] in.zip out.zip
+ *
+ * Recovery reads a package twice: verifier.c checks the signature files
+ * and then every entry in manifest order, and the install reads
+ * update-binary, the script, and whatever the script extracts, in script
+ * order (minzip extracts a directory's entries in name order).  The
+ * output puts the signature files first, then the entries in the order
+ * the install reads them, then everything else.  STORED entries start on
+ * an alignment boundary, padded with an 0xd935 extra field as zipalign
+ * does, and DEFLATED entries that save less than min-saving percent are
+ * stored instead, so recovery doesn't inflate them for nothing.
+ *
+ * Entry contents don't change, so the jar signature still holds.  A
+ * whole-file signature in the archive comment would not, so it is
+ * dropped and the output has to be signed again.  A before/after report
+ * of seeks and inflated bytes goes to stdout.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#define LOCSIG 0x04034b50
+#define CENSIG 0x02014b50
+#define ENDSIG 0x06054b50
+#define LOCHDR 30
+#define CENHDR 46
+#define ENDHDR 22
+
+#define STORED 0
+#define DEFLATED 8
+
+#define ALIGN_EXTRA_ID 0xd935
+#define DEFAULT_ALIGNMENT 4096
+#define DEFAULT_MIN_SAVING 5
+
+// Reads that start this soon after the last one ended are taken to be
+// served by readahead, not a seek.
+#define READAHEAD_BYTES (128 * 1024)
+
+#define MAX_PASS 2
+
+static const char *kBinaryName = "META-INF/com/google/android/update-binary";
+static const char *kScriptName = "META-INF/com/google/android/updater-script";
+static const char *kAmendName = "META-INF/com/google/android/update-script";
+static const char *kManifestName = "META-INF/MANIFEST.MF";
+
+typedef struct {
+    const unsigned char *cen;       // central directory record
+    const char *name;               // in cen, not terminated
+    unsigned nameLen;
+    unsigned flags, method, crc, compLen, uncompLen;
+    const unsigned char *local;     // local header in the input
+    const unsigned char *data;      // compressed data in the input
+    unsigned dataOffset;
+
+    int store;                      // DEFLATED in the input, STORED out
+    unsigned char *inflated;        // the data to write when store is set
+    unsigned outLocal, outData;
+    int placed;
+} Entry;
+
+typedef struct {
+    unsigned char *buf;
+    size_t size;
+    Entry *entries;
+    unsigned count;
+    const unsigned char *comment;
+    unsigned commentLen;
+} Package;
+
+// Entry indices in the order one pass over the package reads them.
+typedef struct {
+    unsigned *index;
+    unsigned count, allocated;
+} Pass;
+
+static unsigned get2(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned get4(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned) p[3] << 24);
+}
+
+static void put2(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put4(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int name_is(const Entry *e, const char *name) {
+    return strlen(name) == e->nameLen && !memcmp(e->name, name, e->nameLen);
+}
+
+static int name_ends(const Entry *e, const char *suffix) {
+    size_t n = strlen(suffix);
+    return e->nameLen > n &&
+           !strncasecmp(e->name + e->nameLen - n, suffix, n);
+}
+
+static int is_signature_file(const Entry *e) {
+    return e->nameLen > 9 && !strncasecmp(e->name, "META-INF/", 9) &&
+           (name_ends(e, ".SF") || name_ends(e, ".RSA") ||
+            name_ends(e, ".DSA") || name_ends(e, ".EC"));
+}
+
+static int compare_names(const void *a, const void *b) {
+    const Entry *x = *(Entry * const *) a, *y = *(Entry * const *) b;
+    unsigned n = x->nameLen < y->nameLen ? x->nameLen : y->nameLen;
+    int diff = memcmp(x->name, y->name, n);
+    if (diff != 0) return diff;
+    return (int) x->nameLen - (int) y->nameLen;
+}
+
+static Entry *find_entry(Package *pkg, const char *name, size_t len) {
+    unsigned i;
+    for (i = 0; i < pkg->count; ++i) {
+        Entry *e = &pkg->entries[i];
+        if (e->nameLen == len && !memcmp(e->name, name, len)) return e;
+    }
+    return NULL;
+}
+
+static int load_package(const char *path, Package *pkg) {
+    memset(pkg, 0, sizeof(*pkg));
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "can't read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0 || st.st_size < ENDHDR ||
+        st.st_size > 0xffffffffLL) {
+        fprintf(stderr, "%s: not a zip file\n", path);
+        fclose(fp);
+        return -1;
+    }
+    pkg->size = st.st_size;
+    pkg->buf = malloc(pkg->size);
+    if (pkg->buf == NULL ||
+        fread(pkg->buf, 1, pkg->size, fp) != pkg->size) {
+        fprintf(stderr, "can't read %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    // The end record is the last one, followed only by its comment.
+    size_t back;
+    const unsigned char *end = NULL;
+    for (back = ENDHDR; back <= pkg->size && back <= 0xffff + ENDHDR;
+         ++back) {
+        const unsigned char *p = pkg->buf + pkg->size - back;
+        if (get4(p) == ENDSIG && get2(p + 20) == back - ENDHDR) {
+            end = p;
+            break;
+        }
+    }
+    if (end == NULL) {
+        fprintf(stderr, "%s: no end of central directory\n", path);
+        return -1;
+    }
+    pkg->count = get2(end + 10);
+    unsigned cdSize = get4(end + 12), cdOffset = get4(end + 16);
+    pkg->comment = end + ENDHDR;
+    pkg->commentLen = get2(end + 20);
+    if (get2(end + 4) != 0 || get2(end + 8) != pkg->count ||
+        (size_t) cdOffset + cdSize > (size_t) (end - pkg->buf)) {
+        fprintf(stderr, "%s: multi-disk or zip64 archives aren't "
+                "supported\n", path);
+        return -1;
+    }
+
+    pkg->entries = calloc(pkg->count ? pkg->count : 1, sizeof(Entry));
+    if (pkg->entries == NULL) return -1;
+
+    const unsigned char *p = pkg->buf + cdOffset;
+    const unsigned char *cdEnd = p + cdSize;
+    unsigned i;
+    for (i = 0; i < pkg->count; ++i) {
+        Entry *e = &pkg->entries[i];
+        if (p + CENHDR > cdEnd || get4(p) != CENSIG) {
+            fprintf(stderr, "%s: bad central directory entry %u\n", path, i);
+            return -1;
+        }
+        e->cen = p;
+        e->flags = get2(p + 8);
+        e->method = get2(p + 10);
+        e->crc = get4(p + 16);
+        e->compLen = get4(p + 20);
+        e->uncompLen = get4(p + 24);
+        e->nameLen = get2(p + 28);
+        e->name = (const char *) p + CENHDR;
+        unsigned local = get4(p + 42);
+        p += CENHDR + e->nameLen + get2(p + 30) + get2(p + 32);
+        if (p > cdEnd) {
+            fprintf(stderr, "%s: bad central directory entry %u\n", path, i);
+            return -1;
+        }
+
+        if (e->flags & 1) {
+            fprintf(stderr, "%.*s: encrypted entries aren't supported\n",
+                    e->nameLen, e->name);
+            return -1;
+        }
+        if (e->method != STORED && e->method != DEFLATED) {
+            fprintf(stderr, "%.*s: unsupported compression method %u\n",
+                    e->nameLen, e->name, e->method);
+            return -1;
+        }
+        const unsigned char *loc = pkg->buf + local;
+        if ((size_t) local + LOCHDR > cdOffset || get4(loc) != LOCSIG) {
+            fprintf(stderr, "%.*s: bad local header\n", e->nameLen, e->name);
+            return -1;
+        }
+        e->dataOffset = local + LOCHDR + get2(loc + 26) + get2(loc + 28);
+        if ((size_t) e->dataOffset + e->compLen > cdOffset) {
+            fprintf(stderr, "%.*s: data runs past the central directory\n",
+                    e->nameLen, e->name);
+            return -1;
+        }
+        e->local = loc;
+        e->data = pkg->buf + e->dataOffset;
+    }
+    return 0;
+}
+
+// Inflates a DEFLATED entry into a new buffer, checking its length and CRC.
+static unsigned char *inflate_entry(const Entry *e) {
+    unsigned char *out = malloc(e->uncompLen + 1);
+    if (out == NULL) return NULL;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    zs.next_in = (unsigned char *) e->data;
+    zs.avail_in = e->compLen;
+    zs.next_out = out;
+    zs.avail_out = e->uncompLen + 1;
+    int ret = inflate(&zs, Z_FINISH);
+    unsigned long len = zs.total_out;
+    inflateEnd(&zs);
+
+    if (ret != Z_STREAM_END || len != e->uncompLen ||
+        crc32(crc32(0, NULL, 0), out, len) != e->crc) {
+        fprintf(stderr, "%.*s: corrupt data\n", e->nameLen, e->name);
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Checks every entry, and picks the DEFLATED ones not worth inflating.
+static int choose_methods(Package *pkg, int minSaving) {
+    unsigned i;
+    for (i = 0; i < pkg->count; ++i) {
+        Entry *e = &pkg->entries[i];
+        if (e->method == STORED) {
+            if (e->compLen != e->uncompLen ||
+                crc32(crc32(0, NULL, 0), e->data, e->compLen) != e->crc) {
+                fprintf(stderr, "%.*s: corrupt data\n", e->nameLen, e->name);
+                return -1;
+            }
+            continue;
+        }
+        unsigned char *data = inflate_entry(e);
+        if (data == NULL) return -1;
+        unsigned long long saved = e->uncompLen > e->compLen ?
+                e->uncompLen - e->compLen : 0;
+        if (saved * 100 < (unsigned long long) e->uncompLen * minSaving ||
+            e->uncompLen == 0) {
+            e->store = 1;
+            e->inflated = data;
+        } else {
+            free(data);
+        }
+    }
+    return 0;
+}
+
+static int add_access(Pass *pass, unsigned index) {
+    if (pass->count == pass->allocated) {
+        unsigned n = pass->allocated ? pass->allocated * 2 : 64;
+        unsigned *grown = realloc(pass->index, n * sizeof(unsigned));
+        if (grown == NULL) return -1;
+        pass->index = grown;
+        pass->allocated = n;
+    }
+    pass->index[pass->count++] = index;
+    return 0;
+}
+
+// What a script reference reads: the entry itself, or every entry below
+// it in name order, as mzExtractRecursive() does.
+static int add_reference(Package *pkg, Entry **sorted, Pass *pass,
+                         const char *ref, size_t len) {
+    while (len > 0 && ref[len - 1] == '/') --len;
+    Entry *e = find_entry(pkg, ref, len);
+    if (e != NULL) return add_access(pass, e - pkg->entries);
+
+    unsigned i;
+    for (i = 0; i < pkg->count; ++i) {
+        e = sorted[i];
+        if (len == 0 || (e->nameLen > len && e->name[len] == '/' &&
+                         !memcmp(e->name, ref, len))) {
+            if (add_access(pass, e - pkg->entries) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Picks the package paths out of an edify updater-script or an amend
+// update-script, in the order they appear.
+static int add_script_references(Package *pkg, Entry **sorted, Pass *pass,
+                                 const char *script, size_t len) {
+    static const char *kExtract[] = {
+        "package_extract_file", "package_extract_dir", NULL
+    };
+    const char *p = script, *end = script + len;
+    while (p < end) {
+        const char *ref = NULL, *refEnd = NULL;
+        int i;
+        for (i = 0; kExtract[i] != NULL; ++i) {
+            size_t n = strlen(kExtract[i]);
+            if ((size_t) (end - p) <= n || memcmp(p, kExtract[i], n)) continue;
+            const char *q = p + n;
+            while (q < end && (*q == ' ' || *q == '\t' || *q == '\n')) ++q;
+            if (q < end && *q == '(') ++q;
+            while (q < end && (*q == ' ' || *q == '\t' || *q == '\n')) ++q;
+            if (q < end && *q == '"') {
+                ref = q + 1;
+                for (refEnd = ref; refEnd < end && *refEnd != '"'; ++refEnd) ;
+            }
+            p = q;
+            break;
+        }
+        if (ref == NULL && (size_t) (end - p) > 8 && !memcmp(p, "PACKAGE:", 8)) {
+            ref = p + 8;
+            for (refEnd = ref; refEnd < end && !strchr(" \t\r\n\"),", *refEnd);
+                 ++refEnd) ;
+        }
+        if (ref != NULL) {
+            if (add_reference(pkg, sorted, pass, ref, refEnd - ref) < 0) {
+                return -1;
+            }
+            p = refEnd;
+        } else if (kExtract[i] == NULL) {
+            ++p;
+        }
+    }
+    return 0;
+}
+
+static char *entry_contents(const Entry *e) {
+    char *text;
+    if (e->method == DEFLATED) {
+        text = (char *) inflate_entry(e);
+    } else {
+        text = malloc(e->uncompLen + 1);
+        if (text != NULL) memcpy(text, e->data, e->uncompLen);
+    }
+    if (text != NULL) text[e->uncompLen] = '\0';
+    return text;
+}
+
+// The verifier: the first signature file and its block, the manifest,
+// then each entry the manifest names.
+static int build_verify_pass(Package *pkg, Entry **sorted, Pass *pass) {
+    Entry *mf = find_entry(pkg, kManifestName, strlen(kManifestName));
+    unsigned i;
+    for (i = 0; i < pkg->count; ++i) {
+        Entry *block = sorted[i];
+        if (!is_signature_file(block) || name_ends(block, ".SF")) continue;
+        unsigned stem = block->nameLen;
+        while (block->name[stem - 1] != '.') --stem;
+        char sfName[PATH_MAX];
+        snprintf(sfName, sizeof(sfName), "%.*sSF", stem, block->name);
+        Entry *sf = find_entry(pkg, sfName, strlen(sfName));
+        if (sf == NULL) continue;
+        if (add_access(pass, sf - pkg->entries) < 0 ||
+            add_access(pass, block - pkg->entries) < 0) {
+            return -1;
+        }
+        break;
+    }
+    if (pass->count == 0 || mf == NULL) {
+        pass->count = 0;
+        return 0;
+    }
+    if (add_access(pass, mf - pkg->entries) < 0) return -1;
+
+    char *manifest = entry_contents(mf);
+    if (manifest == NULL) return -1;
+
+    // "Name: " lines, continued on lines that start with a space.
+    char name[PATH_MAX];
+    size_t nameLen = 0;
+    int inName = 0;
+    char *line, *save;
+    for (line = strtok_r(manifest, "\r\n", &save); line != NULL;
+         line = strtok_r(NULL, "\r\n", &save)) {
+        if (inName && line[0] == ' ') {
+            nameLen += snprintf(name + nameLen, sizeof(name) - nameLen,
+                                "%s", line + 1);
+            if (nameLen >= sizeof(name)) nameLen = sizeof(name) - 1;
+            continue;
+        }
+        if (inName) {
+            Entry *e = find_entry(pkg, name, nameLen);
+            if (e != NULL && add_access(pass, e - pkg->entries) < 0) break;
+            inName = 0;
+        }
+        if (!strncmp(line, "Name: ", 6)) {
+            nameLen = snprintf(name, sizeof(name), "%s", line + 6);
+            if (nameLen >= sizeof(name)) nameLen = sizeof(name) - 1;
+            inName = 1;
+        }
+    }
+    if (inName) {
+        Entry *e = find_entry(pkg, name, nameLen);
+        if (e != NULL) add_access(pass, e - pkg->entries);
+    }
+    free(manifest);
+    return 0;
+}
+
+// The install: the update binary and its script, or an amend script,
+// then whatever the script extracts.
+static int build_install_pass(Package *pkg, Entry **sorted, Pass *pass) {
+    Entry *binary = find_entry(pkg, kBinaryName, strlen(kBinaryName));
+    Entry *script = find_entry(pkg, kScriptName, strlen(kScriptName));
+    if (binary == NULL || script == NULL) {
+        binary = NULL;
+        script = find_entry(pkg, kAmendName, strlen(kAmendName));
+    }
+    if (script == NULL) {
+        fprintf(stderr, "warning: no install script; only the signature "
+                "files are reordered\n");
+        return 0;
+    }
+    if (binary != NULL && add_access(pass, binary - pkg->entries) < 0) {
+        return -1;
+    }
+    if (add_access(pass, script - pkg->entries) < 0) return -1;
+
+    char *text = entry_contents(script);
+    if (text == NULL) return -1;
+    int ret = add_script_references(pkg, sorted, pass, text, script->uncompLen);
+    free(text);
+    return ret;
+}
+
+typedef struct {
+    unsigned long long seeks[MAX_PASS];
+    unsigned long long inflated;
+    unsigned unaligned;
+    unsigned long long size;
+} Report;
+
+static void simulate(const Package *pkg, const Pass *passes, int after,
+                     unsigned alignment, unsigned long long size,
+                     Report *report) {
+    int p;
+    unsigned i;
+    memset(report, 0, sizeof(*report));
+    report->size = size;
+    for (p = 0; p < MAX_PASS; ++p) {
+        // Opening the archive reads the central directory at the end.
+        unsigned long long pos = size;
+        for (i = 0; i < passes[p].count; ++i) {
+            const Entry *e = &pkg->entries[passes[p].index[i]];
+            int stored = e->method == STORED || (after && e->store);
+            unsigned long long start = after ? e->outData : e->dataOffset;
+            unsigned long long len = stored ? e->uncompLen : e->compLen;
+            if (len == 0) continue;
+            if (start < pos || start > pos + READAHEAD_BYTES) {
+                report->seeks[p]++;
+            }
+            pos = start + len;
+            if (!stored) report->inflated += e->uncompLen;
+        }
+    }
+    for (i = 0; i < pkg->count; ++i) {
+        const Entry *e = &pkg->entries[i];
+        int stored = e->method == STORED || (after && e->store);
+        unsigned start = after ? e->outData : e->dataOffset;
+        if (stored && e->uncompLen > 0 && start % alignment != 0) {
+            report->unaligned++;
+        }
+    }
+}
+
+// Copies the extra fields other than alignment padding, which is
+// redone, and zipalign's older bare zero padding.
+static unsigned filter_extra(const unsigned char *extra, unsigned len,
+                             unsigned char *out) {
+    unsigned n = 0, i = 0;
+    while (i + 4 <= len) {
+        unsigned id = get2(extra + i), size = get2(extra + i + 2);
+        if (i + 4 + size > len) break;
+        if (id != ALIGN_EXTRA_ID && id != 0) {
+            memcpy(out + n, extra + i, 4 + size);
+            n += 4 + size;
+        }
+        i += 4 + size;
+    }
+    return n;
+}
+
+typedef struct {
+    FILE *fp;
+    unsigned long long offset;
+} Output;
+
+static int emit(Output *out, const void *data, size_t len) {
+    if (len > 0 && fwrite(data, 1, len, out->fp) != len) return -1;
+    out->offset += len;
+    return out->offset > 0xffffffffULL ? -1 : 0;
+}
+
+static unsigned out_flags(const Entry *e) {
+    // Sizes go in the local header, so there is no data descriptor.
+    unsigned flags = e->flags & ~0x0008;
+    if (e->store) flags &= ~0x0006;  // deflate options
+    return flags;
+}
+
+static int write_entry(Output *out, Entry *e, unsigned alignment) {
+    static unsigned char extra[0x10000 + 6 + 0x10000];
+    const unsigned char *loc = e->local;
+    unsigned extraLen = filter_extra(loc + LOCHDR + get2(loc + 26),
+                                     get2(loc + 28), extra);
+    int stored = e->method == STORED || e->store;
+    unsigned len = stored ? e->uncompLen : e->compLen;
+
+    if (stored && len > 0) {
+        unsigned long long start = out->offset + LOCHDR + e->nameLen +
+                                   extraLen + 6;
+        unsigned pad = (alignment - start % alignment) % alignment;
+        if (extraLen + 6 + pad > 0xffff) {
+            fprintf(stderr, "%.*s: extra field too long to align\n",
+                    e->nameLen, e->name);
+            return -1;
+        }
+        put2(extra + extraLen, ALIGN_EXTRA_ID);
+        put2(extra + extraLen + 2, 2 + pad);
+        put2(extra + extraLen + 4, alignment);
+        memset(extra + extraLen + 6, 0, pad);
+        extraLen += 6 + pad;
+    }
+
+    unsigned char header[LOCHDR];
+    put4(header, LOCSIG);
+    put2(header + 4, get2(e->cen + 6));     // version needed
+    put2(header + 6, out_flags(e));
+    put2(header + 8, stored ? STORED : DEFLATED);
+    put2(header + 10, get2(e->cen + 12));   // time
+    put2(header + 12, get2(e->cen + 14));   // date
+    put4(header + 14, e->crc);
+    put4(header + 18, len);
+    put4(header + 22, e->uncompLen);
+    put2(header + 26, e->nameLen);
+    put2(header + 28, extraLen);
+
+    e->outLocal = out->offset;
+    e->outData = out->offset + LOCHDR + e->nameLen + extraLen;
+    return emit(out, header, LOCHDR) || emit(out, e->name, e->nameLen) ||
+           emit(out, extra, extraLen) ||
+           emit(out, e->store ? e->inflated : e->data, len) ? -1 : 0;
+}
+
+static int write_central(Output *out, const Entry *e) {
+    static unsigned char extra[0x10000];
+    const unsigned char *cenExtra = e->cen + CENHDR + e->nameLen;
+    unsigned extraLen = filter_extra(cenExtra, get2(e->cen + 30), extra);
+    int stored = e->method == STORED || e->store;
+
+    unsigned char record[CENHDR];
+    memcpy(record, e->cen, CENHDR);
+    put2(record + 8, out_flags(e));
+    put2(record + 10, stored ? STORED : DEFLATED);
+    put4(record + 20, stored ? e->uncompLen : e->compLen);
+    put2(record + 30, extraLen);
+    put2(record + 34, 0);                   // disk
+    put4(record + 42, e->outLocal);
+    return emit(out, record, CENHDR) || emit(out, e->name, e->nameLen) ||
+           emit(out, extra, extraLen) ||
+           emit(out, cenExtra + get2(e->cen + 30), get2(e->cen + 32)) ?
+           -1 : 0;
+}
+
+static int write_package(const char *path, Package *pkg,
+                         const unsigned *order, unsigned alignment) {
+    Output out = { fopen(path, "wb"), 0 };
+    if (out.fp == NULL) {
+        fprintf(stderr, "can't write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // A whole-file signature at the end of the comment covers the bytes
+    // being moved around; it has to be made again.
+    unsigned commentLen = pkg->commentLen;
+    if (commentLen >= 6 && pkg->comment[commentLen - 4] == 0xff &&
+        pkg->comment[commentLen - 3] == 0xff) {
+        fprintf(stderr, "warning: dropping the whole-file signature; "
+                "sign %s again\n", path);
+        commentLen = 0;
+    }
+
+    unsigned i;
+    int ret = 0;
+    for (i = 0; i < pkg->count && ret == 0; ++i) {
+        ret = write_entry(&out, &pkg->entries[order[i]], alignment);
+    }
+    unsigned long long cdOffset = out.offset;
+    for (i = 0; i < pkg->count && ret == 0; ++i) {
+        ret = write_central(&out, &pkg->entries[order[i]]);
+    }
+
+    unsigned char end[ENDHDR];
+    memset(end, 0, sizeof(end));
+    put4(end, ENDSIG);
+    put2(end + 8, pkg->count);
+    put2(end + 10, pkg->count);
+    put4(end + 12, out.offset - cdOffset);
+    put4(end + 16, cdOffset);
+    put2(end + 20, commentLen);
+    if (ret == 0) {
+        ret = emit(&out, end, ENDHDR) ||
+              emit(&out, pkg->comment, commentLen) ? -1 : 0;
+    }
+    if (fclose(out.fp) != 0) ret = -1;
+    if (ret != 0) {
+        fprintf(stderr, "can't write %s\n", path);
+        unlink(path);
+    }
+    return ret;
+}
+
+static unsigned place(Package *pkg, unsigned *order, unsigned n, Entry *e) {
+    if (!e->placed) {
+        e->placed = 1;
+        order[n++] = e - pkg->entries;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    unsigned alignment = DEFAULT_ALIGNMENT;
+    int minSaving = DEFAULT_MIN_SAVING;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:m:")) != -1) {
+        switch (opt) {
+        case 'a': alignment = strtoul(optarg, NULL, 0); break;
+        case 'm': minSaving = atoi(optarg); break;
+        case '?': return 2;
+        }
+    }
+
+    if (argc != optind + 2 || alignment == 0 || alignment > 0x8000 ||
+        (alignment & (alignment - 1)) != 0 ||
+        minSaving < 0 || minSaving > 100) {
+        fprintf(stderr,
+            "usage: ota-layout [flags] in.zip out.zip\n"
+            "flags: -a alignment for STORED entries, a power of two up to\n"
+            "          32768 (default %d)\n"
+            "       -m store DEFLATED entries that save less than this\n"
+            "          percentage (default %d)\n",
+            DEFAULT_ALIGNMENT, DEFAULT_MIN_SAVING);
+        return 2;
+    }
+
+    Package pkg;
+    if (load_package(argv[optind], &pkg) < 0) return 1;
+    if (choose_methods(&pkg, minSaving) < 0) return 1;
+
+    Entry **sorted = malloc((pkg.count + 1) * sizeof(Entry *));
+    unsigned *order = malloc((pkg.count + 1) * sizeof(unsigned));
+    if (sorted == NULL || order == NULL) return 1;
+    unsigned i, n = 0;
+    for (i = 0; i < pkg.count; ++i) sorted[i] = &pkg.entries[i];
+    qsort(sorted, pkg.count, sizeof(Entry *), compare_names);
+
+    Pass passes[MAX_PASS];
+    memset(passes, 0, sizeof(passes));
+    if (build_verify_pass(&pkg, sorted, &passes[0]) < 0 ||
+        build_install_pass(&pkg, sorted, &passes[1]) < 0) {
+        return 1;
+    }
+    if (passes[0].count == 0) {
+        fprintf(stderr, "warning: %s isn't signed\n", argv[optind]);
+    }
+
+    // What the verifier opens first, any other signature files, then
+    // the install in the order it reads, then the rest as they were.
+    for (i = 0; i < passes[0].count && i < 3; ++i) {
+        n = place(&pkg, order, n, &pkg.entries[passes[0].index[i]]);
+    }
+    for (i = 0; i < pkg.count; ++i) {
+        if (is_signature_file(sorted[i]) || name_is(sorted[i], kManifestName)) {
+            n = place(&pkg, order, n, sorted[i]);
+        }
+    }
+    for (i = 0; i < passes[1].count; ++i) {
+        n = place(&pkg, order, n, &pkg.entries[passes[1].index[i]]);
+    }
+    for (i = 0; i < pkg.count; ++i) {
+        n = place(&pkg, order, n, &pkg.entries[i]);
+    }
+
+    if (write_package(argv[optind + 1], &pkg, order, alignment) < 0) return 1;
+
+    struct stat st;
+    if (stat(argv[optind + 1], &st) < 0) return 1;
+    Report before, after;
+    simulate(&pkg, passes, 0, alignment, pkg.size, &before);
+    simulate(&pkg, passes, 1, alignment, st.st_size, &after);
+
+    unsigned stored = 0;
+    for (i = 0; i < pkg.count; ++i) stored += pkg.entries[i].store;
+    printf("%-24s %14s %14s\n", "", "before", "after");
+    printf("%-24s %14llu %14llu\n", "package bytes", before.size, after.size);
+    printf("%-24s %14llu %14llu\n", "verify seeks",
+           before.seeks[0], after.seeks[0]);
+    printf("%-24s %14llu %14llu\n", "install seeks",
+           before.seeks[1], after.seeks[1]);
+    printf("%-24s %14llu %14llu\n", "bytes inflated",
+           before.inflated, after.inflated);
+    printf("%-24s %14u %14u\n", "unaligned STORED entries",
+           before.unaligned, after.unaligned);
+    printf("%u of %u entries read by the install; %u stored instead of "
+           "deflated\n", passes[1].count, pkg.count, stored);
+    return 0;
+}
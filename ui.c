@@ -15,13 +15,19 @@
  */
 
 #include <linux/input.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/reboot.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -33,7 +39,6 @@
 #define MAX_ROWS 32
 
 #define MAX_MENU_COLS MAX_COLS
-#define MAX_MENU_ROWS 1024
 
 #define CHAR_WIDTH 10
 #define CHAR_HEIGHT 18
@@ -41,6 +46,12 @@
 #define PROGRESSBAR_INDETERMINATE_STATES 6
 #define PROGRESSBAR_INDETERMINATE_FPS 15
 
+// The screen is redrawn at most this often, however fast it changes.
+#define UI_UPDATE_FPS 30
+
+#define LOG_RING_SIZE 256
+#define LOG_LINE_SIZE 256
+
 enum { LEFT_SIDE, CENTER_TILE, RIGHT_SIDE, NUM_SIDES };
 
 static pthread_mutex_t gUpdateMutex = PTHREAD_MUTEX_INITIALIZER;
@@ -73,6 +84,9 @@ static const struct { gr_surface* surface; const char *name; } BITMAPS[] = {
 
 static gr_surface gCurrentIcon = NULL;
 
+// Background icons freed by ui_drop_caches(), to be loaded again when shown
+static int gIconDropped[NUM_BACKGROUND_ICONS];
+
 static enum ProgressBarType {
     PROGRESSBAR_TYPE_NONE,
     PROGRESSBAR_TYPE_INDETERMINATE,
@@ -83,8 +97,57 @@ static enum ProgressBarType {
 static float gProgressScopeStart = 0, gProgressScopeSize = 0, gProgress = 0;
 static time_t gProgressScopeTime, gProgressScopeDuration;
 
-// Set to 1 when both graphics pages are the same (except for the progress bar)
-static int gPagesIdentical = 0;
+// Current frame of the indeterminate progress bar animation
+static int gProgressFrame = 0;
+
+// Parts of the screen that need repainting on the next update.  Text
+// rows are screen rows (log or menu), not log ring positions.
+static int gDirtyAll = 1;
+static int gDirtyProgress = 0;
+static char gDirtyRows[MAX_ROWS];
+
+// Everything happens on ui_thread, which sleeps in epoll_wait() on the
+// input devices, gWakePipe, gTimerFd and any fds given to ui_watch_fd().
+// Other threads ask for a redraw through gWakePipe; gFramePending keeps
+// a burst of requests down to one wakeup.
+typedef struct {
+    int fd;
+    void (*fn)(int fd, void *cookie);   // NULL when the slot is free
+    void *cookie;
+} UiSource;
+
+#define MAX_UI_SOURCES 32
+
+static pthread_mutex_t gSourcesMutex = PTHREAD_MUTEX_INITIALIZER;
+static UiSource gSources[MAX_UI_SOURCES];
+static int gEpollFd = -1;
+static int gWakePipe[2] = { -1, -1 };
+static volatile int gFramePending = 0;
+static volatile int gUiRunning = 0;
+static int gUiFallback = 0;          // see fallback_frame_thread()
+
+// Ticks the progress bar animation and timed progress; only armed while
+// one of them is on screen.
+static int gTimerFd = -1;
+static int gTimerArmed = 0;
+
+// ui_print() output waiting for ui_thread.  Writers claim a slot by
+// bumping gLogHead and publish it by setting its seq to position + 1;
+// ui_thread hands the slot back by setting seq to position +
+// LOG_RING_SIZE.  Writers only take gUpdateMutex when the ring is full.
+static struct {
+    volatile unsigned seq;
+    char text[LOG_LINE_SIZE];
+} gLogRing[LOG_RING_SIZE];
+static volatile unsigned gLogHead = 0;
+static unsigned gLogTail = 0;
+
+// ui_print() output from before ui_init() is done, which can run at the
+// same time as the rest of startup.  Shown once the ring is drained.
+#define EARLY_LOG_LINES 16
+static pthread_mutex_t gEarlyLogMutex = PTHREAD_MUTEX_INITIALIZER;
+static char gEarlyLog[EARLY_LOG_LINES][LOG_LINE_SIZE];
+static int gEarlyLogCount = 0;
 
 // Log text overlay, displayed when a magic key is pressed
 static char text[MAX_ROWS][MAX_COLS];
@@ -92,7 +155,11 @@ static int text_cols = 0, text_rows = 0;
 static int text_col = 0, text_row = 0, text_top = 0;
 static int show_text = 1;
 
-static char menu[MAX_MENU_ROWS][MAX_MENU_COLS];
+// Only the rows on screen are copied into menu[]: the headers, then the
+// page of items starting at menu_show_start.  The items themselves stay
+// in the caller's array until ui_end_menu(), so menus can be any length.
+static char menu[MAX_ROWS][MAX_MENU_COLS];
+static char** menu_list = NULL;
 static int show_menu = 0;
 static int menu_top = 0, menu_items = 0, menu_sel = 0;
 static int menu_show_start = 0, menu_show_count = 0;
@@ -107,7 +174,6 @@ static volatile char key_pressed[KEY_MAX + 1];
 // Should only be called with gUpdateMutex locked.
 static void draw_background_locked(gr_surface icon)
 {
-    gPagesIdentical = 0;
     gr_color(0, 0, 0, 255);
     gr_fill(0, 0, gr_fb_width(), gr_fb_height());
 
@@ -120,18 +186,24 @@ static void draw_background_locked(gr_surface icon)
     }
 }
 
+// Where the progress bar goes on the screen.
+static void get_progress_rect(int *x, int *y, int *w, int *h)
+{
+    int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
+    *w = gr_get_width(gProgressBarIndeterminate[0]);
+    *h = gr_get_height(gProgressBarIndeterminate[0]);
+    *x = (gr_fb_width() - *w)/2;
+    *y = (3*gr_fb_height() + iconHeight - 2 * *h)/4;
+}
+
 // Draw the progress bar (if any) on the screen.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
 static void draw_progress_locked()
 {
     if (gProgressBarType == PROGRESSBAR_TYPE_NONE) return;
 
-    int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
-    int width = gr_get_width(gProgressBarIndeterminate[0]);
-    int height = gr_get_height(gProgressBarIndeterminate[0]);
-
-    int dx = (gr_fb_width() - width)/2;
-    int dy = (3*gr_fb_height() + iconHeight - 2*height)/4;
+    int dx, dy, width, height;
+    get_progress_rect(&dx, &dy, &width, &height);
 
     // Erase behind the progress bar (in case this was a progress-only update)
     gr_color(0, 0, 0, 255);
@@ -156,21 +228,26 @@ static void draw_progress_locked()
     }
 
     if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) {
-        static int frame = 0;
-        gr_blit(gProgressBarIndeterminate[frame], 0, 0, width, height, dx, dy);
-        frame = (frame + 1) % PROGRESSBAR_INDETERMINATE_STATES;
+        gr_blit(gProgressBarIndeterminate[gProgressFrame], 0, 0,
+                width, height, dx, dy);
     }
 }
 
-static void draw_text_line(int row, const char* t) {
-  if (t[0] != '\0') {
+// Text rows spill a couple of pixels into the next row (descenders and
+// the menu highlight), so a row's area is a little taller than the row.
+#define ROW_SPILL 2
+
+static void draw_text_line(int row, const char* t, int top, int bottom) {
+  if (t[0] != '\0' &&
+      (row+1)*CHAR_HEIGHT+ROW_SPILL > top && row*CHAR_HEIGHT < bottom) {
     gr_text(0, (row+1)*CHAR_HEIGHT-1, t);
   }
 }
 
-// Redraw everything on the screen.  Does not flip pages.
+// Redraw the screen between rows top and bottom (in pixels); drawing
+// must already be clipped to that area.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
-static void draw_screen_locked(void)
+static void draw_screen_locked(int top, int bottom)
 {
     draw_background_locked(gCurrentIcon);
     draw_progress_locked();
@@ -186,15 +263,15 @@ static void draw_screen_locked(void)
                     gr_fb_width(), (menu_top+menu_sel+1)*CHAR_HEIGHT+1);
 
             for (; i < menu_top; ++i)
-                draw_text_line(i, menu[i]);
+                draw_text_line(i, menu[i], top, bottom);
             for (; i < menu_top + menu_show_count; ++i) {
-                if (menu[menu_show_start + i][0] == 0) break;
+                if (menu_show_start + i - menu_top >= menu_items) break;
                 if (i == menu_top + menu_sel) {
                     gr_color(255, 255, 255, 255);
-                    draw_text_line(i, menu[menu_show_start + i]);
+                    draw_text_line(i, menu[i], top, bottom);
                     gr_color(64, 96, 255, 255);
                 } else {
-                    draw_text_line(i, menu[menu_show_start + i]);
+                    draw_text_line(i, menu[i], top, bottom);
                 }
             }
             gr_fill(0, i*CHAR_HEIGHT+CHAR_HEIGHT/2-1,
@@ -205,130 +282,400 @@ static void draw_screen_locked(void)
         gr_color(255, 255, 0, 255);
 
         for (; i < text_rows; ++i) {
-            draw_text_line(i, text[(i+text_top) % text_rows]);
+            draw_text_line(i, text[(i+text_top) % text_rows], top, bottom);
         }
     }
 }
 
-// Redraw everything on the screen and flip the screen (make it visible).
+// Repaint one damaged area and mark it for copying on the next flip.
 // Should only be called with gUpdateMutex locked.
+static void redraw_rect_locked(int x, int y, int w, int h)
+{
+    gr_clip(x, y, w, h);
+    draw_screen_locked(y, y + h);
+    gr_damage(x, y, w, h);
+}
+
+// Mark screen rows [first, last) as needing a repaint.
+static void invalidate_rows_locked(int first, int last)
+{
+    if (first < 0) first = 0;
+    if (last > text_rows) last = text_rows;
+    for (; first < last; ++first) gDirtyRows[first] = 1;
+}
+
+// Redraw whatever is dirty and flip the screen (make it visible).
+// Only ui_thread calls this, with gUpdateMutex locked.
 static void update_screen_locked(void)
 {
-    draw_screen_locked();
+    int i;
+    if (gDirtyAll) {
+        redraw_rect_locked(0, 0, gr_fb_width(), gr_fb_height());
+    } else {
+        // Runs of dirty rows only matter when the text is on screen.
+        for (i = 0; show_text && i < text_rows; ) {
+            if (!gDirtyRows[i]) {
+                ++i;
+                continue;
+            }
+            int first = i;
+            while (i < text_rows && gDirtyRows[i]) ++i;
+            redraw_rect_locked(0, first * CHAR_HEIGHT, gr_fb_width(),
+                               (i - first) * CHAR_HEIGHT + ROW_SPILL);
+        }
+        if (gDirtyProgress && gProgressBarType != PROGRESSBAR_TYPE_NONE) {
+            int x, y, w, h;
+            get_progress_rect(&x, &y, &w, &h);
+            redraw_rect_locked(x, y, w, h);
+        }
+    }
+    gr_clip(0, 0, 0, 0);
+
+    gDirtyAll = gDirtyProgress = 0;
+    memset(gDirtyRows, 0, sizeof(gDirtyRows));
     gr_flip();
 }
 
-// Updates only the progress bar, if possible, otherwise redraws the screen.
+// Ask ui_thread for a new frame.  Safe to call with or without
+// gUpdateMutex.
+static void request_update(void)
+{
+    if (__sync_lock_test_and_set(&gFramePending, 1) == 0 &&
+        gWakePipe[1] >= 0) {
+        char c = 0;
+        write(gWakePipe[1], &c, 1);
+    }
+}
+
+// Updates only the progress bar.
 // Should only be called with gUpdateMutex locked.
 static void update_progress_locked(void)
 {
-    if (show_text || !gPagesIdentical) {
-        draw_screen_locked();    // Must redraw the whole screen
-        gPagesIdentical = 1;
+    gDirtyProgress = 1;
+    request_update();
+}
+
+// Add text to the log overlay.
+// Should only be called with gUpdateMutex locked.
+static void append_text_locked(const char *buf)
+{
+    int old_top = text_top;
+    int first_row = text_row;
+    const char *ptr;
+    for (ptr = buf; *ptr != '\0'; ++ptr) {
+        if (*ptr == '\n' || text_col >= text_cols) {
+            text[text_row][text_col] = '\0';
+            text_col = 0;
+            text_row = (text_row + 1) % text_rows;
+            if (text_row == text_top) text_top = (text_top + 1) % text_rows;
+        }
+        if (*ptr != '\n') text[text_row][text_col++] = *ptr;
+    }
+    text[text_row][text_col] = '\0';
+
+    // Screen row i shows text[(i+text_top) % text_rows].  If the log
+    // scrolled, every row moved; otherwise only the rows written to.
+    if (text_top != old_top) {
+        invalidate_rows_locked(0, text_rows);
     } else {
-        draw_progress_locked();  // Draw only the progress bar
+        int first = (first_row - text_top + text_rows) % text_rows;
+        int last = (text_row - text_top + text_rows) % text_rows;
+        invalidate_rows_locked(first, last + 1);
     }
-    gr_flip();
 }
 
-// Keeps the progress bar updated, even when the process is otherwise busy.
-static void *progress_thread(void *cookie)
+// Move everything published in gLogRing into the log overlay.  Does not
+// redraw.  Should only be called with gUpdateMutex locked.
+static void drain_log_locked(void)
 {
     for (;;) {
-        usleep(1000000 / PROGRESSBAR_INDETERMINATE_FPS);
-        pthread_mutex_lock(&gUpdateMutex);
+        unsigned pos = gLogTail;
+        if (gLogRing[pos % LOG_RING_SIZE].seq != pos + 1) break;
+        __sync_synchronize();
+        if (text_rows > 0 && text_cols > 0) {
+            append_text_locked(gLogRing[pos % LOG_RING_SIZE].text);
+        }
+        __sync_synchronize();
+        gLogRing[pos % LOG_RING_SIZE].seq = pos + LOG_RING_SIZE;
+        gLogTail = pos + 1;
+    }
+}
 
-        // update the progress bar animation, if active
-        // skip this if we have a text overlay (too expensive to update)
-        if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
-            update_progress_locked();
+// Start or stop gTimerFd to match what is on screen.
+// Should only be called with gUpdateMutex locked.
+static void arm_timer_locked(void)
+{
+    // skip the animation if we have a text overlay (too expensive to update)
+    int want = (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE &&
+                !show_text) ||
+               (gProgressBarType == PROGRESSBAR_TYPE_NORMAL &&
+                gProgressScopeDuration > 0 && gProgress < 1.0);
+    if (want == gTimerArmed) return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (want) {
+        its.it_interval.tv_nsec = 1000000000L / PROGRESSBAR_INDETERMINATE_FPS;
+        its.it_value = its.it_interval;
+    }
+    timerfd_settime(gTimerFd, 0, &its, NULL);
+    gTimerArmed = want;
+}
+
+static int add_source(int fd, void (*fn)(int fd, void *cookie), void *cookie)
+{
+    int i, result = -1;
+    pthread_mutex_lock(&gSourcesMutex);
+    for (i = 0; i < MAX_UI_SOURCES; ++i) {
+        if (gSources[i].fn != NULL) continue;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &gSources[i];
+        gSources[i].fd = fd;
+        gSources[i].cookie = cookie;
+        if (epoll_ctl(gEpollFd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+            gSources[i].fn = fn;
+            result = 0;
         }
+        break;
+    }
+    pthread_mutex_unlock(&gSourcesMutex);
+    return result;
+}
 
-        // move the progress bar forward on timed intervals, if configured
-        int duration = gProgressScopeDuration;
-        if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0) {
-            int elapsed = time(NULL) - gProgressScopeTime;
-            float progress = 1.0 * elapsed / duration;
-            if (progress > 1.0) progress = 1.0;
-            if (progress > gProgress) {
-                gProgress = progress;
-                update_progress_locked();
-            }
+static void remove_source(int fd)
+{
+    int i;
+    pthread_mutex_lock(&gSourcesMutex);
+    for (i = 0; i < MAX_UI_SOURCES; ++i) {
+        if (gSources[i].fn != NULL && gSources[i].fd == fd) {
+            epoll_ctl(gEpollFd, EPOLL_CTL_DEL, fd, NULL);
+            gSources[i].fn = NULL;
+            break;
         }
+    }
+    pthread_mutex_unlock(&gSourcesMutex);
+}
 
-        pthread_mutex_unlock(&gUpdateMutex);
+static void wake_ready(int fd, void *cookie)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) continue;
+}
+
+// Keeps the progress bar moving, even when the process is otherwise busy.
+// Should only be called with gUpdateMutex locked.
+static void tick_progress_locked(void)
+{
+    // update the progress bar animation, if active
+    if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
+        gProgressFrame = (gProgressFrame + 1) % PROGRESSBAR_INDETERMINATE_STATES;
+        update_progress_locked();
+    }
+
+    // move the progress bar forward on timed intervals, if configured
+    int duration = gProgressScopeDuration;
+    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0) {
+        int elapsed = time(NULL) - gProgressScopeTime;
+        float progress = 1.0 * elapsed / duration;
+        if (progress > 1.0) progress = 1.0;
+        if (progress > gProgress) {
+            gProgress = progress;
+            update_progress_locked();
+        }
     }
-    return NULL;
 }
 
-// Reads input events, handles special hot keys, and adds to the key queue.
-static void *input_thread(void *cookie)
+static void timer_ready(int fd, void *cookie)
 {
-    int rel_sum = 0;
+    uint64_t expirations;
+    read(fd, &expirations, sizeof(expirations));
+
+    pthread_mutex_lock(&gUpdateMutex);
+    tick_progress_locked();
+    pthread_mutex_unlock(&gUpdateMutex);
+}
+
+// Handles special hot keys, and adds to the key queue.
+static void handle_input_event(struct input_event *ev)
+{
+    static int rel_sum = 0;
     int fake_key = 0;
-    for (;;) {
-        // wait for the next key event
-        struct input_event ev;
-        do {
-            ev_get(&ev, 0);
 
-            if (ev.type == EV_SYN) {
-                continue;
-            } else if (ev.type == EV_REL) {
-                if (ev.code == REL_Y) {
-                    // accumulate the up or down motion reported by
-                    // the trackball.  When it exceeds a threshold
-                    // (positive or negative), fake an up/down
-                    // key event.
-                    rel_sum += ev.value;
-                    if (rel_sum > 3) {
-                        fake_key = 1;
-                        ev.type = EV_KEY;
-                        ev.code = KEY_DOWN;
-                        ev.value = 1;
-                        rel_sum = 0;
-                    } else if (rel_sum < -3) {
-                        fake_key = 1;
-                        ev.type = EV_KEY;
-                        ev.code = KEY_UP;
-                        ev.value = 1;
-                        rel_sum = 0;
-                    }
-                }
-            } else {
+    if (ev->type == EV_SYN) {
+        return;
+    } else if (ev->type == EV_REL) {
+        if (ev->code == REL_Y) {
+            // accumulate the up or down motion reported by
+            // the trackball.  When it exceeds a threshold
+            // (positive or negative), fake an up/down
+            // key event.
+            rel_sum += ev->value;
+            if (rel_sum > 3) {
+                fake_key = 1;
+                ev->type = EV_KEY;
+                ev->code = KEY_DOWN;
+                ev->value = 1;
+                rel_sum = 0;
+            } else if (rel_sum < -3) {
+                fake_key = 1;
+                ev->type = EV_KEY;
+                ev->code = KEY_UP;
+                ev->value = 1;
                 rel_sum = 0;
             }
-        } while (ev.type != EV_KEY || ev.code > KEY_MAX);
-
-        pthread_mutex_lock(&key_queue_mutex);
-        if (!fake_key) {
-            // our "fake" keys only report a key-down event (no
-            // key-up), so don't record them in the key_pressed
-            // table.
-            key_pressed[ev.code] = ev.value;
         }
-        fake_key = 0;
-        const int queue_max = sizeof(key_queue) / sizeof(key_queue[0]);
-        if (ev.value > 0 && key_queue_len < queue_max) {
-            key_queue[key_queue_len++] = ev.code;
-            pthread_cond_signal(&key_queue_cond);
+    } else {
+        rel_sum = 0;
+    }
+    if (ev->type != EV_KEY || ev->code > KEY_MAX) return;
+
+    pthread_mutex_lock(&key_queue_mutex);
+    if (!fake_key) {
+        // our "fake" keys only report a key-down event (no
+        // key-up), so don't record them in the key_pressed
+        // table.
+        key_pressed[ev->code] = ev->value;
+    }
+    const int queue_max = sizeof(key_queue) / sizeof(key_queue[0]);
+    if (ev->value > 0 && key_queue_len < queue_max) {
+        key_queue[key_queue_len++] = ev->code;
+        pthread_cond_signal(&key_queue_cond);
+    }
+    pthread_mutex_unlock(&key_queue_mutex);
+
+    if (ev->value > 0 && device_toggle_display(key_pressed, ev->code)) {
+        pthread_mutex_lock(&gUpdateMutex);
+        show_text = !show_text;
+        gDirtyAll = 1;
+        request_update();
+        pthread_mutex_unlock(&gUpdateMutex);
+    }
+
+    if (ev->value > 0 && device_reboot_now(key_pressed, ev->code)) {
+        reboot(RB_AUTOBOOT);
+    }
+}
+
+static void input_ready(int fd, void *cookie)
+{
+    struct input_event ev[16];
+    int i, n;
+    do {
+        n = ev_read(fd, ev, 16);
+        for (i = 0; i < n; ++i) handle_input_event(&ev[i]);
+    } while (n == 16);
+
+    // A device that went away stays readable (EPOLLHUP/EPOLLERR) forever.
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        LOGW("Dropping input device (%s)\n", n == 0 ? "EOF" : strerror(errno));
+        remove_source(fd);
+    }
+}
+
+static long long now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Waits for input, timer ticks, watched fds and redraw requests, and
+// draws frames no more than UI_UPDATE_FPS a second.  Requests made while
+// we wait out the frame interval are all served by the same frame.
+static void *ui_thread(void *cookie)
+{
+    const long long frame = 1000000LL / UI_UPDATE_FPS;
+    long long last = 0;
+    struct epoll_event events[16];
+
+    for (;;) {
+        int i, n, timeout = -1;
+        if (gFramePending) {
+            long long wait = last + frame - now_usec();
+            timeout = (wait > 0) ? (int) ((wait + 999) / 1000) : 0;
+        }
+
+        n = epoll_wait(gEpollFd, events, 16, timeout);
+        for (i = 0; i < n; ++i) {
+            UiSource *src = events[i].data.ptr;
+            void (*fn)(int, void*) = src->fn;
+            if (fn != NULL) fn(src->fd, src->cookie);
         }
-        pthread_mutex_unlock(&key_queue_mutex);
 
-        if (ev.value > 0 && device_toggle_display(key_pressed, ev.code)) {
+        if (gFramePending && now_usec() >= last + frame) {
+            __sync_lock_release(&gFramePending);
             pthread_mutex_lock(&gUpdateMutex);
-            show_text = !show_text;
+            drain_log_locked();
             update_screen_locked();
+            arm_timer_locked();
             pthread_mutex_unlock(&gUpdateMutex);
+            last = now_usec();
         }
+    }
+    return NULL;
+}
 
-        if (ev.value > 0 && device_reboot_now(key_pressed, ev.code)) {
-            reboot(RB_AUTOBOOT);
+// Used instead of ui_thread when the event loop can't be set up: one
+// thread blocks reading keys, the other ticks the progress bar and draws
+// any frame that was asked for.
+static void *fallback_input_thread(void *cookie)
+{
+    struct input_event ev;
+    for (;;) {
+        if (ev_get(&ev, 0) == 0) handle_input_event(&ev);
+    }
+    return NULL;
+}
+
+static void *fallback_frame_thread(void *cookie)
+{
+    for (;;) {
+        usleep(1000000 / PROGRESSBAR_INDETERMINATE_FPS);
+        pthread_mutex_lock(&gUpdateMutex);
+        tick_progress_locked();
+        if (gFramePending) {
+            __sync_lock_release(&gFramePending);
+            drain_log_locked();
+            update_screen_locked();
         }
+        pthread_mutex_unlock(&gUpdateMutex);
     }
     return NULL;
 }
 
+int ui_watch_fd(int fd, void (*fn)(int fd, void *cookie), void *cookie)
+{
+    if (!gUiRunning || gUiFallback) return -1;
+    return add_source(fd, fn, cookie);
+}
+
+void ui_unwatch_fd(int fd)
+{
+    remove_source(fd);
+}
+
+// Hands a line to ui_thread for the log overlay.
+static void show_log_line(const char *buf)
+{
+    // Claim a slot.  If the ring is full, empty it into the overlay
+    // ourselves rather than wait for the next frame.
+    unsigned pos = __sync_fetch_and_add(&gLogHead, 1);
+    while (gLogRing[pos % LOG_RING_SIZE].seq != pos) {
+        if (pthread_mutex_trylock(&gUpdateMutex) == 0) {
+            drain_log_locked();
+            pthread_mutex_unlock(&gUpdateMutex);
+        } else {
+            sched_yield();
+        }
+    }
+    strcpy(gLogRing[pos % LOG_RING_SIZE].text, buf);
+    __sync_synchronize();
+    gLogRing[pos % LOG_RING_SIZE].seq = pos + 1;
+    request_update();
+}
+
 void ui_init(void)
 {
     gr_init();
@@ -355,14 +702,77 @@ void ui_init(void)
         }
     }
 
+    for (i = 0; i < LOG_RING_SIZE; ++i) gLogRing[i].seq = i;
+
     pthread_t t;
-    pthread_create(&t, NULL, progress_thread, NULL);
-    pthread_create(&t, NULL, input_thread, NULL);
+    gEpollFd = epoll_create(MAX_UI_SOURCES);
+    gTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (gEpollFd >= 0 && gTimerFd >= 0 && pipe(gWakePipe) == 0) {
+        fcntl(gWakePipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(gWakePipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(gTimerFd, F_SETFL, O_NONBLOCK);
+        add_source(gWakePipe[0], wake_ready, NULL);
+        add_source(gTimerFd, timer_ready, NULL);
+
+        int fds[MAX_UI_SOURCES - 2];
+        int count = ev_get_fds(fds, MAX_UI_SOURCES - 2);
+        for (i = 0; i < count; ++i) add_source(fds[i], input_ready, NULL);
+
+        pthread_create(&t, NULL, ui_thread, NULL);
+    } else {
+        LOGW("Can't set up UI event loop (%s); polling instead\n",
+             strerror(errno));
+        gUiFallback = 1;
+        pthread_create(&t, NULL, fallback_input_thread, NULL);
+        pthread_create(&t, NULL, fallback_frame_thread, NULL);
+    }
+
+    pthread_mutex_lock(&gEarlyLogMutex);
+    for (i = 0; i < gEarlyLogCount; ++i) show_log_line(gEarlyLog[i]);
+    gUiRunning = 1;
+    pthread_mutex_unlock(&gEarlyLogMutex);
+    request_update();
+}
+
+// Should only be called with gUpdateMutex locked.
+static gr_surface get_background_locked(int icon)
+{
+    int i;
+    if (!gIconDropped[icon]) return gBackgroundIcon[icon];
+    gIconDropped[icon] = 0;
+    for (i = 0; BITMAPS[i].name != NULL; ++i) {
+        if (BITMAPS[i].surface == &gBackgroundIcon[icon] &&
+            res_create_surface(BITMAPS[i].name, &gBackgroundIcon[icon]) < 0) {
+            LOGW("Can't reload bitmap %s\n", BITMAPS[i].name);
+            gBackgroundIcon[icon] = NULL;
+        }
+    }
+    return gBackgroundIcon[icon];
+}
+
+void ui_drop_caches()
+{
+    long bytes = 0;
+    int i;
+    pthread_mutex_lock(&gUpdateMutex);
+    for (i = 0; i < NUM_BACKGROUND_ICONS; ++i) {
+        // The installing icon places the progress bar, so it stays.
+        gr_surface icon = gBackgroundIcon[i];
+        if (icon == NULL || icon == gCurrentIcon ||
+            i == BACKGROUND_ICON_INSTALLING) continue;
+        bytes += res_free_surface(icon);
+        gBackgroundIcon[i] = NULL;
+        gIconDropped[i] = 1;
+    }
+    pthread_mutex_unlock(&gUpdateMutex);
+    LOGI("Dropped %ld KB of background icons\n", bytes / 1024);
 }
 
 char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     pthread_mutex_lock(&gUpdateMutex);
-    draw_background_locked(gBackgroundIcon[icon]);
+    gr_clip(0, 0, 0, 0);
+    draw_background_locked(get_background_locked(icon));
+    gDirtyAll = 1;  // the drawing surface no longer matches the screen
     *width = gr_fb_width();
     *height = gr_fb_height();
     *bpp = sizeof(gr_pixel) * 8;
@@ -370,8 +780,10 @@ char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     char *ret = malloc(size);
     if (ret == NULL) {
         LOGE("Can't allocate %d bytes for image\n", size);
-    } else {
-        memcpy(ret, gr_fb_data(), size);
+    } else if (gr_fb_read_565((gr_pixel*) ret) < 0) {
+        LOGE("Can't read the screen image\n");
+        free(ret);
+        ret = NULL;
     }
     pthread_mutex_unlock(&gUpdateMutex);
     return ret;
@@ -380,8 +792,9 @@ char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
 void ui_set_background(int icon)
 {
     pthread_mutex_lock(&gUpdateMutex);
-    gCurrentIcon = gBackgroundIcon[icon];
-    update_screen_locked();
+    gCurrentIcon = get_background_locked(icon);
+    gDirtyAll = 1;
+    request_update();
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -432,56 +845,68 @@ void ui_reset_progress()
     gProgressScopeStart = gProgressScopeSize = 0;
     gProgressScopeTime = gProgressScopeDuration = 0;
     gProgress = 0;
-    update_screen_locked();
+    gDirtyAll = 1;
+    request_update();
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
 void ui_print(const char *fmt, ...)
 {
-    char buf[256];
+    char buf[LOG_LINE_SIZE];
     va_list ap;
     va_start(ap, fmt);
-    vsnprintf(buf, 256, fmt, ap);
+    vsnprintf(buf, LOG_LINE_SIZE, fmt, ap);
     va_end(ap);
 
     fputs(buf, stderr);
 
-    // This can get called before ui_init(), so be careful.
-    pthread_mutex_lock(&gUpdateMutex);
-    if (text_rows > 0 && text_cols > 0) {
-        char *ptr;
-        for (ptr = buf; *ptr != '\0'; ++ptr) {
-            if (*ptr == '\n' || text_col >= text_cols) {
-                text[text_row][text_col] = '\0';
-                text_col = 0;
-                text_row = (text_row + 1) % text_rows;
-                if (text_row == text_top) text_top = (text_top + 1) % text_rows;
-            }
-            if (*ptr != '\n') text[text_row][text_col++] = *ptr;
+    // This can get called before ui_init(), when nobody would ever drain
+    // the ring, so hold on to it until then.
+    if (!gUiRunning) {
+        pthread_mutex_lock(&gEarlyLogMutex);
+        int running = gUiRunning;
+        if (!running && gEarlyLogCount < EARLY_LOG_LINES) {
+            strcpy(gEarlyLog[gEarlyLogCount++], buf);
         }
-        text[text_row][text_col] = '\0';
-        update_screen_locked();
+        pthread_mutex_unlock(&gEarlyLogMutex);
+        if (!running) return;
     }
-    pthread_mutex_unlock(&gUpdateMutex);
+    show_log_line(buf);
 }
 
-void ui_start_menu(char** headers, char** items) {
+static void copy_menu_row_locked(int row, const char* t) {
+    strncpy(menu[row], t, text_cols-1);
+    menu[row][text_cols-1] = '\0';
+}
+
+// Copy the headers and count the items; the caller's arrays may have
+// changed since the last call.
+static void load_menu_locked(char** headers, char** items) {
     int i;
+    for (i = 0; i < text_rows - 1; ++i) {
+        if (headers[i] == NULL) break;
+        copy_menu_row_locked(i, headers[i]);
+    }
+    menu_top = i;
+    menu_list = items;
+    for (menu_items = 0; items[menu_items] != NULL; ++menu_items)
+        ;
+}
+
+// Copy the page of items that is on screen.
+static void load_menu_page_locked(void) {
+    int i;
+    for (i = 0; i < menu_show_count; ++i) {
+        int item = menu_show_start + i;
+        copy_menu_row_locked(menu_top + i,
+                             item < menu_items ? menu_list[item] : "");
+    }
+}
+
+void ui_start_menu(char** headers, char** items) {
     pthread_mutex_lock(&gUpdateMutex);
     if (text_rows > 0 && text_cols > 0) {
-        for (i = 0; i < MAX_MENU_ROWS; ++i) {
-            if (headers[i] == NULL) break;
-            strncpy(menu[i], headers[i], text_cols-1);
-            menu[i][text_cols-1] = '\0';
-        }
-        menu_top = i;
-        for (; i < MAX_MENU_ROWS; ++i) {
-            if (items[i-menu_top] == NULL) break;
-            strncpy(menu[i], items[i-menu_top], text_cols-1);
-            menu[i][text_cols-1] = '\0';
-        }
-        menu[i][0] = 0;
-        menu_items = i - menu_top;
+        load_menu_locked(headers, items);
         show_menu = 1;
         menu_sel = 0;
         menu_show_start = 0;
@@ -491,29 +916,20 @@ void ui_start_menu(char** headers, char** items) {
         if(menu_show_count > 1) menu_show_count--;
         if(menu_show_count > 1) menu_show_count--;
         if(menu_show_count > 1) menu_show_count--;
-        update_screen_locked();
+        load_menu_page_locked();
+        gDirtyAll = 1;
+        request_update();
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
 void ui_modify_menu(char** headers, char** items) {
-    int i;
     pthread_mutex_lock(&gUpdateMutex);
-    if (text_rows > 0 && text_cols > 0) {
-        for (i = 0; i < text_rows; ++i) {
-            if (headers[i] == NULL) break;
-            strncpy(menu[i], headers[i], text_cols-1);
-            menu[i][text_cols-1] = '\0';
-        }
-        menu_top = i;
-        for (; i < text_rows; ++i) {
-            if (items[i-menu_top] == NULL) break;
-            strncpy(menu[i], items[i-menu_top], text_cols-1);
-            menu[i][text_cols-1] = '\0';
-        }
-        menu_items = i - menu_top;
-        show_menu = 1;
-        update_screen_locked();
+    if (show_menu > 0 && text_rows > 0 && text_cols > 0) {
+        load_menu_locked(headers, items);
+        load_menu_page_locked();
+        invalidate_rows_locked(0, menu_top + menu_show_count + 1);
+        request_update();
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -523,16 +939,25 @@ int ui_menu_select(int sel) {
     pthread_mutex_lock(&gUpdateMutex);
     if (show_menu > 0) {
         old_sel = menu_sel;
-        sel = sel;
         if (sel < 0) {
             sel = 0;
         }
         if (sel >= menu_items) {
             sel = menu_items - 1;
         }
+        int old_start = menu_show_start;
         menu_sel = sel % menu_show_count;
         menu_show_start = (sel / menu_show_count) * menu_show_count;
-        if (menu_sel != old_sel) update_screen_locked();
+        if (menu_show_start != old_start) {
+            load_menu_page_locked();
+            invalidate_rows_locked(menu_top, menu_top + menu_show_count + 1);
+        } else {
+            invalidate_rows_locked(menu_top + old_sel, menu_top + old_sel + 1);
+            invalidate_rows_locked(menu_top + menu_sel, menu_top + menu_sel + 1);
+        }
+        if (menu_sel != old_sel || menu_show_start != old_start) {
+            request_update();
+        }
     }
     pthread_mutex_unlock(&gUpdateMutex);
     return sel;
@@ -543,7 +968,9 @@ void ui_end_menu() {
     pthread_mutex_lock(&gUpdateMutex);
     if (show_menu > 0 && text_rows > 0 && text_cols > 0) {
         show_menu = 0;
-        update_screen_locked();
+        menu_list = NULL;
+        gDirtyAll = 1;
+        request_update();
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
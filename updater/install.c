@@ -34,6 +34,21 @@
 #include "mtdutils/mtdutils.h"
 #include "updater.h"
 
+#define FLASH_HEALTH_FILE "/cache/recovery/flash_health"
+
+// Append the health record collected while writing an mtd partition, if
+// /cache is available.  Recovery appends its own records to the same file.
+static void SaveFlashHealth(const MtdPartition* mtd) {
+    FILE* f = fopen(FLASH_HEALTH_FILE, "a");
+    if (f == NULL) {
+        fprintf(stderr, "can't open %s: %s\n",
+                FLASH_HEALTH_FILE, strerror(errno));
+        return;
+    }
+    mtd_write_health_report(mtd, f);
+    fclose(f);
+}
+
 
 // mount(type, location, mount_point)
 //
@@ -210,6 +225,7 @@ char* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
             result = strdup("");
             goto done;
         }
+        SaveFlashHealth(mtd);
         result = location;
     } else {
         fprintf(stderr, "%s: unsupported type \"%s\"", name, type);
@@ -646,6 +662,7 @@ char* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (mtd_write_close(ctx) != 0) {
         fprintf(stderr, "%s: error closing write of %s\n", name, partition);
     }
+    SaveFlashHealth(mtd);
 
     printf("%s %s partition from %s\n",
            success ? "wrote" : "failed to write", partition, filename);